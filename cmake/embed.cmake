@@ -0,0 +1,11 @@
+# Embed a file in a C source as a NUL-terminated string.
+# Usage: cmake -DINPUT=FILE -DOUTPUT=SOURCE -DNAME=SYMBOL -P embed.cmake
+
+file(READ "${INPUT}" hex HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+set(twelve "0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,")
+string(REGEX REPLACE "(${twelve})" "\\1\n    " bytes "${bytes}")
+get_filename_component(input_name "${INPUT}" NAME)
+file(WRITE "${OUTPUT}"
+  "/* Generated from ${input_name}, do not edit. */\n\n"
+  "const char ${NAME}[] = {\n    ${bytes}0\n};\n")
@@ -5,17 +5,22 @@
 
 #include <argp.h>
 #include <errno.h>
-#include <netdb.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
-#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ahrs400.h"
+#include "../../utils/control.h"
+#include "../../utils/runstats.h"
+#include "../../utils/sink.h"
+#include "../../utils/textconv.h"
+#include "../../utils/utils.h"
 
 
 /** Mavlink system identifier */
@@ -24,6 +29,9 @@
 /** Mavlink compenent identifier, equal to MAV_COMP_ID_IMU */
 #define MAVLINK_COMPID 200
 
+/** Message definitions, embedded in the binary log header. */
+extern const char ahrs400_messages_xml[];
+
 /** Program version. */
 const char *argp_program_version = "ahrs400-read 0.1";
 
@@ -31,20 +39,30 @@ const char *argp_program_version = "ahrs400-read 0.1";
 const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
 
 /** Program documentation. */
-static char doc[] = "ahrs400-read -- Read from a Crossbow AHRS400.";
+static char doc[] = "ahrs400-read -- Read from a Crossbow AHRS400."
+    "\vWith --convert, the text log is produced from a binary log written "
+    "with --logbin instead, so that only the binary log is written in "
+    "flight.";
 
 /** Description of the accepted arguments. */
-static char args_doc[] = "AHRS_PORT";
+static char args_doc[] = "AHRS_PORT\n--convert=BINLOG --logtxt=FILE";
 
 /** Program options structure. */
 static struct argp_option options[] = {
     {"logtxt", 't', "FILE", 0, "Write received data as text to FILE"},
-    {"logbin", 'b', "FILE", 0, "Write binary MAVLink stream FILE"},
     {"verbose", 'v', 0, 0, "Write received data as text to STDOUT"},
-    {"udp", 'u', "HOST", OPTION_ARG_OPTIONAL,
-     "Send MAVLink messages via UDP to HOST, defaults to 224.0.0.1"},
-    {"udp-port", 'p', "UDPPORT", 0,
-     "UDP port to send MAVLink messages to, defaults to 38400, implies --udp"},
+    {"stats", 'S', "SECONDS", 0,
+     "Output a summary of each field every SECONDS"},
+    {"mode", 'm', "MODE", 0,
+     "Measurement mode: voltage, scaled or angle, defaults to angle"},
+    {0}
+};
+
+/** Child option parsers. */
+static struct argp_child children[] = {
+    {&sink_argp, 0, "Output options:", 0},
+    {&control_argp, 0, "Control options:", 0},
+    {&textconv_argp, 0, "Deferred text log options:", 0},
     {0}
 };
 
@@ -52,20 +70,39 @@ static struct argp_option options[] = {
 typedef struct arguments {
     char *ahrs_port;
     char *text_log;
-    char *binary_log;
     bool verbose;
-    bool use_udp;
-    char *udp_host;
-    uint16_t udp_port;
+    uint64_t stats_interval;
+    ahrs_mode_t mode;
+    sink_config_t sink;
+    control_config_t control;
+    textconv_config_t textconv;
 } arguments_t;
 
 /** Program output streams structure */
 typedef struct output_streams {
-    int udp_sock;
-    FILE *binary_log;
+    sink_t sink;
     FILE *text_log;
 } output_streams_t;
 
+/** Acquisition settings changed by the control commands, and counters. */
+typedef struct runtime {
+    ahrs_mode_t mode;
+    bool text_log_enabled;
+    bool verbose;
+    unsigned long messages;
+} runtime_t;
+
+/** Converted message of any mode. */
+typedef struct sample {
+    uint64_t time_usec;
+    double field[AHRS400_FIELD_ENUM_END]; ///< Values in AHRS400_FIELD order.
+    uint16_t sensor_time;
+} sample_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
 
 /** Argument parser function */
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
@@ -73,6 +110,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     arguments_t *arguments = state->input;
     
     switch (key) {
+    case ARGP_KEY_INIT:
+        state->child_inputs[0] = &arguments->sink;
+        state->child_inputs[1] = &arguments->control;
+        state->child_inputs[2] = &arguments->textconv;
+        break;
+        
     case 't':
         arguments->text_log = arg;
         break;
@@ -81,31 +124,21 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         arguments->verbose = true;
         break;
         
-    case 'b':
-        arguments->binary_log = arg;
-        break;
-
-    case 'u':
-        arguments->use_udp = true;
-        if (arg)
-            arguments->udp_host = arg;
+    case 'S':
+        {
+            char *endptr = 0;
+            double seconds = strtod(arg, &endptr);
+            if (*endptr || !(seconds > 0))
+                argp_error(state, "SECONDS must be a positive number.");
+            arguments->stats_interval = seconds * 1e6;
+        }
         break;
         
-    case 'p':
-	arguments->use_udp = true;
-	{
-	    char *endptr = 0;
-	    unsigned long udp_port = strtoul(arg, &endptr, 0);
-	    if (*endptr) {
-                argp_error(state, "UPDPORT argument must be an integer.");
-	    }
-            if (udp_port > 65535) {
-                argp_error(state, "UPDPORT number too large.");
-            }
-	    arguments->udp_port = udp_port;
-	}
+    case 'm':
+        if (ahrs_mode_from_name(arg, &arguments->mode))
+            argp_error(state, "Unknown MODE `%s`.", arg);
         break;
-	        
+        
     case ARGP_KEY_ARG:
       if (state->arg_num >= 1)
           argp_error(state, "Too many arguments.");
@@ -113,8 +146,14 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
       break;
 
     case ARGP_KEY_END:
-        if (state->arg_num < 1)
+        if (arguments->textconv.binary_log) {
+            if (state->arg_num > 0)
+                argp_error(state, "No AHRS_PORT when converting.");
+            if (!arguments->text_log)
+                argp_error(state, "--convert requires --logtxt.");
+        } else if (state->arg_num < 1) {
             argp_error(state, "Not enough arguments.");
+        }
       break;
         
     default:
@@ -126,7 +165,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
 
 /** Argument parser object. */
-static struct argp argp = {options, parse_opt, args_doc, doc};
+static struct argp argp = {options, parse_opt, args_doc, doc, children};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
 
 
 /**
@@ -140,162 +184,444 @@ void open_output_streams(arguments_t *args, output_streams_t *out) {
 	    syslog(LOG_ERR, "Error opening text log: %s", strerror(errno));
 	    exit(EXIT_FAILURE);
 	}
-        // Print file header
-        int status = fprintf(
-            out->text_log, "%% time[us]\txacc[m/s^2]\tyacc\tzacc\t"
-            "xgyro[rad/s]\tygyro\tzgyro\txmag[gauss]\tymag\tzmag\t"
-            "xmag[gauss]\tymag\tzmag\troll[rad]\tpitch\tyaw\t"
-            "temperature[C]\tsensor_time\n"
-        );
-        if (status < 0)
-            syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
     }
     
-    // Open binary log
-    if (args->binary_log) {
-	out->binary_log = fopen(args->binary_log, "w");
-	if (!out->binary_log) {
-	    syslog(LOG_ERR, "Error opening binary log: %s", strerror(errno));
-	    exit(EXIT_FAILURE);
-	}
+    // Open binary log and UDP socket
+    sink_open(&args->sink, &out->sink);
+
+    // Keep MAVLink 1 framing unless asked otherwise
+    if (!args->sink.mavlink2)
+        mavlink_get_channel_status(MAVLINK_COMM_0)->flags |=
+            MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+}
+
+
+/**
+ * Whether a field is present in the messages of a mode.
+ */
+static bool has_field(ahrs_mode_t mode, int field) {
+    bool attitude = field == AHRS400_FIELD_ROLL
+        || field == AHRS400_FIELD_PITCH || field == AHRS400_FIELD_YAW;
+    return mode == AHRS_ANGLE_MODE || !attitude;
+}
+
+
+/**
+ * Print the text log header of a mode, starting a new table.
+ */
+void log_header(ahrs_mode_t mode, FILE *out) {
+    if (!out)
+        return;
+    
+    int status;
+    if (mode == AHRS_VOLTAGE_MODE) {
+        status = fprintf(
+            out, "%% time[us]\txacc[V]\tyacc\tzacc\txgyro[V]\tygyro\t"
+            "zgyro\txmag[V]\tymag\tzmag\ttemperature[V]\tsensor_time\n"
+        );
+    } else {
+        status = fprintf(
+            out, "%% time[us]\txacc[m/s^2]\tyacc\tzacc\t"
+            "xgyro[rad/s]\tygyro\tzgyro\txmag[gauss]\tymag\tzmag\t%s"
+            "temperature[C]\tsensor_time\n",
+            mode == AHRS_ANGLE_MODE ? "roll[rad]\tpitch\tyaw\t" : ""
+        );
     }
+    if (status < 0)
+        syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+}
+
+
+void log_text(ahrs_mode_t mode, const sample_t *sample, FILE *out) {
+    if (!out)
+        return;
     
-    // Open UDP socket
-    if (args->use_udp) {
-        struct sockaddr_in host_addr;
-        socklen_t addr_len = sizeof(host_addr);
-        struct hostent *hostent = gethostbyname(args->udp_host);
-        if (!hostent) {
-            syslog(LOG_ERR, "Could not find host address `%s`", args->udp_host);
-	    exit(EXIT_FAILURE);
+    if (fprintf(out, "%llu\t", (unsigned long long) sample->time_usec) < 0)
+        goto err;
+    for (int i=0; i<AHRS400_FIELD_ENUM_END; i++)
+        if (has_field(mode, i) && fprintf(out, "%e\t", sample->field[i]) < 0)
+            goto err;
+    if (fprintf(out, "%u\n", sample->sensor_time) < 0)
+        goto err;
+    return;
+    
+ err:
+    syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+}
+
+
+void output_mavlink_msg(mavlink_message_t *msg, output_streams_t *out) {
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    size_t len = mavlink_msg_to_send_buffer(buf, msg);
+    sink_send(&out->sink, buf, len);
+}
+
+
+/**
+ * Copy the sensor fields of a converted message to a sample.
+ */
+#define SET_SENSOR_FIELDS(sample, msg)                                  \
+    do {                                                                \
+        sample->time_usec = msg.time_usec;                              \
+        sample->field[AHRS400_FIELD_XACC] = msg.xacc;                   \
+        sample->field[AHRS400_FIELD_YACC] = msg.yacc;                   \
+        sample->field[AHRS400_FIELD_ZACC] = msg.zacc;                   \
+        sample->field[AHRS400_FIELD_XGYRO] = msg.xgyro;                 \
+        sample->field[AHRS400_FIELD_YGYRO] = msg.ygyro;                 \
+        sample->field[AHRS400_FIELD_ZGYRO] = msg.zgyro;                 \
+        sample->field[AHRS400_FIELD_XMAG] = msg.xmag;                   \
+        sample->field[AHRS400_FIELD_YMAG] = msg.ymag;                   \
+        sample->field[AHRS400_FIELD_ZMAG] = msg.zmag;                   \
+        sample->field[AHRS400_FIELD_TEMPERATURE] = msg.temperature;     \
+        sample->sensor_time = msg.sensor_time;                          \
+    } while (0)
+
+
+/**
+ * Read a message of the current mode, output its raw and converted MAVLink
+ * messages and convert it to a sample.
+ * @return 0 if success, -1 if error or EOF.
+ */
+int read_sample(FILE *ahrs_stream, ahrs_mode_t mode, output_streams_t *out,
+                sample_t *sample) {
+    mavlink_message_t msg;
+    
+    switch (mode) {
+    case AHRS_VOLTAGE_MODE:
+        {
+            mavlink_ahrs400_voltage_raw_t raw;
+            mavlink_ahrs400_voltage_t voltage;
+            if (ahrs_get_voltage_raw(ahrs_stream, &raw))
+                return -1;
+            ahrs_voltage_conv(&raw, &voltage);
+            
+            mavlink_msg_ahrs400_voltage_raw_encode(
+                MAVLINK_SYSID, MAVLINK_COMPID, &msg, &raw
+            );
+            output_mavlink_msg(&msg, out);
+            mavlink_msg_ahrs400_voltage_encode(
+                MAVLINK_SYSID, MAVLINK_COMPID, &msg, &voltage
+            );
+            output_mavlink_msg(&msg, out);
+            SET_SENSOR_FIELDS(sample, voltage);
         }
-        if (hostent->h_addrtype != AF_INET || hostent->h_length != 4) {
-            syslog(LOG_ERR, "Only IPv4 hosts supported.");
-	    exit(EXIT_FAILURE);
+        break;
+        
+    case AHRS_SCALED_MODE:
+        {
+            mavlink_ahrs400_scaled_raw_t raw;
+            mavlink_ahrs400_scaled_t scaled;
+            if (ahrs_get_scaled_raw(ahrs_stream, &raw))
+                return -1;
+            ahrs_scaled_conv(&raw, &scaled);
+            
+            mavlink_msg_ahrs400_scaled_raw_encode(
+                MAVLINK_SYSID, MAVLINK_COMPID, &msg, &raw
+            );
+            output_mavlink_msg(&msg, out);
+            mavlink_msg_ahrs400_scaled_encode(
+                MAVLINK_SYSID, MAVLINK_COMPID, &msg, &scaled
+            );
+            output_mavlink_msg(&msg, out);
+            SET_SENSOR_FIELDS(sample, scaled);
         }
-        memset((void *)&host_addr, 0, addr_len);
-        host_addr.sin_family = AF_INET;
-        host_addr.sin_port = htons(args->udp_port);
-        memcpy((void *)&host_addr.sin_addr,
-               hostent->h_addr_list[0], hostent->h_length);
+        break;
         
-        out->udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (out->udp_sock < 0) {
-	    syslog(LOG_ERR, "Error creating UDP socket: %s", strerror(errno));
-	    exit(EXIT_FAILURE);
-	}
+    case AHRS_ANGLE_MODE:
+        {
+            mavlink_ahrs400_angle_raw_t raw;
+            mavlink_ahrs400_angle_t angle;
+            if (ahrs_get_angle_raw(ahrs_stream, &raw))
+                return -1;
+            ahrs_angle_conv(&raw, &angle);
+            
+            mavlink_msg_ahrs400_angle_raw_encode(
+                MAVLINK_SYSID, MAVLINK_COMPID, &msg, &raw
+            );
+            output_mavlink_msg(&msg, out);
+            mavlink_msg_ahrs400_angle_encode(
+                MAVLINK_SYSID, MAVLINK_COMPID, &msg, &angle
+            );
+            output_mavlink_msg(&msg, out);
+            SET_SENSOR_FIELDS(sample, angle);
+            sample->field[AHRS400_FIELD_ROLL] = angle.roll;
+            sample->field[AHRS400_FIELD_PITCH] = angle.pitch;
+            sample->field[AHRS400_FIELD_YAW] = angle.yaw;
+        }
+        break;
+    }
+    
+    return 0;
+}
 
-        if (connect(out->udp_sock, (struct sockaddr *)&host_addr, addr_len)) {
-	    syslog(LOG_ERR, "Error connecting socket: %s", strerror(errno));
-	    exit(EXIT_FAILURE);
+
+/**
+ * Write the text of a converted message of a binary log, with a new table
+ * header when the mode changes.
+ * @param state the mode of the current table plus 1, 0 before the first.
+ * @return 0 if success, -1 if error.
+ */
+static int convert_frame(const mavframe_t *frame, FILE *text,
+                         uint32_t *state, void *ctx) {
+    sample_t converted, *sample = &converted;
+    ahrs_mode_t mode;
+    
+    switch (frame->msgid) {
+    case MAVLINK_MSG_ID_AHRS400_VOLTAGE:
+        {
+            mavlink_ahrs400_voltage_t voltage;
+            mavframe_payload(frame, &voltage, sizeof voltage);
+            mode = AHRS_VOLTAGE_MODE;
+            SET_SENSOR_FIELDS(sample, voltage);
+        }
+        break;
+        
+    case MAVLINK_MSG_ID_AHRS400_SCALED:
+        {
+            mavlink_ahrs400_scaled_t scaled;
+            mavframe_payload(frame, &scaled, sizeof scaled);
+            mode = AHRS_SCALED_MODE;
+            SET_SENSOR_FIELDS(sample, scaled);
+        }
+        break;
+        
+    case MAVLINK_MSG_ID_AHRS400_ANGLE:
+        {
+            mavlink_ahrs400_angle_t angle;
+            mavframe_payload(frame, &angle, sizeof angle);
+            mode = AHRS_ANGLE_MODE;
+            SET_SENSOR_FIELDS(sample, angle);
+            sample->field[AHRS400_FIELD_ROLL] = angle.roll;
+            sample->field[AHRS400_FIELD_PITCH] = angle.pitch;
+            sample->field[AHRS400_FIELD_YAW] = angle.yaw;
         }
+        break;
+        
+    default:
+        return 0;
     }
+    
+    if (*state != mode + 1) {
+        log_header(mode, text);
+        *state = mode + 1;
+    }
+    log_text(mode, sample, text);
+    return ferror(text) ? -1 : 0;
 }
 
 
-void log_text(const mavlink_ahrs400_angle_t *angle, FILE *out) {
-    if (out) {
-        int status = fprintf(
-            out, "%llu\t%e\t%e\t%e\t%e\t%e\t%e\t%e\t%e\t%e\t"
-            "%e\t%e\t%e\t%e\t%u\n", (unsigned long long) angle->time_usec,
-            angle->xacc, angle->yacc, angle->zacc,
-            angle->xgyro, angle->ygyro, angle->zgyro,
-            angle->xmag, angle->ymag, angle->zmag,
-            angle->roll, angle->pitch, angle->yaw,
-            angle->temperature, angle->sensor_time
+/**
+ * Output the summary of the fields of a mode and start a new interval.
+ */
+void output_stats(runstats_t *stats, ahrs_mode_t mode, output_streams_t *out) {
+    for (unsigned i=0; i<stats->nchannels; i++) {
+        if (!has_field(mode, i))
+            continue;
+
+        mavlink_ahrs400_stats_t ahrs_stats = {
+            .time_usec=stats->start_usec, .count=stats->count, .field=i,
+            .min=stats->min[i], .max=stats->max[i], .mean=stats->mean[i],
+            .std=runstats_std(stats, i), .rms=runstats_rms(stats, i)
+        };
+
+        mavlink_message_t msg;
+        mavlink_msg_ahrs400_stats_encode(
+            MAVLINK_SYSID, MAVLINK_COMPID, &msg, &ahrs_stats
         );
-        if (status < 0)
-	    syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
-    }    
+        uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+        size_t len = mavlink_msg_to_send_buffer(buf, &msg);
+        sink_send_summary(&out->sink, buf, len);
+    }
+    runstats_reset(stats);
 }
 
 
-void output_mavlink_msg(mavlink_message_t *msg, output_streams_t *out) {
-    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
-    size_t len = mavlink_msg_to_send_buffer(buf, msg);
+/**
+ * Put the AHRS in the given measurement mode and continuous output.
+ * @param settle_ms time to wait for the data in transit to arrive.
+ * @return 0 if success, -1 if error.
+ */
+int configure_ahrs(FILE *ahrs_stream, ahrs_mode_t mode, unsigned settle_ms) {
+    // Put AHRS into polled mode for configuration
+    if (ahrs_set_polled(ahrs_stream))
+        return -1;
+        
+    // Wait for pending data to arrive and clear buffers
+    fflush(ahrs_stream);
+    struct timespec settle = {
+        .tv_sec=settle_ms / 1000, .tv_nsec=settle_ms % 1000 * 1000000L
+    };
+    nanosleep(&settle, NULL);
+    ahrs_purge(ahrs_stream);
     
-    // Output to binary log
-    if (out->binary_log)
-        if (!fwrite(buf, len, 1, out->binary_log))
-	    syslog(LOG_ERR, "Error writing to binary log: %s", strerror(errno));
+    // Ping the AHRS
+    if (ahrs_ping(ahrs_stream))
+        return -1;
     
-    // Output to UDP socket
-    if (out->udp_sock > 0)
-        if (send(out->udp_sock, buf, len, 0) != len)
-	    syslog(LOG_ERR, "Error sending UDP message: %s", strerror(errno));
-}
-
-
-void output_angle_raw(const mavlink_ahrs400_angle_raw_t *angle_raw,
-                      output_streams_t *out) {
-    mavlink_message_t msg;
-    mavlink_msg_ahrs400_angle_raw_encode(
-        MAVLINK_SYSID, MAVLINK_COMPID, &msg, angle_raw
-    );
-    output_mavlink_msg(&msg, out);
+    // Set the mode
+    if (ahrs_set_mode(ahrs_stream, mode)
+        || ahrs_set_continuous(ahrs_stream))
+        return -1;
+    return 0;
 }
 
 
-void output_angle(const mavlink_ahrs400_angle_t *angle, output_streams_t *out) {
-    mavlink_message_t msg;
-    mavlink_msg_ahrs400_angle_encode(
-        MAVLINK_SYSID, MAVLINK_COMPID, &msg, angle
-    );
-    output_mavlink_msg(&msg, out);
+/**
+ * Execute a control command, between two messages.
+ * @return 0 if success, -1 if the AHRS was left unusable.
+ */
+int handle_command(control_t *control, const control_cmd_t *cmd,
+                   FILE *ahrs_stream, runtime_t *runtime, runstats_t *stats,
+                   output_streams_t *out) {
+    const char *name = cmd->argv[0];
+    const char *arg = cmd->argc == 2 ? cmd->argv[1] : NULL;
+    
+    if (control_sink_command(control, cmd, &out->sink))
+        return 0;
+    
+    if (!strcmp(name, "mode") && arg) {
+        ahrs_mode_t mode;
+        if (ahrs_mode_from_name(arg, &mode)) {
+            control_reply(control, cmd, "error: unknown mode `%s`", arg);
+        } else if (configure_ahrs(ahrs_stream, mode, 50)) {
+            control_reply(control, cmd, "error: AHRS configuration failed");
+            return -1;
+        } else {
+            // Close the summaries of the previous mode
+            if (stats->count)
+                output_stats(stats, runtime->mode, out);
+            
+            runtime->mode = mode;
+            if (runtime->text_log_enabled)
+                log_header(mode, out->text_log);
+            if (runtime->verbose)
+                log_header(mode, stdout);
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "logtxt") && arg
+               && control_parse_switch(arg) >= 0) {
+        if (!out->text_log) {
+            control_reply(control, cmd, "error: text log not open");
+        } else {
+            // The mode may have changed while off, name the columns again
+            bool enable = control_parse_switch(arg);
+            if (enable && !runtime->text_log_enabled)
+                log_header(runtime->mode, out->text_log);
+            runtime->text_log_enabled = enable;
+            fflush(out->text_log);
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "verbose") && arg
+               && control_parse_switch(arg) >= 0) {
+        runtime->verbose = control_parse_switch(arg);
+        control_reply(control, cmd, "ok");
+    } else if (!strcmp(name, "counters") && !arg) {
+        control_reply(control, cmd,
+                      "ok mode=%s messages=%lu frames=%lu udp_errors=%lu",
+                      ahrs_mode_name(runtime->mode), runtime->messages,
+                      out->sink.frames, out->sink.udp_errors);
+    } else {
+        control_reply(control, cmd, "error: unknown command `%s`", name);
+    }
+    return 0;
 }
 
 
 int main(int argc, char **argv) {
     // Parse command line arguments
-    arguments_t arguments = {.udp_host="224.0.0.1", .udp_port=38400};
-    output_streams_t output_streams = {.udp_sock=-1};
+    arguments_t arguments = {.mode=AHRS_ANGLE_MODE};
+    output_streams_t output_streams = {};
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    arguments.sink.schema_xml = ahrs400_messages_xml;
 
     // Setup syslog
     openlog(0, LOG_PERROR, 0);
 
+    // Produce the text log of a previous or running acquisition
+    if (arguments.textconv.binary_log) {
+        if (textconv_run(&arguments.textconv, arguments.text_log,
+                         convert_frame, NULL))
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    // Cheap time stamps from the calibrated TSC
+    timing_init();
+
+    // Flush the outputs when stopped
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
     // Open the output streams
     open_output_streams(&arguments, &output_streams);
     
+    // Open the control socket
+    control_t control;
+    control_open(&arguments.control, &control);
+    runtime_t runtime = {
+        .mode=arguments.mode,
+        .text_log_enabled=true,
+        .verbose=arguments.verbose,
+    };
+    
     // Open AHRS port
     FILE *ahrs_stream = ahrs_open(arguments.ahrs_port);
     if (!ahrs_stream)
         return EXIT_FAILURE;
 
-    // Put AHRS into polled mode for configuration
-    if (ahrs_set_polled(ahrs_stream))
-        return EXIT_FAILURE;
-        
-    // Wait for pending data to arrive and clear buffers
-    fflush(ahrs_stream);
-    sleep(1);
-    ahrs_purge(ahrs_stream);
-    
-    // Ping the AHRS
-    if (ahrs_ping(ahrs_stream))
-        return EXIT_FAILURE;
-    
-    // Set the mode
-    if (ahrs_set_mode(ahrs_stream, AHRS_ANGLE_MODE)
-        || ahrs_set_continuous(ahrs_stream))
+    // Configure the AHRS, waiting a second for data of a previous session
+    if (configure_ahrs(ahrs_stream, runtime.mode, 1000))
         return EXIT_FAILURE;
+    log_header(runtime.mode, output_streams.text_log);
 
-    // Read loop
-    for (;;) {
-        mavlink_ahrs400_angle_raw_t angle_raw;
-        if (ahrs_get_angle_raw(ahrs_stream, &angle_raw))
-            return EXIT_FAILURE;
-
-        mavlink_ahrs400_angle_t angle;
-        ahrs_angle_conv(&angle_raw, &angle);
+    // Field summaries
+    runstats_t stats;
+    runstats_init(&stats, AHRS400_FIELD_ENUM_END);
 
-        output_angle_raw(&angle_raw, &output_streams);
-        output_angle(&angle, &output_streams);
+    // Read loop
+    int exit_status = EXIT_SUCCESS;
+    while (!stop_requested) {
+        // The fields the mode does not decode are summarized as zeros
+        sample_t sample = {0};
+        if (read_sample(ahrs_stream, runtime.mode, &output_streams, &sample)) {
+            if (!stop_requested)
+                exit_status = EXIT_FAILURE;
+            break;
+        }
+        
+        if (arguments.stats_interval) {
+            if (stats.count && sample.time_usec - stats.start_usec
+                               >= arguments.stats_interval)
+                output_stats(&stats, runtime.mode, &output_streams);
+            runstats_update(&stats, sample.time_usec, sample.field);
+        }
+        
+        runtime.messages++;
+        if (runtime.text_log_enabled)
+            log_text(runtime.mode, &sample, output_streams.text_log);
+        if (runtime.verbose)
+            log_text(runtime.mode, &sample, stdout);
         
-        log_text(&angle, output_streams.text_log);
-        if (arguments.verbose)
-            log_text(&angle, stdout);
+        // Release the UDP frames held back by the compression and shaping
+        sink_poll(&output_streams.sink);
+        
+        // Apply the pending commands before the next message
+        control_cmd_t cmd;
+        while (control_poll(&control, &cmd)) {
+            if (handle_command(&control, &cmd, ahrs_stream, &runtime,
+                               &stats, &output_streams)) {
+                stop_requested = 1;
+                exit_status = EXIT_FAILURE;
+            }
+        }
     }
     
-    return 0;
+    if (stats.count)
+        output_stats(&stats, runtime.mode, &output_streams);
+    control_close(&control);
+    sink_close(&output_streams.sink);
+    if (output_streams.text_log)
+        fclose(output_streams.text_log);
+    return exit_status;
 }
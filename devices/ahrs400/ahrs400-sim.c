@@ -0,0 +1,283 @@
+/**
+ * Simulated Crossbow AHRS400 on a pseudo-terminal.
+ *
+ * Answers the ping, measurement mode and communication mode commands used
+ * by ahrs400-read and streams frames of slowly varying data in continuous
+ * mode, so that the reader can be run and soaked without the unit.
+ */
+
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define AHRS_DATA_HEADER 0xFF
+
+/** Number of 16-bit words of the voltage, scaled and angle mode frames. */
+#define VOLTAGE_WORDS 11
+#define SCALED_WORDS 11
+#define ANGLE_WORDS 14
+
+
+/** Program version. */
+const char *argp_program_version = "ahrs400-sim 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "ahrs400-sim -- Simulate a Crossbow AHRS400 on a "
+    "pseudo-terminal.";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"rate", 'r', "HZ", 0, "Continuous mode frame rate, defaults to 60 Hz"},
+    {"count", 'n', "N", 0, "Stop after N frames, defaults to unlimited"},
+    {"link", 'l', "PATH", 0, "Create a symbolic link to the pty at PATH"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    double rate;
+    unsigned long count;
+    char *link;
+} arguments_t;
+
+/** Simulated unit state. */
+typedef struct unit {
+    char mode; ///< Response of the measurement mode: `R`, `C` or `A`.
+    bool continuous;
+    unsigned long frames; ///< Frames written.
+    unsigned long dropped; ///< Frames not written, the pty being full.
+} unit_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+    char *endptr = 0;
+
+    switch (key) {
+    case 'r':
+        arguments->rate = strtod(arg, &endptr);
+        if (*endptr || arguments->rate <= 0)
+            argp_error(state, "HZ argument must be a positive number.");
+        break;
+
+    case 'n':
+        arguments->count = strtoul(arg, &endptr, 0);
+        if (*endptr)
+            argp_error(state, "N argument must be an integer.");
+        break;
+
+    case 'l':
+        arguments->link = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        argp_error(state, "Too many arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, 0, doc};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Open the master side of a new pseudo-terminal, without blocking.
+ * Aborts the program on error.
+ */
+int open_pty(char *link) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+        syslog(LOG_ERR, "Error creating pty: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct termios termios;
+    if (!tcgetattr(fd, &termios)) {
+        cfmakeraw(&termios);
+        tcsetattr(fd, TCSANOW, &termios);
+    }
+
+    char *slave = ptsname(fd);
+    if (link) {
+        unlink(link);
+        if (symlink(slave, link))
+            syslog(LOG_WARNING, "Error creating link `%s`: %s",
+                   link, strerror(errno));
+    }
+    printf("%s\n", slave);
+    fflush(stdout);
+    return fd;
+}
+
+
+/**
+ * Write a frame of the current mode at a given time since start, dropping
+ * it if the pty is full.
+ */
+void write_frame(int pty, unit_t *unit, double t) {
+    unsigned nwords = unit->mode == 'A' ? ANGLE_WORDS
+                    : unit->mode == 'C' ? SCALED_WORDS : VOLTAGE_WORDS;
+    uint8_t frame[2 + 2 * ANGLE_WORDS];
+    uint8_t *payload = frame + 1;
+    uint8_t checksum = 0;
+
+    // Slow sinusoids, unsigned around mid-scale in voltage mode, and the
+    // temperature and sensor time words last
+    for (unsigned i=0; i<nwords; i++) {
+        double wave = sin(2 * M_PI * 0.1 * (i + 1) * t + i);
+        uint16_t word = unit->mode == 'R' ? 2048 + 500 * wave : 4000 * wave;
+        if (i == nwords - 2)
+            word = 2000 + 10 * wave;
+        else if (i == nwords - 1)
+            word = unit->frames;
+        payload[2*i] = word >> 8;
+        payload[2*i + 1] = word;
+        checksum += payload[2*i] + payload[2*i + 1];
+    }
+    frame[0] = AHRS_DATA_HEADER;
+    payload[2 * nwords] = checksum;
+
+    size_t len = 2 + 2 * nwords;
+    if (write(pty, frame, len) == len)
+        unit->frames++;
+    else
+        unit->dropped++;
+}
+
+
+/**
+ * Answer the commands received from the reader.
+ */
+void handle_commands(int pty, unit_t *unit, double t) {
+    uint8_t commands[64];
+    ssize_t n = read(pty, commands, sizeof commands);
+    for (ssize_t i=0; i<n; i++) {
+        char response = 0;
+        switch (commands[i]) {
+        case 'R':
+            response = 'H';
+            break;
+        case 'r':
+        case 'c':
+        case 'a':
+            unit->mode = response = commands[i] - 'a' + 'A';
+            break;
+        case 'P':
+            unit->continuous = false;
+            break;
+        case 'C':
+            unit->continuous = true;
+            break;
+        case 'G':
+            write_frame(pty, unit, t);
+            break;
+        }
+        if (response && write(pty, &response, 1) != 1)
+            syslog(LOG_WARNING, "Error answering command: %s",
+                   strerror(errno));
+    }
+}
+
+
+/**
+ * Time elapsed since `start`, in seconds.
+ */
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.rate=60};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int pty = open_pty(arguments.link);
+    unit_t unit = {.mode='R'};
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double period = 1 / arguments.rate, next = 0;
+
+    while (!stop_requested
+           && (!arguments.count || unit.frames < arguments.count)) {
+        // Wait for a command or the next frame, at most a period
+        double t = elapsed(&start);
+        int timeout = unit.continuous && next > t ? (next - t) * 1e3 : 0;
+        if (!unit.continuous)
+            timeout = period * 1e3 + 1;
+        struct pollfd pollfd = {.fd=pty, .events=POLLIN};
+        int ready = poll(&pollfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "Error polling pty: %s", strerror(errno));
+            break;
+        }
+
+        // Without a reader on the slave side the pty hangs up
+        t = elapsed(&start);
+        if (ready > 0 && pollfd.revents & POLLIN)
+            handle_commands(pty, &unit, t);
+        else if (ready > 0 && pollfd.revents & POLLHUP)
+            usleep(timeout * 1000);
+
+        // Frames at a steady rate, the missed ones skipped
+        if (unit.continuous && t >= next) {
+            write_frame(pty, &unit, t);
+            next += period;
+            if (next < t)
+                next = t + period;
+        }
+    }
+
+    syslog(LOG_INFO, "%lu frames written, %lu dropped", unit.frames,
+           unit.dropped);
+    if (arguments.link)
+        unlink(arguments.link);
+    return EXIT_SUCCESS;
+}
@@ -26,7 +26,6 @@
 
 #define AHRS_DATA_HEADER 0xFF
 #define AHRS_MAX_MSG_SIZE 30
-#define AHRS_ANGLE_PAYLOAD_LEN 28
 
 
 /*** AHRS Message codes ***/
@@ -67,6 +66,84 @@
 #define CLEAR_SOFTI_RESPONSE 'T'
 
 
+/*** Frame descriptors ***/
+
+/*
+ * The payload of each measurement mode is a sequence of big-endian 16-bit
+ * words, listed in order as X(field, unpack, convert) entries: `unpack`
+ * selects the routine reading the word into the raw message field and
+ * `convert` the scaling of the raw field into the converted message. The
+ * lists are expanded below into the payload lengths and the specialized
+ * unpack and convert routines of each mode.
+ */
+#define AHRS_VOLTAGE_FIELDS(X)                  \
+    X(xgyro, be_uint16, voltage)                \
+    X(ygyro, be_uint16, voltage)                \
+    X(zgyro, be_uint16, voltage)                \
+    X(xacc, be_uint16, voltage)                 \
+    X(yacc, be_uint16, voltage)                 \
+    X(zacc, be_uint16, voltage)                 \
+    X(xmag, be_uint16, voltage)                 \
+    X(ymag, be_uint16, voltage)                 \
+    X(zmag, be_uint16, voltage)                 \
+    X(temperature, be_uint16, voltage)          \
+    X(sensor_time, be_uint16, copy)
+
+#define AHRS_SCALED_FIELDS(X)                   \
+    X(xgyro, be_int16, gyro)                    \
+    X(ygyro, be_int16, gyro)                    \
+    X(zgyro, be_int16, gyro)                    \
+    X(xacc, be_int16, accel)                    \
+    X(yacc, be_int16, accel)                    \
+    X(zacc, be_int16, accel)                    \
+    X(xmag, be_int16, mag)                      \
+    X(ymag, be_int16, mag)                      \
+    X(zmag, be_int16, mag)                      \
+    X(temperature, be_uint16, temperature)      \
+    X(sensor_time, be_uint16, copy)
+
+#define AHRS_ANGLE_FIELDS(X)                    \
+    X(roll, be_int16, angle)                    \
+    X(pitch, be_int16, angle)                   \
+    X(yaw, be_int16, angle)                     \
+    X(xgyro, be_int16, gyro)                    \
+    X(ygyro, be_int16, gyro)                    \
+    X(zgyro, be_int16, gyro)                    \
+    X(xacc, be_int16, accel)                    \
+    X(yacc, be_int16, accel)                    \
+    X(zacc, be_int16, accel)                    \
+    X(xmag, be_int16, mag)                      \
+    X(ymag, be_int16, mag)                      \
+    X(zmag, be_int16, mag)                      \
+    X(temperature, be_uint16, temperature)      \
+    X(sensor_time, be_uint16, copy)
+
+/** Payload length of a field list, without header or checksum. */
+#define WORD_LEN(field, unpack, convert) + 2
+#define PAYLOAD_LEN(FIELDS) (0 FIELDS(WORD_LEN))
+
+_Static_assert(PAYLOAD_LEN(AHRS_ANGLE_FIELDS) + 2 == AHRS_MAX_MSG_SIZE,
+               "angle mode frames are the longest");
+
+
+/** Mode configuration of the AHRS. */
+typedef struct ahrs_mode_desc {
+    const char *name;
+    char command;
+    char response;
+    unsigned payload_len;
+} ahrs_mode_desc_t;
+
+static const ahrs_mode_desc_t mode_desc[] = {
+    [AHRS_VOLTAGE_MODE] = {"voltage", VOLTAGE_MODE, VOLTAGE_MODE_RESPONSE,
+                           PAYLOAD_LEN(AHRS_VOLTAGE_FIELDS)},
+    [AHRS_SCALED_MODE] = {"scaled", SCALED_MODE, SCALED_MODE_RESPONSE,
+                          PAYLOAD_LEN(AHRS_SCALED_FIELDS)},
+    [AHRS_ANGLE_MODE] = {"angle", ANGLE_MODE, ANGLE_MODE_RESPONSE,
+                         PAYLOAD_LEN(AHRS_ANGLE_FIELDS)},
+};
+
+
 /**
  * Open the AHRS serial port stream.
  * @param The path of the serial port device.
@@ -196,25 +273,12 @@ int ahrs_purge(FILE *file) {
  * @return 0 if success received, -1 if error or EOF.
  */
 int ahrs_set_mode(FILE *file, ahrs_mode_t mode) {
-    char mode_command, mode_response;
-    
-    switch (mode) {
-    case AHRS_VOLTAGE_MODE:
-        mode_command = VOLTAGE_MODE;
-        mode_response = VOLTAGE_MODE_RESPONSE;
-        break;
-    case AHRS_SCALED_MODE:
-        mode_command = SCALED_MODE;
-        mode_response = SCALED_MODE_RESPONSE;
-        break;
-    case AHRS_ANGLE_MODE:
-        mode_command = ANGLE_MODE;
-        mode_response = ANGLE_MODE_RESPONSE;
-        break;
-    default:
+    if (mode < 0 || mode > AHRS_ANGLE_MODE) {
         syslog(LOG_ERR, "Unknown AHRS mode");
         return -1;
     }
+    char mode_command = mode_desc[mode].command;
+    char mode_response = mode_desc[mode].response;
     
     if (fputc(mode_command, file) == EOF) {
         syslog(LOG_ERR, "Error writing mode command to AHRS stream: %s",
@@ -241,6 +305,39 @@ int ahrs_set_mode(FILE *file, ahrs_mode_t mode) {
 }
 
 
+/**
+ * Get the AHRS measurement mode by name.
+ * @param name of the mode: `voltage`, `scaled` or `angle`.
+ * @param[out] the mode.
+ * @return 0 if success, -1 if the name is unknown.
+ */
+int ahrs_mode_from_name(const char *name, ahrs_mode_t *mode) {
+    for (int i=0; i<=AHRS_ANGLE_MODE; i++) {
+        if (!strcmp(name, mode_desc[i].name)) {
+            *mode = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Get the name of an AHRS measurement mode.
+ */
+const char* ahrs_mode_name(ahrs_mode_t mode) {
+    return mode_desc[mode].name;
+}
+
+
+/**
+ * Get the payload length of the frames of an AHRS measurement mode.
+ */
+unsigned ahrs_payload_len(ahrs_mode_t mode) {
+    return mode_desc[mode].payload_len;
+}
+
+
 /**
  * Search for an AHRS header in the stream.
  * @param AHRS400 serial port stream.
@@ -338,44 +435,20 @@ static int get_msg(FILE *file, unsigned size, uint8_t *payload,
 }
 
 
-static inline int16_t pack_int16(uint8_t *payload, unsigned index) {
+static inline int16_t unpack_be_int16(uint8_t *payload, unsigned index) {
     unsigned msb = index*2;
     unsigned lsb = index*2 + 1;
     return payload[lsb] + ((int16_t)payload[msb]<<8);
 }
 
 
-static inline uint16_t pack_uint16(uint8_t *payload, unsigned index) {
-    return (uint16_t) pack_int16(payload, index);
+static inline uint16_t unpack_be_uint16(uint8_t *payload, unsigned index) {
+    return (uint16_t) unpack_be_int16(payload, index);
 }
 
 
-/**
- * Get an angle mode message from the AHRS.
- * @param AHRS400 serial port stream.
- * @param Angle raw message payload.
- * @return 0 if message read and payload stored, -1 if error or EOF.
- */
-int ahrs_get_angle_raw(FILE *file, mavlink_ahrs400_angle_raw_t *angle_raw) {
-    uint8_t payload[AHRS_ANGLE_PAYLOAD_LEN];
-    if (get_msg(file, sizeof payload, payload, &angle_raw->time_usec))
-        return -1;
-    
-    angle_raw->roll = pack_int16(payload, 0);
-    angle_raw->pitch = pack_int16(payload, 1);
-    angle_raw->yaw = pack_int16(payload, 2);
-    angle_raw->xgyro = pack_int16(payload, 3);
-    angle_raw->ygyro = pack_int16(payload, 4);
-    angle_raw->zgyro = pack_int16(payload, 5);
-    angle_raw->xacc = pack_int16(payload, 6);
-    angle_raw->yacc = pack_int16(payload, 7);
-    angle_raw->zacc = pack_int16(payload, 8);
-    angle_raw->xmag = pack_int16(payload, 9);
-    angle_raw->ymag = pack_int16(payload, 10);
-    angle_raw->zmag = pack_int16(payload, 11);
-    angle_raw->temperature = pack_uint16(payload, 12);
-    angle_raw->sensor_time = pack_uint16(payload, 13);
-    return 0;
+static inline float raw_to_voltage(uint16_t raw){
+    return raw * 5 / 4096.0;
 }
 
 
@@ -409,21 +482,47 @@ static inline float raw_to_time(int16_t raw){
 }
 
 
-void ahrs_angle_conv(mavlink_ahrs400_angle_raw_t *raw,
-                     mavlink_ahrs400_angle_t *scaled) {
-    scaled->time_usec = raw->time_usec;
-    scaled->xacc = raw_to_accel(raw->xacc);
-    scaled->yacc = raw_to_accel(raw->yacc);
-    scaled->zacc = raw_to_accel(raw->zacc);
-    scaled->xgyro = raw_to_gyro(raw->xgyro);
-    scaled->ygyro = raw_to_gyro(raw->ygyro);
-    scaled->zgyro = raw_to_gyro(raw->zgyro);
-    scaled->xmag = raw_to_mag(raw->xmag);
-    scaled->ymag = raw_to_mag(raw->ymag);
-    scaled->zmag = raw_to_mag(raw->zmag);
-    scaled->roll = raw_to_angle(raw->roll);
-    scaled->pitch = raw_to_angle(raw->pitch);
-    scaled->yaw = raw_to_angle(raw->yaw);
-    scaled->temperature = raw_to_temperature(raw->temperature);
-    scaled->sensor_time = raw->sensor_time;
+static inline uint16_t raw_to_copy(uint16_t raw){
+    return raw;
 }
+
+
+#define UNPACK_FIELD(field, unpack, convert)            \
+    raw->field = unpack_##unpack(payload, word++);
+#define CONVERT_FIELD(field, unpack, convert)           \
+    conv->field = raw_to_##convert(raw->field);
+
+/**
+ * Define the routines reading and converting the frames of a mode:
+ * `ahrs_get_<mode>_raw` and `ahrs_<mode>_conv`.
+ */
+#define DEFINE_FRAME_ROUTINES(mode, FIELDS)                             \
+    int ahrs_get_##mode##_raw(FILE *file,                               \
+                              mavlink_ahrs400_##mode##_raw_t *raw) {    \
+        uint8_t payload[PAYLOAD_LEN(FIELDS)];                           \
+        uint64_t time_usec;                                             \
+        if (get_msg(file, sizeof payload, payload, &time_usec))         \
+            return -1;                                                  \
+                                                                        \
+        unsigned word = 0;                                              \
+        raw->time_usec = time_usec;                                     \
+        FIELDS(UNPACK_FIELD)                                            \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    void ahrs_##mode##_conv(mavlink_ahrs400_##mode##_raw_t *raw,        \
+                            mavlink_ahrs400_##mode##_t *conv) {         \
+        conv->time_usec = raw->time_usec;                               \
+        FIELDS(CONVERT_FIELD)                                           \
+    }
+
+
+/**
+ * Get a voltage, scaled or angle mode message from the AHRS.
+ * @param AHRS400 serial port stream.
+ * @param[out] Raw message payload.
+ * @return 0 if message read and payload stored, -1 if error or EOF.
+ */
+DEFINE_FRAME_ROUTINES(voltage, AHRS_VOLTAGE_FIELDS)
+DEFINE_FRAME_ROUTINES(scaled, AHRS_SCALED_FIELDS)
+DEFINE_FRAME_ROUTINES(angle, AHRS_ANGLE_FIELDS)
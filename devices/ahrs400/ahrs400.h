@@ -21,6 +21,15 @@ int ahrs_set_continuous(FILE *file);
 int ahrs_set_polled(FILE *file);
 int ahrs_purge(FILE *file);
 int ahrs_set_mode(FILE *file, ahrs_mode_t mode);
+int ahrs_mode_from_name(const char *name, ahrs_mode_t *mode);
+const char* ahrs_mode_name(ahrs_mode_t mode);
+unsigned ahrs_payload_len(ahrs_mode_t mode);
+int ahrs_get_voltage_raw(FILE *file, mavlink_ahrs400_voltage_raw_t *raw);
+void ahrs_voltage_conv(mavlink_ahrs400_voltage_raw_t *raw,
+                       mavlink_ahrs400_voltage_t *voltage);
+int ahrs_get_scaled_raw(FILE *file, mavlink_ahrs400_scaled_raw_t *raw);
+void ahrs_scaled_conv(mavlink_ahrs400_scaled_raw_t *raw,
+                      mavlink_ahrs400_scaled_t *scaled);
 int ahrs_get_angle_raw(FILE *file, mavlink_ahrs400_angle_raw_t *angle_raw);
 void ahrs_angle_conv(mavlink_ahrs400_angle_raw_t *raw,
                      mavlink_ahrs400_angle_t *scaled);
@@ -0,0 +1,425 @@
+/**
+ * Device module for NMEA and u-blox UBX GPS receivers.
+ */
+
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "gps.h"
+#include "../../utils/control.h"
+#include "../../utils/sink.h"
+#include "../../utils/utils.h"
+
+
+/** Mavlink system identifier */
+#define MAVLINK_SYSID 1
+
+/** Mavlink compenent identifier, equal to MAV_COMP_ID_GPS */
+#define MAVLINK_COMPID 220
+
+/** Message definitions, embedded in the binary log header. */
+extern const char gps_messages_xml[];
+
+/** Size of the serial port read buffer */
+#define READ_BUFFER_SIZE 4096
+
+/** Program version. */
+const char *argp_program_version = "gps-read 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "gps-read -- Read from a NMEA or u-blox UBX GPS receiver.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "GPS_PORT";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"logtxtdir", 'd', "DIR", 0,
+     "Write the navigation solution and NMEA sentences as text to DIR"},
+    {"verbose", 'v', 0, 0, "Write received data as text to STDOUT"},
+    {"baud", 'B', "RATE", 0, "Serial port baud rate, defaults to 9600"},
+    {0}
+};
+
+/** Child option parsers. */
+static struct argp_child children[] = {
+    {&sink_argp, 0, "Output options:", 0},
+    {&control_argp, 0, "Control options:", 0},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char *gps_port;
+    char *text_log_dir;
+    bool verbose;
+    speed_t baud;
+    sink_config_t sink;
+    control_config_t control;
+} arguments_t;
+
+/** Program output streams structure */
+typedef struct output_streams {
+    sink_t sink;
+    FILE *text_log;
+    FILE *nmea_log;
+} output_streams_t;
+
+/** Settings changed by the control commands, and counters. */
+typedef struct runtime {
+    bool text_log_enabled;
+    bool verbose;
+    unsigned long packets;
+    unsigned long fixes;
+} runtime_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+/** Convert a numeric baud rate to the termios constant. */
+static speed_t baud_constant(unsigned long rate) {
+    switch (rate) {
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    default: return B0;
+    }
+}
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case ARGP_KEY_INIT:
+        state->child_inputs[0] = &arguments->sink;
+        state->child_inputs[1] = &arguments->control;
+        break;
+
+    case 'd':
+        arguments->text_log_dir = arg;
+        break;
+
+    case 'v':
+        arguments->verbose = true;
+        break;
+
+    case 'B':
+        {
+            char *endptr = 0;
+            unsigned long rate = strtoul(arg, &endptr, 0);
+            if (*endptr || baud_constant(rate) == B0)
+                argp_error(state, "Unsupported baud RATE.");
+            arguments->baud = baud_constant(rate);
+        }
+        break;
+
+    case ARGP_KEY_ARG:
+        if (state->arg_num >= 1)
+            argp_error(state, "Too many arguments.");
+        arguments->gps_port = arg;
+        break;
+
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc, children};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Open a text log file in the log directory.
+ * Aborts the program on error.
+ */
+static FILE* open_text_log(char *dir, char *name, char *header) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        syslog(LOG_ERR, "Error opening text log `%s`: %s",
+               path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (fputs(header, file) < 0)
+        syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+    return file;
+}
+
+
+/**
+ * Open the program output streams
+ */
+void open_output_streams(arguments_t *args, output_streams_t *out) {
+    // Open text logs
+    if (args->text_log_dir) {
+        out->text_log = open_text_log(
+            args->text_log_dir, "gps.log",
+            "% time[us]\tutc[us]\tlat[deg]\tlon[deg]\talt[m]\t"
+            "vel_n[m/s]\tvel_e\tvel_d\tground_speed[m/s]\tcourse[deg]\t"
+            "dop\tfix_type\tsatellites\tflags\n"
+        );
+        out->nmea_log = open_text_log(
+            args->text_log_dir, "nmea.log", "% time[us]\tsentence\n"
+        );
+    }
+
+    // Open binary log and UDP socket
+    sink_open(&args->sink, &out->sink);
+
+    // Keep MAVLink 1 framing unless asked otherwise
+    if (!args->sink.mavlink2)
+        mavlink_get_channel_status(MAVLINK_COMM_0)->flags |=
+            MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+}
+
+
+/**
+ * Open the GPS serial port.
+ * Aborts the program on error.
+ */
+int open_serial_port(char *path, speed_t baud) {
+    int fd = open(path, O_RDONLY | O_NOCTTY);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Error opening port `%s`: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct termios termios;
+    if (tcgetattr(fd, &termios)
+        || cfsetispeed(&termios, baud)
+        || cfsetospeed(&termios, baud)
+        || tcsetattr(fd, TCSANOW, &termios)) {
+        char *msg = "Error setting serial port baud rate: %s";
+        syslog(LOG_WARNING, msg, strerror(errno));
+    } else {
+        cfmakeraw(&termios);
+        if (tcsetattr(fd, TCSANOW, &termios)) {
+            char *msg = "Error making serial port raw: %s";
+            syslog(LOG_WARNING, msg, strerror(errno));
+        }
+    }
+    return fd;
+}
+
+
+void log_text(const mavlink_gps_fix_t *fix, FILE *out) {
+    if (out) {
+        int status = fprintf(
+            out, "%llu\t%llu\t%.7f\t%.7f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t"
+            "%.5f\t%.2f\t%u\t%u\t%u\n",
+            (unsigned long long) fix->time_usec,
+            (unsigned long long) fix->utc_usec,
+            fix->lat * 1e-7, fix->lon * 1e-7, fix->alt * 1e-3,
+            fix->vel_n * 1e-3, fix->vel_e * 1e-3, fix->vel_d * 1e-3,
+            fix->ground_speed * 1e-3, fix->course * 1e-5, fix->dop * 1e-2,
+            fix->fix_type, fix->satellites, fix->flags
+        );
+        if (status < 0)
+            syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+    }
+}
+
+
+void log_nmea(uint64_t time_usec, const gps_packet_t *packet, FILE *out) {
+    if (out && packet->type == GPS_PACKET_NMEA) {
+        // Sentence without the line terminator
+        int len = packet->len;
+        while (len && (packet->data[len - 1] == '\n'
+                       || packet->data[len - 1] == '\r'))
+            len--;
+
+        int status = fprintf(out, "%llu\t%.*s\n", (unsigned long long)
+                             time_usec, len, (const char *) packet->data);
+        if (status < 0)
+            syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+    }
+}
+
+
+void output_mavlink_msg(mavlink_message_t *msg, output_streams_t *out) {
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    size_t len = mavlink_msg_to_send_buffer(buf, msg);
+    sink_send(&out->sink, buf, len);
+}
+
+
+void output_gps_fix(const mavlink_gps_fix_t *fix, output_streams_t *out) {
+    mavlink_message_t msg;
+    mavlink_msg_gps_fix_encode(MAVLINK_SYSID, MAVLINK_COMPID, &msg, fix);
+    output_mavlink_msg(&msg, out);
+}
+
+
+/**
+ * Execute a control command, between two reads.
+ */
+void handle_command(control_t *control, const control_cmd_t *cmd,
+                    runtime_t *runtime, output_streams_t *out) {
+    const char *name = cmd->argv[0];
+    const char *arg = cmd->argc == 2 ? cmd->argv[1] : NULL;
+
+    if (control_sink_command(control, cmd, &out->sink))
+        return;
+
+    if (!strcmp(name, "logtxt") && arg && control_parse_switch(arg) >= 0) {
+        if (!out->text_log) {
+            control_reply(control, cmd, "error: text logs not open");
+        } else {
+            runtime->text_log_enabled = control_parse_switch(arg);
+            fflush(out->text_log);
+            fflush(out->nmea_log);
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "verbose") && arg
+               && control_parse_switch(arg) >= 0) {
+        runtime->verbose = control_parse_switch(arg);
+        control_reply(control, cmd, "ok");
+    } else if (!strcmp(name, "counters") && !arg) {
+        control_reply(control, cmd,
+                      "ok packets=%lu fixes=%lu frames=%lu udp_errors=%lu",
+                      runtime->packets, runtime->fixes, out->sink.frames,
+                      out->sink.udp_errors);
+    } else {
+        control_reply(control, cmd, "error: unknown command `%s`", name);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.baud=B9600};
+    output_streams_t output_streams = {};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    arguments.sink.schema_xml = gps_messages_xml;
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    // Cheap time stamps from the calibrated TSC
+    timing_init();
+
+    // Flush the outputs when stopped
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Open the output streams
+    open_output_streams(&arguments, &output_streams);
+
+    // Open the control socket
+    control_t control;
+    control_open(&arguments.control, &control);
+    runtime_t runtime = {
+        .text_log_enabled=true,
+        .verbose=arguments.verbose,
+    };
+
+    // Open GPS port
+    int port = open_serial_port(arguments.gps_port, arguments.baud);
+
+    // Read loop
+    static uint8_t buf[READ_BUFFER_SIZE];
+    size_t used = 0;
+    gps_scanner_t scanner = {};
+    gps_decoder_t decoder = {};
+    int exit_status = EXIT_SUCCESS;
+
+    while (!stop_requested) {
+        ssize_t n = read(port, buf + used, sizeof buf - used);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Error reading GPS port: %s", strerror(errno));
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        if (n == 0) {
+            syslog(LOG_WARNING, "EOF on GPS port");
+            break;
+        }
+
+        // Packets are stamped with the time of the read completing them
+        uint64_t time_usec = get_time_us();
+        used += n;
+
+        size_t pos = 0;
+        gps_packet_t packet;
+        while (gps_scan(&scanner, buf, used, &pos, &packet)) {
+            runtime.packets++;
+            if (runtime.text_log_enabled)
+                log_nmea(time_usec, &packet, output_streams.nmea_log);
+
+            mavlink_gps_fix_t fix;
+            if (!gps_decode(&decoder, &packet, &fix))
+                continue;
+            fix.time_usec = time_usec;
+
+            runtime.fixes++;
+            output_gps_fix(&fix, &output_streams);
+            if (runtime.text_log_enabled)
+                log_text(&fix, output_streams.text_log);
+            if (runtime.verbose)
+                log_text(&fix, stdout);
+        }
+
+        // Keep the incomplete packet for the next read
+        memmove(buf, buf + pos, used - pos);
+        used -= pos;
+
+        // Release the UDP frames held back by the compression and shaping
+        sink_poll(&output_streams.sink);
+
+        // Apply the pending commands before the next read
+        control_cmd_t cmd;
+        while (control_poll(&control, &cmd))
+            handle_command(&control, &cmd, &runtime, &output_streams);
+    }
+
+    control_close(&control);
+    sink_close(&output_streams.sink);
+    if (output_streams.text_log)
+        fclose(output_streams.text_log);
+    if (output_streams.nmea_log)
+        fclose(output_streams.nmea_log);
+    return exit_status;
+}
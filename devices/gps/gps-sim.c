@@ -0,0 +1,368 @@
+/**
+ * Simulated NMEA and u-blox UBX GPS receiver on a pseudo-terminal.
+ *
+ * Writes the solutions of a circular trajectory to the master side of a
+ * pty, so that gps-read (or any other reader) can be run and benchmarked
+ * against the slave side without the receiver.
+ */
+
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** Center of the simulated trajectory (degrees and meters). */
+#define CENTER_LAT -19.8697
+#define CENTER_LON -43.9637
+#define CENTER_ALT 850.0
+
+/** Radius (m) and speed (m/s) of the simulated trajectory. */
+#define RADIUS 500.0
+#define SPEED 30.0
+
+#define EARTH_RADIUS 6371000.0
+#define MS_TO_KNOTS 1.943844
+
+
+/** Program version. */
+const char *argp_program_version = "gps-sim 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "gps-sim -- Simulate a GPS receiver on a pseudo-terminal.";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"rate", 'r', "HZ", 0, "Solution rate, defaults to 5 Hz"},
+    {"ubx", 'x', 0, 0, "Output UBX NAV-PVT instead of NMEA RMC and GGA"},
+    {"count", 'n', "N", 0, "Stop after N solutions, defaults to unlimited"},
+    {"link", 'l', "PATH", 0, "Create a symbolic link to the pty at PATH"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    double rate;
+    bool ubx;
+    unsigned long count;
+    char *link;
+} arguments_t;
+
+/** Simulated navigation solution. */
+typedef struct solution {
+    struct timespec utc;
+    double lat, lon, alt; ///< Degrees and meters.
+    double vel_n, vel_e; ///< Meters per second.
+    double course; ///< Degrees.
+} solution_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+    char *endptr = 0;
+
+    switch (key) {
+    case 'r':
+        arguments->rate = strtod(arg, &endptr);
+        if (*endptr || arguments->rate <= 0)
+            argp_error(state, "HZ argument must be a positive number.");
+        break;
+
+    case 'x':
+        arguments->ubx = true;
+        break;
+
+    case 'n':
+        arguments->count = strtoul(arg, &endptr, 0);
+        if (*endptr)
+            argp_error(state, "N argument must be an integer.");
+        break;
+
+    case 'l':
+        arguments->link = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        argp_error(state, "Too many arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, 0, doc};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Open the master side of a new pseudo-terminal.
+ * Aborts the program on error.
+ */
+int open_pty(char *link) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+        syslog(LOG_ERR, "Error creating pty: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct termios termios;
+    if (!tcgetattr(fd, &termios)) {
+        cfmakeraw(&termios);
+        tcsetattr(fd, TCSANOW, &termios);
+    }
+
+    char *slave = ptsname(fd);
+    if (link) {
+        unlink(link);
+        if (symlink(slave, link))
+            syslog(LOG_WARNING, "Error creating link `%s`: %s",
+                   link, strerror(errno));
+    }
+    printf("%s\n", slave);
+    fflush(stdout);
+    return fd;
+}
+
+
+/**
+ * Compute the simulated solution at a given time since start.
+ */
+void simulate(double t, solution_t *sol) {
+    double angle = SPEED * t / RADIUS;
+    double north = RADIUS * sin(angle);
+    double east = RADIUS * (1 - cos(angle));
+
+    sol->lat = CENTER_LAT + north / EARTH_RADIUS * 180 / M_PI;
+    sol->lon = CENTER_LON + east / (EARTH_RADIUS * cos(CENTER_LAT * M_PI / 180))
+               * 180 / M_PI;
+    sol->alt = CENTER_ALT + 10 * sin(angle / 4);
+    sol->vel_n = SPEED * cos(angle);
+    sol->vel_e = SPEED * sin(angle);
+    sol->course = fmod(atan2(sol->vel_e, sol->vel_n) * 180 / M_PI + 360, 360);
+}
+
+
+/**
+ * Append a NMEA sentence with its checksum to a buffer.
+ * @return the length of the sentence.
+ */
+static int format_nmea(char *out, size_t size, const char *body) {
+    uint8_t checksum = 0;
+    for (const char *c = body; *c; c++)
+        checksum ^= *c;
+    return snprintf(out, size, "$%s*%02X\r\n", body, checksum);
+}
+
+
+/**
+ * Format a NMEA coordinate as degrees and decimal minutes.
+ */
+static void format_coordinate(char *out, size_t size, double degrees,
+                              int deg_digits, char pos, char neg) {
+    char hemi = degrees < 0 ? neg : pos;
+    degrees = fabs(degrees);
+    int whole = degrees;
+    snprintf(out, size, "%0*d%07.4f,%c",
+             deg_digits, whole, (degrees - whole) * 60, hemi);
+}
+
+
+/**
+ * Format the RMC and GGA sentences of a solution.
+ * @return the length of the output.
+ */
+size_t format_nmea_solution(const solution_t *sol, char *out, size_t size) {
+    struct tm tm;
+    gmtime_r(&sol->utc.tv_sec, &tm);
+    double seconds = tm.tm_sec + sol->utc.tv_nsec * 1e-9;
+
+    char lat[32], lon[32], body[160];
+    format_coordinate(lat, sizeof lat, sol->lat, 2, 'N', 'S');
+    format_coordinate(lon, sizeof lon, sol->lon, 3, 'E', 'W');
+    double speed = hypot(sol->vel_n, sol->vel_e) * MS_TO_KNOTS;
+
+    snprintf(body, sizeof body,
+             "GPRMC,%02d%02d%06.3f,A,%s,%s,%.2f,%.2f,%02d%02d%02d,,,A",
+             tm.tm_hour, tm.tm_min, seconds, lat, lon, speed, sol->course,
+             tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+    size_t len = format_nmea(out, size, body);
+
+    snprintf(body, sizeof body,
+             "GPGGA,%02d%02d%06.3f,%s,%s,1,09,0.9,%.1f,M,-5.0,M,,",
+             tm.tm_hour, tm.tm_min, seconds, lat, lon, sol->alt);
+    len += format_nmea(out + len, size - len, body);
+    return len;
+}
+
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+
+/**
+ * Format the UBX NAV-PVT frame of a solution.
+ * @return the length of the output.
+ */
+size_t format_ubx_solution(const solution_t *sol, uint8_t *out) {
+    struct tm tm;
+    gmtime_r(&sol->utc.tv_sec, &tm);
+
+    uint8_t *p = out + 6;
+    memset(p, 0, 92);
+    put_le32(p, (tm.tm_wday * 86400 + tm.tm_hour * 3600 + tm.tm_min * 60
+                 + tm.tm_sec) * 1000 + sol->utc.tv_nsec / 1000000);
+    put_le16(p + 4, tm.tm_year + 1900);
+    p[6] = tm.tm_mon + 1;
+    p[7] = tm.tm_mday;
+    p[8] = tm.tm_hour;
+    p[9] = tm.tm_min;
+    p[10] = tm.tm_sec;
+    p[11] = 0x07;
+    put_le32(p + 16, sol->utc.tv_nsec);
+    p[20] = 3;
+    p[21] = 0x01;
+    p[23] = 9;
+    put_le32(p + 24, lround(sol->lon * 1e7));
+    put_le32(p + 28, lround(sol->lat * 1e7));
+    put_le32(p + 32, lround((sol->alt - 5) * 1000));
+    put_le32(p + 36, lround(sol->alt * 1000));
+    put_le32(p + 48, lround(sol->vel_n * 1000));
+    put_le32(p + 52, lround(sol->vel_e * 1000));
+    put_le32(p + 60, lround(hypot(sol->vel_n, sol->vel_e) * 1000));
+    put_le32(p + 64, lround(sol->course * 1e5));
+    put_le16(p + 76, 150);
+
+    out[0] = 0xB5;
+    out[1] = 0x62;
+    out[2] = 0x01;
+    out[3] = 0x07;
+    put_le16(out + 4, 92);
+
+    uint8_t ck_a = 0, ck_b = 0;
+    for (int i=2; i<6 + 92; i++) {
+        ck_a += out[i];
+        ck_b += ck_a;
+    }
+    out[98] = ck_a;
+    out[99] = ck_b;
+    return 100;
+}
+
+
+/**
+ * Write a whole buffer to the pty.
+ * @return 0 if success, -1 if error.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        // A signal may end a blocked write with part of the buffer written
+        if (stop_requested)
+            return -1;
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR && !stop_requested)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.rate=5};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int pty = open_pty(arguments.link);
+
+    struct timespec start, next;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    long period_ns = 1e9 / arguments.rate;
+
+    unsigned long n;
+    for (n=0; !stop_requested && (!arguments.count || n < arguments.count);
+         n++) {
+        solution_t sol;
+        clock_gettime(CLOCK_REALTIME, &sol.utc);
+        simulate(n / arguments.rate, &sol);
+
+        uint8_t out[512];
+        size_t len;
+        if (arguments.ubx)
+            len = format_ubx_solution(&sol, out);
+        else
+            len = format_nmea_solution(&sol, (char *) out, sizeof out);
+
+        if (write_all(pty, out, len)) {
+            if (!stop_requested)
+                syslog(LOG_ERR, "Error writing to pty: %s", strerror(errno));
+            break;
+        }
+
+        // Wait for the next solution
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+               == EINTR && !stop_requested);
+    }
+
+    syslog(LOG_INFO, "%lu solutions written", n);
+    if (arguments.link)
+        unlink(arguments.link);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,515 @@
+/**
+ * Streaming NMEA and u-blox UBX parser for GPS receivers.
+ *
+ * Packets are located in blocks of received bytes without copying, their
+ * checksums validated and the navigation sentences decoded into GPS_FIX
+ * messages.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "gps.h"
+
+
+/*** Framing constants ***/
+#define NMEA_START '$'
+#define NMEA_MAX_LEN 128
+
+#define UBX_SYNC1 0xB5
+#define UBX_SYNC2 0x62
+#define UBX_HEADER_LEN 6
+#define UBX_CHECKSUM_LEN 2
+#define UBX_MAX_PAYLOAD_LEN 1024
+
+
+/*** UBX message identifiers ***/
+#define UBX_CLASS_NAV 0x01
+#define UBX_NAV_POSLLH 0x02
+#define UBX_NAV_PVT 0x07
+#define UBX_NAV_VELNED 0x12
+
+#define UBX_NAV_POSLLH_LEN 28
+#define UBX_NAV_PVT_LEN 92
+#define UBX_NAV_VELNED_LEN 36
+
+
+/** Knots to millimeters per second. */
+#define KNOT_TO_MM_S 514.444
+
+
+static int hex_value(uint8_t c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+
+/**
+ * Check for a NMEA sentence at the start of a block.
+ * @return 1 if valid sentence found, 0 if incomplete, -1 if invalid.
+ */
+static int scan_nmea(gps_scanner_t *scanner, const uint8_t *p, size_t avail,
+                     gps_packet_t *packet) {
+    size_t limit = avail < NMEA_MAX_LEN ? avail : NMEA_MAX_LEN;
+    const uint8_t *eol = memchr(p, '\n', limit);
+    if (!eol)
+        return avail < NMEA_MAX_LEN ? 0 : -1;
+
+    const uint8_t *star = memchr(p, '*', eol - p);
+    if (!star || eol - star < 3)
+        return -1;
+
+    int hi = hex_value(star[1]);
+    int lo = hex_value(star[2]);
+    if (hi < 0 || lo < 0)
+        return -1;
+
+    uint8_t checksum = 0;
+    for (const uint8_t *q = p + 1; q < star; q++)
+        checksum ^= *q;
+    if (checksum != (hi << 4 | lo)) {
+        scanner->bad_checksum++;
+        return -1;
+    }
+
+    packet->type = GPS_PACKET_NMEA;
+    packet->data = p;
+    packet->len = eol - p + 1;
+    packet->payload = p + 1;
+    packet->payload_len = star - p - 1;
+    scanner->nmea++;
+    return 1;
+}
+
+
+/**
+ * Check for a UBX frame at the start of a block.
+ * @return 1 if valid frame found, 0 if incomplete, -1 if invalid.
+ */
+static int scan_ubx(gps_scanner_t *scanner, const uint8_t *p, size_t avail,
+                    gps_packet_t *packet) {
+    if (avail < 2)
+        return 0;
+    if (p[1] != UBX_SYNC2)
+        return -1;
+    if (avail < UBX_HEADER_LEN)
+        return 0;
+
+    size_t payload_len = p[4] | p[5] << 8;
+    if (payload_len > UBX_MAX_PAYLOAD_LEN)
+        return -1;
+    size_t len = UBX_HEADER_LEN + payload_len + UBX_CHECKSUM_LEN;
+    if (avail < len)
+        return 0;
+
+    // 8-bit Fletcher checksum over class, id, length and payload
+    uint8_t ck_a = 0, ck_b = 0;
+    for (size_t i=2; i<UBX_HEADER_LEN + payload_len; i++) {
+        ck_a += p[i];
+        ck_b += ck_a;
+    }
+    if (ck_a != p[len - 2] || ck_b != p[len - 1]) {
+        scanner->bad_checksum++;
+        return -1;
+    }
+
+    packet->type = GPS_PACKET_UBX;
+    packet->data = p;
+    packet->len = len;
+    packet->payload = p + UBX_HEADER_LEN;
+    packet->payload_len = payload_len;
+    packet->ubx_class = p[2];
+    packet->ubx_id = p[3];
+    scanner->ubx++;
+    return 1;
+}
+
+
+/**
+ * Find the next NMEA sentence or UBX frame in a block of bytes.
+ *
+ * The packet points into the scanned buffer. When no complete packet is
+ * found, `pos` is left at the start of the incomplete candidate (or at the
+ * end of the block), so that the caller can keep the tail of the block and
+ * retry once more data is available.
+ *
+ * @param scanner counters.
+ * @param block of bytes to scan.
+ * @param length of the block.
+ * @param[in,out] offset where the scan starts, updated past the packet.
+ * @param[out] the packet found.
+ * @return 1 if a packet was found, 0 if more data is needed.
+ */
+int gps_scan(gps_scanner_t *scanner, const uint8_t *buf, size_t len,
+             size_t *pos, gps_packet_t *packet) {
+    size_t i = *pos;
+
+    for (; i < len; i++) {
+        int status = -1;
+        if (buf[i] == NMEA_START)
+            status = scan_nmea(scanner, buf + i, len - i, packet);
+        else if (buf[i] == UBX_SYNC1)
+            status = scan_ubx(scanner, buf + i, len - i, packet);
+
+        if (status > 0) {
+            *pos = i + packet->len;
+            return 1;
+        }
+        if (status == 0)
+            break;
+
+        scanner->skipped++;
+    }
+
+    *pos = i;
+    return 0;
+}
+
+
+/** Iterator over the comma-separated fields of a NMEA sentence. */
+typedef struct nmea_fields {
+    const char *next;
+    const char *end;
+} nmea_fields_t;
+
+
+/**
+ * Get the next field of a NMEA sentence.
+ * @return true if a field was found, false at the end of the sentence.
+ */
+static bool next_field(nmea_fields_t *fields, const char **field,
+                       size_t *len) {
+    if (!fields->next)
+        return false;
+
+    const char *comma = memchr(fields->next, ',', fields->end - fields->next);
+    *field = fields->next;
+    if (comma) {
+        *len = comma - fields->next;
+        fields->next = comma + 1;
+    } else {
+        *len = fields->end - fields->next;
+        fields->next = NULL;
+    }
+    return true;
+}
+
+
+/**
+ * Parse a decimal number in place.
+ * @return true if success, false if the field is empty or invalid.
+ */
+static bool parse_decimal(const char *s, size_t len, double *value) {
+    double sign = 1, result = 0, scale = 1;
+    bool digits = false, fraction = false;
+
+    size_t i = 0;
+    if (len && (s[0] == '-' || s[0] == '+')) {
+        sign = s[0] == '-' ? -1 : 1;
+        i++;
+    }
+    for (; i<len; i++) {
+        if (s[i] == '.' && !fraction) {
+            fraction = true;
+        } else if (s[i] >= '0' && s[i] <= '9') {
+            result = result * 10 + (s[i] - '0');
+            if (fraction)
+                scale *= 10;
+            digits = true;
+        } else {
+            return false;
+        }
+    }
+
+    *value = sign * result / scale;
+    return digits;
+}
+
+
+/**
+ * Parse a hhmmss.ss NMEA time field.
+ * @return true if success, false if the field is empty or invalid.
+ */
+static bool parse_time(const char *s, size_t len, uint32_t *time_ms) {
+    double hhmmss;
+    if (len < 6 || !parse_decimal(s, len, &hhmmss))
+        return false;
+
+    unsigned hours = hhmmss / 10000;
+    unsigned minutes = fmod(hhmmss, 10000) / 100;
+    double seconds = fmod(hhmmss, 100);
+    *time_ms = (hours * 3600 + minutes * 60) * 1000 + lround(seconds * 1000);
+    return true;
+}
+
+
+/**
+ * Parse a NMEA latitude or longitude and its hemisphere fields.
+ * @return true if success, false if the fields are empty or invalid.
+ */
+static bool parse_coordinate(const char *s, size_t len, const char *hemi,
+                             size_t hemi_len, int32_t *deg_e7) {
+    double ddmm;
+    if (!parse_decimal(s, len, &ddmm) || hemi_len != 1)
+        return false;
+
+    double degrees = floor(ddmm / 100) + fmod(ddmm, 100) / 60;
+    if (*hemi == 'S' || *hemi == 'W')
+        degrees = -degrees;
+    *deg_e7 = llround(degrees * 1e7);
+    return true;
+}
+
+
+/**
+ * Convert a calendar UTC date and time to microseconds since epoch.
+ */
+static uint64_t utc_to_usec(int year, int month, int day,
+                            uint32_t time_ms) {
+    struct tm tm = {.tm_year=year - 1900, .tm_mon=month - 1, .tm_mday=day};
+    time_t days = timegm(&tm);
+    return (uint64_t)days * 1000000 + (uint64_t)time_ms * 1000;
+}
+
+
+/**
+ * Decode a RMC sentence, holding its course and date for the next GGA.
+ */
+static void decode_rmc(gps_decoder_t *decoder, nmea_fields_t *fields) {
+    const char *f[10];
+    size_t len[10];
+    int n;
+    for (n=1; n<10 && next_field(fields, &f[n], &len[n]); n++);
+    if (n < 10)
+        return;
+
+    mavlink_gps_fix_t *rmc = &decoder->rmc;
+    memset(rmc, 0, sizeof *rmc);
+    if (!parse_time(f[1], len[1], &decoder->rmc_time_ms))
+        return;
+
+    double knots, course;
+    if (len[2] == 1 && *f[2] == 'A'
+        && parse_decimal(f[7], len[7], &knots)) {
+        rmc->ground_speed = lround(knots * KNOT_TO_MM_S);
+        if (parse_decimal(f[8], len[8], &course))
+            rmc->course = lround(course * 1e5);
+        rmc->flags |= GPS_FIX_COURSE_VALID;
+    }
+
+    double ddmmyy;
+    if (len[9] == 6 && parse_decimal(f[9], len[9], &ddmmyy)) {
+        int date = ddmmyy;
+        rmc->utc_usec = utc_to_usec(2000 + date % 100, date / 100 % 100,
+                                    date / 10000, decoder->rmc_time_ms);
+        rmc->flags |= GPS_FIX_UTC_VALID;
+    }
+}
+
+
+/**
+ * Decode a GGA sentence, merged with the RMC of the same epoch.
+ * @return 1 if a fix was decoded, 0 otherwise.
+ */
+static int decode_gga(gps_decoder_t *decoder, nmea_fields_t *fields,
+                      mavlink_gps_fix_t *fix) {
+    const char *f[10];
+    size_t len[10];
+    int n;
+    for (n=1; n<10 && next_field(fields, &f[n], &len[n]); n++);
+    if (n < 10)
+        return 0;
+
+    uint32_t time_ms;
+    if (!parse_time(f[1], len[1], &time_ms))
+        return 0;
+
+    double quality = 0, satellites = 0, hdop = 0, alt;
+    parse_decimal(f[6], len[6], &quality);
+    parse_decimal(f[7], len[7], &satellites);
+    parse_decimal(f[8], len[8], &hdop);
+    fix->satellites = satellites;
+    fix->dop = lround(hdop * 100);
+
+    int32_t lat, lon;
+    if (quality > 0
+        && parse_coordinate(f[2], len[2], f[3], len[3], &lat)
+        && parse_coordinate(f[4], len[4], f[5], len[5], &lon)) {
+        fix->lat = lat;
+        fix->lon = lon;
+        fix->flags |= GPS_FIX_POSITION_VALID;
+        fix->fix_type = 2;
+        if (parse_decimal(f[9], len[9], &alt)) {
+            fix->alt = lround(alt * 1000);
+            fix->fix_type = 3;
+        }
+    }
+
+    // Course and date from the RMC of the same epoch
+    const mavlink_gps_fix_t *rmc = &decoder->rmc;
+    if (decoder->rmc_time_ms == time_ms) {
+        fix->ground_speed = rmc->ground_speed;
+        fix->course = rmc->course;
+        fix->flags |= rmc->flags & GPS_FIX_COURSE_VALID;
+        if (rmc->flags & GPS_FIX_UTC_VALID) {
+            fix->utc_usec = rmc->utc_usec;
+            fix->flags |= GPS_FIX_UTC_VALID;
+        }
+    }
+
+    return 1;
+}
+
+
+static int decode_nmea(gps_decoder_t *decoder, const gps_packet_t *packet,
+                       mavlink_gps_fix_t *fix) {
+    nmea_fields_t fields = {
+        .next=(const char *) packet->payload,
+        .end=(const char *) packet->payload + packet->payload_len
+    };
+
+    // Sentence identifier: two-letter talker and three-letter type
+    const char *id;
+    size_t id_len;
+    if (!next_field(&fields, &id, &id_len) || id_len != 5)
+        return 0;
+
+    if (!memcmp(id + 2, "GGA", 3))
+        return decode_gga(decoder, &fields, fix);
+    if (!memcmp(id + 2, "RMC", 3))
+        decode_rmc(decoder, &fields);
+    return 0;
+}
+
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static int decode_nav_pvt(const uint8_t *p, mavlink_gps_fix_t *fix) {
+    fix->itow = le32(p);
+
+    // Date and time valid flags
+    if ((p[11] & 0x03) == 0x03) {
+        uint32_t time_ms = (p[8] * 3600 + p[9] * 60 + p[10]) * 1000;
+        int32_t nano = le32(p + 16);
+        fix->utc_usec = utc_to_usec(le16(p + 4), p[6], p[7], time_ms)
+                        + nano / 1000;
+        fix->flags |= GPS_FIX_UTC_VALID;
+    }
+
+    fix->fix_type = p[20];
+    fix->satellites = p[23];
+    fix->lon = le32(p + 24);
+    fix->lat = le32(p + 28);
+    fix->alt = le32(p + 36);
+    fix->vel_n = le32(p + 48);
+    fix->vel_e = le32(p + 52);
+    fix->vel_d = le32(p + 56);
+    fix->ground_speed = le32(p + 60);
+    fix->course = le32(p + 64);
+    fix->dop = le16(p + 76);
+
+    // gnssFixOK flag
+    if (p[21] & 0x01)
+        fix->flags |= GPS_FIX_POSITION_VALID | GPS_FIX_COURSE_VALID
+                      | GPS_FIX_NED_VELOCITY_VALID;
+    return 1;
+}
+
+
+static void decode_nav_velned(gps_decoder_t *decoder, const uint8_t *p) {
+    mavlink_gps_fix_t *velned = &decoder->velned;
+    velned->itow = le32(p);
+    velned->vel_n = (int32_t)le32(p + 4) * 10;
+    velned->vel_e = (int32_t)le32(p + 8) * 10;
+    velned->vel_d = (int32_t)le32(p + 12) * 10;
+    velned->ground_speed = le32(p + 20) * 10;
+    velned->course = le32(p + 24);
+    velned->flags = GPS_FIX_COURSE_VALID | GPS_FIX_NED_VELOCITY_VALID;
+}
+
+
+static int decode_nav_posllh(gps_decoder_t *decoder, const uint8_t *p,
+                             mavlink_gps_fix_t *fix) {
+    fix->itow = le32(p);
+    fix->lon = le32(p + 4);
+    fix->lat = le32(p + 8);
+    fix->alt = le32(p + 16);
+    fix->fix_type = 3;
+    fix->flags |= GPS_FIX_POSITION_VALID;
+
+    // Velocity from the VELNED of the same epoch
+    const mavlink_gps_fix_t *velned = &decoder->velned;
+    if (velned->flags && velned->itow == fix->itow) {
+        fix->vel_n = velned->vel_n;
+        fix->vel_e = velned->vel_e;
+        fix->vel_d = velned->vel_d;
+        fix->ground_speed = velned->ground_speed;
+        fix->course = velned->course;
+        fix->flags |= velned->flags;
+    }
+    return 1;
+}
+
+
+static int decode_ubx(gps_decoder_t *decoder, const gps_packet_t *packet,
+                      mavlink_gps_fix_t *fix) {
+    if (packet->ubx_class != UBX_CLASS_NAV)
+        return 0;
+
+    const uint8_t *p = packet->payload;
+    size_t len = packet->payload_len;
+    switch (packet->ubx_id) {
+    case UBX_NAV_PVT:
+        if (len < UBX_NAV_PVT_LEN)
+            return 0;
+        return decode_nav_pvt(p, fix);
+    case UBX_NAV_POSLLH:
+        if (len < UBX_NAV_POSLLH_LEN)
+            return 0;
+        return decode_nav_posllh(decoder, p, fix);
+    case UBX_NAV_VELNED:
+        if (len >= UBX_NAV_VELNED_LEN)
+            decode_nav_velned(decoder, p);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * Decode a packet into a navigation solution.
+ *
+ * Sentences carrying part of a solution are held in the decoder and merged
+ * into the fix of the same epoch: RMC into GGA and NAV-VELNED into
+ * NAV-POSLLH. NAV-PVT carries the whole solution.
+ *
+ * @param decoder state.
+ * @param packet from `gps_scan`.
+ * @param[out] navigation solution, except for `time_usec`.
+ * @return 1 if a fix was decoded, 0 otherwise.
+ */
+int gps_decode(gps_decoder_t *decoder, const gps_packet_t *packet,
+               mavlink_gps_fix_t *fix) {
+    memset(fix, 0, sizeof *fix);
+
+    if (packet->type == GPS_PACKET_NMEA)
+        return decode_nmea(decoder, packet, fix);
+    else
+        return decode_ubx(decoder, packet, fix);
+}
@@ -0,0 +1,58 @@
+/**
+ * Streaming NMEA and u-blox UBX parser for GPS receivers.
+ */
+
+#ifndef GPS_H
+#define GPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "generated/gps_messages/mavlink.h"
+
+
+/** Bits of the GPS_FIX flags field. */
+#define GPS_FIX_POSITION_VALID 0x01
+#define GPS_FIX_COURSE_VALID 0x02
+#define GPS_FIX_NED_VELOCITY_VALID 0x04
+#define GPS_FIX_UTC_VALID 0x08
+
+typedef enum {
+    GPS_PACKET_NMEA,
+    GPS_PACKET_UBX
+} gps_packet_type_t;
+
+/** A packet found in a block, pointing into the scanned buffer. */
+typedef struct gps_packet {
+    gps_packet_type_t type;
+    const uint8_t *data; ///< Whole packet, as received.
+    size_t len;
+    const uint8_t *payload; ///< NMEA text between `$` and `*` or UBX payload.
+    size_t payload_len;
+    uint8_t ubx_class;
+    uint8_t ubx_id;
+} gps_packet_t;
+
+/** Scanner counters. */
+typedef struct gps_scanner {
+    uint64_t nmea;
+    uint64_t ubx;
+    uint64_t bad_checksum;
+    uint64_t skipped;
+} gps_scanner_t;
+
+/** Decoder state, merging the sentences of a navigation epoch. */
+typedef struct gps_decoder {
+    mavlink_gps_fix_t rmc; ///< Latest NMEA RMC data.
+    uint32_t rmc_time_ms; ///< Time of day of the latest RMC, in milliseconds.
+    mavlink_gps_fix_t velned; ///< Latest UBX NAV-VELNED data.
+} gps_decoder_t;
+
+
+int gps_scan(gps_scanner_t *scanner, const uint8_t *buf, size_t len,
+             size_t *pos, gps_packet_t *packet);
+int gps_decode(gps_decoder_t *decoder, const gps_packet_t *packet,
+               mavlink_gps_fix_t *fix);
+
+
+#endif//GPS_H
@@ -0,0 +1,246 @@
+/**
+ * Triggered high-rate burst capture for the VCM-DAS-1.
+ *
+ * The acquisition thread scans a channel subset at the burst rate, up to as
+ * fast as the board allows, into a preallocated ring holding the pre- and post-trigger windows. When
+ * the post-trigger window completes, the ring is copied to a window buffer
+ * and written to the burst log by a separate thread, so that disk latency
+ * never stalls the scanning. Windows completing while the writer is still
+ * busy with the previous one are dropped and counted.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "burst.h"
+
+#include "generated/vcmdas1_messages/mavlink.h"
+
+
+/** Mavlink system identifier, the same as the normal-rate stream */
+#define MAVLINK_SYSID 1
+
+/** Mavlink compenent identifier, the same as the normal-rate stream */
+#define MAVLINK_COMPID 200
+
+
+/**
+ * Write the windows handed over by the acquisition thread.
+ */
+static void* writer_thread(void *arg) {
+    burst_t *burst = arg;
+
+    pthread_mutex_lock(&burst->lock);
+    for (;;) {
+        while (!burst->window_full && !burst->stop)
+            pthread_cond_wait(&burst->cond, &burst->lock);
+        if (!burst->window_full)
+            break;
+        pthread_mutex_unlock(&burst->lock);
+
+        // The window is not touched by the acquisition thread while full
+        for (unsigned i=0; i<burst->window_len; i++) {
+            burst_scan_t *scan = &burst->window[i];
+            mavlink_adc_burst_t adc_burst = {
+                .time_usec=scan->time_usec,
+                .trigger_usec=burst->window_trigger_usec,
+                .event=burst->window_event,
+                .channels=burst->channels,
+            };
+            memcpy(adc_burst.data, scan->data, sizeof adc_burst.data);
+
+            // A separate channel keeps the sequence numbers thread-local
+            mavlink_message_t msg;
+            mavlink_msg_adc_burst_encode_chan(
+                MAVLINK_SYSID, MAVLINK_COMPID, MAVLINK_COMM_1, &msg, &adc_burst
+            );
+            uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+            size_t len = mavlink_msg_to_send_buffer(buf, &msg);
+            logwriter_record(burst->log, scan->time_usec, buf, len);
+        }
+        logwriter_flush(burst->log);
+
+        pthread_mutex_lock(&burst->lock);
+        burst->window_full = false;
+    }
+    pthread_mutex_unlock(&burst->lock);
+    return NULL;
+}
+
+
+/**
+ * Allocate the burst buffers, open the burst log and start its writer.
+ * @param path of the burst log.
+ * @param channels bit mask of the scanned channels.
+ * @param pre number of scans kept before the trigger.
+ * @param post number of scans captured from the trigger on, at least 1.
+ * @param threshold trigger condition, checked on every scan.
+ * @return 0 if success, -1 if error.
+ */
+int burst_open(burst_t *burst, const char *path, uint16_t channels,
+               unsigned pre, unsigned post, burst_threshold_t threshold) {
+    memset(burst, 0, sizeof *burst);
+    burst->channels = channels;
+    burst->pre = pre;
+    burst->post = post ? post : 1;
+    burst->threshold = threshold;
+    burst->size = burst->pre + burst->post;
+
+    burst->ring = calloc(burst->size, sizeof *burst->ring);
+    burst->window = calloc(burst->size, sizeof *burst->window);
+    if (!burst->ring || !burst->window) {
+        syslog(LOG_ERR, "Error allocating burst buffers: %s", strerror(errno));
+        goto err;
+    }
+
+    burst->log = logwriter_open(path, 0);
+    if (!burst->log)
+        goto err;
+
+    pthread_mutex_init(&burst->lock, NULL);
+    pthread_cond_init(&burst->cond, NULL);
+
+    // The signals stay with the acquisition thread
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int status = pthread_create(&burst->writer, NULL, writer_thread, burst);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error starting burst writer: %s", strerror(status));
+        logwriter_close(burst->log);
+        goto err;
+    }
+    return 0;
+
+ err:
+    free(burst->ring);
+    free(burst->window);
+    burst->ring = burst->window = NULL;
+    return -1;
+}
+
+
+/**
+ * Hand the completed window over to the writer thread.
+ */
+static void complete_window(burst_t *burst) {
+    pthread_mutex_lock(&burst->lock);
+    if (burst->window_full) {
+        burst->dropped++;
+    } else {
+        // Unroll the ring, oldest scan first
+        unsigned len = burst->filled;
+        unsigned start = (burst->head + burst->size - len) % burst->size;
+        unsigned first = burst->size - start < len
+                       ? burst->size - start : len;
+        memcpy(burst->window, burst->ring + start,
+               first * sizeof *burst->ring);
+        memcpy(burst->window + first, burst->ring,
+               (len - first) * sizeof *burst->ring);
+
+        burst->window_len = len;
+        burst->window_trigger_usec = burst->trigger_usec;
+        burst->window_event = burst->event;
+        burst->window_full = true;
+        pthread_cond_signal(&burst->cond);
+    }
+    pthread_mutex_unlock(&burst->lock);
+}
+
+
+/**
+ * Whether the scan crosses the trigger threshold.
+ */
+static bool threshold_crossed(burst_t *burst, const burst_scan_t *scan) {
+    burst_threshold_t *threshold = &burst->threshold;
+    if (threshold->channel < 0)
+        return false;
+
+    // The previous level is kept apart from the ring, which holds a single
+    // scan without pre-trigger window
+    int16_t last = burst->last_level;
+    int16_t level = scan->data[threshold->channel];
+    bool has_last = burst->has_last_level;
+    burst->last_level = level;
+    burst->has_last_level = true;
+    if (!has_last)
+        return false;
+
+    if (threshold->rising)
+        return last < threshold->level && level >= threshold->level;
+    else
+        return last > threshold->level && level <= threshold->level;
+}
+
+
+/**
+ * Store a scan of the burst channels and evaluate the trigger conditions.
+ */
+void burst_add(burst_t *burst, const burst_scan_t *scan) {
+    burst->ring[burst->head] = *scan;
+    burst->head = (burst->head + 1) % burst->size;
+    if (burst->filled < burst->size)
+        burst->filled++;
+
+    bool crossed = threshold_crossed(burst, scan);
+
+    // Capture the post-trigger window
+    if (burst->remaining) {
+        if (--burst->remaining == 0)
+            complete_window(burst);
+        return;
+    }
+
+    // Start a new window, the triggering scan being its first
+    if (crossed || burst->external) {
+        burst->external = false;
+        burst->trigger_usec = scan->time_usec;
+        burst->event++;
+        burst->remaining = burst->post - 1;
+
+        // Keep no more than the pre-trigger window from earlier scans
+        if (burst->filled > burst->pre + 1)
+            burst->filled = burst->pre + 1;
+        if (burst->remaining == 0)
+            complete_window(burst);
+    }
+}
+
+
+/**
+ * Trigger a capture on the next scan.
+ */
+void burst_trigger(burst_t *burst) {
+    burst->external = true;
+}
+
+
+/**
+ * Write the pending window, stop the writer and free the buffers.
+ * A window whose post-trigger part is incomplete is discarded.
+ */
+void burst_close(burst_t *burst) {
+    if (!burst->log)
+        return;
+
+    pthread_mutex_lock(&burst->lock);
+    burst->stop = true;
+    pthread_cond_signal(&burst->cond);
+    pthread_mutex_unlock(&burst->lock);
+    pthread_join(burst->writer, NULL);
+
+    if (burst->dropped)
+        syslog(LOG_WARNING, "%lu burst windows dropped, writer busy",
+               burst->dropped);
+
+    logwriter_close(burst->log);
+    free(burst->ring);
+    free(burst->window);
+    pthread_mutex_destroy(&burst->lock);
+    pthread_cond_destroy(&burst->cond);
+    burst->log = NULL;
+}
@@ -0,0 +1,74 @@
+/**
+ * Triggered high-rate burst capture for the VCM-DAS-1.
+ */
+
+#ifndef BURST_H
+#define BURST_H
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../utils/logwriter.h"
+
+
+/** Number of ADC channels. */
+#define BURST_CHANNELS 16
+
+
+/** One scan of the burst channels. */
+typedef struct burst_scan {
+    uint64_t time_usec;
+    int16_t data[BURST_CHANNELS];
+} burst_scan_t;
+
+/** Threshold trigger condition. */
+typedef struct burst_threshold {
+    int channel; ///< Channel compared, negative to disable.
+    int16_t level;
+    bool rising; ///< Trigger on rising crossings, otherwise on falling ones.
+} burst_threshold_t;
+
+/** Burst capture state. */
+typedef struct burst {
+    uint16_t channels; ///< Bit mask of the scanned channels.
+    unsigned pre; ///< Scans kept before the trigger.
+    unsigned post; ///< Scans captured from the trigger on.
+    burst_threshold_t threshold;
+
+    // Pre-trigger ring, touched only by the acquisition thread
+    burst_scan_t *ring;
+    unsigned size;
+    unsigned head;
+    unsigned filled;
+    unsigned remaining; ///< Scans until the window is complete, 0 if idle.
+    bool external; ///< External trigger pending.
+    int16_t last_level; ///< Trigger channel of the previous scan.
+    bool has_last_level; ///< Whether a previous scan was compared.
+    uint64_t trigger_usec;
+    uint16_t event;
+
+    // Window handed to the writer thread
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    burst_scan_t *window;
+    unsigned window_len;
+    uint64_t window_trigger_usec;
+    uint16_t window_event;
+    bool window_full;
+    bool stop;
+    logwriter_t *log;
+    unsigned long dropped; ///< Windows lost while the writer was busy.
+} burst_t;
+
+
+int burst_open(burst_t *burst, const char *path, uint16_t channels,
+               unsigned pre, unsigned post, burst_threshold_t threshold);
+void burst_add(burst_t *burst, const burst_scan_t *scan);
+void burst_trigger(burst_t *burst);
+void burst_close(burst_t *burst);
+
+
+#endif//BURST_H
@@ -0,0 +1,314 @@
+/**
+ * Online vibration spectrum of the VCM-DAS-1 channels.
+ *
+ * Each analysed channel keeps the last window of samples in a ring. Every
+ * half window, the mean is removed, a Hann window applied and the real FFT
+ * computed as a complex FFT of half the length: a first radix-4 pass
+ * without multiplications, then radix-2 passes whose butterflies run over
+ * contiguous twiddles in split real and imaginary arrays, so that the
+ * compiler vectorizes them. The squared magnitudes are averaged over the
+ * interval (Welch's method) and summed into equal-width bands up to the
+ * Nyquist frequency.
+ *
+ * All buffers are allocated when opened. The windows of the channels are
+ * staggered across the hop, so that a sample completes at most a few
+ * windows and the work per sample stays bounded.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "spectrum.h"
+
+
+/**
+ * Build the tables of the window length.
+ */
+static void make_tables(spectrum_t *s) {
+    unsigned n = s->size, m = n / 2;
+
+    // Hann window, normalized so that a band power is a variance
+    double power = 0;
+    for (unsigned i=0; i<n; i++) {
+        s->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / n);
+        power += (double) s->window[i] * s->window[i];
+    }
+    s->scale = 1 / (n * power);
+
+    unsigned bits = 0;
+    while (1u << bits < m)
+        bits++;
+    for (unsigned i=0; i<m; i++) {
+        unsigned r = 0;
+        for (unsigned b=0; b<bits; b++)
+            r |= (i >> b & 1) << (bits - 1 - b);
+        s->bitrev[i] = r;
+    }
+
+    for (unsigned h=1; h<m; h*=2) {
+        for (unsigned j=0; j<h; j++) {
+            s->stage_re[h + j] = cos(M_PI * j / h);
+            s->stage_im[h + j] = -sin(M_PI * j / h);
+        }
+    }
+
+    for (unsigned k=0; k<=m; k++) {
+        s->post_cos[k] = cos(2 * M_PI * k / n);
+        s->post_sin[k] = sin(2 * M_PI * k / n);
+    }
+}
+
+
+/**
+ * Allocate the buffers and tables of the analyser.
+ * @param channels bit mask of the analysed channels.
+ * @param size window length, a power of 2.
+ * @param nbands number of bands of the band-power messages.
+ * @param interval_usec time between band-power messages.
+ * @return 0 if success, -1 if error.
+ */
+int spectrum_open(spectrum_t *spectrum, uint16_t channels, unsigned size,
+                  unsigned nbands, uint64_t interval_usec) {
+    memset(spectrum, 0, sizeof *spectrum);
+    for (unsigned i=0; i<SPECTRUM_CHANNELS; i++)
+        if (channels & 1 << i)
+            spectrum->channel[spectrum->nchannels++] = i;
+    spectrum->size = size;
+    spectrum->hop = size / 2;
+    spectrum->nbands = nbands;
+    spectrum->interval_usec = interval_usec;
+
+    unsigned m = size / 2, nch = spectrum->nchannels;
+    spectrum_t *s = spectrum;
+    s->window = calloc(size, sizeof *s->window);
+    s->bitrev = calloc(m, sizeof *s->bitrev);
+    s->stage_re = calloc(m, sizeof *s->stage_re);
+    s->stage_im = calloc(m, sizeof *s->stage_im);
+    s->post_cos = calloc(m + 1, sizeof *s->post_cos);
+    s->post_sin = calloc(m + 1, sizeof *s->post_sin);
+    s->re = calloc(m, sizeof *s->re);
+    s->im = calloc(m, sizeof *s->im);
+    s->time = calloc(size, sizeof *s->time);
+    s->samples = calloc((size_t) nch * size, sizeof *s->samples);
+    s->psd = calloc((size_t) nch * (m + 1), sizeof *s->psd);
+    if (!s->window || !s->bitrev || !s->stage_re || !s->stage_im
+        || !s->post_cos || !s->post_sin || !s->re || !s->im || !s->time
+        || !s->samples || !s->psd) {
+        syslog(LOG_ERR, "Error allocating spectrum buffers: %s",
+               strerror(errno));
+        spectrum_close(spectrum);
+        return -1;
+    }
+
+    make_tables(spectrum);
+    spectrum_reset(spectrum);
+    return 0;
+}
+
+
+/**
+ * In-place complex FFT of the bit-reversed work buffers.
+ */
+static void fft(spectrum_t *s) {
+    unsigned m = s->size / 2;
+    float *restrict re = s->re;
+    float *restrict im = s->im;
+
+    // Radix-4 pass, merging the first two stages with trivial twiddles
+    for (unsigned g=0; g<m; g+=4) {
+        float a0r = re[g] + re[g+1], a0i = im[g] + im[g+1];
+        float a1r = re[g] - re[g+1], a1i = im[g] - im[g+1];
+        float a2r = re[g+2] + re[g+3], a2i = im[g+2] + im[g+3];
+        float a3r = re[g+2] - re[g+3], a3i = im[g+2] - im[g+3];
+        re[g] = a0r + a2r;
+        im[g] = a0i + a2i;
+        re[g+2] = a0r - a2r;
+        im[g+2] = a0i - a2i;
+        re[g+1] = a1r + a3i;
+        im[g+1] = a1i - a3r;
+        re[g+3] = a1r - a3i;
+        im[g+3] = a1i + a3r;
+    }
+
+    // Radix-2 passes over contiguous butterflies
+    for (unsigned h=4; h<m; h*=2) {
+        const float *restrict wr = s->stage_re + h;
+        const float *restrict wi = s->stage_im + h;
+        for (unsigned g=0; g<m; g+=2*h) {
+            float *restrict xr = re + g, *restrict xi = im + g;
+            float *restrict yr = re + g + h, *restrict yi = im + g + h;
+            for (unsigned j=0; j<h; j++) {
+                float tr = wr[j] * yr[j] - wi[j] * yi[j];
+                float ti = wr[j] * yi[j] + wi[j] * yr[j];
+                yr[j] = xr[j] - tr;
+                yi[j] = xi[j] - ti;
+                xr[j] += tr;
+                xi[j] += ti;
+            }
+        }
+    }
+}
+
+
+/**
+ * Add the periodogram of the last window of an analysed channel.
+ */
+static void analyse(spectrum_t *s, unsigned c) {
+    unsigned n = s->size, m = n / 2;
+    const float *x = s->samples + (size_t) c * n;
+
+    // Oldest sample at the head of the ring
+    double mean = 0;
+    for (unsigned i=0; i<n; i++)
+        mean += x[i];
+    mean /= n;
+
+    // Pack the even and odd samples as a complex sequence
+    for (unsigned i=0; i<m; i++) {
+        unsigned even = (s->head + 2 * i) & (n - 1);
+        unsigned odd = (even + 1) & (n - 1);
+        unsigned r = s->bitrev[i];
+        s->re[r] = (x[even] - mean) * s->window[2 * i];
+        s->im[r] = (x[odd] - mean) * s->window[2 * i + 1];
+    }
+    fft(s);
+
+    // Split into the spectrum of the real sequence, one-sided
+    double *psd = s->psd + (size_t) c * (m + 1);
+    for (unsigned k=0; k<=m; k++) {
+        unsigned p = k % m, q = (m - k) % m;
+        float even_re = (s->re[p] + s->re[q]) / 2;
+        float even_im = (s->im[p] - s->im[q]) / 2;
+        float odd_re = (s->im[p] + s->im[q]) / 2;
+        float odd_im = (s->re[q] - s->re[p]) / 2;
+        float cs = s->post_cos[k], sn = s->post_sin[k];
+        float xr = even_re + cs * odd_re + sn * odd_im;
+        float xi = even_im + cs * odd_im - sn * odd_re;
+        double weight = k == 0 || k == m ? 1 : 2;
+        psd[k] += weight * s->scale * ((double) xr * xr + (double) xi * xi);
+    }
+
+    uint64_t first = s->time[s->head];
+    uint64_t last = s->time[(s->head + n - 1) & (n - 1)];
+    if (last > first)
+        s->rate_sum[c] += (n - 1) * 1e6 / (last - first);
+    s->segments[c]++;
+}
+
+
+/**
+ * Add a scan, analysing the channels whose window it completes.
+ */
+void spectrum_add(spectrum_t *spectrum, const mavlink_adc_raw_t *adc) {
+    spectrum_t *s = spectrum;
+    if (!s->start_usec)
+        s->start_usec = adc->time_usec;
+
+    s->time[s->head] = adc->time_usec;
+    for (unsigned c=0; c<s->nchannels; c++)
+        s->samples[(size_t) c * s->size + s->head] = adc->data[s->channel[c]];
+    s->head = (s->head + 1) & (s->size - 1);
+    if (s->filled < s->size)
+        s->filled++;
+
+    for (unsigned c=0; c<s->nchannels; c++) {
+        if (--s->countdown[c])
+            continue;
+        s->countdown[c] = s->hop;
+        analyse(s, c);
+    }
+}
+
+
+/**
+ * Whether the band-power messages of the interval are due.
+ */
+bool spectrum_due(const spectrum_t *spectrum, uint64_t time_usec) {
+    return spectrum->start_usec
+        && time_usec - spectrum->start_usec >= spectrum->interval_usec;
+}
+
+
+/**
+ * Fill the band-power messages of the channels analysed in the interval and
+ * start a new interval.
+ * @param[out] msgs one per analysed channel, at most SPECTRUM_CHANNELS.
+ * @return the number of messages filled.
+ */
+unsigned spectrum_summarize(spectrum_t *spectrum,
+                            mavlink_adc_spectrum_t *msgs) {
+    spectrum_t *s = spectrum;
+    unsigned m = s->size / 2, count = 0;
+    for (unsigned c=0; c<s->nchannels; c++) {
+        if (!s->segments[c])
+            continue;
+
+        // The DC bin was removed with the mean
+        mavlink_adc_spectrum_t *msg = &msgs[count++];
+        double *psd = s->psd + (size_t) c * (m + 1);
+        double rate = s->rate_sum[c] / s->segments[c];
+        memset(msg, 0, sizeof *msg);
+        msg->time_usec = s->start_usec;
+        msg->band_width = rate / 2 / s->nbands;
+        msg->segments = s->segments[c];
+        msg->channel = s->channel[c];
+        msg->nbands = s->nbands;
+        for (unsigned b=0; b<s->nbands; b++) {
+            unsigned lo = 1 + b * m / s->nbands;
+            unsigned hi = 1 + (b + 1) * m / s->nbands;
+            double power = 0;
+            for (unsigned k=lo; k<hi; k++)
+                power += psd[k];
+            msg->power[b] = power / s->segments[c];
+        }
+
+        memset(psd, 0, (m + 1) * sizeof *psd);
+        s->segments[c] = 0;
+        s->rate_sum[c] = 0;
+    }
+    s->start_usec = 0;
+    return count;
+}
+
+
+/**
+ * Drop the sample history and the averages, when the sampling changes.
+ */
+void spectrum_reset(spectrum_t *spectrum) {
+    spectrum_t *s = spectrum;
+    unsigned m = s->size / 2;
+    s->head = 0;
+    s->filled = 0;
+    s->start_usec = 0;
+    memset(s->psd, 0, (size_t) s->nchannels * (m + 1) * sizeof *s->psd);
+
+    // Stagger the windows of the channels across the hop
+    for (unsigned c=0; c<s->nchannels; c++) {
+        s->countdown[c] = s->size + c * s->hop / s->nchannels;
+        s->segments[c] = 0;
+        s->rate_sum[c] = 0;
+    }
+}
+
+
+/**
+ * Free the buffers of the analyser.
+ */
+void spectrum_close(spectrum_t *spectrum) {
+    spectrum_t *s = spectrum;
+    free(s->window);
+    free(s->bitrev);
+    free(s->stage_re);
+    free(s->stage_im);
+    free(s->post_cos);
+    free(s->post_sin);
+    free(s->re);
+    free(s->im);
+    free(s->time);
+    free(s->samples);
+    free(s->psd);
+    memset(spectrum, 0, sizeof *spectrum);
+}
@@ -0,0 +1,73 @@
+/**
+ * Online vibration spectrum of the VCM-DAS-1 channels.
+ */
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "generated/vcmdas1_messages/mavlink.h"
+
+
+/** Number of ADC channels. */
+#define SPECTRUM_CHANNELS 16
+
+/** Smallest and largest window lengths, in samples. */
+#define SPECTRUM_MIN_SIZE 16
+#define SPECTRUM_MAX_SIZE 8192
+
+/** Maximum number of bands of the band-power messages. */
+#define SPECTRUM_MAX_BANDS 16
+
+
+/** Spectrum analyser state, all buffers allocated by `spectrum_open`. */
+typedef struct spectrum {
+    unsigned nchannels;
+    uint8_t channel[SPECTRUM_CHANNELS]; ///< ADC channel of each analysed.
+    unsigned size; ///< Window length, a power of 2.
+    unsigned hop; ///< Samples between windows, half of them.
+    unsigned nbands;
+    uint64_t interval_usec; ///< Time between band-power messages.
+
+    // Tables
+    float *window; ///< Hann window.
+    float scale; ///< Normalization of the squared magnitudes.
+    unsigned *bitrev; ///< Bit reversal of the half-length indices.
+    float *stage_re; ///< Twiddles of the FFT stages, stage h at [h, 2h).
+    float *stage_im;
+    float *post_cos; ///< Twiddles of the real FFT split, for 0..size/2.
+    float *post_sin;
+
+    // Work buffers of the half-length complex FFT
+    float *re;
+    float *im;
+
+    // Sample history, a ring of `size` scans
+    uint64_t *time;
+    float *samples; ///< Channel-major, `size` samples per channel.
+    unsigned head; ///< Next ring position.
+    unsigned filled;
+    unsigned countdown[SPECTRUM_CHANNELS]; ///< Samples to the next window.
+
+    // Averages of the current interval
+    double *psd; ///< Channel-major, size/2 + 1 bins per channel.
+    unsigned segments[SPECTRUM_CHANNELS];
+    double rate_sum[SPECTRUM_CHANNELS]; ///< Sum of the window sample rates.
+    uint64_t start_usec; ///< Start of the interval, 0 before the first.
+} spectrum_t;
+
+
+int spectrum_open(spectrum_t *spectrum, uint16_t channels, unsigned size,
+                  unsigned nbands, uint64_t interval_usec);
+void spectrum_add(spectrum_t *spectrum, const mavlink_adc_raw_t *adc);
+bool spectrum_due(const spectrum_t *spectrum, uint64_t time_usec);
+unsigned spectrum_summarize(spectrum_t *spectrum,
+                            mavlink_adc_spectrum_t *msgs);
+void spectrum_reset(spectrum_t *spectrum);
+void spectrum_close(spectrum_t *spectrum);
+
+
+#endif//SPECTRUM_H
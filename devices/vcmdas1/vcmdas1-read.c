@@ -5,7 +5,7 @@
 
 #include <argp.h>
 #include <errno.h>
-#include <netdb.h>
+#include <math.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -14,10 +14,15 @@
 #include <string.h>
 #include <syslog.h>
 #include <sys/io.h>
-#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "burst.h"
+#include "spectrum.h"
+#include "../../utils/control.h"
+#include "../../utils/runstats.h"
+#include "../../utils/sink.h"
+#include "../../utils/textconv.h"
 #include "../../utils/utils.h"
 
 #include "generated/vcmdas1_messages/mavlink.h"
@@ -25,6 +30,10 @@
 
 #define PORT_RANGE 16 ///< Number of IO ports used
 
+#define BOARD_CHANNELS 16 ///< Number of ADC channels of a board
+#define MAX_BOARDS 4 ///< Number of stacked boards read together
+#define MAX_CHANNELS (BOARD_CHANNELS * MAX_BOARDS)
+
 // Board register offsets
 #define CONTROL   0x00
 #define ADCSTAT   0x00
@@ -38,6 +47,9 @@
 #define DONE_BIT 0x40
 #define BUSY_BIT 0x80
 
+/** Conversion time of the simulated boards, in nanoseconds. */
+#define SIMULATED_CONVERSION_NS 10000
+
 
 /** Mavlink system identifier */
 #define MAVLINK_SYSID 1
@@ -45,6 +57,21 @@
 /** Mavlink compenent identifier, equal to MAV_COMP_ID_IMU */
 #define MAVLINK_COMPID 200
 
+/** Message definitions, embedded in the binary log header. */
+extern const char vcmdas1_messages_xml[];
+
+/** Keys of the long-only options. */
+enum {
+    OPT_BURST_PRE = 0x100,
+    OPT_BURST_POST,
+    OPT_BURST_RATE,
+    OPT_SPECTRUM_CHANNELS,
+    OPT_SPECTRUM_SIZE,
+    OPT_SPECTRUM_BANDS,
+    OPT_SPECTRUM_INTERVAL,
+    OPT_SIMULATE,
+};
+
 /** Program version. */
 const char *argp_program_version = "vcmdas1-read 0.1";
 
@@ -52,41 +79,134 @@ const char *argp_program_version = "vcmdas1-read 0.1";
 const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
 
 /** Program documentation. */
-static char doc[] = "vcmdas1-read -- Read from a Versalogic VCM-DAS-1.";
+static char doc[] = "vcmdas1-read -- Read from a Versalogic VCM-DAS-1."
+    "\vWith --convert, the text log is produced from a binary log written "
+    "with --logbin instead, so that only the binary log is written in "
+    "flight.\n\nEach BASE_ADDRESS is a distinct multiple of 0x10, the "
+    "boards taking 16 ports. With several base addresses, the stacked boards "
+    "are scanned together: their conversions are interleaved, the scan has "
+    "a single time stamp and is output as one ADC_SCAN message, their "
+    "channels being numbered on from 16 for the second board. The burst "
+    "capture and the vibration spectrum use the first board.";
 
 /** Description of the accepted arguments. */
-static char args_doc[] = "[BASE_ADDRESS]";
+static char args_doc[] = "[BASE_ADDRESS...]";
 
 /** Program options structure. */
 static struct argp_option options[] = {
     {"logtxt", 't', "FILE", 0, "Write received data as text to FILE"},
-    {"logbin", 'b', "FILE", 0, "Write binary MAVLink stream FILE"},
     {"verbose", 'v', 0, 0, "Write received data as text to STDOUT"},
-    {"udp", 'u', "HOST", OPTION_ARG_OPTIONAL,
-     "Send MAVLink messages via UDP to HOST, defaults to 224.0.0.1"},
-    {"udp-port", 'p', "UDPPORT", 0,
-     "UDP port to send MAVLink messages to, defaults to 38400, implies --udp"},
+    {"stats", 'S', "SECONDS", 0,
+     "Output a summary of each channel every SECONDS"},
+    {0, 0, 0, 0, "Burst capture options:"},
+    {"burst-log", 'B', "FILE", 0,
+     "Scan the burst channels between the samples and write the windows "
+     "around each trigger to FILE"},
+    {"burst-channels", 'C', "LIST", 0,
+     "Comma-separated channels or ranges to scan, defaults to all"},
+    {"burst-trigger", 'T', "CHANNEL>LEVEL", 0,
+     "Trigger when CHANNEL rises to LEVEL, or falls to it with `<`; "
+     "SIGUSR1 triggers as well"},
+    {"burst-pre", OPT_BURST_PRE, "SCANS", 0,
+     "Scans written before the trigger, defaults to 1000"},
+    {"burst-post", OPT_BURST_POST, "SCANS", 0,
+     "Scans written from the trigger on, defaults to 1000"},
+    {"burst-rate", OPT_BURST_RATE, "HZ", 0,
+     "Scans per second, back to back if slower, defaults to 1000"},
+    {0, 0, 0, 0, "Vibration spectrum options:"},
+    {"spectrum-channels", OPT_SPECTRUM_CHANNELS, "LIST", 0,
+     "Comma-separated channels or ranges whose band powers are output"},
+    {"spectrum-size", OPT_SPECTRUM_SIZE, "SAMPLES", 0,
+     "Length of the half-overlapping windows, a power of 2, defaults to 256"},
+    {"spectrum-bands", OPT_SPECTRUM_BANDS, "N", 0,
+     "Number of equal bands up to the Nyquist frequency, defaults to 8"},
+    {"spectrum-interval", OPT_SPECTRUM_INTERVAL, "SECONDS", 0,
+     "Averaging interval of the band powers, defaults to 10"},
+    {0, 0, 0, 0, "Test options:"},
+    {"simulate", OPT_SIMULATE, 0, 0,
+     "Read simulated boards, without port access, to soak the acquisition"},
+    {0}
+};
+
+/** Child option parsers. */
+static struct argp_child children[] = {
+    {&sink_argp, 0, "Output options:", 0},
+    {&control_argp, 0, "Control options:", 0},
+    {&textconv_argp, 0, "Deferred text log options:", 0},
     {0}
 };
 
 /** Program arguments structure. */
 typedef struct arguments {
-    unsigned base_address;
+    unsigned base_address[MAX_BOARDS];
+    unsigned nboards;
     char *text_log;
-    char *binary_log;
     bool verbose;
-    bool use_udp;
-    char *udp_host;
-    uint16_t udp_port;
+    uint64_t stats_interval;
+    char *burst_log;
+    uint16_t burst_channels;
+    burst_threshold_t burst_threshold;
+    unsigned burst_pre;
+    unsigned burst_post;
+    uint64_t burst_period_ns;
+    uint16_t spectrum_channels;
+    unsigned spectrum_size;
+    unsigned spectrum_bands;
+    uint64_t spectrum_interval;
+    bool simulate;
+    sink_config_t sink;
+    control_config_t control;
+    textconv_config_t textconv;
 } arguments_t;
 
 /** Program output streams structure */
 typedef struct output_streams {
-    int udp_sock;
-    FILE *binary_log;
+    sink_t sink;
     FILE *text_log;
 } output_streams_t;
 
+/** Acquisition settings changed by the control commands, and counters. */
+typedef struct runtime {
+    uint64_t channels; ///< Bit mask of the channels read every tick.
+    unsigned nchannels; ///< Channels of all boards.
+    bool text_log_enabled;
+    bool verbose;
+    unsigned long samples;
+    unsigned long overruns; ///< Timer ticks missed.
+    uint64_t scan_ns_max; ///< Longest scan of the channels.
+} runtime_t;
+
+
+/**
+ * Parse a list of channels such as `0,3-5`, below `nchannels`.
+ * @return the channel bit mask or 0 if invalid.
+ */
+static uint64_t parse_channels(char *arg, unsigned nchannels) {
+    uint64_t mask = 0;
+    char *endptr = arg;
+    do {
+        unsigned long first = strtoul(endptr, &endptr, 10);
+        unsigned long last = first;
+        if (*endptr == '-')
+            last = strtoul(endptr + 1, &endptr, 10);
+        if (first > last || last >= nchannels)
+            return 0;
+        for (unsigned long i=first; i<=last; i++)
+            mask |= (uint64_t) 1 << i;
+    } while (*endptr++ == ',');
+    return endptr[-1] ? 0 : mask;
+}
+
+
+/** Parse an unsigned number of scans. */
+static unsigned parse_scans(char *arg, struct argp_state *state) {
+    char *endptr = 0;
+    unsigned long scans = strtoul(arg, &endptr, 0);
+    if (*endptr || scans > 10000000)
+        argp_error(state, "SCANS must be an integer up to 10000000.");
+    return scans;
+}
+
 
 /** Argument parser function */
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
@@ -94,6 +214,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     arguments_t *arguments = state->input;
     
     switch (key) {
+    case ARGP_KEY_INIT:
+        state->child_inputs[0] = &arguments->sink;
+        state->child_inputs[1] = &arguments->control;
+        state->child_inputs[2] = &arguments->textconv;
+        break;
+        
     case 't':
         arguments->text_log = arg;
         break;
@@ -102,44 +228,143 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         arguments->verbose = true;
         break;
         
-    case 'b':
-        arguments->binary_log = arg;
+    case 'S':
+        {
+            char *endptr = 0;
+            double seconds = strtod(arg, &endptr);
+            if (*endptr || !(seconds > 0))
+                argp_error(state, "SECONDS must be a positive number.");
+            arguments->stats_interval = seconds * 1e6;
+        }
         break;
-
-    case 'u':
-        arguments->use_udp = true;
-        if (arg)
-            arguments->udp_host = arg;
+        
+    case 'B':
+        arguments->burst_log = arg;
         break;
         
-    case 'p':
-	arguments->use_udp = true;
-	{
+    case 'C':
+        arguments->burst_channels = parse_channels(arg, BURST_CHANNELS);
+        if (!arguments->burst_channels)
+            argp_error(state, "Invalid burst channel LIST.");
+        break;
+        
+    case 'T':
+        {
+            burst_threshold_t *threshold = &arguments->burst_threshold;
             char *endptr = 0;
-            unsigned long udp_port = strtoul(arg, &endptr, 0);
-            if (*endptr) {
-                argp_error(state, "UPDPORT argument must be an integer.");
-            }
-            if (udp_port > 65535) {
-                argp_error(state, "UPDPORT number too large.");
-            }
-            arguments->udp_port = udp_port;            
-	}
+            unsigned long channel = strtoul(arg, &endptr, 10);
+            if (endptr == arg || channel >= BURST_CHANNELS
+                || (*endptr != '>' && *endptr != '<'))
+                argp_error(state, "Invalid burst trigger CHANNEL.");
+            threshold->rising = *endptr == '>';
+            
+            char *level = endptr + 1;
+            long value = strtol(level, &endptr, 0);
+            if (*endptr || endptr == level || value < INT16_MIN
+                || value > INT16_MAX)
+                argp_error(state, "Invalid burst trigger LEVEL.");
+            threshold->channel = channel;
+            threshold->level = value;
+        }
+        break;
+        
+    case OPT_BURST_PRE:
+        arguments->burst_pre = parse_scans(arg, state);
+        break;
+        
+    case OPT_BURST_POST:
+        arguments->burst_post = parse_scans(arg, state);
+        if (!arguments->burst_post)
+            argp_error(state, "At least one scan after the trigger needed.");
+        break;
+        
+    case OPT_BURST_RATE:
+        {
+            char *endptr = 0;
+            double rate = strtod(arg, &endptr);
+            if (*endptr || !(rate >= 1 && rate <= 1e6))
+                argp_error(state, "HZ must be a number from 1 to 1000000.");
+            arguments->burst_period_ns = 1e9 / rate;
+        }
+        break;
+        
+    case OPT_SPECTRUM_CHANNELS:
+        arguments->spectrum_channels = parse_channels(arg,
+                                                      SPECTRUM_CHANNELS);
+        if (!arguments->spectrum_channels)
+            argp_error(state, "Invalid spectrum channel LIST.");
         break;
-	        
+        
+    case OPT_SPECTRUM_SIZE:
+        {
+            char *endptr = 0;
+            unsigned long size = strtoul(arg, &endptr, 0);
+            if (*endptr || size < SPECTRUM_MIN_SIZE
+                || size > SPECTRUM_MAX_SIZE || size & (size - 1))
+                argp_error(state, "SAMPLES must be a power of 2 from %d to "
+                           "%d.", SPECTRUM_MIN_SIZE, SPECTRUM_MAX_SIZE);
+            arguments->spectrum_size = size;
+        }
+        break;
+        
+    case OPT_SPECTRUM_BANDS:
+        {
+            char *endptr = 0;
+            unsigned long bands = strtoul(arg, &endptr, 0);
+            if (*endptr || !bands || bands > SPECTRUM_MAX_BANDS)
+                argp_error(state, "N must be an integer from 1 to %d.",
+                           SPECTRUM_MAX_BANDS);
+            arguments->spectrum_bands = bands;
+        }
+        break;
+        
+    case OPT_SPECTRUM_INTERVAL:
+        {
+            char *endptr = 0;
+            double seconds = strtod(arg, &endptr);
+            if (*endptr || !(seconds > 0))
+                argp_error(state, "SECONDS must be a positive number.");
+            arguments->spectrum_interval = seconds * 1e6;
+        }
+        break;
+        
+    case OPT_SIMULATE:
+        arguments->simulate = true;
+        break;
+        
     case ARGP_KEY_ARG:
-      if (state->arg_num >= 1)
-          argp_error(state, "Too many arguments.");
+      if (state->arg_num >= MAX_BOARDS)
+          argp_error(state, "At most %d boards are read.", MAX_BOARDS);
       else {
 	    char *endptr = 0;
 	    unsigned long base_address = strtoul(arg, &endptr, 0);
 	    if (*endptr) {
                 argp_error(state, "BASE_ADDRESS argument must be an uint.");
 	    }
-	    arguments->base_address = base_address;
+	    if (base_address > 0x400 - PORT_RANGE)
+                argp_error(state, "BASE_ADDRESS must be an ISA port.");
+
+	    // Aligned boards overlap only if at the same address
+	    if (base_address % PORT_RANGE)
+                argp_error(state, "BASE_ADDRESS must be a multiple of %#x.",
+                           PORT_RANGE);
+	    for (unsigned b=0; b<arguments->nboards; b++)
+		if (arguments->base_address[b] == base_address)
+		    argp_error(state, "BASE_ADDRESS %#lx given twice.",
+			       base_address);
+	    arguments->base_address[arguments->nboards++] = base_address;
       }
       break;
       
+    case ARGP_KEY_END:
+        if (!arguments->nboards)
+            arguments->base_address[arguments->nboards++] = 0x3E0;
+        if (arguments->textconv.binary_log && !arguments->text_log)
+            argp_error(state, "--convert requires --logtxt.");
+        if (arguments->spectrum_bands > arguments->spectrum_size / 2)
+            argp_error(state, "More spectrum bands than frequencies.");
+        break;
+        
     default:
         return ARGP_ERR_UNKNOWN;        
     }
@@ -149,7 +374,19 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
 
 /** Argument parser object. */
-static struct argp argp = {options, parse_opt, args_doc, doc};
+static struct argp argp = {options, parse_opt, args_doc, doc, children};
+
+
+/**
+ * Print the text log file header.
+ */
+void log_header(FILE *out) {
+    if (fprintf(out, "%% time[us]\t") < 0)
+        syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+    for (int i=0; i<0; i++)
+        if (fprintf(out, "channel%d\t", i) < 0)
+            syslog(LOG_ERR,"Error writing to text log: %s",strerror(errno));
+}
 
 
 /**
@@ -164,64 +401,35 @@ void open_output_streams(arguments_t *args, output_streams_t *out) {
 	    exit(EXIT_FAILURE);
 	}
         // Print file header
-        if (fprintf(out->text_log, "%% time[us]\t") < 0)
-            syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
-        for (int i=0; i<0; i++)
-            if (fprintf(out->text_log, "channel%d\t", i) < 0)
-                syslog(LOG_ERR,"Error writing to text log: %s",strerror(errno));
-    }
-    
-    // Open binary log
-    if (args->binary_log) {
-	out->binary_log = fopen(args->binary_log, "w");
-	if (!out->binary_log) {
-	    syslog(LOG_ERR, "Error opening binary log: %s", strerror(errno));
-	    exit(EXIT_FAILURE);
-	}
+        log_header(out->text_log);
     }
     
-    // Open UDP socket
-    if (args->use_udp) {
-        struct sockaddr_in host_addr;
-        socklen_t addr_len = sizeof(host_addr);
-        struct hostent *hostent = gethostbyname(args->udp_host);
-        if (!hostent) {
-            syslog(LOG_ERR, "Could not find host address `%s`", args->udp_host);
-	    exit(EXIT_FAILURE);
-        }
-        if (hostent->h_addrtype != AF_INET || hostent->h_length != 4) {
-            syslog(LOG_ERR, "Only IPv4 hosts supported.");
-	    exit(EXIT_FAILURE);
-        }
-        memset((void *)&host_addr, 0, addr_len);
-        host_addr.sin_family = AF_INET;
-        host_addr.sin_port = htons(args->udp_port);
-        memcpy((void *)&host_addr.sin_addr,
-               hostent->h_addr_list[0], hostent->h_length);
-        
-        out->udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-	if (out->udp_sock < 0) {
-	    syslog(LOG_ERR, "Error creating UDP socket: %s", strerror(errno));
-	    exit(EXIT_FAILURE);
-	}
-
-        if (connect(out->udp_sock, (struct sockaddr *)&host_addr, addr_len)) {
-	    syslog(LOG_ERR, "Error connecting socket: %s", strerror(errno));
-	    exit(EXIT_FAILURE);
-        }
+    // Open binary log and UDP socket
+    sink_open(&args->sink, &out->sink);
+
+    // Keep MAVLink 1 framing, also for the burst log, unless asked otherwise
+    if (!args->sink.mavlink2) {
+        mavlink_get_channel_status(MAVLINK_COMM_0)->flags |=
+            MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+        mavlink_get_channel_status(MAVLINK_COMM_1)->flags |=
+            MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
     }
 }
 
 
-void log_text(const mavlink_adc_raw_t *adc, FILE *out) {
+/**
+ * Write a scan of `nchannels` channels to a text log.
+ */
+void log_text(uint64_t time_usec, const int16_t *data, unsigned nchannels,
+              FILE *out) {
     if (!out)
         return;
     
-    if (fprintf(out, "%llu\t", (long long unsigned) adc->time_usec) < 0)
+    if (fprintf(out, "%llu\t", (long long unsigned) time_usec) < 0)
         goto err;
     
-    for (int i=0; i<16; i++) {
-        if (fprintf(out, "%d\t", (int) adc->data[i]) < 0)
+    for (unsigned i=0; i<nchannels; i++) {
+        if (fprintf(out, "%d\t", (int) data[i]) < 0)
             goto err;
     }
 
@@ -234,19 +442,40 @@ void log_text(const mavlink_adc_raw_t *adc, FILE *out) {
 }
 
 
+/**
+ * Write the text of an ADC_RAW or ADC_SCAN message of a binary log.
+ * @param state 1 once the file header is written.
+ * @return 0 if success, -1 if error.
+ */
+static int convert_frame(const mavframe_t *frame, FILE *text,
+                         uint32_t *state, void *ctx) {
+    if (!*state) {
+        log_header(text);
+        *state = 1;
+    }
+    
+    int16_t data[MAX_CHANNELS];
+    if (frame->msgid == MAVLINK_MSG_ID_ADC_RAW) {
+        mavlink_adc_raw_t adc;
+        mavframe_payload(frame, &adc, sizeof adc);
+        memcpy(data, adc.data, sizeof adc.data);
+        log_text(adc.time_usec, data, BOARD_CHANNELS, text);
+    } else if (frame->msgid == MAVLINK_MSG_ID_ADC_SCAN) {
+        mavlink_adc_scan_t scan;
+        mavframe_payload(frame, &scan, sizeof scan);
+        unsigned nboards = scan.nboards < MAX_BOARDS ? scan.nboards
+                                                      : MAX_BOARDS;
+        memcpy(data, scan.data, sizeof scan.data);
+        log_text(scan.time_usec, data, nboards * BOARD_CHANNELS, text);
+    }
+    return ferror(text) ? -1 : 0;
+}
+
+
 void output_mavlink_msg(mavlink_message_t *msg, output_streams_t *out) {
     uint8_t buf[MAVLINK_MAX_PACKET_LEN];
     size_t len = mavlink_msg_to_send_buffer(buf, msg);
-    
-    // Output to binary log
-    if (out->binary_log)
-        if (!fwrite(buf, len, 1, out->binary_log))
-	    syslog(LOG_ERR, "Error writing to binary log: %s", strerror(errno));
-    
-    // Output to UDP socket
-    if (out->udp_sock > 0)
-        if (send(out->udp_sock, buf, len, 0) != len)
-	    syslog(LOG_ERR, "Error sending UDP message: %s", strerror(errno));
+    sink_send(&out->sink, buf, len);
 }
 
 
@@ -257,53 +486,328 @@ void output_adc_raw(const mavlink_adc_raw_t *adc, output_streams_t *out) {
 }
 
 
+void output_adc_scan(const mavlink_adc_scan_t *scan, output_streams_t *out) {
+    mavlink_message_t msg;
+    mavlink_msg_adc_scan_encode(MAVLINK_SYSID, MAVLINK_COMPID, &msg, scan);
+    output_mavlink_msg(&msg, out);
+}
+
+
+/**
+ * Output the summary of all channels and start a new interval.
+ */
+void output_adc_stats(runstats_t *stats, output_streams_t *out) {
+    for (unsigned i=0; i<stats->nchannels; i++) {
+        mavlink_adc_stats_t adc_stats = {
+            .time_usec=stats->start_usec, .count=stats->count, .channel=i,
+            .min=stats->min[i], .max=stats->max[i], .mean=stats->mean[i],
+            .std=runstats_std(stats, i), .rms=runstats_rms(stats, i)
+        };
+
+        mavlink_message_t msg;
+        mavlink_msg_adc_stats_encode(
+            MAVLINK_SYSID, MAVLINK_COMPID, &msg, &adc_stats
+        );
+        uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+        size_t len = mavlink_msg_to_send_buffer(buf, &msg);
+        sink_send_summary(&out->sink, buf, len);
+    }
+    runstats_reset(stats);
+}
+
+
+/**
+ * Output the band powers of the analysed channels and start a new interval.
+ */
+void output_adc_spectrum(spectrum_t *spectrum, output_streams_t *out) {
+    mavlink_adc_spectrum_t spectra[SPECTRUM_CHANNELS];
+    unsigned n = spectrum_summarize(spectrum, spectra);
+    for (unsigned i=0; i<n; i++) {
+        mavlink_message_t msg;
+        mavlink_msg_adc_spectrum_encode(
+            MAVLINK_SYSID, MAVLINK_COMPID, &msg, &spectra[i]
+        );
+        uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+        size_t len = mavlink_msg_to_send_buffer(buf, &msg);
+        sink_send_summary(&out->sink, buf, len);
+    }
+}
+
+
+/** Conversion in progress on a simulated board. */
+typedef struct simulated_board {
+    uint8_t channel;
+    uint64_t done_ns; ///< Monotonic time the conversion is done at.
+} simulated_board_t;
+
+/** Whether the boards are simulated, by --simulate. */
+static bool simulated;
+
+/** Simulated boards, by base address. */
+static simulated_board_t simulated_board[0x400 / PORT_RANGE];
+
+
+/**
+ * Value of a simulated channel: a sinusoid of a frequency of its own,
+ * with some noise.
+ */
+static int16_t simulated_value(uint8_t channel, uint64_t time_ns) {
+    double wave = sin(2 * M_PI * (channel + 1) * time_ns * 1e-9);
+    return 1000 * (channel % 4 + 1) * wave + rand() % 32 - 16;
+}
+
+
 /**
  * Whether the analog to digital conversion is done.
  */
 static inline bool conversion_done(unsigned base_address) {
+    if (simulated) {
+        simulated_board_t *board = &simulated_board[base_address / PORT_RANGE];
+        return get_mono_ns() >= board->done_ns;
+    }
     return inb(base_address + ADCSTAT) & DONE_BIT;
 }
 
 
 /**
- * Read a from the VCM-DAS-1.
+ * Select a channel of the VCM-DAS-1 and start its conversion.
  */
-static inline int16_t read_adc(unsigned base_address, uint8_t channel) {
+static inline void start_conversion(unsigned base_address, uint8_t channel) {
+    if (simulated) {
+        simulated_board_t *board = &simulated_board[base_address / PORT_RANGE];
+        board->channel = channel;
+        board->done_ns = get_mono_ns() + SIMULATED_CONVERSION_NS;
+        return;
+    }
     outw(channel + 0x100, base_address + ADCSEL);
+}
+
+
+/**
+ * Wait for the conversion of the VCM-DAS-1 and read it.
+ */
+static inline int16_t read_conversion(unsigned base_address) {
     while (!conversion_done(base_address));
+    if (simulated) {
+        simulated_board_t *board = &simulated_board[base_address / PORT_RANGE];
+        return simulated_value(board->channel, board->done_ns);
+    }
     return inw(base_address + ADCLO);
 }
 
 
 /**
- * Read all channels from the VCM-DAS-1.
+ * Read a from the VCM-DAS-1.
+ */
+static inline int16_t read_adc(unsigned base_address, uint8_t channel) {
+    start_conversion(base_address, channel);
+    return read_conversion(base_address);
+}
+
+
+/**
+ * Next selected channel of a board from `channel` on, or BOARD_CHANNELS.
+ */
+static inline unsigned next_channel(uint16_t channels, unsigned channel) {
+    while (channel < BOARD_CHANNELS && !(channels & 1 << channel))
+        channel++;
+    return channel;
+}
+
+
+/**
+ * Read the selected channels of the boards, the others are zero.
+ *
+ * The boards are served in turn: each conversion read is followed by the
+ * start of the next one of the same board, which then converts while the
+ * other boards are read back. A scan of several boards thus takes about as
+ * long as one of a single board while the conversion time dominates.
+ * @param channels bit mask, 16 channels per board.
+ * @param data 16 values per board.
+ * @param start_ns 16 per board, monotonic time each selected conversion
+ *        was started at, the input being sampled then.
+ */
+void read_all(const unsigned *base_address, unsigned nboards,
+              uint64_t channels, int16_t *data, uint64_t *start_ns) {
+    unsigned channel[MAX_BOARDS];
+    unsigned active = 0;
+    memset(data, 0, nboards * BOARD_CHANNELS * sizeof *data);
+    for (unsigned b=0; b<nboards; b++) {
+        uint16_t board = channels >> b * BOARD_CHANNELS;
+        channel[b] = next_channel(board, 0);
+        if (channel[b] < BOARD_CHANNELS) {
+            start_ns[b * BOARD_CHANNELS + channel[b]] = get_mono_ns();
+            start_conversion(base_address[b], channel[b]);
+            active++;
+        }
+    }
+
+    while (active) {
+        for (unsigned b=0; b<nboards; b++) {
+            if (channel[b] >= BOARD_CHANNELS)
+                continue;
+            uint16_t board = channels >> b * BOARD_CHANNELS;
+            int16_t value = read_conversion(base_address[b]);
+            data[b * BOARD_CHANNELS + channel[b]] = value;
+            channel[b] = next_channel(board, channel[b] + 1);
+            if (channel[b] < BOARD_CHANNELS) {
+                start_ns[b * BOARD_CHANNELS + channel[b]] = get_mono_ns();
+                start_conversion(base_address[b], channel[b]);
+            } else {
+                active--;
+            }
+        }
+    }
+}
+
+
+/**
+ * Scan the burst channels.
+ */
+void read_burst(unsigned base_address, uint16_t channels,
+                burst_scan_t *scan) {
+    scan->time_usec = get_time_us();
+    for (int i=0; i<BURST_CHANNELS; i++)
+        scan->data[i] = channels & 1 << i ? read_adc(base_address, i) : 0;
+}
+
+
+/**
+ * Set the sampling period of the timer.
+ * @return 0 if success, -1 if error.
+ */
+int set_period(timer_t timerid, long period_ns) {
+    struct itimerspec itimerspec = {
+        .it_interval={.tv_sec=period_ns / 1000000000L,
+                      .tv_nsec=period_ns % 1000000000L},
+        .it_value={.tv_sec=period_ns / 1000000000L,
+                   .tv_nsec=period_ns % 1000000000L},
+    };
+    if (timer_settime(timerid, 0, &itimerspec, NULL)) {
+        syslog(LOG_ERR, "Error configuring timer: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Execute a control command, between two samples.
  */
-void read_all(unsigned base_address, mavlink_adc_raw_t *adc) {
-    adc->time_usec = get_time_us();
-    for (int i=0; i<16; i++)
-        adc->data[i] = read_adc(base_address, i);
+void handle_command(control_t *control, const control_cmd_t *cmd,
+                    timer_t timerid, runtime_t *runtime,
+                    output_streams_t *out, burst_t *burst,
+                    spectrum_t *spectrum) {
+    const char *name = cmd->argv[0];
+    const char *arg = cmd->argc == 2 ? cmd->argv[1] : NULL;
+    
+    if (control_sink_command(control, cmd, &out->sink))
+        return;
+    
+    if (!strcmp(name, "period") && arg) {
+        char *endptr = 0;
+        double period_ms = strtod(arg, &endptr);
+        if (*endptr || !(period_ms >= 1 && period_ms <= 60000))
+            control_reply(control, cmd, "error: period must be 1 to 60000 ms");
+        else if (set_period(timerid, period_ms * 1e6))
+            control_reply(control, cmd, "error: %s", strerror(errno));
+        else {
+            // Windows across the change would mix two sample rates
+            if (spectrum->nchannels)
+                spectrum_reset(spectrum);
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "channels") && arg) {
+        uint64_t channels = parse_channels((char *) arg, runtime->nchannels);
+        if (!channels) {
+            control_reply(control, cmd, "error: invalid channel list");
+        } else {
+            runtime->channels = channels;
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "logtxt") && arg
+               && control_parse_switch(arg) >= 0) {
+        if (!out->text_log) {
+            control_reply(control, cmd, "error: text log not open");
+        } else {
+            runtime->text_log_enabled = control_parse_switch(arg);
+            fflush(out->text_log);
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "verbose") && arg
+               && control_parse_switch(arg) >= 0) {
+        runtime->verbose = control_parse_switch(arg);
+        control_reply(control, cmd, "ok");
+    } else if (!strcmp(name, "trigger") && !arg) {
+        if (!burst->log) {
+            control_reply(control, cmd, "error: burst capture not enabled");
+        } else {
+            burst_trigger(burst);
+            control_reply(control, cmd, "ok");
+        }
+    } else if (!strcmp(name, "counters") && !arg) {
+        control_reply(control, cmd,
+                      "ok samples=%lu overruns=%lu frames=%lu udp_errors=%lu "
+                      "bursts=%u bursts_dropped=%lu scan_ns_max=%llu",
+                      runtime->samples, runtime->overruns, out->sink.frames,
+                      out->sink.udp_errors, burst->event, burst->dropped,
+                      (unsigned long long) runtime->scan_ns_max);
+    } else {
+        control_reply(control, cmd, "error: unknown command `%s`", name);
+    }
 }
 
 
 int main(int argc, char **argv) {
     // Parse command line arguments
     arguments_t arguments = {
-        .base_address=0x3E0, .udp_host="224.0.0.1", .udp_port=38400
+        .burst_channels=0xFFFF,
+        .burst_threshold={.channel=-1},
+        .burst_pre=1000,
+        .burst_post=1000,
+        .burst_period_ns=1000000,
+        .spectrum_size=256,
+        .spectrum_bands=8,
+        .spectrum_interval=10000000,
     };
-    output_streams_t output_streams = {.udp_sock=-1};
+    output_streams_t output_streams = {};
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    arguments.sink.schema_xml = vcmdas1_messages_xml;
 
     // Setup syslog
     openlog(0, LOG_PERROR, 0);
 
+    // Produce the text log of a previous or running acquisition
+    if (arguments.textconv.binary_log) {
+        if (textconv_run(&arguments.textconv, arguments.text_log,
+                         convert_frame, NULL))
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    // Cheap time stamps from the calibrated TSC
+    timing_init();
+
     // Open the output streams
     open_output_streams(&arguments, &output_streams);
     
-    // Request IO port permission
-    ioperm(arguments.base_address, PORT_RANGE, 1);
+    // Open the control socket
+    control_t control;
+    control_open(&arguments.control, &control);
+    unsigned nchannels = arguments.nboards * BOARD_CHANNELS;
+    runtime_t runtime = {
+        .channels=nchannels < 64 ? ((uint64_t) 1 << nchannels) - 1 : ~0ull,
+        .nchannels=nchannels,
+        .text_log_enabled=true,
+        .verbose=arguments.verbose,
+    };
     
-    // Set control register
-    outb(0, arguments.base_address + CONTROL);
+    // Request IO port permission and set the control register of each board
+    simulated = arguments.simulate;
+    for (unsigned b=0; b<arguments.nboards && !simulated; b++) {
+        ioperm(arguments.base_address[b], PORT_RANGE, 1);
+        outb(0, arguments.base_address[b] + CONTROL);
+    }
 
     // Create the sampling timer
     timer_t timerid;
@@ -312,42 +816,174 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
     
-    // Block SIGALRM
+    // Start the burst capture, the trigger channel being always scanned
+    burst_t burst = {};
+    if (arguments.burst_log) {
+        burst_threshold_t threshold = arguments.burst_threshold;
+        if (threshold.channel >= 0)
+            arguments.burst_channels |= 1 << threshold.channel;
+        if (burst_open(&burst, arguments.burst_log, arguments.burst_channels,
+                       arguments.burst_pre, arguments.burst_post, threshold))
+            exit(EXIT_FAILURE);
+    }
+    
+    // Allocate the spectrum buffers before the acquisition
+    spectrum_t spectrum = {};
+    if (arguments.spectrum_channels
+        && spectrum_open(&spectrum, arguments.spectrum_channels,
+                         arguments.spectrum_size, arguments.spectrum_bands,
+                         arguments.spectrum_interval))
+        exit(EXIT_FAILURE);
+    
+    // Block SIGALRM and the termination signals, they are taken by sigwait.
+    // SIGUSR1 is the external burst trigger.
     sigset_t alrmset;
     sigemptyset(&alrmset);
     sigaddset(&alrmset, SIGALRM);
+    sigaddset(&alrmset, SIGINT);
+    sigaddset(&alrmset, SIGTERM);
+    if (arguments.burst_log)
+        sigaddset(&alrmset, SIGUSR1);
     sigprocmask(SIG_BLOCK, &alrmset, NULL);
     
     // Fire the timer
-    struct itimerspec itimerspec = {
-        .it_interval={.tv_sec=0, .tv_nsec=20000000L},
-        .it_value={.tv_sec=0, .tv_nsec=20000000L},
-    };
-    if (timer_settime(timerid, 0, &itimerspec, NULL)) {
-        syslog(LOG_ERR, "Error configuring timer: %s", strerror(errno));
+    if (set_period(timerid, 20000000L))
         exit(EXIT_FAILURE);
-    }
     
+    // Channel summaries
+    runstats_t stats;
+    runstats_init(&stats, nchannels);
+
     // Read loop
+    uint64_t next_burst_ns = get_mono_ns();
     for (;;) {
         // Wait for timer signal
-        int sig;
-        if (sigwait(&alrmset, &sig))
+        int sig = SIGALRM;
+        if (arguments.burst_log) {
+            // Wait for a signal until the next scan of the burst channels
+            uint64_t now_ns = get_mono_ns();
+            uint64_t wait_ns = next_burst_ns > now_ns
+                               ? next_burst_ns - now_ns : 0;
+            struct timespec timeout = {
+                .tv_sec=wait_ns / 1000000000, .tv_nsec=wait_ns % 1000000000
+            };
+            sig = sigtimedwait(&alrmset, NULL, &timeout);
+            if (sig < 0 && errno == EAGAIN) {
+                burst_scan_t scan;
+                read_burst(arguments.base_address[0], burst.channels, &scan);
+                burst_add(&burst, &scan);
+                
+                // Scans falling behind are not made up for
+                next_burst_ns += arguments.burst_period_ns;
+                if (next_burst_ns < now_ns)
+                    next_burst_ns = now_ns + arguments.burst_period_ns;
+                continue;
+            }
+            if (sig < 0) {
+                if (errno != EINTR)
+                    syslog(LOG_ERR, "Error in sigtimedwait: %s",
+                           strerror(errno));
+                continue;
+            }
+            if (sig == SIGUSR1) {
+                burst_trigger(&burst);
+                continue;
+            }
+        } else if (sigwait(&alrmset, &sig)) {
             syslog(LOG_ERR, "Error in sigwait: %s", strerror(errno));
-
-        // Read from the ADC
-        mavlink_adc_raw_t adc;
-        read_all(arguments.base_address, &adc);
+        }
+        if (sig != SIGALRM)
+            break;
         
-        // Output Mavlink
-        output_adc_raw(&adc, &output_streams);
+        int overrun = timer_getoverrun(timerid);
+        if (overrun > 0)
+            runtime.overruns += overrun;
+        runtime.samples++;
+
+        // Read from the ADCs, all boards with the time stamp of the scan
+        int16_t data[MAX_CHANNELS];
+        uint64_t start_ns[MAX_CHANNELS];
+        uint64_t scan_start = get_mono_ns();
+        uint64_t time_usec = get_time_us();
+        read_all(arguments.base_address, arguments.nboards, runtime.channels,
+                 data, start_ns);
+        uint64_t scan_ns = get_mono_ns() - scan_start;
+        
+        // The scan is stamped midway between its first and last conversions
+        uint64_t first_ns = UINT64_MAX, last_ns = 0;
+        for (unsigned i=0; i<nchannels; i++) {
+            if (!(runtime.channels >> i & 1))
+                continue;
+            if (start_ns[i] < first_ns)
+                first_ns = start_ns[i];
+            if (start_ns[i] > last_ns)
+                last_ns = start_ns[i];
+        }
+        if (first_ns <= last_ns)
+            time_usec += (first_ns + (last_ns - first_ns) / 2 - scan_start)
+                         / 1000;
+        if (scan_ns > runtime.scan_ns_max)
+            runtime.scan_ns_max = scan_ns;
+        
+        // Output Mavlink, a single board keeping its ADC_RAW messages
+        mavlink_adc_raw_t adc = {.time_usec=time_usec};
+        memcpy(adc.data, data, sizeof adc.data);
+        if (arguments.nboards == 1) {
+            output_adc_raw(&adc, &output_streams);
+        } else {
+            mavlink_adc_scan_t scan = {
+                .time_usec=time_usec, .nboards=arguments.nboards
+            };
+            memcpy(scan.data, data, nchannels * sizeof *data);
+            output_adc_scan(&scan, &output_streams);
+        }
+
+        // Summarize the channels
+        if (arguments.stats_interval) {
+            if (stats.count && time_usec - stats.start_usec
+                               >= arguments.stats_interval)
+                output_adc_stats(&stats, &output_streams);
+
+            double x[MAX_CHANNELS];
+            for (unsigned i=0; i<nchannels; i++)
+                x[i] = data[i];
+            runstats_update(&stats, time_usec, x);
+        }
+
+        // Analyse the vibration spectrum
+        if (spectrum.nchannels) {
+            if (spectrum_due(&spectrum, adc.time_usec))
+                output_adc_spectrum(&spectrum, &output_streams);
+            spectrum_add(&spectrum, &adc);
+        }
 
         // Output text
-        log_text(&adc, output_streams.text_log);
-        if (arguments.verbose)
-            log_text(&adc, stdout);
+        if (runtime.text_log_enabled)
+            log_text(time_usec, data, nchannels, output_streams.text_log);
+        if (runtime.verbose)
+            log_text(time_usec, data, nchannels, stdout);
+        
+        // Release the UDP frames held back by the compression and shaping
+        sink_poll(&output_streams.sink);
+        
+        // Apply the pending commands before the next sample
+        control_cmd_t cmd;
+        while (control_poll(&control, &cmd))
+            handle_command(&control, &cmd, timerid, &runtime,
+                           &output_streams, &burst, &spectrum);
     }
     
+    if (stats.count)
+        output_adc_stats(&stats, &output_streams);
+    if (spectrum.nchannels) {
+        output_adc_spectrum(&spectrum, &output_streams);
+        spectrum_close(&spectrum);
+    }
+    burst_close(&burst);
+    control_close(&control);
+    sink_close(&output_streams.sink);
+    if (output_streams.text_log)
+        fclose(output_streams.text_log);
     return 0;
 }
 
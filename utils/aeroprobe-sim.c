@@ -0,0 +1,241 @@
+/**
+ * Simulated Aeroprobe air data computer on a pseudo-terminal.
+ *
+ * Writes the MAVLink DATA_INT stream of the air data probe to the master
+ * side of a pty, so that mavlog can be run and soaked against the slave
+ * side without the probe.
+ */
+
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mavlink/v1.0/ceaufmg/mavlink.h"
+
+
+/** MAVLink system id of the probe. */
+#define MAVLINK_SYSID 1
+
+/** MAVLink component id of the probe. */
+#define MAVLINK_COMPID 210
+
+/** DATA_INT ids of the probe channels, see start-acquisition. */
+enum {ID_ALPHA=20, ID_BETA, ID_QBAR, ID_TEMPERATURE, ID_PRESSURE};
+
+
+/** Program version. */
+const char *argp_program_version = "aeroprobe-sim 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "aeroprobe-sim -- Simulate the Aeroprobe air data "
+    "computer on a pseudo-terminal.";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"rate", 'r', "HZ", 0, "Sample rate, defaults to 100 Hz"},
+    {"count", 'n', "N", 0, "Stop after N samples, defaults to unlimited"},
+    {"link", 'l', "PATH", 0, "Create a symbolic link to the pty at PATH"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    double rate;
+    unsigned long count;
+    char *link;
+} arguments_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+    char *endptr = 0;
+
+    switch (key) {
+    case 'r':
+        arguments->rate = strtod(arg, &endptr);
+        if (*endptr || arguments->rate <= 0)
+            argp_error(state, "HZ argument must be a positive number.");
+        break;
+
+    case 'n':
+        arguments->count = strtoul(arg, &endptr, 0);
+        if (*endptr)
+            argp_error(state, "N argument must be an integer.");
+        break;
+
+    case 'l':
+        arguments->link = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        argp_error(state, "Too many arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, 0, doc};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Open the master side of a new pseudo-terminal.
+ * Aborts the program on error.
+ */
+int open_pty(char *link) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+        syslog(LOG_ERR, "Error creating pty: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct termios termios;
+    if (!tcgetattr(fd, &termios)) {
+        cfmakeraw(&termios);
+        tcsetattr(fd, TCSANOW, &termios);
+    }
+
+    char *slave = ptsname(fd);
+    if (link) {
+        unlink(link);
+        if (symlink(slave, link))
+            syslog(LOG_WARNING, "Error creating link `%s`: %s",
+                   link, strerror(errno));
+    }
+    printf("%s\n", slave);
+    fflush(stdout);
+    return fd;
+}
+
+
+/**
+ * Write a whole buffer to the pty.
+ * @return 0 if success, -1 if error.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        // A signal may end a blocked write with part of the buffer written
+        if (stop_requested)
+            return -1;
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR && !stop_requested)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * Pack the probe channels at a given time since start, returning the
+ * length of the frames written to `out`.
+ */
+static size_t format_sample(double t, uint8_t *out) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t time_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    // Centidegrees, pascals and centidegrees Celsius
+    int32_t values[] = {
+        [ID_ALPHA - ID_ALPHA] = 300 + 200 * sin(2 * M_PI * 0.5 * t),
+        [ID_BETA - ID_ALPHA] = 100 * sin(2 * M_PI * 0.3 * t),
+        [ID_QBAR - ID_ALPHA] = 550 + 50 * sin(2 * M_PI * 0.1 * t),
+        [ID_TEMPERATURE - ID_ALPHA] = 2500 + 10 * sin(2 * M_PI * 0.01 * t),
+        [ID_PRESSURE - ID_ALPHA] = 91000 + 100 * sin(2 * M_PI * 0.02 * t),
+    };
+
+    size_t len = 0;
+    for (unsigned i=0; i<sizeof values / sizeof *values; i++) {
+        mavlink_data_int_t data_int = {
+            .time_usec=time_usec, .value=values[i], .id=ID_ALPHA + i};
+        mavlink_message_t msg;
+        mavlink_msg_data_int_encode(MAVLINK_SYSID, MAVLINK_COMPID,
+                                    &msg, &data_int);
+        len += mavlink_msg_to_send_buffer(out + len, &msg);
+    }
+    return len;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.rate=100};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int pty = open_pty(arguments.link);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long period_ns = 1e9 / arguments.rate;
+
+    unsigned long n;
+    for (n=0; !stop_requested && (!arguments.count || n < arguments.count);
+         n++) {
+        uint8_t out[5 * MAVLINK_MAX_PACKET_LEN];
+        size_t len = format_sample(n / arguments.rate, out);
+        if (write_all(pty, out, len)) {
+            if (!stop_requested)
+                syslog(LOG_ERR, "Error writing to pty: %s", strerror(errno));
+            break;
+        }
+
+        // Wait for the next sample
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+               == EINTR && !stop_requested);
+    }
+
+    syslog(LOG_INFO, "%lu samples written", n);
+    if (arguments.link)
+        unlink(arguments.link);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,478 @@
+/**
+ * Fixed-size circular "black box" log.
+ *
+ * The file is preallocated when opened and never grows: after two header
+ * slots, it holds a ring of fixed-size blocks, each starting with its
+ * sequence number, data length and checksum. The data is appended to the
+ * block being filled in memory, which is written in one go when full, at
+ * the position of its sequence number in the ring, overwriting the oldest
+ * block. The header, holding the geometry and the current sequence number,
+ * is written after each block and flush to the older of its two slots, so
+ * that a torn write leaves the other slot valid.
+ *
+ * A freeze copies the current window, oldest block first, into a normal
+ * log beside the black box. The copy runs in a thread, outpacing the
+ * writer that overwrites the oldest blocks; the blocks overwritten anyway
+ * are recognized by their sequence numbers and skipped. Reopening a black
+ * box of the same geometry continues its ring, keeping the window of the
+ * previous run.
+ *
+ * The header and block fields are in host byte order.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "blackbox.h"
+#include "mavframe.h"
+#include "utils.h"
+
+
+/** Magic of the header slots. */
+#define HEADER_MAGIC "FDAS3BBX"
+
+/** Format version. */
+#define HEADER_VERSION 1
+
+/** Size of a header slot. */
+#define HEADER_SLOT_SIZE 512
+
+/** Offset of the ring of blocks. */
+#define DATA_OFFSET 4096
+
+/** Magic of the blocks. */
+#define BLOCK_MAGIC 0x4B4C4242
+
+
+/** Header slot. */
+typedef struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint32_t reserved;
+    uint64_t update; ///< The valid slot with the latest update wins.
+    uint64_t first_seq;
+    uint64_t seq;
+    uint16_t crc;
+} header_t;
+
+/** Header of a block. */
+typedef struct block_header {
+    uint32_t magic;
+    uint32_t used; ///< Bytes of data following the header.
+    uint64_t seq;
+    uint16_t crc; ///< Of the header up to here and the data.
+    uint16_t reserved[3];
+} block_header_t;
+
+/** Bytes of data in a block. */
+#define BLOCK_CAPACITY (BLACKBOX_BLOCK_SIZE - sizeof(block_header_t))
+
+
+/**
+ * Checksum of a structure up to its `crc` field.
+ */
+#define STRUCT_CRC(s) mavframe_crc((const uint8_t *) (s), \
+                                   offsetof(typeof(*(s)), crc), 0xFFFF)
+
+
+/**
+ * Offset of the block of a sequence number.
+ */
+static off_t block_offset(const blackbox_t *blackbox, uint64_t seq) {
+    return DATA_OFFSET + (off_t) (seq % blackbox->nblocks)
+        * BLACKBOX_BLOCK_SIZE;
+}
+
+
+/**
+ * Write a whole buffer at an offset.
+ * @return 0 if success, -1 if error.
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const uint8_t *) buf + done, len - done,
+                           offset + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Write the header to the older slot.
+ * @return 0 if success, -1 if error.
+ */
+static int write_header(blackbox_t *blackbox) {
+    header_t header = {
+        .magic=HEADER_MAGIC, .version=HEADER_VERSION,
+        .block_size=BLACKBOX_BLOCK_SIZE, .nblocks=blackbox->nblocks,
+        .update=++blackbox->update, .first_seq=blackbox->first_seq,
+        .seq=blackbox->seq
+    };
+    header.crc = STRUCT_CRC(&header);
+    off_t slot = (header.update % 2) * HEADER_SLOT_SIZE;
+    if (pwrite_all(blackbox->fd, &header, sizeof header, slot)) {
+        syslog(LOG_ERR, "Error writing black box header: %s",
+               strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Read the latest valid header slot.
+ * @return whether one is valid.
+ */
+static bool read_header(int fd, header_t *header) {
+    bool found = false;
+    for (int i=0; i<2; i++) {
+        header_t slot;
+        if (pread(fd, &slot, sizeof slot, i * HEADER_SLOT_SIZE)
+            != sizeof slot)
+            continue;
+        if (memcmp(slot.magic, HEADER_MAGIC, sizeof slot.magic)
+            || slot.version != HEADER_VERSION || slot.crc != STRUCT_CRC(&slot))
+            continue;
+        if (!found || slot.update > header->update)
+            *header = slot;
+        found = true;
+    }
+    return found;
+}
+
+
+/**
+ * Read a block, checking that it holds the given sequence number.
+ * @param block buffer of BLACKBOX_BLOCK_SIZE bytes.
+ * @return the length of its data or -1 if invalid.
+ */
+static ssize_t read_block(const blackbox_t *blackbox, int fd, uint64_t seq,
+                          uint8_t *block) {
+    block_header_t *header = (block_header_t *) block;
+    if (pread(fd, block, BLACKBOX_BLOCK_SIZE, block_offset(blackbox, seq))
+        != BLACKBOX_BLOCK_SIZE)
+        return -1;
+    if (header->magic != BLOCK_MAGIC || header->seq != seq
+        || header->used > BLOCK_CAPACITY)
+        return -1;
+    uint16_t crc = mavframe_crc(block + sizeof *header, header->used,
+                                STRUCT_CRC(header));
+    return crc == header->crc ? header->used : -1;
+}
+
+
+/**
+ * Latest sequence number of the blocks of the file, or 0 if none.
+ */
+static uint64_t scan_blocks(const blackbox_t *blackbox) {
+    uint64_t latest = 0;
+    for (uint32_t i=0; i<blackbox->nblocks; i++) {
+        block_header_t header;
+        off_t offset = DATA_OFFSET + (off_t) i * BLACKBOX_BLOCK_SIZE;
+        if (pread(blackbox->fd, &header, sizeof header, offset)
+            == sizeof header
+            && header.magic == BLOCK_MAGIC
+            && header.seq % blackbox->nblocks == i && header.seq > latest)
+            latest = header.seq;
+    }
+    return latest;
+}
+
+
+/**
+ * Open a black box, continuing its ring if it has the same geometry, and
+ * preallocate it.
+ * @param size of the file, in bytes.
+ * @return the black box or NULL if error.
+ */
+blackbox_t* blackbox_open(const char *path, uint64_t size) {
+    blackbox_t *blackbox = calloc(1, sizeof *blackbox);
+    if (!blackbox || !(blackbox->block = malloc(BLACKBOX_BLOCK_SIZE))
+        || !(blackbox->path = strdup(path))) {
+        syslog(LOG_ERR, "Error allocating black box: %s", strerror(errno));
+        goto fail;
+    }
+    blackbox->nblocks = (size - DATA_OFFSET) / BLACKBOX_BLOCK_SIZE;
+    if (size <= DATA_OFFSET || blackbox->nblocks < 2) {
+        syslog(LOG_ERR, "Black box of %llu bytes too small",
+               (unsigned long long) size);
+        goto fail;
+    }
+
+    blackbox->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (blackbox->fd < 0) {
+        syslog(LOG_ERR, "Error opening black box `%s`: %s", path,
+               strerror(errno));
+        goto fail;
+    }
+
+    // Continue after the latest block, even if the header lags behind
+    header_t header;
+    if (read_header(blackbox->fd, &header)
+        && header.block_size == BLACKBOX_BLOCK_SIZE
+        && header.nblocks == blackbox->nblocks) {
+        uint64_t latest = scan_blocks(blackbox);
+        blackbox->first_seq = header.first_seq;
+        blackbox->update = header.update;
+        blackbox->seq = (latest > header.seq ? latest : header.seq) + 1;
+    } else if (ftruncate(blackbox->fd, 0)) {
+        syslog(LOG_ERR, "Error truncating black box: %s", strerror(errno));
+        goto fail;
+    } else {
+        blackbox->first_seq = blackbox->seq = 1;
+    }
+
+    off_t length = DATA_OFFSET + (off_t) blackbox->nblocks
+        * BLACKBOX_BLOCK_SIZE;
+    int status = posix_fallocate(blackbox->fd, 0, length);
+    if (status) {
+        syslog(LOG_ERR, "Error preallocating black box: %s",
+               strerror(status));
+        goto fail;
+    }
+    if (write_header(blackbox))
+        goto fail;
+    return blackbox;
+
+ fail:
+    if (blackbox && blackbox->fd > 0)
+        close(blackbox->fd);
+    if (blackbox) {
+        free(blackbox->block);
+        free(blackbox->path);
+    }
+    free(blackbox);
+    return NULL;
+}
+
+
+/**
+ * Write the block being filled at its position in the ring.
+ * @return 0 if success, -1 if error.
+ */
+static int write_block(blackbox_t *blackbox) {
+    block_header_t *header = (block_header_t *) blackbox->block;
+    *header = (block_header_t) {
+        .magic=BLOCK_MAGIC, .used=blackbox->used, .seq=blackbox->seq
+    };
+    header->crc = mavframe_crc(blackbox->block + sizeof *header,
+                               blackbox->used, STRUCT_CRC(header));
+    if (pwrite_all(blackbox->fd, blackbox->block,
+                   sizeof *header + blackbox->used,
+                   block_offset(blackbox, blackbox->seq))) {
+        syslog(LOG_ERR, "Error writing black box: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Append data to the black box, in the block being filled if it fits.
+ * @return 0 if success, -1 if error.
+ */
+int blackbox_append(blackbox_t *blackbox, const void *data, size_t len) {
+    if (len > BLOCK_CAPACITY)
+        return -1;
+
+    // Data is not split across blocks, so that each is a valid log
+    int status = 0;
+    if (blackbox->used + len > BLOCK_CAPACITY) {
+        status = write_block(blackbox);
+        blackbox->seq++;
+        blackbox->used = 0;
+        if (write_header(blackbox))
+            status = -1;
+    }
+
+    uint8_t *block_data = blackbox->block + sizeof(block_header_t);
+    memcpy(block_data + blackbox->used, data, len);
+    blackbox->used += len;
+    return status;
+}
+
+
+/**
+ * Write the block being filled and the header.
+ * @return 0 if success, -1 if error.
+ */
+int blackbox_flush(blackbox_t *blackbox) {
+    if (blackbox->used && write_block(blackbox))
+        return -1;
+    return write_header(blackbox);
+}
+
+
+/**
+ * Write a whole buffer to a file.
+ * @return 0 if success, -1 if error.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const uint8_t *) buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Copy the frozen window to its log.
+ */
+static void* freeze_thread(void *arg) {
+    blackbox_t *blackbox = arg;
+    uint8_t *block = malloc(BLACKBOX_BLOCK_SIZE);
+    int in = open(blackbox->path, O_RDONLY);
+    if (!block || in < 0) {
+        syslog(LOG_ERR, "Error reading black box: %s", strerror(errno));
+        goto done;
+    }
+
+    uint64_t lost = 0;
+    int status = 0;
+    if (blackbox->freeze_header)
+        status = write_all(blackbox->freeze_fd, blackbox->freeze_header,
+                           blackbox->freeze_header_len);
+    for (uint64_t seq=blackbox->freeze_first;
+         seq<blackbox->freeze_last && !status; seq++) {
+        ssize_t len = read_block(blackbox, in, seq, block);
+        if (len < 0)
+            lost++;
+        else
+            status = write_all(blackbox->freeze_fd,
+                               block + sizeof(block_header_t), len);
+    }
+    if (!status)
+        status = write_all(blackbox->freeze_fd, blackbox->freeze_tail,
+                           blackbox->freeze_tail_len);
+    if (!status)
+        status = fdatasync(blackbox->freeze_fd);
+
+    if (status)
+        syslog(LOG_ERR, "Error writing frozen log `%s`: %s",
+               blackbox->freeze_path, strerror(errno));
+    else if (lost)
+        syslog(LOG_WARNING, "Frozen log `%s` misses %llu overwritten blocks",
+               blackbox->freeze_path, (unsigned long long) lost);
+    else
+        syslog(LOG_INFO, "Black box frozen to `%s`", blackbox->freeze_path);
+
+ done:
+    if (in >= 0)
+        close(in);
+    free(block);
+    close(blackbox->freeze_fd);
+    __atomic_store_n(&blackbox->freezing, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+/**
+ * Wait for the previous freeze to complete.
+ */
+static void join_freezer(blackbox_t *blackbox) {
+    if (!blackbox->freezer_started)
+        return;
+    pthread_join(blackbox->freezer, NULL);
+    blackbox->freezer_started = false;
+}
+
+
+/**
+ * Copy the current window into a new log, named after the black box and
+ * the time, in the background.
+ * @return the path of the log, or NULL if error or a freeze is running.
+ */
+const char* blackbox_freeze(blackbox_t *blackbox) {
+    if (__atomic_load_n(&blackbox->freezing, __ATOMIC_ACQUIRE))
+        return NULL;
+    join_freezer(blackbox);
+
+    // A new file, never replacing a previous freeze
+    unsigned long long now = get_time_us() / 1000000;
+    size_t size = sizeof blackbox->freeze_path;
+    char *path = blackbox->freeze_path;
+    snprintf(path, size, "%s.%llu", blackbox->path, now);
+    int fd;
+    for (unsigned i=1; (fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0
+                       && errno == EEXIST && i < 100; i++)
+        snprintf(path, size, "%s.%llu-%u", blackbox->path, now, i);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Error creating frozen log `%s`: %s", path,
+               strerror(errno));
+        return NULL;
+    }
+
+    // The block being filled is copied from memory, the others from the file
+    uint8_t *tail = realloc(blackbox->freeze_tail, blackbox->used + 1);
+    if (!tail) {
+        syslog(LOG_ERR, "Error allocating frozen block: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    memcpy(tail, blackbox->block + sizeof(block_header_t), blackbox->used);
+    blackbox->freeze_tail = tail;
+    blackbox->freeze_tail_len = blackbox->used;
+    blackbox->freeze_fd = fd;
+    blackbox->freeze_last = blackbox->seq;
+    blackbox->freeze_first = blackbox->seq - blackbox->nblocks + 1;
+    if (blackbox->seq < blackbox->first_seq + blackbox->nblocks - 1)
+        blackbox->freeze_first = blackbox->first_seq;
+
+    // The thread takes no signals, they stay with the acquisition loop
+    blackbox_flush(blackbox);
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    blackbox->freezing = true;
+    int status = pthread_create(&blackbox->freezer, NULL, freeze_thread,
+                                blackbox);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error starting freeze: %s", strerror(status));
+        blackbox->freezing = false;
+        close(fd);
+        return NULL;
+    }
+    blackbox->freezer_started = true;
+    return path;
+}
+
+
+/**
+ * Flush and close the black box, waiting for a running freeze.
+ */
+void blackbox_close(blackbox_t *blackbox) {
+    if (!blackbox)
+        return;
+
+    join_freezer(blackbox);
+    blackbox_flush(blackbox);
+    if (close(blackbox->fd))
+        syslog(LOG_ERR, "Error closing black box: %s", strerror(errno));
+    free(blackbox->block);
+    free(blackbox->freeze_tail);
+    free(blackbox->path);
+    free(blackbox);
+}
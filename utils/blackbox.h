@@ -0,0 +1,56 @@
+/**
+ * Fixed-size circular "black box" log.
+ */
+
+#ifndef BLACKBOX_H
+#define BLACKBOX_H
+
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Default size of the black box file, in bytes. */
+#define BLACKBOX_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/** Size of the blocks the black box is written in. */
+#define BLACKBOX_BLOCK_SIZE (64 * 1024)
+
+
+/** Open black box log. */
+typedef struct blackbox {
+    int fd;
+    char *path;
+    uint32_t nblocks;
+    uint64_t first_seq; ///< First block written to the file.
+    uint64_t seq; ///< Sequence number of the block being filled.
+    uint64_t update; ///< Header updates, alternating between two slots.
+    uint8_t *block; ///< Block being filled, its header included.
+    size_t used; ///< Bytes of data in the block being filled.
+
+    // Copy of the window by the freeze thread
+    pthread_t freezer;
+    bool freezer_started;
+    bool freezing; ///< Cleared by the freeze thread when done.
+    int freeze_fd;
+    uint64_t freeze_first; ///< First block copied from the file.
+    uint64_t freeze_last; ///< Block copied from `freeze_tail` instead.
+    uint8_t *freeze_tail;
+    size_t freeze_tail_len;
+    char freeze_path[PATH_MAX];
+    const uint8_t *freeze_header; ///< Start of the frozen logs, or NULL.
+    size_t freeze_header_len;
+} blackbox_t;
+
+
+blackbox_t* blackbox_open(const char *path, uint64_t size);
+int blackbox_append(blackbox_t *blackbox, const void *data, size_t len);
+int blackbox_flush(blackbox_t *blackbox);
+const char* blackbox_freeze(blackbox_t *blackbox);
+void blackbox_close(blackbox_t *blackbox);
+
+
+#endif//BLACKBOX_H
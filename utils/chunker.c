@@ -0,0 +1,144 @@
+/**
+ * Content-defined chunking of files, for the deduplicated log offload.
+ *
+ * The cut points are found with a gear rolling hash over the last 64
+ * bytes, so that they follow the content: an insertion or a file that
+ * grew only changes the chunks around the edit, and the others keep
+ * their hashes. The chunk length is normalized towards CHUNKER_AVG_LEN by
+ * a stricter cut condition before it and a looser one after it.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "chunker.h"
+
+
+/** Size of the read buffer. */
+#define READ_BUFFER_LEN (1024 * 1024)
+
+/** Cut conditions before and after the average length, on the high bits. */
+#define MASK_STRICT (((1ull << 15) - 1) << 49)
+#define MASK_LOOSE (((1ull << 11) - 1) << 53)
+
+
+/** Gear values of the bytes. */
+static uint64_t gear[256];
+
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Fill the gear table with a fixed pseudo-random sequence, splitmix64, as
+ * the cut points must not change between the flight computer and the
+ * ground store.
+ */
+static void gear_init(void) {
+    uint64_t x = 0x666461733343dc;
+    for (int i=0; i<256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15);
+        z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9;
+        z = (z ^ z >> 27) * 0x94d049bb133111eb;
+        gear[i] = z ^ z >> 31;
+    }
+}
+
+
+/**
+ * Length of the first chunk of a buffer, the whole buffer if it ends
+ * before a cut point. The buffer must hold CHUNKER_MAX_LEN bytes unless it
+ * is the end of the file.
+ */
+size_t chunker_cut(const uint8_t *data, size_t len) {
+    pthread_once(&gear_once, gear_init);
+    if (len <= CHUNKER_MIN_LEN)
+        return len;
+
+    size_t normal = len < CHUNKER_AVG_LEN ? len : CHUNKER_AVG_LEN;
+    size_t limit = len < CHUNKER_MAX_LEN ? len : CHUNKER_MAX_LEN;
+    uint64_t h = 0;
+    size_t i = CHUNKER_MIN_LEN;
+    for (; i<normal; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & MASK_STRICT))
+            return i + 1;
+    }
+    for (; i<limit; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & MASK_LOOSE))
+            return i + 1;
+    }
+    return limit;
+}
+
+
+/**
+ * Split a file into chunks and hash them.
+ * @param chunks set to an array allocated with malloc.
+ * @return 0 if success, -1 if error.
+ */
+int chunker_file(int fd, chunk_t **chunks, size_t *nchunks) {
+    uint8_t *buf = malloc(READ_BUFFER_LEN);
+    size_t capacity = 1024, n = 0;
+    chunk_t *list = malloc(capacity * sizeof *list);
+    if (!buf || !list) {
+        syslog(LOG_ERR, "Error allocating chunker: %s", strerror(errno));
+        goto error;
+    }
+
+    uint64_t offset = 0;
+    size_t start = 0, end = 0;
+    bool eof = false;
+    while (!eof || start < end) {
+        // Keep a whole maximum chunk ahead of the cut search
+        if (!eof && end - start < CHUNKER_MAX_LEN) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+            ssize_t got = read(fd, buf + end, READ_BUFFER_LEN - end);
+            if (got < 0) {
+                if (errno == EINTR)
+                    continue;
+                syslog(LOG_ERR, "Error reading file: %s", strerror(errno));
+                goto error;
+            }
+            eof = got == 0;
+            end += got;
+            continue;
+        }
+
+        if (n == capacity) {
+            chunk_t *grown = realloc(list, 2 * capacity * sizeof *list);
+            if (!grown) {
+                syslog(LOG_ERR, "Error allocating chunks: %s",
+                       strerror(errno));
+                goto error;
+            }
+            list = grown;
+            capacity *= 2;
+        }
+
+        size_t len = chunker_cut(buf + start, end - start);
+        list[n].offset = offset;
+        list[n].len = len;
+        sha256(buf + start, len, list[n].hash);
+        n++;
+        offset += len;
+        start += len;
+    }
+
+    free(buf);
+    *chunks = list;
+    *nchunks = n;
+    return 0;
+
+ error:
+    free(buf);
+    free(list);
+    return -1;
+}
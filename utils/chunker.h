@@ -0,0 +1,33 @@
+/**
+ * Content-defined chunking of files, for the deduplicated log offload.
+ */
+
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+
+/** Bounds and target of the chunk length. */
+#define CHUNKER_MIN_LEN (2 * 1024)
+#define CHUNKER_AVG_LEN (8 * 1024)
+#define CHUNKER_MAX_LEN (64 * 1024)
+
+
+/** Chunk of a file. */
+typedef struct chunk {
+    uint64_t offset;
+    uint32_t len;
+    uint8_t hash[SHA256_LEN];
+} chunk_t;
+
+
+size_t chunker_cut(const uint8_t *data, size_t len);
+int chunker_file(int fd, chunk_t **chunks, size_t *nchunks);
+
+
+#endif//CHUNKER_H
@@ -0,0 +1,261 @@
+/**
+ * Runtime control socket of the device readers.
+ *
+ * Commands are text datagrams of whitespace-separated words sent to a
+ * Unix-domain socket. The readers poll the socket without blocking between
+ * samples, so a command takes effect at a sample boundary and never pauses
+ * the acquisition. Replies are sent back to the address of the client and
+ * start with `ok` or `error:`.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "control.h"
+
+
+/** Control options structure. */
+static struct argp_option options[] = {
+    {"control", 'c', "SOCKET", 0,
+     "Accept runtime commands on the Unix datagram SOCKET"},
+    {0}
+};
+
+
+/** Control option parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the configuration structure to write the parsed options
+    control_config_t *config = state->input;
+
+    switch (key) {
+    case 'c':
+        if (strlen(arg) >= sizeof ((struct sockaddr_un *) 0)->sun_path)
+            argp_error(state, "SOCKET path too long.");
+        config->path = arg;
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Control option parser object. */
+struct argp control_argp = {options, parse_opt};
+
+
+/**
+ * Open the control socket, if configured, replacing a stale one.
+ * Aborts the program on error.
+ */
+void control_open(const control_config_t *config, control_t *control) {
+    control->sock = -1;
+    control->path = config->path;
+    if (!config->path)
+        return;
+
+    control->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (control->sock < 0) {
+        syslog(LOG_ERR, "Error creating control socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_un addr = {.sun_family=AF_UNIX};
+    strncpy(addr.sun_path, config->path, sizeof addr.sun_path - 1);
+    unlink(config->path);
+    if (bind(control->sock, (struct sockaddr *) &addr, sizeof addr)) {
+        char *msg = "Error binding control socket `%s`: %s";
+        syslog(LOG_ERR, msg, config->path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int flags = fcntl(control->sock, F_GETFL);
+    if (flags < 0 || fcntl(control->sock, F_SETFL, flags | O_NONBLOCK)) {
+        char *msg = "Error making control socket non-blocking: %s";
+        syslog(LOG_ERR, msg, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Receive a pending command without blocking.
+ * @param[out] cmd the command split in words.
+ * @return whether a command was received.
+ */
+bool control_poll(control_t *control, control_cmd_t *cmd) {
+    if (control->sock < 0)
+        return false;
+
+    for (;;) {
+        cmd->fromlen = sizeof cmd->from;
+        ssize_t n = recvfrom(control->sock, cmd->text, CONTROL_MAX_LEN, 0,
+                             (struct sockaddr *) &cmd->from, &cmd->fromlen);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                syslog(LOG_ERR, "Error receiving command: %s",
+                       strerror(errno));
+            return false;
+        }
+
+        cmd->text[n] = 0;
+        cmd->argc = 0;
+        char *saveptr;
+        char *word = strtok_r(cmd->text, " \t\r\n", &saveptr);
+        while (word && cmd->argc < CONTROL_MAX_ARGS) {
+            cmd->argv[cmd->argc++] = word;
+            word = strtok_r(NULL, " \t\r\n", &saveptr);
+        }
+
+        // Empty datagrams are ignored
+        if (cmd->argc)
+            return true;
+    }
+}
+
+
+/**
+ * Send a reply to the client of a command, if it has an address.
+ */
+void control_reply(control_t *control, const control_cmd_t *cmd,
+                   const char *format, ...) {
+    if (cmd->fromlen <= sizeof(sa_family_t))
+        return;
+
+    char reply[CONTROL_MAX_LEN];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(reply, sizeof reply, format, ap);
+    va_end(ap);
+    if (len >= sizeof reply)
+        len = sizeof reply - 1;
+
+    // Replies are best-effort, a slow client must not stall acquisition
+    ssize_t n = sendto(control->sock, reply, len, MSG_DONTWAIT,
+                       (struct sockaddr *) &cmd->from, cmd->fromlen);
+    if (n < 0)
+        syslog(LOG_WARNING, "Error sending reply: %s", strerror(errno));
+}
+
+
+/**
+ * Parse an `on` or `off` argument.
+ * @return 1 for on, 0 for off or -1 if invalid.
+ */
+int control_parse_switch(const char *arg) {
+    if (!strcmp(arg, "on"))
+        return 1;
+    if (!strcmp(arg, "off"))
+        return 0;
+    return -1;
+}
+
+
+/**
+ * Reply to the `shaping` command with the UDP shaping counters: the frames
+ * not sent in total, and the frames sent and not sent of each message type.
+ */
+static void reply_shaping(control_t *control, const control_cmd_t *cmd,
+                          const sink_t *sink) {
+    char counters[CONTROL_MAX_LEN] = "";
+    size_t len = 0;
+    for (unsigned i=0; i<sink->nshapers && len < sizeof counters; i++) {
+        const sink_shaper_t *shaper = &sink->shapers[i];
+        len += snprintf(counters + len, sizeof counters - len,
+                        " %lu:%lu/%lu", (unsigned long) shaper->msgid,
+                        shaper->sent, shaper->shaped);
+    }
+    control_reply(control, cmd, "ok shaped=%lu%s", sink->udp_shaped,
+                  counters);
+}
+
+
+/**
+ * Reply to the `compression` command with the UDP compression counters: the
+ * frames sent over the shaping limits in total, and the frames sent and
+ * left to rebuild of each compressed message type.
+ */
+static void reply_compression(control_t *control, const control_cmd_t *cmd,
+                              const sink_t *sink) {
+    if (!sink->compressor) {
+        control_reply(control, cmd, "error: UDP compression not enabled");
+        return;
+    }
+
+    char counters[CONTROL_MAX_LEN] = "";
+    size_t len = 0;
+    const swingdoor_t *sd = sink->compressor;
+    for (unsigned i=0; i<sd->nstreams && len < sizeof counters; i++) {
+        const swingdoor_stream_t *s = &sd->streams[i];
+        len += snprintf(counters + len, sizeof counters - len,
+                        " %s:%lu/%lu", s->msg->name, s->nsent, s->dropped);
+    }
+    control_reply(control, cmd, "ok overlimit=%lu%s", sink->udp_overlimit,
+                  counters);
+}
+
+
+/**
+ * Handle the `sink udp|logbin|shm|blackbox on|off`, `shaping`,
+ * `compression` and `freeze` commands shared by all readers.
+ * @return whether the command was handled.
+ */
+bool control_sink_command(control_t *control, const control_cmd_t *cmd,
+                          sink_t *sink) {
+    if (!strcmp(cmd->argv[0], "shaping") && cmd->argc == 1) {
+        reply_shaping(control, cmd, sink);
+        return true;
+    }
+
+    if (!strcmp(cmd->argv[0], "compression") && cmd->argc == 1) {
+        reply_compression(control, cmd, sink);
+        return true;
+    }
+
+    if (!strcmp(cmd->argv[0], "freeze") && cmd->argc == 1) {
+        const char *path = sink_freeze(sink);
+        if (!sink->blackbox)
+            control_reply(control, cmd, "error: black box not open");
+        else if (!path)
+            control_reply(control, cmd, "error: freeze failed or running");
+        else
+            control_reply(control, cmd, "ok %s", path);
+        return true;
+    }
+
+    if (!strcmp(cmd->argv[0], "sink")) {
+        int enable = cmd->argc == 3 ? control_parse_switch(cmd->argv[2]) : -1;
+        if (enable < 0)
+            control_reply(control, cmd, "error: usage: sink NAME on|off");
+        else if (sink_enable(sink, cmd->argv[1], enable))
+            control_reply(control, cmd, "error: sink `%s` not open",
+                          cmd->argv[1]);
+        else
+            control_reply(control, cmd, "ok");
+        return true;
+    }
+
+    return false;
+}
+
+
+/**
+ * Close the control socket and remove its path.
+ */
+void control_close(control_t *control) {
+    if (control->sock < 0)
+        return;
+
+    if (close(control->sock))
+        syslog(LOG_ERR, "Error closing control socket: %s", strerror(errno));
+    unlink(control->path);
+    control->sock = -1;
+}
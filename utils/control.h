@@ -0,0 +1,60 @@
+/**
+ * Runtime control socket of the device readers.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+
+#include <argp.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+
+
+/** Maximum length of a command or reply datagram. */
+#define CONTROL_MAX_LEN 1024
+
+/** Maximum number of words in a command. */
+#define CONTROL_MAX_ARGS 16
+
+
+/** Control configuration, filled by the `control_argp` option parser. */
+typedef struct control_config {
+    char *path;
+} control_config_t;
+
+/** Open control socket. */
+typedef struct control {
+    int sock;
+    char *path;
+} control_t;
+
+/** Command received from a client. */
+typedef struct control_cmd {
+    char text[CONTROL_MAX_LEN + 1];
+    int argc;
+    char *argv[CONTROL_MAX_ARGS];
+    struct sockaddr_un from;
+    socklen_t fromlen;
+} control_cmd_t;
+
+
+/** Option parser of the control socket, to be used as an argp child. */
+extern struct argp control_argp;
+
+
+void control_open(const control_config_t *config, control_t *control);
+bool control_poll(control_t *control, control_cmd_t *cmd);
+void control_reply(control_t *control, const control_cmd_t *cmd,
+                   const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+bool control_sink_command(control_t *control, const control_cmd_t *cmd,
+                          sink_t *sink);
+int control_parse_switch(const char *arg);
+void control_close(control_t *control);
+
+
+#endif//CONTROL_H
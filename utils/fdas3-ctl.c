@@ -0,0 +1,158 @@
+/**
+ * Client of the runtime control socket of the device readers.
+ */
+
+
+#include <argp.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+
+
+/** Program version. */
+const char *argp_program_version = "fdas3-ctl 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "fdas3-ctl -- Send a command to a running device reader."
+    "\vCommands accepted by all readers:\n"
+    "  sink udp|logbin|shm|blackbox on|off\n"
+    "  logtxt on|off\n"
+    "  verbose on|off\n"
+    "  counters\n"
+    "  shaping\n"
+    "  compression\n"
+    "  freeze\n"
+    "vcmdas1-read only:\n"
+    "  period MILLISECONDS\n"
+    "  channels LIST\n"
+    "  trigger\n"
+    "ahrs400-read only:\n"
+    "  mode voltage|scaled|angle";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "SOCKET COMMAND...";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"timeout", 't', "SECONDS", 0, "Time to wait for the reply, defaults to 2"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char *socket;
+    char command[CONTROL_MAX_LEN];
+    unsigned timeout;
+} arguments_t;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 't':
+        {
+            char *endptr = 0;
+            unsigned long timeout = strtoul(arg, &endptr, 0);
+            if (*endptr || !timeout)
+                argp_error(state, "SECONDS must be a positive integer.");
+            arguments->timeout = timeout;
+        }
+        break;
+
+    case ARGP_KEY_ARG:
+        if (state->arg_num == 0) {
+            if (strlen(arg) >= sizeof ((struct sockaddr_un *) 0)->sun_path)
+                argp_error(state, "SOCKET path too long.");
+            arguments->socket = arg;
+        } else {
+            // Join the command words with spaces
+            size_t used = strlen(arguments->command);
+            size_t left = sizeof arguments->command - used;
+            int n = snprintf(arguments->command + used, left, "%s%s",
+                             used ? " " : "", arg);
+            if (n >= left)
+                argp_error(state, "COMMAND too long.");
+        }
+        break;
+
+    case ARGP_KEY_END:
+        if (state->arg_num < 2)
+            argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.timeout=2};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        syslog(LOG_ERR, "Error creating socket: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Bind to an autogenerated abstract address so the reader can reply
+    struct sockaddr_un local = {.sun_family=AF_UNIX};
+    if (bind(sock, (struct sockaddr *) &local, sizeof(sa_family_t))) {
+        syslog(LOG_ERR, "Error binding socket: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct timeval timeout = {.tv_sec=arguments.timeout};
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout))
+        syslog(LOG_WARNING, "Error setting timeout: %s", strerror(errno));
+
+    struct sockaddr_un remote = {.sun_family=AF_UNIX};
+    strncpy(remote.sun_path, arguments.socket, sizeof remote.sun_path - 1);
+    size_t len = strlen(arguments.command);
+    if (sendto(sock, arguments.command, len, 0,
+               (struct sockaddr *) &remote, sizeof remote) != len) {
+        char *msg = "Error sending command to `%s`: %s";
+        syslog(LOG_ERR, msg, arguments.socket, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    char reply[CONTROL_MAX_LEN + 1];
+    ssize_t n = recv(sock, reply, CONTROL_MAX_LEN, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            syslog(LOG_ERR, "No reply from `%s`", arguments.socket);
+        else
+            syslog(LOG_ERR, "Error receiving reply: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    reply[n] = 0;
+
+    puts(reply);
+    close(sock);
+    return strncmp(reply, "ok", 2) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1221 @@
+/**
+ * Offload the flight logs to a ground store, deduplicated by chunk.
+ *
+ * The files are split into content-defined chunks named by their SHA-256.
+ * For each file the client asks the store which chunks it already has,
+ * sends the missing ones and commits the file as its list of chunks, which
+ * the store assembles. Several files are offloaded in parallel, one
+ * connection each, and the requests of a connection are pipelined up to a
+ * window instead of waiting for each reply.
+ *
+ * The chunk list of each file is kept next to the logs, in `.offload`,
+ * along with the identifier of the store it was committed to, if any: an
+ * interrupted offload starts again without hashing the files anew, skips
+ * the files already committed and sends only the chunks the store has not
+ * acknowledged.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chunker.h"
+#include "sha256.h"
+
+
+/** Default TCP port of the store. */
+#define DEFAULT_PORT 38500
+
+/** Directory of the chunk lists, in each offloaded directory. */
+#define STATE_DIR ".offload"
+
+/** Magic of the chunk list files. */
+#define INDEX_MAGIC "FDAS3IDX"
+
+/** Hashes asked about in a HAVE request. */
+#define HAVE_BATCH 256
+
+/** Largest message accepted, a COMMIT of up to some 4 GB of chunks. */
+#ifndef MAX_MESSAGE_LEN
+#define MAX_MESSAGE_LEN (16 * 1024 * 1024)
+#endif
+
+/** Maximum number of pipelined requests. */
+#define MAX_WINDOW 256
+
+/** Maximum number of parallel offloads. */
+#define MAX_JOBS 32
+
+/** Longest wait before reconnecting, in seconds. */
+#define MAX_BACKOFF 30
+
+/** Request and reply types. */
+enum {
+    MSG_HELLO = 'I', ///< Answered by the store identifier.
+    MSG_HAVE = 'H', ///< Hashes, answered by a bitmap of those stored.
+    MSG_PUT = 'P', ///< Hash and chunk data, answered by a status.
+    MSG_LIST = 'L', ///< Leading hashes of the next COMMIT, not answered.
+    MSG_COMMIT = 'C', ///< Size, path and hashes, answered by a status.
+    MSG_HELLO_REPLY = 'i',
+    MSG_HAVE_REPLY = 'h',
+    MSG_PUT_REPLY = 'p',
+    MSG_COMMIT_REPLY = 'c',
+};
+
+
+/** Program version. */
+const char *argp_program_version = "fdas3-offload 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "fdas3-offload -- Offload the flight logs to a ground "
+    "store, deduplicated by chunk."
+    "\vThe files under each DIR are stored as STORE/files/NAME/PATH, NAME "
+    "being the last component of DIR, from the chunks in STORE/chunks. Only "
+    "the chunks missing from the store are sent, and an interrupted offload "
+    "resumes from the chunk lists kept in DIR/" STATE_DIR ".\n\n"
+    "With --serve, runs the store instead, in the STORE directory.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "HOST DIR...\n--serve=STORE";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"port", 'p', "PORT", 0,
+     "TCP port of the store, defaults to 38500"},
+    {"jobs", 'j', "N", 0, "Files offloaded in parallel, defaults to 4"},
+    {"window", 'w', "N", 0, "Requests in flight per file, defaults to 32"},
+    {"retries", 'r', "N", 0,
+     "Reconnections to the store before giving up on a file, defaults to 10"},
+    {"timeout", 't', "SECONDS", 0,
+     "Time without progress before the link is deemed down, defaults to 30"},
+    {"verbose", 'v', 0, 0, "Print each file offloaded"},
+    {"serve", 's', "STORE", 0, "Run the store in the STORE directory"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char *host;
+    char **dirs;
+    unsigned ndirs;
+    char *store;
+    uint16_t port;
+    unsigned jobs;
+    unsigned window;
+    unsigned retries;
+    unsigned timeout;
+    bool verbose;
+} arguments_t;
+
+/** Chunk list file header, followed by the chunks. */
+typedef struct index_header {
+    char magic[8];
+    uint64_t size; ///< Size of the file when chunked.
+    int64_t mtime_sec; ///< Modification time of the file when chunked.
+    int64_t mtime_nsec;
+    uint64_t nchunks;
+    uint64_t committed; ///< Store that acknowledged the file, or 0.
+} index_header_t;
+
+/** File to offload. */
+typedef struct file {
+    char *path; ///< Local path.
+    char *name; ///< Path in the store.
+    char *index; ///< Path of the chunk list.
+} file_t;
+
+/** Connection to the store, with its pipelined requests. */
+typedef struct connection {
+    int fd;
+    unsigned pending; ///< Requests sent and not answered.
+    uint8_t *reply;
+    size_t reply_cap;
+    uint32_t reply_len;
+} connection_t;
+
+/** Offload shared by the workers. */
+typedef struct offload {
+    const arguments_t *arguments;
+    struct addrinfo *addr;
+    uint64_t store_id;
+    file_t *files;
+    size_t nfiles;
+    size_t next_file; ///< Next file to take, atomic.
+
+    // Totals, atomic
+    uint64_t files_done;
+    uint64_t files_skipped;
+    uint64_t files_failed;
+    uint64_t bytes_total;
+    uint64_t bytes_sent;
+    uint64_t chunks_total;
+    uint64_t chunks_sent;
+} offload_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+/** Files found by the directory walk, see `collect_file`. */
+static file_t *walk_files;
+static size_t walk_nfiles, walk_cap;
+static const char *walk_root, *walk_name;
+
+
+static unsigned long parse_uint(struct argp_state *state, char *arg,
+                                unsigned long max, char *name) {
+    char *endptr = 0;
+    unsigned long value = strtoul(arg, &endptr, 0);
+    if (*endptr)
+        argp_error(state, "%s argument must be an integer.", name);
+    if (value > max)
+        argp_error(state, "%s number too large.", name);
+    return value;
+}
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'p':
+        arguments->port = parse_uint(state, arg, 65535, "PORT");
+        break;
+
+    case 'j':
+        arguments->jobs = parse_uint(state, arg, MAX_JOBS, "N");
+        if (!arguments->jobs)
+            argp_error(state, "At least one job is needed.");
+        break;
+
+    case 'w':
+        arguments->window = parse_uint(state, arg, MAX_WINDOW, "N");
+        if (!arguments->window)
+            argp_error(state, "The window must be at least 1.");
+        break;
+
+    case 'r':
+        arguments->retries = parse_uint(state, arg, UINT_MAX, "N");
+        break;
+
+    case 't':
+        arguments->timeout = parse_uint(state, arg, 3600, "SECONDS");
+        if (!arguments->timeout)
+            argp_error(state, "SECONDS must be positive.");
+        break;
+
+    case 'v':
+        arguments->verbose = true;
+        break;
+
+    case 's':
+        arguments->store = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        if (arguments->store)
+            argp_error(state, "Too many arguments.");
+        if (state->arg_num == 0) {
+            arguments->host = arg;
+        } else {
+            // The remaining arguments are all directories
+            arguments->dirs = &state->argv[state->next - 1];
+            arguments->ndirs = state->argc - state->next + 1;
+            state->next = state->argc;
+        }
+        break;
+
+    case ARGP_KEY_END:
+        if (!arguments->store && !arguments->ndirs)
+            argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Create a directory and its missing parents.
+ * @return 0 if success, -1 if error.
+ */
+static int make_dirs(const char *path) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof dir, "%s", path) >= sizeof dir) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (char *p = dir + 1; ; p++) {
+        if (*p && *p != '/')
+            continue;
+        char c = *p;
+        *p = 0;
+        if (mkdir(dir, 0755) && errno != EEXIST)
+            return -1;
+        if (!c)
+            return 0;
+        *p = c;
+    }
+}
+
+
+/**
+ * Create the parent directories of a file.
+ * @return 0 if success, -1 if error.
+ */
+static int make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof dir, "%s", path) >= sizeof dir) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return make_dirs(dirname(dir));
+}
+
+
+/**
+ * Write a whole buffer to a descriptor.
+ * @return 0 if success, -1 if error.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK)
+            n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR && !stop_requested)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * Read a whole buffer from a descriptor.
+ * @return 0 if success, -1 if error or end of file.
+ */
+static int read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR && !stop_requested)
+            continue;
+        if (n <= 0) {
+            if (!n)
+                errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * Send a message made of two parts, with its length and type header.
+ * @return 0 if success, -1 if error.
+ */
+static int send_message(int fd, uint8_t type, const void *a, size_t alen,
+                        const void *b, size_t blen) {
+    uint8_t header[5];
+    uint32_t len = htole32(alen + blen);
+    memcpy(header, &len, 4);
+    header[4] = type;
+
+    struct iovec iov[3] = {
+        {.iov_base=header, .iov_len=sizeof header},
+        {.iov_base=(void *) a, .iov_len=alen},
+        {.iov_base=(void *) b, .iov_len=blen},
+    };
+    struct msghdr msg = {.msg_iov=iov, .msg_iovlen=3};
+    size_t left = sizeof header + alen + blen;
+    while (left) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR && !stop_requested)
+                continue;
+            return -1;
+        }
+        left -= n;
+
+        // Skip what was sent
+        while (msg.msg_iovlen && n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Receive a message into a growing buffer.
+ * @return 0 if success, -1 if error.
+ */
+static int recv_message(int fd, uint8_t *type, uint8_t **buf, size_t *cap,
+                        uint32_t *len) {
+    uint8_t header[5];
+    if (read_all(fd, header, sizeof header))
+        return -1;
+    memcpy(len, header, 4);
+    *len = le32toh(*len);
+    *type = header[4];
+    if (*len > MAX_MESSAGE_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (*len > *cap) {
+        uint8_t *grown = realloc(*buf, *len);
+        if (!grown)
+            return -1;
+        *buf = grown;
+        *cap = *len;
+    }
+    return read_all(fd, *buf, *len);
+}
+
+
+/**
+ * Set the timeouts and options of a connection.
+ */
+static void setup_socket(int fd, unsigned timeout) {
+    int on = 1;
+    struct timeval tv = {.tv_sec=timeout};
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on)
+        || setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on)
+        || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv)
+        || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv))
+        syslog(LOG_WARNING, "Error setting socket options: %s",
+               strerror(errno));
+}
+
+
+/**
+ * Start a thread with the signals blocked, left to the main thread.
+ * @return 0 if success, -1 if error.
+ */
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int status = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error creating thread: %s", strerror(status));
+        return -1;
+    }
+    return 0;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Store                                                                  */
+/* ---------------------------------------------------------------------- */
+
+
+/** Connection of a client to the store. */
+typedef struct store_client {
+    const char *store;
+    uint64_t id;
+    int fd;
+} store_client_t;
+
+
+/**
+ * Read the identifier of the store, drawing it on creation, so that the
+ * clients tell a store that was replaced from the one they offloaded to.
+ * @return 0 if success, -1 if error.
+ */
+static int store_id(const char *store, uint64_t *id) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/id", store);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        int status = read_all(fd, id, sizeof *id);
+        close(fd);
+        return status;
+    }
+
+    int urandom = open("/dev/urandom", O_RDONLY);
+    *id = 0;
+    while (!*id)
+        if (urandom < 0 || read_all(urandom, id, sizeof *id)) {
+            close(urandom);
+            return -1;
+        }
+    close(urandom);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    int status = fd < 0 ? -1 : write_all(fd, id, sizeof *id);
+    return fd < 0 || close(fd) || status ? -1 : 0;
+}
+
+
+/**
+ * Path of a chunk in the store.
+ */
+static void chunk_path(const char *store, const uint8_t *hash,
+                       char path[PATH_MAX]) {
+    char hex[2*SHA256_LEN + 1];
+    sha256_hex(hash, hex);
+    snprintf(path, PATH_MAX, "%s/chunks/%.2s/%s", store, hex, hex);
+}
+
+
+/**
+ * Whether a path sent by a client stays inside the store.
+ */
+static bool valid_name(const char *name) {
+    if (!*name || *name == '/')
+        return false;
+    for (const char *p = name; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (!len || (len == 1 && p[0] == '.')
+            || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        p += len;
+        if (*p)
+            p++;
+    }
+    return true;
+}
+
+
+/**
+ * Store a chunk, after checking its hash.
+ * @return 0 if success, -1 if error.
+ */
+static int store_put(const char *store, const uint8_t *msg, uint32_t len) {
+    if (len < SHA256_LEN)
+        return -1;
+    uint8_t hash[SHA256_LEN];
+    sha256(msg + SHA256_LEN, len - SHA256_LEN, hash);
+    if (memcmp(hash, msg, SHA256_LEN)) {
+        syslog(LOG_WARNING, "Chunk received with a wrong hash");
+        return -1;
+    }
+
+    // Written aside and renamed, the chunks in the store are always whole
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    chunk_path(store, hash, path);
+    if (!access(path, F_OK))
+        return 0;
+    snprintf(tmp, sizeof tmp, "%s.%lx.tmp", path, (long) pthread_self());
+    if (make_parent_dirs(path))
+        return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    int status = write_all(fd, msg + SHA256_LEN, len - SHA256_LEN);
+    status = fsync(fd) || status ? -1 : 0;
+    status = close(fd) || status ? -1 : rename(tmp, path);
+    if (status) {
+        syslog(LOG_ERR, "Error storing chunk `%s`: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+    return status;
+}
+
+
+/**
+ * Assemble a committed file from its chunks.
+ * @param list hashes of the leading chunks, received in LIST messages.
+ * @return 0 if success, -1 if error.
+ */
+static int store_commit(const char *store, const uint8_t *msg, uint32_t len,
+                        const uint8_t *list, size_t nlisted) {
+    if (len < 10)
+        return -1;
+    uint64_t size;
+    uint16_t namelen;
+    memcpy(&size, msg, 8);
+    memcpy(&namelen, msg + 8, 2);
+    size = le64toh(size);
+    namelen = le16toh(namelen);
+    if (len < 10 + namelen || (len - 10 - namelen) % SHA256_LEN)
+        return -1;
+    char name[PATH_MAX];
+    if (namelen >= sizeof name)
+        return -1;
+    memcpy(name, msg + 10, namelen);
+    name[namelen] = 0;
+    if (!valid_name(name)) {
+        syslog(LOG_WARNING, "Commit of an invalid path `%s`", name);
+        return -1;
+    }
+
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    if (snprintf(path, sizeof path, "%s/files/%s", store, name) >= sizeof path)
+        return -1;
+    snprintf(tmp, sizeof tmp, "%s.%lx.tmp", path, (long) pthread_self());
+    if (make_parent_dirs(path))
+        return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    size_t nchunks = nlisted + (len - 10 - namelen) / SHA256_LEN;
+    uint64_t written = 0;
+    int status = 0;
+    uint8_t *buf = malloc(CHUNKER_MAX_LEN);
+    for (size_t i=0; i<nchunks && buf && !status; i++) {
+        const uint8_t *hash = i < nlisted ? list + i*SHA256_LEN
+            : msg + 10 + namelen + (i - nlisted)*SHA256_LEN;
+        char chunk[PATH_MAX];
+        chunk_path(store, hash, chunk);
+        int in = open(chunk, O_RDONLY);
+        ssize_t n = in < 0 ? -1 : read(in, buf, CHUNKER_MAX_LEN);
+        if (in >= 0)
+            close(in);
+        if (n < 0 || write_all(fd, buf, n)) {
+            syslog(LOG_ERR, "Error copying chunk `%s` to `%s`: %s",
+                   chunk, path, strerror(errno));
+            status = -1;
+        }
+        written += n;
+    }
+    if (!buf || written != size)
+        status = -1;
+    free(buf);
+
+    if (fsync(fd) || close(fd) || status || rename(tmp, path)) {
+        if (!status)
+            syslog(LOG_ERR, "Error writing `%s`: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Serve the requests of a client until it disconnects.
+ */
+static void *store_thread(void *arg) {
+    store_client_t *client = arg;
+    uint8_t *msg = NULL, *list = NULL;
+    size_t cap = 0, listed = 0;
+    uint32_t len;
+    uint8_t type;
+    while (!recv_message(client->fd, &type, &msg, &cap, &len)) {
+        int status;
+        if (type == MSG_HELLO) {
+            uint64_t id = htole64(client->id);
+            status = send_message(client->fd, MSG_HELLO_REPLY,
+                                  &id, sizeof id, NULL, 0);
+        } else if (type == MSG_HAVE && len % SHA256_LEN == 0) {
+            uint8_t bitmap[(HAVE_BATCH + 7) / 8];
+            size_t n = len / SHA256_LEN;
+            if (n > HAVE_BATCH)
+                break;
+            memset(bitmap, 0, (n + 7) / 8);
+            for (size_t i=0; i<n; i++) {
+                char path[PATH_MAX];
+                chunk_path(client->store, msg + i*SHA256_LEN, path);
+                if (!access(path, F_OK))
+                    bitmap[i / 8] |= 1 << i % 8;
+            }
+            status = send_message(client->fd, MSG_HAVE_REPLY,
+                                  bitmap, (n + 7) / 8, NULL, 0);
+        } else if (type == MSG_PUT) {
+            uint8_t ok = !store_put(client->store, msg, len);
+            status = send_message(client->fd, MSG_PUT_REPLY, &ok, 1, NULL, 0);
+        } else if (type == MSG_LIST && len % SHA256_LEN == 0) {
+            uint8_t *grown = realloc(list, listed + len);
+            if (!grown)
+                break;
+            list = grown;
+            memcpy(list + listed, msg, len);
+            listed += len;
+            continue;
+        } else if (type == MSG_COMMIT) {
+            uint8_t ok = !store_commit(client->store, msg, len, list,
+                                       listed / SHA256_LEN);
+            listed = 0;
+            status = send_message(client->fd, MSG_COMMIT_REPLY, &ok, 1,
+                                  NULL, 0);
+        } else {
+            syslog(LOG_WARNING, "Unknown request `%c`", type);
+            break;
+        }
+        if (status)
+            break;
+    }
+
+    close(client->fd);
+    free(msg);
+    free(list);
+    free(client);
+    return NULL;
+}
+
+
+/**
+ * Run the store, accepting clients until terminated.
+ */
+static int serve(const arguments_t *arguments) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof dir, "%s/chunks", arguments->store);
+    uint64_t id;
+    if (make_dirs(dir) || store_id(arguments->store, &id)) {
+        syslog(LOG_ERR, "Error creating store `%s`: %s", arguments->store,
+               strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_INET6, SOCK_STREAM, 0);
+    int on = 1, off = 0;
+    struct sockaddr_in6 addr = {
+        .sin6_family=AF_INET6, .sin6_port=htons(arguments->port),
+        .sin6_addr=in6addr_any,
+    };
+    if (sock < 0
+        || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on)
+        || setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off)
+        || bind(sock, (struct sockaddr *) &addr, sizeof addr)
+        || listen(sock, 16)) {
+        syslog(LOG_ERR, "Error listening on port %u: %s", arguments->port,
+               strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    while (!stop_requested) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR)
+                syslog(LOG_ERR, "Error accepting client: %s", strerror(errno));
+            continue;
+        }
+        setup_socket(fd, arguments->timeout);
+
+        store_client_t *client = malloc(sizeof *client);
+        pthread_t thread;
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        *client = (store_client_t) {
+            .store=arguments->store, .id=id, .fd=fd};
+        if (start_thread(&thread, store_thread, client)) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(sock);
+    return EXIT_SUCCESS;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Client                                                                 */
+/* ---------------------------------------------------------------------- */
+
+
+/**
+ * Add a regular file of the walked directory to the offload, nftw callback.
+ */
+static int collect_file(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+    const char *rel = path + strlen(walk_root);
+    while (*rel == '/')
+        rel++;
+    if (!strncmp(rel, STATE_DIR, strlen(STATE_DIR))
+        && (!rel[strlen(STATE_DIR)] || rel[strlen(STATE_DIR)] == '/'))
+        return 0;
+    if (flag != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    if (walk_nfiles == walk_cap) {
+        walk_cap = walk_cap ? 2 * walk_cap : 64;
+        walk_files = realloc(walk_files, walk_cap * sizeof *walk_files);
+        if (!walk_files)
+            return -1;
+    }
+    file_t *file = &walk_files[walk_nfiles++];
+    if (asprintf(&file->path, "%s", path) < 0
+        || asprintf(&file->name, "%s/%s", walk_name, rel) < 0
+        || asprintf(&file->index, "%s/%s/%s.idx", walk_root, STATE_DIR,
+                    rel) < 0)
+        return -1;
+    return 0;
+}
+
+
+/**
+ * Load the chunk list of a file if still valid, or chunk the file anew.
+ * @return 0 if success, -1 if error.
+ */
+static int load_chunks(const file_t *file, int fd, index_header_t *header,
+                       chunk_t **chunks) {
+    struct stat st;
+    if (fstat(fd, &st))
+        return -1;
+
+    int index = open(file->index, O_RDONLY);
+    if (index >= 0) {
+        bool valid = !read_all(index, header, sizeof *header)
+            && !memcmp(header->magic, INDEX_MAGIC, sizeof header->magic)
+            && header->size == st.st_size
+            && header->mtime_sec == st.st_mtim.tv_sec
+            && header->mtime_nsec == st.st_mtim.tv_nsec
+            && header->nchunks <= SIZE_MAX / sizeof **chunks
+            && (*chunks = malloc(header->nchunks * sizeof **chunks + 1))
+            && !read_all(index, *chunks, header->nchunks * sizeof **chunks);
+        close(index);
+        if (valid)
+            return 0;
+        free(*chunks);
+        *chunks = NULL;
+    }
+
+    size_t nchunks;
+    if (chunker_file(fd, chunks, &nchunks))
+        return -1;
+    *header = (index_header_t) {
+        .magic=INDEX_MAGIC, .size=st.st_size, .mtime_sec=st.st_mtim.tv_sec,
+        .mtime_nsec=st.st_mtim.tv_nsec, .nchunks=nchunks,
+    };
+
+    // Saved aside and renamed, a list is never seen half written
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof tmp, "%s.tmp", file->index);
+    if (make_parent_dirs(tmp)
+        || (index = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        syslog(LOG_WARNING, "Error saving chunk list `%s`: %s", file->index,
+               strerror(errno));
+        return 0;
+    }
+    int status = write_all(index, header, sizeof *header)
+        || write_all(index, *chunks, nchunks * sizeof **chunks);
+    if (close(index) || status || rename(tmp, file->index)) {
+        syslog(LOG_WARNING, "Error saving chunk list `%s`: %s", file->index,
+               strerror(errno));
+        unlink(tmp);
+    }
+    return 0;
+}
+
+
+/**
+ * Record in its chunk list the store a file was committed to.
+ */
+static void mark_committed(const file_t *file, uint64_t store_id) {
+    int index = open(file->index, O_WRONLY);
+    off_t offset = offsetof(index_header_t, committed);
+    if (index < 0 || pwrite(index, &store_id, 8, offset) != 8)
+        syslog(LOG_WARNING, "Error updating chunk list `%s`: %s",
+               file->index, strerror(errno));
+    if (index >= 0)
+        close(index);
+}
+
+
+/**
+ * Wait for the reply to the oldest pipelined request.
+ * @return 0 if success, -1 if error.
+ */
+static int await_reply(connection_t *conn, uint8_t expected) {
+    uint8_t type;
+    if (recv_message(conn->fd, &type, &conn->reply, &conn->reply_cap,
+                     &conn->reply_len))
+        return -1;
+    conn->pending--;
+    if (type != expected || !conn->reply_len) {
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Connect to the store and get its identifier.
+ * @return 0 if success, -1 if error.
+ */
+static int connect_store(offload_t *offload, connection_t *conn,
+                         uint64_t *store_id) {
+    for (struct addrinfo *ai = offload->addr; ai; ai = ai->ai_next) {
+        conn->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (conn->fd < 0)
+            continue;
+        setup_socket(conn->fd, offload->arguments->timeout);
+        conn->pending = 0;
+        if (!connect(conn->fd, ai->ai_addr, ai->ai_addrlen)
+            && !send_message(conn->fd, MSG_HELLO, NULL, 0, NULL, 0)
+            && ++conn->pending && !await_reply(conn, MSG_HELLO_REPLY)
+            && conn->reply_len == sizeof *store_id) {
+            memcpy(store_id, conn->reply, sizeof *store_id);
+            *store_id = le64toh(*store_id);
+            return 0;
+        }
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    return -1;
+}
+
+
+/** Order of the indices into the chunks `arg` by hash, then by position. */
+static int compare_chunks(const void *a, const void *b, void *arg) {
+    const chunk_t *chunks = arg;
+    size_t i = *(const size_t *) a, j = *(const size_t *) b;
+    int c = memcmp(chunks[i].hash, chunks[j].hash, SHA256_LEN);
+    return c ? c : (i > j) - (i < j);
+}
+
+
+/**
+ * Offload a file over a connection.
+ * @param missing scratch flags, one per chunk.
+ * @return 0 if success, -1 if error.
+ */
+static int offload_file(offload_t *offload, connection_t *conn,
+                        const file_t *file, int fd, chunk_t *chunks,
+                        size_t nchunks, uint64_t size, bool *missing) {
+    unsigned window = offload->arguments->window;
+
+    // Ask which chunks the store has, a batch per request
+    size_t nbatches = (nchunks + HAVE_BATCH - 1) / HAVE_BATCH, answered = 0;
+    for (size_t b=0; b<nbatches || conn->pending; ) {
+        if (b < nbatches && conn->pending < window) {
+            uint8_t hashes[HAVE_BATCH * SHA256_LEN];
+            size_t n = 0;
+            for (size_t i=b*HAVE_BATCH; i<nchunks && n<HAVE_BATCH; i++, n++)
+                memcpy(hashes + n*SHA256_LEN, chunks[i].hash, SHA256_LEN);
+            if (send_message(conn->fd, MSG_HAVE, hashes, n * SHA256_LEN,
+                             NULL, 0))
+                return -1;
+            conn->pending++;
+            b++;
+            continue;
+        }
+        if (await_reply(conn, MSG_HAVE_REPLY))
+            return -1;
+        size_t first = answered++ * HAVE_BATCH;
+        for (size_t i=first; i<nchunks && i<first + HAVE_BATCH; i++) {
+            size_t bit = i - first;
+            missing[i] = bit / 8 >= conn->reply_len
+                || !(conn->reply[bit / 8] & 1 << bit % 8);
+        }
+    }
+
+    // Send each missing chunk once, repeated ones included
+    size_t *order = malloc(nchunks * sizeof *order + 1);
+    if (!order)
+        return -1;
+    for (size_t i=0; i<nchunks; i++)
+        order[i] = i;
+    qsort_r(order, nchunks, sizeof *order, compare_chunks, chunks);
+    for (size_t k=1; k<nchunks; k++)
+        if (!memcmp(chunks[order[k]].hash, chunks[order[k-1]].hash,
+                    SHA256_LEN))
+            missing[order[k]] = false;
+    free(order);
+
+    uint8_t *buf = malloc(CHUNKER_MAX_LEN);
+    if (!buf)
+        return -1;
+    int status = 0;
+    for (size_t i=0; (i<nchunks || conn->pending) && !status; ) {
+        if (stop_requested) {
+            errno = EINTR;
+            status = -1;
+        } else if (i < nchunks && !missing[i]) {
+            i++;
+        } else if (i < nchunks && conn->pending < window) {
+            chunk_t *chunk = &chunks[i++];
+            if (pread(fd, buf, chunk->len, chunk->offset) != chunk->len
+                || send_message(conn->fd, MSG_PUT, chunk->hash, SHA256_LEN,
+                                buf, chunk->len))
+                status = -1;
+            conn->pending++;
+            __atomic_add_fetch(&offload->chunks_sent, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&offload->bytes_sent, chunk->len,
+                               __ATOMIC_RELAXED);
+        } else if (await_reply(conn, MSG_PUT_REPLY)) {
+            status = -1;
+        } else if (!conn->reply[0]) {
+            errno = EIO;
+            status = -1;
+        }
+    }
+    free(buf);
+    if (status)
+        return -1;
+
+    // Commit the file as its list of chunks, the hashes that do not fit in
+    // the message going ahead in LIST messages
+    size_t namelen = strlen(file->name);
+    size_t batch = (MAX_MESSAGE_LEN - 10 - namelen) / SHA256_LEN;
+    uint8_t *commit = malloc(10 + namelen
+                             + (nchunks < batch ? nchunks : batch)*SHA256_LEN);
+    if (!commit)
+        return -1;
+    size_t i = 0;
+    while (nchunks - i > batch && !status) {
+        for (size_t n=0; n<batch; n++, i++)
+            memcpy(commit + n*SHA256_LEN, chunks[i].hash, SHA256_LEN);
+        status = send_message(conn->fd, MSG_LIST, commit, batch * SHA256_LEN,
+                              NULL, 0);
+    }
+    uint64_t size_le = htole64(size);
+    uint16_t namelen_le = htole16(namelen);
+    memcpy(commit, &size_le, 8);
+    memcpy(commit + 8, &namelen_le, 2);
+    memcpy(commit + 10, file->name, namelen);
+    size_t len = 10 + namelen;
+    for (; i<nchunks; i++, len+=SHA256_LEN)
+        memcpy(commit + len, chunks[i].hash, SHA256_LEN);
+    if (!status)
+        status = send_message(conn->fd, MSG_COMMIT, commit, len, NULL, 0);
+    free(commit);
+    if (status)
+        return -1;
+    conn->pending++;
+    if (await_reply(conn, MSG_COMMIT_REPLY))
+        return -1;
+    if (!conn->reply[0]) {
+        syslog(LOG_ERR, "Store refused `%s`", file->name);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Offload files until none is left.
+ */
+static void *offload_thread(void *arg) {
+    offload_t *offload = arg;
+    const arguments_t *arguments = offload->arguments;
+    connection_t conn = {.fd=-1};
+    uint64_t store_id = 0;
+
+    while (!stop_requested) {
+        size_t f = __atomic_fetch_add(&offload->next_file, 1,
+                                      __ATOMIC_RELAXED);
+        if (f >= offload->nfiles)
+            break;
+        const file_t *file = &offload->files[f];
+
+        int fd = open(file->path, O_RDONLY);
+        index_header_t header;
+        chunk_t *chunks = NULL;
+        if (fd < 0 || load_chunks(file, fd, &header, &chunks)) {
+            syslog(LOG_ERR, "Error reading `%s`: %s", file->path,
+                   strerror(errno));
+            __atomic_add_fetch(&offload->files_failed, 1, __ATOMIC_RELAXED);
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        __atomic_add_fetch(&offload->bytes_total, header.size,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&offload->chunks_total, header.nchunks,
+                           __ATOMIC_RELAXED);
+        if (header.committed == offload->store_id) {
+            __atomic_add_fetch(&offload->files_skipped, 1, __ATOMIC_RELAXED);
+            close(fd);
+            free(chunks);
+            continue;
+        }
+
+        // Reconnect with a growing backoff until done or out of retries
+        bool *missing = malloc(header.nchunks + 1);
+        int status = missing ? -1 : -2;
+        for (unsigned attempt=0, backoff=1;
+             status == -1 && attempt <= arguments->retries && !stop_requested;
+             attempt++) {
+            if (conn.fd < 0 && connect_store(offload, &conn, &store_id)) {
+                syslog(LOG_WARNING, "Error connecting to `%s`: %s",
+                       arguments->host, strerror(errno));
+            } else if (offload_file(offload, &conn, file, fd, chunks,
+                                    header.nchunks, header.size, missing)) {
+                if (!stop_requested)
+                    syslog(LOG_WARNING, "Error offloading `%s`: %s",
+                           file->path, strerror(errno));
+                close(conn.fd);
+                conn.fd = -1;
+            } else {
+                status = 0;
+                break;
+            }
+            if (attempt < arguments->retries && !stop_requested) {
+                sleep(backoff);
+                backoff = backoff * 2 > MAX_BACKOFF ? MAX_BACKOFF : backoff * 2;
+            }
+        }
+
+        if (status) {
+            __atomic_add_fetch(&offload->files_failed, 1, __ATOMIC_RELAXED);
+        } else {
+            mark_committed(file, store_id);
+            __atomic_add_fetch(&offload->files_done, 1, __ATOMIC_RELAXED);
+            if (arguments->verbose)
+                printf("%s\n", file->name);
+        }
+        free(missing);
+        free(chunks);
+        close(fd);
+    }
+
+    if (conn.fd >= 0)
+        close(conn.fd);
+    free(conn.reply);
+    return NULL;
+}
+
+
+/**
+ * Offload the directories given.
+ */
+static int offload(const arguments_t *arguments) {
+    // Gather the files of every directory
+    for (unsigned d=0; d<arguments->ndirs; d++) {
+        char root[PATH_MAX];
+        snprintf(root, sizeof root, "%s", arguments->dirs[d]);
+        size_t len = strlen(root);
+        while (len > 1 && root[len - 1] == '/')
+            root[--len] = 0;
+        walk_root = root;
+        walk_name = basename(root);
+        if (nftw(root, collect_file, 16, FTW_PHYS)) {
+            syslog(LOG_ERR, "Error listing `%s`: %s", root, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    char port[8];
+    snprintf(port, sizeof port, "%u", arguments->port);
+    struct addrinfo hints = {.ai_socktype=SOCK_STREAM}, *addr;
+    int err = getaddrinfo(arguments->host, port, &hints, &addr);
+    if (err) {
+        syslog(LOG_ERR, "Error resolving `%s`: %s", arguments->host,
+               gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    offload_t offload = {
+        .arguments=arguments, .addr=addr, .files=walk_files,
+        .nfiles=walk_nfiles,
+    };
+
+    // The store identifier tells the files already committed to it
+    connection_t conn = {.fd=-1};
+    for (unsigned attempt=0;
+         connect_store(&offload, &conn, &offload.store_id); attempt++) {
+        if (attempt >= arguments->retries || stop_requested) {
+            syslog(LOG_ERR, "Error connecting to `%s`: %s", arguments->host,
+                   strerror(errno));
+            freeaddrinfo(addr);
+            return EXIT_FAILURE;
+        }
+        sleep(1);
+    }
+    close(conn.fd);
+    free(conn.reply);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[MAX_JOBS];
+    unsigned nthreads = 0;
+    for (; nthreads < arguments->jobs; nthreads++)
+        if (start_thread(&threads[nthreads], offload_thread, &offload))
+            break;
+    for (unsigned i=0; i<nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = end.tv_sec - start.tv_sec
+        + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("%llu files offloaded, %llu already, %llu failed; "
+           "%llu of %llu chunks sent, %llu of %llu bytes, in %.1f s\n",
+           (unsigned long long) offload.files_done,
+           (unsigned long long) offload.files_skipped,
+           (unsigned long long) offload.files_failed,
+           (unsigned long long) offload.chunks_sent,
+           (unsigned long long) offload.chunks_total,
+           (unsigned long long) offload.bytes_sent,
+           (unsigned long long) offload.bytes_total, elapsed);
+
+    freeaddrinfo(addr);
+    bool complete = offload.files_done + offload.files_skipped
+        == offload.nfiles;
+    return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {
+        .port=DEFAULT_PORT, .jobs=4, .window=32, .retries=10, .timeout=30,
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    // Stop between requests, the chunk lists are then left consistent
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (arguments.store)
+        return serve(&arguments);
+    return offload(&arguments);
+}
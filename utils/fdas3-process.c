@@ -0,0 +1,983 @@
+/**
+ * Incremental and parallel post-flight processing of a log directory.
+ *
+ * The pipeline file lists the processing stages, each a shell command with
+ * its input and output files. Stages whose inputs are produced by others
+ * run after them, independent ones run concurrently. A stage with a `%`
+ * in its inputs runs once per matching file, so that a new log segment
+ * adds jobs rather than redoing the whole stage.
+ *
+ * A job is skipped when its key, a hash of the stage version and command
+ * and of the contents of its inputs, matches the stamp of its last
+ * successful run and its outputs are as that run left them. The hashes of
+ * the inputs are cached by size, modification time and inode, so that
+ * unchanged logs are not read again.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+/** Directory of the stamps and hash cache, inside the log directory. */
+#define STATE_DIR ".fdas3-process"
+
+/** Length of the blocks read for hashing. */
+#define HASH_BLOCK (1024 * 1024)
+
+/** Installed default pipeline. */
+#ifndef FDAS3_PIPELINE
+#define FDAS3_PIPELINE "/usr/local/share/fdas3/postflight.pipeline"
+#endif
+
+
+/** Program version. */
+const char *argp_program_version = "fdas3-process 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "fdas3-process -- Run the post-flight processing "
+    "pipeline over a log directory."
+    "\vThe pipeline is LOGDIR/pipeline if present, else " FDAS3_PIPELINE ". "
+    "Each stage is a header line followed by indented command lines:\n\n"
+    "  NAME VERSION: INPUT... -> OUTPUT...\n"
+    "      shell command using $in, $out and $stem\n\n"
+    "Commands run in LOGDIR. A `%` in the first input that has one makes a "
+    "job per matching file, `%` standing for the same stem in the other "
+    "inputs and outputs; inputs with * ? or [ are globs. Jobs whose inputs, "
+    "command and VERSION are unchanged since their last successful run are "
+    "not run again.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "LOGDIR";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"pipeline", 'p', "FILE", 0, "Pipeline file"},
+    {"jobs", 'j', "N", 0, "Number of concurrent jobs, defaults to the number "
+     "of processors"},
+    {"dry-run", 'n', 0, 0, "Print the jobs that would run without running "
+     "them"},
+    {"force", 'B', 0, 0, "Run all jobs regardless of their stamps"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char *logdir;
+    char *pipeline;
+    unsigned jobs;
+    bool dry_run;
+    bool force;
+} arguments_t;
+
+/** Growable list of strings. */
+typedef struct strlist {
+    char **items;
+    unsigned n;
+    unsigned capacity;
+} strlist_t;
+
+/** Stage of the pipeline file. */
+typedef struct stage {
+    char *name;
+    char *version;
+    strlist_t inputs;
+    strlist_t outputs;
+    char *command;
+    unsigned line;
+} stage_t;
+
+/** Job states. */
+typedef enum {
+    JOB_PENDING,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_SKIPPED,
+} job_state_t;
+
+/** Instance of a stage. */
+typedef struct job {
+    const stage_t *stage;
+    char *label;
+    char *stem;
+    strlist_t inputs;
+    strlist_t outputs;
+    job_state_t state;
+    bool ran; ///< Run, or would be in a dry run.
+    pid_t pid;
+    uint64_t key;
+} job_t;
+
+/** Cached content hash of a file. */
+typedef struct file_hash {
+    char *path;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t ino;
+    uint64_t hash;
+} file_hash_t;
+
+/** Runner state. */
+typedef struct runner {
+    const arguments_t *args;
+    stage_t *stages;
+    unsigned nstages;
+    job_t *jobs;
+    unsigned njobs;
+    file_hash_t *hashes;
+    unsigned nhashes;
+    unsigned hash_capacity;
+} runner_t;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'p':
+        arguments->pipeline = arg;
+        break;
+
+    case 'j':
+        {
+            char *endptr = 0;
+            unsigned long jobs = strtoul(arg, &endptr, 0);
+            if (*endptr || !jobs || jobs > 1024)
+                argp_error(state, "N must be an integer from 1 to 1024.");
+            arguments->jobs = jobs;
+        }
+        break;
+
+    case 'n':
+        arguments->dry_run = true;
+        break;
+
+    case 'B':
+        arguments->force = true;
+        break;
+
+    case ARGP_KEY_ARG:
+        if (state->arg_num >= 1)
+            argp_error(state, "Too many arguments.");
+        arguments->logdir = arg;
+        break;
+
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+/**
+ * Copy a string, aborting the program if out of memory.
+ */
+static char* xstrdup(const char *s) {
+    char *copy = strdup(s);
+    if (!copy) {
+        syslog(LOG_ERR, "Error allocating memory: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+
+/**
+ * Grow an array to hold one more element.
+ * Aborts the program if out of memory.
+ */
+static void reserve(void **array, unsigned *capacity, unsigned count,
+                    size_t size) {
+    if (count < *capacity)
+        return;
+
+    unsigned new_capacity = *capacity ? 2 * *capacity : 16;
+    void *grown = realloc(*array, new_capacity * size);
+    if (!grown) {
+        syslog(LOG_ERR, "Error allocating memory: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    *array = grown;
+    *capacity = new_capacity;
+}
+
+
+/**
+ * Append a copy of a string to a list, unless already in it.
+ */
+static void strlist_add(strlist_t *list, const char *s) {
+    for (unsigned i=0; i<list->n; i++)
+        if (!strcmp(list->items[i], s))
+            return;
+
+    reserve((void **) &list->items, &list->capacity, list->n,
+            sizeof *list->items);
+    list->items[list->n++] = xstrdup(s);
+}
+
+
+/**
+ * Join the items of a list with spaces into a new string.
+ */
+static char* strlist_join(const strlist_t *list) {
+    size_t len = 1;
+    for (unsigned i=0; i<list->n; i++)
+        len += strlen(list->items[i]) + 1;
+
+    char *joined = malloc(len);
+    if (!joined) {
+        syslog(LOG_ERR, "Error allocating memory: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    joined[0] = 0;
+    for (unsigned i=0; i<list->n; i++) {
+        if (i)
+            strcat(joined, " ");
+        strcat(joined, list->items[i]);
+    }
+    return joined;
+}
+
+
+/**
+ * Parse the header line of a stage: NAME VERSION: INPUT... -> OUTPUT...
+ * @return 0 if success, -1 if malformed.
+ */
+static int parse_header(char *line, stage_t *stage) {
+    char *colon = strchr(line, ':');
+    if (!colon)
+        return -1;
+    *colon = 0;
+
+    char *save;
+    char *name = strtok_r(line, " \t", &save);
+    char *version = strtok_r(NULL, " \t", &save);
+    if (!name || !version || strtok_r(NULL, " \t", &save))
+        return -1;
+    stage->name = xstrdup(name);
+    stage->version = xstrdup(version);
+
+    bool outputs = false;
+    for (char *word = strtok_r(colon + 1, " \t\n", &save); word;
+         word = strtok_r(NULL, " \t\n", &save)) {
+        if (!strcmp(word, "->")) {
+            if (outputs)
+                return -1;
+            outputs = true;
+        } else {
+            strlist_add(outputs ? &stage->outputs : &stage->inputs, word);
+        }
+    }
+    return outputs && stage->outputs.n ? 0 : -1;
+}
+
+
+/**
+ * Read the pipeline file.
+ * Aborts the program on error.
+ */
+static void read_pipeline(runner_t *run, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        syslog(LOG_ERR, "Error opening pipeline `%s`: %s", path,
+               strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned capacity = 0;
+    stage_t *stage = NULL;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    unsigned lineno = 0;
+    while (getline(&line, &line_capacity, file) >= 0) {
+        lineno++;
+        char *text = line;
+        while (isspace((unsigned char) *text))
+            text++;
+        if (!*text || *text == '#')
+            continue;
+
+        // Indented lines are the command of the current stage
+        if (text != line) {
+            if (!stage) {
+                syslog(LOG_ERR, "%s:%u: command outside of a stage", path,
+                       lineno);
+                exit(EXIT_FAILURE);
+            }
+            size_t used = stage->command ? strlen(stage->command) : 0;
+            char *command = realloc(stage->command, used + strlen(text) + 1);
+            if (!command) {
+                syslog(LOG_ERR, "Error allocating memory: %s",
+                       strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            strcpy(command + used, text);
+            stage->command = command;
+            continue;
+        }
+
+        reserve((void **) &run->stages, &capacity, run->nstages,
+                sizeof *run->stages);
+        stage = &run->stages[run->nstages++];
+        memset(stage, 0, sizeof *stage);
+        stage->line = lineno;
+        if (parse_header(line, stage)) {
+            syslog(LOG_ERR, "%s:%u: expected `NAME VERSION: INPUT... -> "
+                   "OUTPUT...`", path, lineno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ferror(file)) {
+        syslog(LOG_ERR, "Error reading pipeline `%s`: %s", path,
+               strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(line);
+    fclose(file);
+
+    for (unsigned i=0; i<run->nstages; i++)
+        if (!run->stages[i].command) {
+            syslog(LOG_ERR, "%s:%u: stage `%s` has no command", path,
+                   run->stages[i].line, run->stages[i].name);
+            exit(EXIT_FAILURE);
+        }
+}
+
+
+/**
+ * Replace the `%` of a pattern by a stem into a new string.
+ */
+static char* substitute(const char *pattern, const char *stem) {
+    const char *percent = strchr(pattern, '%');
+    if (!percent || !stem)
+        return xstrdup(pattern);
+
+    char *s;
+    if (asprintf(&s, "%.*s%s%s", (int) (percent - pattern), pattern, stem,
+                 percent + 1) < 0) {
+        syslog(LOG_ERR, "Error allocating memory: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+
+/**
+ * Match a path against a `%` pattern.
+ * @return the stem or NULL if not matching.
+ */
+static char* match_stem(const char *pattern, const char *path) {
+    const char *percent = strchr(pattern, '%');
+    size_t prefix = percent - pattern;
+    size_t suffix = strlen(percent + 1);
+    size_t len = strlen(path);
+    if (len <= prefix + suffix || strncmp(path, pattern, prefix)
+        || strcmp(path + len - suffix, percent + 1))
+        return NULL;
+
+    char *stem = xstrdup(path + prefix);
+    stem[len - prefix - suffix] = 0;
+    return strchr(stem, '/') ? (free(stem), NULL) : stem;
+}
+
+
+/**
+ * Find the job producing a file.
+ * @return the job index or -1 if none, the file being a source.
+ */
+static int find_producer(const runner_t *run, const char *path) {
+    for (unsigned i=0; i<run->njobs; i++)
+        for (unsigned j=0; j<run->jobs[i].outputs.n; j++)
+            if (!strcmp(run->jobs[i].outputs.items[j], path))
+                return i;
+    return -1;
+}
+
+
+/** Order of strings, for qsort. */
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/**
+ * Add the files matching a glob, existing or to be produced, to a list.
+ * The matches are sorted, so that the job key does not depend on whether
+ * they were found on disk or among the outputs.
+ */
+static void add_glob(const runner_t *run, const char *pattern,
+                     strlist_t *list) {
+    strlist_t matches = {0};
+    glob_t g;
+    if (!glob(pattern, 0, NULL, &g)) {
+        for (size_t i=0; i<g.gl_pathc; i++)
+            strlist_add(&matches, g.gl_pathv[i]);
+        globfree(&g);
+    }
+
+    for (unsigned i=0; i<run->njobs; i++)
+        for (unsigned j=0; j<run->jobs[i].outputs.n; j++)
+            if (!fnmatch(pattern, run->jobs[i].outputs.items[j], FNM_PATHNAME))
+                strlist_add(&matches, run->jobs[i].outputs.items[j]);
+
+    qsort(matches.items, matches.n, sizeof *matches.items, compare_strings);
+    for (unsigned i=0; i<matches.n; i++) {
+        strlist_add(list, matches.items[i]);
+        free(matches.items[i]);
+    }
+    free(matches.items);
+}
+
+
+/**
+ * Create a job of a stage.
+ * @param stem substituted for `%`, NULL for stages without pattern.
+ */
+static void add_job(runner_t *run, unsigned *capacity, const stage_t *stage,
+                    const char *stem) {
+    job_t job = {.stage=stage, .state=JOB_PENDING};
+    if (stem) {
+        job.stem = xstrdup(stem);
+        if (asprintf(&job.label, "%s[%s]", stage->name, stem) < 0)
+            job.label = NULL;
+    } else {
+        job.label = strdup(stage->name);
+    }
+    if (!job.label) {
+        syslog(LOG_ERR, "Error allocating memory: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned i=0; i<stage->inputs.n; i++) {
+        char *input = substitute(stage->inputs.items[i], stem);
+        if (strpbrk(input, "*?["))
+            add_glob(run, input, &job.inputs);
+        else
+            strlist_add(&job.inputs, input);
+        free(input);
+    }
+    for (unsigned i=0; i<stage->outputs.n; i++) {
+        char *output = substitute(stage->outputs.items[i], stem);
+        int producer = find_producer(run, output);
+        if (producer >= 0) {
+            syslog(LOG_ERR, "Output `%s` of `%s` already produced by `%s`",
+                   output, job.label, run->jobs[producer].label);
+            exit(EXIT_FAILURE);
+        }
+        strlist_add(&job.outputs, output);
+        free(output);
+    }
+
+    reserve((void **) &run->jobs, capacity, run->njobs, sizeof *run->jobs);
+    run->jobs[run->njobs++] = job;
+}
+
+
+/**
+ * Create the jobs of all stages, in pipeline order.
+ *
+ * The files matched by a `%` pattern are those in the log directory and
+ * the outputs of the jobs of the previous stages.
+ */
+static void expand_stages(runner_t *run) {
+    unsigned capacity = 0;
+
+    for (unsigned i=0; i<run->nstages; i++) {
+        const stage_t *stage = &run->stages[i];
+        const char *pattern = NULL;
+        for (unsigned j=0; j<stage->inputs.n && !pattern; j++)
+            if (strchr(stage->inputs.items[j], '%'))
+                pattern = stage->inputs.items[j];
+        if (!pattern) {
+            add_job(run, &capacity, stage, NULL);
+            continue;
+        }
+
+        // Candidates: the files of the pattern directory and the outputs
+        strlist_t candidates = {0};
+        const char *slash = strrchr(pattern, '/');
+        const char *percent = strchr(pattern, '%');
+        char dir[PATH_MAX] = ".";
+        if (slash && slash < percent)
+            snprintf(dir, sizeof dir, "%.*s", (int) (slash - pattern),
+                     pattern);
+        DIR *d = opendir(dir);
+        for (struct dirent *e; d && (e = readdir(d)); ) {
+            char path[PATH_MAX];
+            int len = slash && slash < percent
+                ? snprintf(path, sizeof path, "%s/%s", dir, e->d_name)
+                : snprintf(path, sizeof path, "%s", e->d_name);
+            if (len < 0 || len >= sizeof path) {
+                syslog(LOG_WARNING, "Skipping `%s/%s`, path too long", dir,
+                       e->d_name);
+                continue;
+            }
+            strlist_add(&candidates, path);
+        }
+        if (d)
+            closedir(d);
+        unsigned njobs = run->njobs;
+        for (unsigned j=0; j<njobs; j++)
+            for (unsigned k=0; k<run->jobs[j].outputs.n; k++)
+                strlist_add(&candidates, run->jobs[j].outputs.items[k]);
+
+        for (unsigned j=0; j<candidates.n; j++) {
+            char *stem = match_stem(pattern, candidates.items[j]);
+            if (stem)
+                add_job(run, &capacity, stage, stem);
+            free(stem);
+            free(candidates.items[j]);
+        }
+        free(candidates.items);
+    }
+}
+
+
+/**
+ * Mix a block of bytes into a 64-bit hash.
+ */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof word);
+        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    for (; len; p++, len--)
+        h = (h ^ *p) * 0x100000001B3ULL;
+    return h;
+}
+
+
+/**
+ * Load the cached hashes of the input files.
+ */
+static void load_hashes(runner_t *run) {
+    FILE *file = fopen(STATE_DIR "/hashes", "r");
+    if (!file)
+        return;
+
+    char path[PATH_MAX + 1];
+    unsigned long long hash, size, ino;
+    long long mtime_ns;
+    while (fscanf(file, "%llx %llu %lld %llu %4096[^\n]\n", &hash, &size,
+                  &mtime_ns, &ino, path) == 5) {
+        reserve((void **) &run->hashes, &run->hash_capacity, run->nhashes,
+                sizeof *run->hashes);
+        run->hashes[run->nhashes++] = (file_hash_t) {
+            xstrdup(path), size, mtime_ns, ino, hash
+        };
+    }
+    fclose(file);
+}
+
+
+/**
+ * Save the hashes of the input files for the next run.
+ */
+static void save_hashes(const runner_t *run) {
+    FILE *file = fopen(STATE_DIR "/hashes.tmp", "w");
+    if (!file) {
+        syslog(LOG_WARNING, "Error saving hashes: %s", strerror(errno));
+        return;
+    }
+
+    for (unsigned i=0; i<run->nhashes; i++) {
+        const file_hash_t *h = &run->hashes[i];
+        fprintf(file, "%016llx %llu %lld %llu %s\n",
+                (unsigned long long) h->hash, (unsigned long long) h->size,
+                (long long) h->mtime_ns, (unsigned long long) h->ino,
+                h->path);
+    }
+    if (fclose(file) || rename(STATE_DIR "/hashes.tmp", STATE_DIR "/hashes"))
+        syslog(LOG_WARNING, "Error saving hashes: %s", strerror(errno));
+}
+
+
+/**
+ * Hash the contents of a file, reusing the cached hash if unchanged.
+ * @return 0 if success, -1 if the file cannot be read.
+ */
+static int hash_file(runner_t *run, const char *path, uint64_t *hash) {
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+    int64_t mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    file_hash_t *cached = NULL;
+    for (unsigned i=0; i<run->nhashes && !cached; i++)
+        if (!strcmp(run->hashes[i].path, path))
+            cached = &run->hashes[i];
+    if (cached && cached->size == st.st_size && cached->mtime_ns == mtime_ns
+        && cached->ino == st.st_ino) {
+        *hash = cached->hash;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    static uint8_t block[HASH_BLOCK];
+    uint64_t h = 0xCBF29CE484222325ULL;
+    ssize_t n;
+    while ((n = read(fd, block, sizeof block)) > 0 || (n < 0 && errno == EINTR))
+        if (n > 0)
+            h = hash_bytes(h, block, n);
+    close(fd);
+    if (n < 0)
+        return -1;
+
+    if (!cached) {
+        reserve((void **) &run->hashes, &run->hash_capacity, run->nhashes,
+                sizeof *run->hashes);
+        cached = &run->hashes[run->nhashes++];
+        cached->path = xstrdup(path);
+    }
+    cached->size = st.st_size;
+    cached->mtime_ns = mtime_ns;
+    cached->ino = st.st_ino;
+    cached->hash = h;
+    *hash = h;
+    return 0;
+}
+
+
+/**
+ * Path of the stamp of a job.
+ */
+static void stamp_path(const job_t *job, char *path, size_t size) {
+    snprintf(path, size, STATE_DIR "/%s", job->label);
+    for (char *p = path + strlen(STATE_DIR "/"); *p; p++)
+        if (*p == '/')
+            *p = '_';
+}
+
+
+/**
+ * Whether the stamp of a job matches its key and outputs.
+ */
+static bool stamp_valid(const job_t *job) {
+    char path[PATH_MAX];
+    stamp_path(job, path, sizeof path);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    unsigned long long key;
+    bool valid = fscanf(file, "%llx\n", &key) == 1 && key == job->key;
+    for (unsigned i=0; valid && i<job->outputs.n; i++) {
+        unsigned long long size;
+        long long mtime_ns;
+        struct stat st;
+        valid = fscanf(file, "%llu %lld%*[^\n]\n", &size, &mtime_ns) == 2
+                && !stat(job->outputs.items[i], &st) && st.st_size == size
+                && st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec
+                   == mtime_ns;
+    }
+    fclose(file);
+    return valid;
+}
+
+
+/**
+ * Record the successful run of a job.
+ * @return 0 if success, -1 if an output is missing.
+ */
+static int write_stamp(const job_t *job) {
+    char path[PATH_MAX];
+    stamp_path(job, path, sizeof path);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        syslog(LOG_WARNING, "Error writing stamp `%s`: %s", path,
+               strerror(errno));
+        return 0;
+    }
+
+    int status = 0;
+    fprintf(file, "%016llx\n", (unsigned long long) job->key);
+    for (unsigned i=0; i<job->outputs.n; i++) {
+        struct stat st;
+        if (stat(job->outputs.items[i], &st)) {
+            syslog(LOG_ERR, "`%s` did not produce `%s`", job->label,
+                   job->outputs.items[i]);
+            status = -1;
+            break;
+        }
+        fprintf(file, "%llu %lld %s\n", (unsigned long long) st.st_size,
+                st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+                job->outputs.items[i]);
+    }
+    if (fclose(file) || status)
+        unlink(path);
+    return status;
+}
+
+
+/**
+ * Compute the key of a job from its stage and the contents of its inputs.
+ * @return 0 if success, -1 if an input is missing.
+ */
+static int job_key(runner_t *run, job_t *job) {
+    const stage_t *stage = job->stage;
+    uint64_t h = 0xCBF29CE484222325ULL;
+    h = hash_bytes(h, stage->version, strlen(stage->version) + 1);
+    h = hash_bytes(h, stage->command, strlen(stage->command) + 1);
+
+    for (unsigned i=0; i<job->inputs.n; i++) {
+        uint64_t content;
+        const char *input = job->inputs.items[i];
+        if (hash_file(run, input, &content))
+            return -1;
+        h = hash_bytes(h, input, strlen(input) + 1);
+        h = hash_bytes(h, &content, sizeof content);
+    }
+    job->key = h;
+    return 0;
+}
+
+
+/**
+ * Start the command of a job.
+ * @return 0 if started, -1 if error.
+ */
+static int start_job(job_t *job) {
+    char *in = strlist_join(&job->inputs);
+    char *out = strlist_join(&job->outputs);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("in", in, 1);
+        setenv("out", out, 1);
+        setenv("stem", job->stem ? job->stem : "", 1);
+        execl("/bin/sh", "sh", "-e", "-c", job->stage->command, (char *) 0);
+        _exit(127);
+    }
+    free(in);
+    free(out);
+
+    if (pid < 0) {
+        syslog(LOG_ERR, "Error starting `%s`: %s", job->label,
+               strerror(errno));
+        return -1;
+    }
+    job->pid = pid;
+    return 0;
+}
+
+
+/**
+ * Decide whether a pending job can start, has to wait or is skipped.
+ * @return true if it is ready to run.
+ */
+static bool prepare_job(runner_t *run, job_t *job) {
+    bool deps_ran = false;
+    for (unsigned i=0; i<job->inputs.n; i++) {
+        int producer = find_producer(run, job->inputs.items[i]);
+        if (producer < 0)
+            continue;
+
+        job_t *dep = &run->jobs[producer];
+        if (dep->state == JOB_PENDING || dep->state == JOB_RUNNING)
+            return false;
+        if (dep->state != JOB_DONE) {
+            printf("%s: skipped, `%s` not done\n", job->label, dep->label);
+            job->state = JOB_SKIPPED;
+            return false;
+        }
+        deps_ran |= dep->ran;
+    }
+
+    // A dry run cannot hash the outputs its jobs would have produced
+    if (run->args->dry_run && deps_ran) {
+        job->ran = true;
+    } else if (job_key(run, job)) {
+        printf("%s: skipped, missing input\n", job->label);
+        job->state = JOB_SKIPPED;
+        return false;
+    } else {
+        job->ran = run->args->force || !stamp_valid(job);
+    }
+
+    if (!job->ran || run->args->dry_run) {
+        printf("%s: %s\n", job->label, job->ran ? "would run" : "up to date");
+        job->state = JOB_DONE;
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Run the jobs, as many at a time as allowed, in dependency order.
+ * @return the number of failed jobs.
+ */
+static unsigned run_jobs(runner_t *run) {
+    unsigned running = 0;
+    unsigned failed = 0;
+
+    for (;;) {
+        bool progress = false;
+        bool pending = false;
+        for (unsigned i=0; i<run->njobs; i++) {
+            job_t *job = &run->jobs[i];
+            if (job->state != JOB_PENDING)
+                continue;
+            if (running == run->args->jobs) {
+                pending = true;
+                break;
+            }
+            if (!prepare_job(run, job)) {
+                progress |= job->state != JOB_PENDING;
+                pending |= job->state == JOB_PENDING;
+                continue;
+            }
+
+            // Remove the stamp first, so that an interrupted run is redone
+            char stamp[PATH_MAX];
+            stamp_path(job, stamp, sizeof stamp);
+            unlink(stamp);
+            printf("%s: running\n", job->label);
+            fflush(stdout);
+            if (start_job(job)) {
+                job->state = JOB_FAILED;
+                failed++;
+            } else {
+                job->state = JOB_RUNNING;
+                running++;
+            }
+            progress = true;
+        }
+
+        if (!running) {
+            if (!pending)
+                break;
+            if (!progress) {
+                for (unsigned i=0; i<run->njobs; i++)
+                    if (run->jobs[i].state == JOB_PENDING) {
+                        syslog(LOG_ERR, "`%s` is in a dependency cycle",
+                               run->jobs[i].label);
+                        run->jobs[i].state = JOB_FAILED;
+                        failed++;
+                    }
+                break;
+            }
+            continue;
+        }
+
+        // Wait for a job to finish
+        int wstatus;
+        pid_t pid = wait(&wstatus);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Error waiting for jobs: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned i=0; i<run->njobs; i++) {
+            job_t *job = &run->jobs[i];
+            if (job->state != JOB_RUNNING || job->pid != pid)
+                continue;
+
+            running--;
+            if (WIFEXITED(wstatus) && !WEXITSTATUS(wstatus)
+                && !write_stamp(job)) {
+                job->state = JOB_DONE;
+                printf("%s: done\n", job->label);
+            } else {
+                job->state = JOB_FAILED;
+                failed++;
+                printf("%s: failed\n", job->label);
+            }
+            fflush(stdout);
+        }
+    }
+
+    return failed;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {0};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (!arguments.jobs) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        arguments.jobs = ncpu > 0 ? ncpu : 1;
+    }
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    // Resolve the pipeline before entering the log directory
+    char pipeline[PATH_MAX];
+    if (arguments.pipeline) {
+        if (!realpath(arguments.pipeline, pipeline)) {
+            syslog(LOG_ERR, "Error accessing pipeline `%s`: %s",
+                   arguments.pipeline, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    if (chdir(arguments.logdir)) {
+        syslog(LOG_ERR, "Error entering `%s`: %s", arguments.logdir,
+               strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (!arguments.pipeline)
+        snprintf(pipeline, sizeof pipeline, "%s",
+                 access("pipeline", R_OK) ? FDAS3_PIPELINE : "pipeline");
+
+    if (mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+        syslog(LOG_ERR, "Error creating `%s/%s`: %s", arguments.logdir,
+               STATE_DIR, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    runner_t run = {.args=&arguments};
+    read_pipeline(&run, pipeline);
+    expand_stages(&run);
+    load_hashes(&run);
+
+    unsigned failed = run_jobs(&run);
+    save_hashes(&run);
+    if (failed)
+        syslog(LOG_ERR, "%u jobs failed", failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,797 @@
+/**
+ * Sequential reader of binary logs through a sliding memory mapping.
+ *
+ * Logs of any size are read with a fixed address space footprint: the
+ * mapping covers a window of the file and slides forward when the next
+ * record could cross its end. The optional time index records the time
+ * range of the records starting in each block of the log, so that queries
+ * over a time interval skip the blocks outside it. Logs starting with the
+ * header of logwriter_header carry their message definitions, which check
+ * the frames and decode them without the code the log was written with.
+ *
+ * Gzip logs, such as rotated or archived ones, are read the same way: a
+ * thread decompresses the blocks ahead of the reader, which parses them in
+ * place of the mapping. The record offsets are then those of the
+ * decompressed data, and seeking is only forward.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "logscan.h"
+#include "logwriter.h"
+
+
+/** Magic string at the start of the index files. */
+#define INDEX_MAGIC "FDAS3IDX"
+
+/** Version of the index file layout. */
+#define INDEX_VERSION 1
+
+/** Magic bytes at the start of gzip files. */
+#define GZIP_MAGIC "\x1f\x8b"
+
+/** Buffer of the compressed input of gzip logs. */
+#define GZIP_BUFFER (256 * 1024)
+
+
+/** Header of the index files, all integers little-endian. */
+typedef struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_len;
+    uint64_t log_size;
+    uint32_t nblocks;
+    uint32_t reserved;
+} index_header_t;
+
+/**
+ * Block of a decompressed gzip log, after room for the end of the previous
+ * block.
+ */
+typedef struct inflate_block {
+    uint8_t *buf; ///< LOGSCAN_OVERLAP bytes of room, then the data.
+    size_t len; ///< Length of the data, 0 at the end of the log.
+    uint64_t input_offset; ///< Compressed bytes read once decompressed.
+    bool error; ///< Whether the decompression failed.
+} inflate_block_t;
+
+/** Decompression of a gzip log ahead of the reader. */
+typedef struct logscan_inflater {
+    gzFile gz;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    inflate_block_t queue[LOGSCAN_INFLATE_AHEAD];
+    unsigned head;
+    unsigned count;
+    bool stop;
+    bool failed; ///< Whether the reader got a failed block.
+    uint8_t *window; ///< Buffer of the block being read.
+} logscan_inflater_t;
+
+
+/**
+ * Check the fixed part of a log header.
+ * @param[out] len of the definitions following it.
+ * @return 1 if a header, 0 if none, -1 if an unsupported one.
+ */
+static int check_header(const uint8_t *header, uint32_t *len) {
+    if (memcmp(header, LOGWRITER_MAGIC, 8))
+        return 0;
+
+    uint32_t version;
+    memcpy(&version, header + 8, sizeof version);
+    memcpy(len, header + 12, sizeof *len);
+    if (le32toh(version) != LOGWRITER_VERSION) {
+        syslog(LOG_ERR, "Unsupported log header version %u",
+               (unsigned) le32toh(version));
+        return -1;
+    }
+    *len = le32toh(*len);
+    return 1;
+}
+
+
+/**
+ * Read the message definitions embedded in the header of a log.
+ * Logs without header are left with empty definitions.
+ * @param[out] schema receiving the definitions.
+ * @param[out] data_offset file offset of the first record.
+ * @return 0 if success, -1 if error.
+ */
+int logscan_header(int fd, mavschema_t *schema, uint64_t *data_offset) {
+    *data_offset = 0;
+    uint8_t header[LOGWRITER_HEADER_LEN];
+    uint32_t len;
+    if (pread(fd, header, sizeof header, 0) != sizeof header)
+        return 0;
+    int found = check_header(header, &len);
+    if (found <= 0)
+        return found;
+
+    uint8_t *defs = malloc(len ? len : 1);
+    if (!defs) {
+        syslog(LOG_ERR, "Error allocating log header: %s", strerror(errno));
+        return -1;
+    }
+    ssize_t n = pread(fd, defs, len, sizeof header);
+    bool complete = n == (ssize_t) len;
+    int status = complete ? mavschema_decode(schema, defs, len) : -1;
+    if (!complete)
+        syslog(LOG_ERR, "Truncated log header");
+    free(defs);
+
+    *data_offset = sizeof header + (uint64_t) len;
+    return status;
+}
+
+
+/**
+ * Decompress the blocks of a gzip log ahead of the reader, up to the end of
+ * the log or an error.
+ */
+static void* inflate_thread(void *arg) {
+    logscan_inflater_t *inflater = arg;
+
+    for (bool end = false; !end;) {
+        pthread_mutex_lock(&inflater->lock);
+        while (inflater->count == LOGSCAN_INFLATE_AHEAD && !inflater->stop)
+            pthread_cond_wait(&inflater->cond, &inflater->lock);
+        bool stop = inflater->stop;
+        pthread_mutex_unlock(&inflater->lock);
+        if (stop)
+            break;
+
+        inflate_block_t block = {
+            .buf=malloc(LOGSCAN_OVERLAP + LOGSCAN_INFLATE_BLOCK)
+        };
+        int n = -1;
+        if (!block.buf)
+            syslog(LOG_ERR, "Error allocating decompressed block: %s",
+                   strerror(errno));
+        else
+            n = gzread(inflater->gz, block.buf + LOGSCAN_OVERLAP,
+                       LOGSCAN_INFLATE_BLOCK);
+        int errnum = Z_OK;
+        const char *error = block.buf ? gzerror(inflater->gz, &errnum) : "";
+        if (n < 0 && block.buf)
+            syslog(LOG_ERR, "Error decompressing log: %s", error);
+        else if (!n && errnum != Z_OK)
+            syslog(LOG_WARNING, "Compressed log ends early: %s", error);
+        block.len = n > 0 ? n : 0;
+        block.error = n < 0;
+        z_off_t input_offset = gzoffset(inflater->gz);
+        block.input_offset = input_offset > 0 ? input_offset : 0;
+        end = n <= 0;
+
+        pthread_mutex_lock(&inflater->lock);
+        unsigned tail = (inflater->head + inflater->count)
+                        % LOGSCAN_INFLATE_AHEAD;
+        inflater->queue[tail] = block;
+        inflater->count++;
+        pthread_cond_signal(&inflater->cond);
+        pthread_mutex_unlock(&inflater->lock);
+    }
+    return NULL;
+}
+
+
+/**
+ * Start the decompression of a gzip log, reading its header first.
+ * @return 0 if success, -1 if error.
+ */
+static int inflater_open(logscan_t *scan) {
+    logscan_inflater_t *inflater = calloc(1, sizeof *inflater);
+    int fd = dup(scan->fd);
+    if (!inflater || fd < 0) {
+        syslog(LOG_ERR, "Error starting decompression: %s", strerror(errno));
+        free(inflater);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    inflater->gz = gzdopen(fd, "rb");
+    if (!inflater->gz) {
+        syslog(LOG_ERR, "Error starting decompression");
+        close(fd);
+        free(inflater);
+        return -1;
+    }
+    gzbuffer(inflater->gz, GZIP_BUFFER);
+
+    // The header is decompressed before the records, if any
+    uint8_t header[LOGWRITER_HEADER_LEN];
+    uint32_t len;
+    int found = 0;
+    if (gzread(inflater->gz, header, sizeof header) == sizeof header)
+        found = check_header(header, &len);
+    if (found < 0)
+        goto fail;
+    if (found) {
+        uint8_t *defs = malloc(len ? len : 1);
+        if (!defs) {
+            syslog(LOG_ERR, "Error allocating log header: %s",
+                   strerror(errno));
+            goto fail;
+        }
+        bool complete = gzread(inflater->gz, defs, len) == (int) len;
+        int status = complete ? mavschema_decode(&scan->schema, defs, len)
+                              : -1;
+        if (!complete)
+            syslog(LOG_ERR, "Truncated log header");
+        free(defs);
+        if (status)
+            goto fail;
+        scan->data_offset = sizeof header + (uint64_t) len;
+    } else if (gzrewind(inflater->gz)) {
+        syslog(LOG_ERR, "Error rewinding compressed log");
+        goto fail;
+    }
+
+    // The signals stay with the calling thread
+    pthread_mutex_init(&inflater->lock, NULL);
+    pthread_cond_init(&inflater->cond, NULL);
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int status = pthread_create(&inflater->thread, NULL, inflate_thread,
+                                inflater);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error starting decompression: %s", strerror(status));
+        pthread_cond_destroy(&inflater->cond);
+        pthread_mutex_destroy(&inflater->lock);
+        goto fail;
+    }
+
+    scan->inflater = inflater;
+    scan->map_offset = scan->data_offset;
+    scan->pos = 0;
+    scan->size = UINT64_MAX;
+    return 0;
+
+ fail:
+    gzclose(inflater->gz);
+    free(inflater);
+    return -1;
+}
+
+
+/**
+ * Continue with the next decompressed block, the data from the current
+ * position moved before it. At the end of the log, the size is set and the
+ * current block kept.
+ * @return 0 if success, -1 if error.
+ */
+static int refill(logscan_t *scan) {
+    logscan_inflater_t *inflater = scan->inflater;
+    if (inflater->failed)
+        return -1;
+    if (scan->size != UINT64_MAX)
+        return 0;
+
+    pthread_mutex_lock(&inflater->lock);
+    while (!inflater->count)
+        pthread_cond_wait(&inflater->cond, &inflater->lock);
+    inflate_block_t block = inflater->queue[inflater->head];
+    inflater->head = (inflater->head + 1) % LOGSCAN_INFLATE_AHEAD;
+    inflater->count--;
+    pthread_cond_signal(&inflater->cond);
+    pthread_mutex_unlock(&inflater->lock);
+
+    if (block.error || !block.len) {
+        free(block.buf);
+        inflater->failed = block.error;
+        scan->size = scan->map_offset + scan->map_len;
+        return block.error ? -1 : 0;
+    }
+
+    // The reader slides the window with less than the overlap remaining
+    size_t carry = scan->map_len - scan->pos;
+    uint8_t *start = block.buf + LOGSCAN_OVERLAP - carry;
+    if (carry)
+        memcpy(start, scan->map + scan->pos, carry);
+    free(inflater->window);
+    inflater->window = block.buf;
+    scan->map = start;
+    scan->map_offset += scan->pos;
+    scan->map_len = carry + block.len;
+    scan->pos = 0;
+    scan->input_offset = block.input_offset;
+    return 0;
+}
+
+
+/**
+ * Stop the decompression of a gzip log and free its blocks.
+ */
+static void inflater_close(logscan_t *scan) {
+    logscan_inflater_t *inflater = scan->inflater;
+    if (!inflater)
+        return;
+
+    pthread_mutex_lock(&inflater->lock);
+    inflater->stop = true;
+    pthread_cond_signal(&inflater->cond);
+    pthread_mutex_unlock(&inflater->lock);
+    pthread_join(inflater->thread, NULL);
+
+    for (unsigned i=0; i<inflater->count; i++)
+        free(inflater->queue[(inflater->head + i)
+                             % LOGSCAN_INFLATE_AHEAD].buf);
+    free(inflater->window);
+    gzclose(inflater->gz);
+    pthread_cond_destroy(&inflater->cond);
+    pthread_mutex_destroy(&inflater->lock);
+    free(inflater);
+    scan->inflater = NULL;
+    scan->map = NULL;
+    scan->map_len = 0;
+}
+
+
+/**
+ * Open a log for reading, decompressing it if gzip.
+ * The frames are checked against the embedded definitions, if any.
+ * @param format of the log, LOGSCAN_AUTO to detect from the first byte.
+ * @return 0 if success, -1 if error.
+ */
+int logscan_open(logscan_t *scan, const char *path, logscan_format_t format) {
+    memset(scan, 0, sizeof *scan);
+
+    scan->fd = open(path, O_RDONLY);
+    if (scan->fd < 0) {
+        syslog(LOG_ERR, "Error opening `%s`: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(scan->fd, &st)) {
+        syslog(LOG_ERR, "Error getting size of `%s`: %s", path,
+               strerror(errno));
+        close(scan->fd);
+        return -1;
+    }
+    scan->size = st.st_size;
+    if (posix_fadvise(scan->fd, 0, 0, POSIX_FADV_SEQUENTIAL))
+        syslog(LOG_WARNING, "Error advising `%s`", path);
+
+    // Gzip logs embed their header in the compressed data
+    char magic[sizeof GZIP_MAGIC - 1];
+    bool gzip = pread(scan->fd, magic, sizeof magic, 0) == sizeof magic
+                && !memcmp(magic, GZIP_MAGIC, sizeof magic);
+    if (gzip ? inflater_open(scan)
+             : logscan_header(scan->fd, &scan->schema, &scan->data_offset)) {
+        syslog(LOG_ERR, "Invalid header in `%s`", path);
+        logscan_close(scan);
+        return -1;
+    }
+    if (scan->schema.nmessages) {
+        if (mavschema_crc_extras(&scan->schema, &scan->crc_extras,
+                                 &scan->scanner.ncrc_extras)) {
+            logscan_close(scan);
+            return -1;
+        }
+        scan->scanner.crc_extras = scan->crc_extras;
+        scan->scanner.accept_unknown = true;
+    }
+    if (!scan->inflater)
+        scan->pos = scan->data_offset;
+
+    // Frames start with their marker, mavlog records with a timestamp
+    uint8_t first = 0;
+    if (format == LOGSCAN_AUTO) {
+        format = LOGSCAN_MAVLOG;
+        if (scan->inflater) {
+            if (refill(scan)) {
+                logscan_close(scan);
+                return -1;
+            }
+            if (scan->map_len)
+                first = scan->map[0];
+        } else if (pread(scan->fd, &first, 1, scan->data_offset) != 1) {
+            first = 0;
+        }
+        if (first == MAVFRAME_V1_STX || first == MAVFRAME_V2_STX)
+            format = LOGSCAN_LOGBIN;
+    }
+    scan->format = format;
+    return 0;
+}
+
+
+/**
+ * Map the window starting at the page holding the given offset.
+ * @return 0 if success, -1 if error.
+ */
+static int remap(logscan_t *scan, uint64_t offset) {
+    if (scan->map)
+        munmap((void *) scan->map, scan->map_len);
+    scan->map = NULL;
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+    uint64_t len = scan->size - start;
+    if (len > LOGSCAN_WINDOW + LOGSCAN_OVERLAP)
+        len = LOGSCAN_WINDOW + LOGSCAN_OVERLAP;
+
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, scan->fd, start);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Error mapping log: %s", strerror(errno));
+        return -1;
+    }
+    if (madvise(map, len, MADV_SEQUENTIAL))
+        syslog(LOG_WARNING, "Error advising mapping: %s", strerror(errno));
+
+    scan->map = map;
+    scan->map_len = len;
+    scan->map_offset = start;
+    scan->pos = offset - start;
+    return 0;
+}
+
+
+/**
+ * Slide the window of the log to a file offset, or to the current position
+ * of gzip logs.
+ * @return 0 if success, -1 if error.
+ */
+static int slide(logscan_t *scan, uint64_t offset) {
+    return scan->inflater ? refill(scan) : remap(scan, offset);
+}
+
+
+/**
+ * Parse the record at the current position of the mapping.
+ * @return 1 if found, 0 if incomplete, -1 if not a record.
+ */
+static int parse_record(logscan_t *scan, logrecord_t *record) {
+    const uint8_t *buf = scan->map;
+    size_t len = scan->map_len;
+    size_t pos = scan->pos;
+
+    if (scan->format == LOGSCAN_LOGBIN) {
+        uint64_t skipped = scan->scanner.skipped;
+        int found = mavframe_next(&scan->scanner, buf, len, &pos,
+                                  &record->frame);
+        scan->malformed += scan->scanner.skipped - skipped;
+        if (!found) {
+            scan->pos = pos;
+            return 0;
+        }
+
+        uint64_t time_le;
+        mavframe_payload(&record->frame, &time_le, sizeof time_le);
+        record->time_usec = le64toh(time_le);
+        record->offset = scan->map_offset + (record->frame.data - buf);
+        scan->pos = pos;
+        return 1;
+    }
+
+    // The frame must immediately follow the timestamp
+    if (len - pos <= LOGSCAN_TIMESTAMP_LEN)
+        return 0;
+    const uint8_t *data = buf + pos + LOGSCAN_TIMESTAMP_LEN;
+    size_t avail = len - pos - LOGSCAN_TIMESTAMP_LEN;
+    if (avail > MAVFRAME_MAX_LEN)
+        avail = MAVFRAME_MAX_LEN;
+    size_t frame_pos = 0;
+    if (!mavframe_next(&scan->scanner, data, avail, &frame_pos,
+                       &record->frame))
+        return avail < MAVFRAME_MAX_LEN ? 0 : -1;
+    if (record->frame.data != data)
+        return -1;
+
+    uint64_t time_be;
+    memcpy(&time_be, buf + pos, sizeof time_be);
+    record->time_usec = be64toh(time_be);
+    record->offset = scan->map_offset + pos;
+    scan->pos = pos + LOGSCAN_TIMESTAMP_LEN + record->frame.len;
+    return 1;
+}
+
+
+/**
+ * Read the next record.
+ * @return 1 if read, 0 at the end of the log, -1 if error.
+ */
+int logscan_next(logscan_t *scan, logrecord_t *record) {
+    for (;;) {
+        uint64_t offset = scan->map_offset + scan->pos;
+        if (offset >= scan->size)
+            return 0;
+
+        // Slide the window when a record could cross its end
+        bool eof = scan->map && scan->map_offset + scan->map_len == scan->size;
+        if (!scan->map
+            || (!eof && scan->map_len - scan->pos < LOGSCAN_OVERLAP)) {
+            if (slide(scan, offset))
+                return -1;
+            continue;
+        }
+
+        int status = parse_record(scan, record);
+        if (status > 0)
+            return 1;
+
+        if (status < 0) {
+            scan->malformed++;
+            scan->pos++;
+        } else if (eof) {
+            scan->malformed += scan->map_len - scan->pos;
+            scan->pos = scan->map_len;
+        } else if (slide(scan, scan->map_offset + scan->pos)) {
+            return -1;
+        }
+    }
+}
+
+
+/**
+ * Continue reading a gzip log from a later offset, decompressing the data
+ * before it.
+ * @return 0 if success, -1 if error.
+ */
+static int skip(logscan_t *scan, uint64_t offset) {
+    if (offset < scan->map_offset + scan->pos) {
+        syslog(LOG_ERR, "Cannot seek backwards in a compressed log");
+        return -1;
+    }
+
+    while (offset >= scan->map_offset + scan->map_len
+           && scan->map_offset + scan->map_len < scan->size) {
+        scan->pos = scan->map_len;
+        if (refill(scan))
+            return -1;
+    }
+    scan->pos = offset < scan->map_offset + scan->map_len
+                ? offset - scan->map_offset : scan->map_len;
+    return 0;
+}
+
+
+/**
+ * Continue reading from a file offset, at the start of a record.
+ * @return 0 if success, -1 if error.
+ */
+int logscan_seek(logscan_t *scan, uint64_t offset) {
+    if (scan->map && offset >= scan->map_offset
+        && offset - scan->map_offset < scan->map_len) {
+        scan->pos = offset - scan->map_offset;
+        return 0;
+    }
+    if (scan->inflater)
+        return skip(scan, offset);
+
+    if (offset >= scan->size) {
+        if (scan->map)
+            munmap((void *) scan->map, scan->map_len);
+        scan->map = NULL;
+        scan->map_len = 0;
+        scan->map_offset = scan->size;
+        scan->pos = 0;
+        return 0;
+    }
+    return remap(scan, offset);
+}
+
+
+/**
+ * Unmap and close the log, freeing its embedded definitions.
+ */
+void logscan_close(logscan_t *scan) {
+    if (scan->inflater)
+        inflater_close(scan);
+    else if (scan->map)
+        munmap((void *) scan->map, scan->map_len);
+    scan->map = NULL;
+    if (scan->fd >= 0 && close(scan->fd))
+        syslog(LOG_ERR, "Error closing log: %s", strerror(errno));
+    scan->fd = -1;
+    mavschema_free(&scan->schema);
+    free(scan->crc_extras);
+    scan->crc_extras = NULL;
+    scan->scanner.crc_extras = NULL;
+}
+
+
+/**
+ * Path of the index of a log.
+ * @return 0 if success, -1 if too long.
+ */
+static int index_path(const char *path, char *index, size_t size) {
+    if (snprintf(index, size, "%s.idx", path) >= size) {
+        syslog(LOG_ERR, "Index path of `%s` too long", path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Write an index beside its log.
+ * @return 0 if success, -1 if error.
+ */
+static int index_save(const char *path, const logscan_index_t *index) {
+    char idx_path[PATH_MAX];
+    if (index_path(path, idx_path, sizeof idx_path))
+        return -1;
+
+    FILE *file = fopen(idx_path, "wb");
+    if (!file) {
+        syslog(LOG_ERR, "Error creating index `%s`: %s", idx_path,
+               strerror(errno));
+        return -1;
+    }
+
+    index_header_t header = {
+        .magic=INDEX_MAGIC, .version=htole32(INDEX_VERSION),
+        .block_len=htole32(index->block_len),
+        .log_size=htole64(index->log_size), .nblocks=htole32(index->nblocks)
+    };
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1;
+    for (uint32_t i=0; ok && i<index->nblocks; i++) {
+        const logscan_block_t *block = &index->blocks[i];
+        uint64_t entry[3] = {
+            htole64(block->offset), htole64(block->min_usec),
+            htole64(block->max_usec)
+        };
+        ok = fwrite(entry, sizeof entry, 1, file) == 1;
+    }
+
+    if (fclose(file) || !ok) {
+        syslog(LOG_ERR, "Error writing index `%s`: %s", idx_path,
+               strerror(errno));
+        unlink(idx_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Index a log by time and save the index beside it, as LOG.idx.
+ * @param block_len length of the indexed blocks, 0 for the default.
+ * @param[out] index built.
+ * @return 0 if success, -1 if error.
+ */
+int logscan_index_build(const char *path, logscan_format_t format,
+                        uint32_t block_len, logscan_index_t *index) {
+    memset(index, 0, sizeof *index);
+    index->block_len = block_len ? block_len : LOGSCAN_INDEX_BLOCK;
+
+    logscan_t scan;
+    struct stat st;
+    if (logscan_open(&scan, path, format))
+        return -1;
+    if (fstat(scan.fd, &st)) {
+        syslog(LOG_ERR, "Error getting size of `%s`: %s", path,
+               strerror(errno));
+        logscan_close(&scan);
+        return -1;
+    }
+    index->log_size = st.st_size;
+
+    uint32_t capacity = 0;
+    uint64_t block_num = UINT64_MAX;
+    logrecord_t record;
+    int status;
+    while ((status = logscan_next(&scan, &record)) > 0) {
+        if (index->nblocks && record.offset / index->block_len == block_num) {
+            logscan_block_t *block = &index->blocks[index->nblocks - 1];
+            if (record.time_usec < block->min_usec)
+                block->min_usec = record.time_usec;
+            if (record.time_usec > block->max_usec)
+                block->max_usec = record.time_usec;
+            continue;
+        }
+
+        // New block
+        if (index->nblocks == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            void *blocks = realloc(index->blocks,
+                                   capacity * sizeof *index->blocks);
+            if (!blocks) {
+                syslog(LOG_ERR, "Error allocating index: %s", strerror(errno));
+                status = -1;
+                break;
+            }
+            index->blocks = blocks;
+        }
+        block_num = record.offset / index->block_len;
+        index->blocks[index->nblocks++] = (logscan_block_t) {
+            record.offset, record.time_usec, record.time_usec
+        };
+    }
+    logscan_close(&scan);
+
+    if (status < 0 || index_save(path, index)) {
+        logscan_index_free(index);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Load the index of a log, if present and up to date.
+ * @return 0 if loaded, -1 if missing, stale or invalid.
+ */
+int logscan_index_load(const char *path, logscan_index_t *index) {
+    memset(index, 0, sizeof *index);
+
+    char idx_path[PATH_MAX];
+    if (index_path(path, idx_path, sizeof idx_path))
+        return -1;
+
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+
+    FILE *file = fopen(idx_path, "rb");
+    if (!file)
+        return -1;
+
+    index_header_t header;
+    if (fread(&header, sizeof header, 1, file) != 1
+        || memcmp(header.magic, INDEX_MAGIC, sizeof header.magic)
+        || le32toh(header.version) != INDEX_VERSION
+        || le64toh(header.log_size) != st.st_size) {
+        syslog(LOG_WARNING, "Ignoring stale or invalid index `%s`", idx_path);
+        fclose(file);
+        return -1;
+    }
+
+    index->log_size = le64toh(header.log_size);
+    index->block_len = le32toh(header.block_len);
+    index->nblocks = le32toh(header.nblocks);
+    index->blocks = calloc(index->nblocks ? index->nblocks : 1,
+                           sizeof *index->blocks);
+    if (!index->blocks) {
+        syslog(LOG_ERR, "Error allocating index: %s", strerror(errno));
+        fclose(file);
+        return -1;
+    }
+
+    for (uint32_t i=0; i<index->nblocks; i++) {
+        uint64_t entry[3];
+        if (fread(entry, sizeof entry, 1, file) != 1) {
+            syslog(LOG_WARNING, "Ignoring truncated index `%s`", idx_path);
+            fclose(file);
+            logscan_index_free(index);
+            return -1;
+        }
+        index->blocks[i] = (logscan_block_t) {
+            le64toh(entry[0]), le64toh(entry[1]), le64toh(entry[2])
+        };
+    }
+
+    fclose(file);
+    return 0;
+}
+
+
+/**
+ * Free a loaded or built index.
+ */
+void logscan_index_free(logscan_index_t *index) {
+    free(index->blocks);
+    index->blocks = NULL;
+    index->nblocks = 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Sequential reader of binary logs through a sliding memory mapping, or
+ * through a decompression thread for gzip logs.
+ */
+
+#ifndef LOGSCAN_H
+#define LOGSCAN_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mavframe.h"
+#include "mavschema.h"
+
+
+/** Length of the file region processed per mapping, a page multiple. */
+#define LOGSCAN_WINDOW (256 * 1024 * 1024)
+
+/** Extra mapped bytes so that records crossing the window are complete. */
+#define LOGSCAN_OVERLAP (64 * 1024)
+
+/** Length of a mavlog record timestamp. */
+#define LOGSCAN_TIMESTAMP_LEN 8
+
+/** Default length of the blocks of the time index. */
+#define LOGSCAN_INDEX_BLOCK (1024 * 1024)
+
+/** Length of the blocks of gzip logs decompressed at once. */
+#define LOGSCAN_INFLATE_BLOCK (1024 * 1024)
+
+/** Number of blocks of gzip logs decompressed ahead of the reader. */
+#define LOGSCAN_INFLATE_AHEAD 8
+
+
+/** Binary log formats. */
+typedef enum {
+    LOGSCAN_AUTO, ///< Detect from the first byte after the header.
+    LOGSCAN_MAVLOG, ///< Timestamped records of mavlog and mavrecord.
+    LOGSCAN_LOGBIN, ///< Bare frames of the reader `--logbin`.
+} logscan_format_t;
+
+/** Log record, pointing into the mapping until the next read. */
+typedef struct logrecord {
+    uint64_t time_usec; ///< Record timestamp, or leading time_usec field.
+    uint64_t offset; ///< File offset, decompressed for gzip logs.
+    mavframe_t frame;
+} logrecord_t;
+
+/** Time range of a block of the index. */
+typedef struct logscan_block {
+    uint64_t offset; ///< File offset of the first record of the block.
+    uint64_t min_usec;
+    uint64_t max_usec;
+} logscan_block_t;
+
+/** Time index of a log, stored beside it as LOG.idx. */
+typedef struct logscan_index {
+    uint64_t log_size; ///< Size of the log when indexed.
+    uint32_t block_len;
+    uint32_t nblocks;
+    logscan_block_t *blocks;
+} logscan_index_t;
+
+/** Log reader. */
+typedef struct logscan {
+    int fd;
+    uint64_t size; ///< Of gzip logs once decompressed, UINT64_MAX till then.
+    logscan_format_t format;
+    const uint8_t *map;
+    size_t map_len;
+    uint64_t map_offset;
+    size_t pos; ///< Position of the next record in the mapping.
+    mavframe_scanner_t scanner;
+    uint64_t malformed; ///< Bytes not belonging to a record.
+    uint64_t data_offset; ///< File offset of the first record.
+    uint64_t input_offset; ///< Of gzip logs, compressed bytes read so far.
+    mavschema_t schema; ///< Definitions embedded in the log, if any.
+    int16_t *crc_extras; ///< CRC extras of the embedded definitions.
+    struct logscan_inflater *inflater; ///< NULL unless a gzip log.
+} logscan_t;
+
+
+int logscan_header(int fd, mavschema_t *schema, uint64_t *data_offset);
+int logscan_open(logscan_t *scan, const char *path, logscan_format_t format);
+int logscan_next(logscan_t *scan, logrecord_t *record);
+int logscan_seek(logscan_t *scan, uint64_t offset);
+void logscan_close(logscan_t *scan);
+
+int logscan_index_build(const char *path, logscan_format_t format,
+                        uint32_t block_len, logscan_index_t *index);
+int logscan_index_load(const char *path, logscan_index_t *index);
+void logscan_index_free(logscan_index_t *index);
+
+
+#endif//LOGSCAN_H
@@ -0,0 +1,329 @@
+/**
+ * Reader of a log split in segments, by restarts or rotation, as one
+ * stream in time order.
+ *
+ * The segments, plain or gzip logs of either format, are given in the order
+ * of their start. A segment joins the readers once the previous one is
+ * reached, and the records of the joined segments are merged by time, so
+ * that overlapping segments, such as those of a reader restarted before
+ * the previous one flushed, still read in time order. Only the overlapping
+ * segments are open at once.
+ *
+ * A thread keeps the page cache filled ahead of the reader with
+ * posix_fadvise, across the ends of the segments, so that a scan does not
+ * wait for the disk at each window of a segment or at the start of the
+ * next one. The gzip segments are decompressed ahead by their logscan.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logview.h"
+
+
+/** Read ahead state, shared with the prefetch thread. */
+typedef struct logview_prefetch {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const logview_segment_t *segments;
+    unsigned nsegments;
+    uint64_t *starts; ///< Position of the segments in the read ahead bytes.
+    unsigned segment; ///< Earliest segment open by the reader.
+    uint64_t offset; ///< Its file offset, compressed for gzip segments.
+    bool stop;
+
+    // Reader side, to update the position once per chunk
+    unsigned notify_segment;
+    uint64_t notify_offset;
+} logview_prefetch_t;
+
+
+/**
+ * Advise the reading of the segments from the position of the reader, up to
+ * LOGVIEW_READAHEAD bytes ahead of it.
+ */
+static void* prefetch_thread(void *arg) {
+    logview_prefetch_t *pf = arg;
+    unsigned segment = 0;
+    uint64_t done = 0; ///< Bytes of the segment advised.
+    uint64_t size = 0;
+    int fd = -1;
+
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->stop && segment < pf->nsegments) {
+        // Skip what the reader already passed
+        if (pf->segment > segment) {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            segment = pf->segment;
+            done = 0;
+        }
+        if (pf->segment == segment && pf->offset > done)
+            done = pf->offset;
+
+        if (fd < 0) {
+            pthread_mutex_unlock(&pf->lock);
+            struct stat st;
+            fd = open(pf->segments[segment].path, O_RDONLY);
+            size = fd >= 0 && !fstat(fd, &st) ? st.st_size : 0;
+            pthread_mutex_lock(&pf->lock);
+            pf->starts[segment + 1] = pf->starts[segment] + size;
+        }
+
+        uint64_t reader = pf->starts[pf->segment] + pf->offset;
+        if (pf->starts[segment] + done >= reader + LOGVIEW_READAHEAD) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        if (done >= size) {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            segment++;
+            done = 0;
+            continue;
+        }
+
+        uint64_t len = size - done;
+        if (len > LOGVIEW_PREFETCH_CHUNK)
+            len = LOGVIEW_PREFETCH_CHUNK;
+        pthread_mutex_unlock(&pf->lock);
+        posix_fadvise(fd, done, len, POSIX_FADV_WILLNEED);
+        pthread_mutex_lock(&pf->lock);
+        done += len;
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+
+/**
+ * Start reading ahead of the first segment.
+ * @return 0 if success, -1 if error.
+ */
+static int prefetch_open(logview_t *view) {
+    logview_prefetch_t *pf = calloc(1, sizeof *pf);
+    uint64_t *starts = calloc(view->nsegments + 1, sizeof *starts);
+    if (!pf || !starts) {
+        syslog(LOG_ERR, "Error allocating prefetch: %s", strerror(errno));
+        free(pf);
+        free(starts);
+        return -1;
+    }
+    pf->segments = view->segments;
+    pf->nsegments = view->nsegments;
+    pf->starts = starts;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+
+    // The signals stay with the reader
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int status = pthread_create(&pf->thread, NULL, prefetch_thread, pf);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error starting prefetch: %s", strerror(status));
+        pthread_cond_destroy(&pf->cond);
+        pthread_mutex_destroy(&pf->lock);
+        free(pf->starts);
+        free(pf);
+        return -1;
+    }
+    view->prefetch = pf;
+    return 0;
+}
+
+
+/**
+ * Update the position of the reader, once per prefetch chunk.
+ */
+static void prefetch_report(logview_t *view, unsigned segment,
+                            uint64_t offset) {
+    logview_prefetch_t *pf = view->prefetch;
+    if (!pf || (segment == pf->notify_segment && offset < pf->notify_offset))
+        return;
+
+    pf->notify_segment = segment;
+    pf->notify_offset = offset + LOGVIEW_PREFETCH_CHUNK;
+    pthread_mutex_lock(&pf->lock);
+    pf->segment = segment;
+    const logscan_t *scan = &view->segments[segment].scan;
+    pf->offset = scan->inflater ? scan->input_offset : offset;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+
+/**
+ * Stop reading ahead.
+ */
+static void prefetch_close(logview_t *view) {
+    logview_prefetch_t *pf = view->prefetch;
+    if (!pf)
+        return;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf->starts);
+    free(pf);
+    view->prefetch = NULL;
+}
+
+
+/**
+ * Close a segment, keeping its count of malformed bytes.
+ */
+static void close_segment(logview_t *view, logview_segment_t *segment) {
+    if (!segment->open)
+        return;
+    view->malformed += segment->scan.malformed;
+    logscan_close(&segment->scan);
+    segment->open = false;
+    segment->reached = true;
+}
+
+
+/**
+ * Read the next record of a segment, closing it at its end.
+ * @return 0 if success, -1 if error.
+ */
+static int advance(logview_t *view, logview_segment_t *segment) {
+    int status = logscan_next(&segment->scan, &segment->record);
+    if (status <= 0)
+        close_segment(view, segment);
+    if (status < 0)
+        syslog(LOG_ERR, "Error reading `%s`", segment->path);
+    return status < 0 ? -1 : 0;
+}
+
+
+/**
+ * Open the next segment and read its first record.
+ * @return 0 if success, -1 if error.
+ */
+static int open_segment(logview_t *view) {
+    logview_segment_t *segment = &view->segments[view->next_open++];
+    if (logscan_open(&segment->scan, segment->path, view->format))
+        return -1;
+    segment->open = true;
+
+    // The definitions of the first segment outlive it
+    if (segment == view->segments && segment->scan.schema.nmessages) {
+        uint8_t *defs;
+        size_t len;
+        if (mavschema_encode(&segment->scan.schema, &defs, &len))
+            return -1;
+        int status = mavschema_decode(&view->schema, defs, len);
+        free(defs);
+        if (status)
+            return -1;
+    }
+    return advance(view, segment);
+}
+
+
+/**
+ * Open the segments of a log for reading, the first one at once.
+ * @param paths of the segments, in the order of their start.
+ * @param format of the segments, LOGSCAN_AUTO to detect for each.
+ * @return 0 if success, -1 if error.
+ */
+int logview_open(logview_t *view, char *const *paths, unsigned npaths,
+                 logscan_format_t format) {
+    memset(view, 0, sizeof *view);
+    view->format = format;
+    view->current = -1;
+
+    view->segments = calloc(npaths ? npaths : 1, sizeof *view->segments);
+    if (!view->segments) {
+        syslog(LOG_ERR, "Error allocating segments: %s", strerror(errno));
+        return -1;
+    }
+    for (unsigned i=0; i<npaths; i++)
+        view->segments[i].path = paths[i];
+    view->nsegments = npaths;
+
+    if (prefetch_open(view) || (npaths && open_segment(view))) {
+        logview_close(view);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Read the next record in time order. The record points into its segment
+ * until the next read, view->current being the segment.
+ * @return 1 if read, 0 at the end of the last segment, -1 if error.
+ */
+int logview_next(logview_t *view, logrecord_t *record) {
+    if (view->current >= 0
+        && advance(view, &view->segments[view->current]))
+        return -1;
+
+    // The next segment joins once the previous one is reached
+    while (view->first_open < view->next_open
+           && !view->segments[view->first_open].open)
+        view->first_open++;
+    while (view->next_open < view->nsegments
+           && (view->first_open == view->next_open
+               || view->segments[view->next_open - 1].reached)) {
+        if (open_segment(view))
+            return -1;
+        while (view->first_open < view->next_open
+               && !view->segments[view->first_open].open)
+            view->first_open++;
+    }
+
+    // Earliest record of the open segments, the first segment on ties
+    int best = -1;
+    for (unsigned i=view->first_open; i<view->next_open; i++) {
+        const logview_segment_t *segment = &view->segments[i];
+        if (segment->open
+            && (best < 0 || segment->record.time_usec
+                            < view->segments[best].record.time_usec))
+            best = i;
+    }
+    view->current = best;
+    if (best < 0)
+        return 0;
+
+    logview_segment_t *segment = &view->segments[best];
+    segment->reached = true;
+    *record = segment->record;
+    prefetch_report(view, view->first_open,
+                    view->segments[view->first_open].record.offset);
+    return 1;
+}
+
+
+/**
+ * Close the open segments and free the view.
+ */
+void logview_close(logview_t *view) {
+    prefetch_close(view);
+    for (unsigned i=0; i<view->nsegments; i++)
+        close_segment(view, &view->segments[i]);
+    free(view->segments);
+    view->segments = NULL;
+    view->nsegments = 0;
+    mavschema_free(&view->schema);
+}
@@ -0,0 +1,53 @@
+/**
+ * Reader of a log split in segments, by restarts or rotation, as one
+ * stream in time order.
+ */
+
+#ifndef LOGVIEW_H
+#define LOGVIEW_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "logscan.h"
+#include "mavschema.h"
+
+
+/** Bytes read ahead of the reader, across the following segments. */
+#define LOGVIEW_READAHEAD (64 * 1024 * 1024)
+
+/** Length of the ranges read ahead at once. */
+#define LOGVIEW_PREFETCH_CHUNK (4 * 1024 * 1024)
+
+
+/** Segment of a log. */
+typedef struct logview_segment {
+    const char *path;
+    bool open;
+    bool reached; ///< Whether a record of the segment was read.
+    logscan_t scan;
+    logrecord_t record; ///< Next record of the segment, if open.
+} logview_segment_t;
+
+/** Reader of the segments of a log. */
+typedef struct logview {
+    logscan_format_t format;
+    logview_segment_t *segments;
+    unsigned nsegments;
+    unsigned first_open; ///< First segment not closed yet.
+    unsigned next_open; ///< First segment not opened yet.
+    int current; ///< Segment of the last record read, -1 if none.
+    uint64_t malformed; ///< Bytes of the closed segments not in a record.
+    mavschema_t schema; ///< Definitions embedded in the first segment.
+    struct logview_prefetch *prefetch; ///< NULL if not started.
+} logview_t;
+
+
+int logview_open(logview_t *view, char *const *paths, unsigned npaths,
+                 logscan_format_t format);
+int logview_next(logview_t *view, logrecord_t *record);
+void logview_close(logview_t *view);
+
+
+#endif//LOGVIEW_H
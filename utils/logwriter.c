@@ -0,0 +1,184 @@
+/**
+ * Batched writer for binary logs.
+ *
+ * Records are gathered in a memory buffer and written to the file with a
+ * single system call when the buffer fills up or on explicit flushes, so
+ * that the acquisition loops do not pay for a write per message.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "logwriter.h"
+
+
+/**
+ * Open a log file for batched writing, truncating it if it exists.
+ * @param path of the log file.
+ * @param size of the batch buffer, 0 for the default.
+ * @return the writer or NULL if error.
+ */
+logwriter_t* logwriter_open(const char *path, size_t bufsize) {
+    if (!bufsize)
+        bufsize = LOGWRITER_DEFAULT_BUFSIZE;
+
+    logwriter_t *writer = calloc(1, sizeof *writer);
+    if (!writer || !(writer->buf = malloc(bufsize))) {
+        syslog(LOG_ERR, "Error allocating log writer: %s", strerror(errno));
+        free(writer);
+        return NULL;
+    }
+    writer->size = bufsize;
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        char *msg = "Error opening log file `%s`: %s";
+        syslog(LOG_ERR, msg, path, strerror(errno));
+        free(writer->buf);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+
+/**
+ * Write the batch buffer to the file.
+ * @return 0 if success, -1 if error.
+ */
+int logwriter_flush(logwriter_t *writer) {
+    size_t done = 0;
+    while (done < writer->used) {
+        ssize_t n = write(writer->fd, writer->buf + done, writer->used - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Error writing to log: %s", strerror(errno));
+            writer->used = 0;
+            return -1;
+        }
+        done += n;
+    }
+
+    writer->written += done;
+    writer->used = 0;
+    return 0;
+}
+
+
+/**
+ * Append raw bytes to the log.
+ * @return 0 if success, -1 if error.
+ */
+int logwriter_append(logwriter_t *writer, const void *data, size_t len) {
+    if (writer->used + len > writer->size && logwriter_flush(writer))
+        return -1;
+
+    // Data larger than the buffer bypasses it
+    if (len > writer->size) {
+        writer->used = len;
+        uint8_t *buf = writer->buf;
+        writer->buf = (uint8_t *) data;
+        int status = logwriter_flush(writer);
+        writer->buf = buf;
+        return status;
+    }
+
+    memcpy(writer->buf + writer->used, data, len);
+    writer->used += len;
+    return 0;
+}
+
+
+/**
+ * Encode the header embedding the compiled message definitions, so that a
+ * log can be decoded without the code it was written with: LOGWRITER_MAGIC,
+ * the little-endian 32-bit LOGWRITER_VERSION and length of the definitions,
+ * then the definitions as encoded by mavschema_encode.
+ * @param[out] buf set to the header, allocated with malloc.
+ * @param[out] len length of the header.
+ * @return 0 if success, -1 if error.
+ */
+int logwriter_header_encode(const mavschema_t *schema, uint8_t **buf,
+                            size_t *len) {
+    uint8_t *defs;
+    size_t defs_len;
+    if (mavschema_encode(schema, &defs, &defs_len))
+        return -1;
+
+    uint8_t *header = realloc(defs, LOGWRITER_HEADER_LEN + defs_len);
+    if (!header) {
+        syslog(LOG_ERR, "Error allocating log header: %s", strerror(errno));
+        free(defs);
+        return -1;
+    }
+    memmove(header + LOGWRITER_HEADER_LEN, header, defs_len);
+    memcpy(header, LOGWRITER_MAGIC, 8);
+    uint32_t version_le = htole32(LOGWRITER_VERSION);
+    uint32_t len_le = htole32(defs_len);
+    memcpy(header + 8, &version_le, 4);
+    memcpy(header + 12, &len_le, 4);
+
+    *buf = header;
+    *len = LOGWRITER_HEADER_LEN + defs_len;
+    return 0;
+}
+
+
+/**
+ * Start the log with the header embedding the message definitions.
+ * Must precede the first record.
+ * @return 0 if success, -1 if error.
+ */
+int logwriter_header(logwriter_t *writer, const mavschema_t *schema) {
+    uint8_t *header;
+    size_t len;
+    if (logwriter_header_encode(schema, &header, &len))
+        return -1;
+
+    int status = logwriter_append(writer, header, len);
+    free(header);
+    return status;
+}
+
+
+/**
+ * Append a mavlog record: a big-endian 64-bit timestamp followed by a frame.
+ * @param log writer.
+ * @param timestamp in microseconds since epoch.
+ * @param MAVLink frame.
+ * @param length of the frame.
+ * @return 0 if success, -1 if error.
+ */
+int logwriter_record(logwriter_t *writer, uint64_t timestamp,
+                     const void *frame, size_t len) {
+    if (writer->used + sizeof timestamp + len > writer->size
+        && logwriter_flush(writer))
+        return -1;
+
+    uint64_t timestamp_be = htobe64(timestamp);
+    if (logwriter_append(writer, &timestamp_be, sizeof timestamp_be))
+        return -1;
+    return logwriter_append(writer, frame, len);
+}
+
+
+/**
+ * Flush the pending records and close the log.
+ */
+void logwriter_close(logwriter_t *writer) {
+    if (!writer)
+        return;
+
+    logwriter_flush(writer);
+    if (close(writer->fd))
+        syslog(LOG_ERR, "Error closing log: %s", strerror(errno));
+    free(writer->buf);
+    free(writer);
+}
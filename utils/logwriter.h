@@ -0,0 +1,49 @@
+/**
+ * Batched writer for binary logs.
+ */
+
+#ifndef LOGWRITER_H
+#define LOGWRITER_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavschema.h"
+
+
+/** Default size of the batch buffer. */
+#define LOGWRITER_DEFAULT_BUFSIZE (256 * 1024)
+
+/** Magic string at the start of logs with embedded message definitions. */
+#define LOGWRITER_MAGIC "FDAS3LOG"
+
+/** Version of the log header layout. */
+#define LOGWRITER_VERSION 1
+
+/** Length of the log header before the compiled message definitions. */
+#define LOGWRITER_HEADER_LEN 16
+
+
+/** Batched log writer. */
+typedef struct logwriter {
+    int fd;
+    uint8_t *buf;
+    size_t size; ///< Capacity of the batch buffer.
+    size_t used; ///< Bytes waiting in the batch buffer.
+    uint64_t written; ///< Bytes written to the file so far.
+} logwriter_t;
+
+
+logwriter_t* logwriter_open(const char *path, size_t bufsize);
+int logwriter_header_encode(const mavschema_t *schema, uint8_t **buf,
+                            size_t *len);
+int logwriter_header(logwriter_t *writer, const mavschema_t *schema);
+int logwriter_append(logwriter_t *writer, const void *data, size_t len);
+int logwriter_record(logwriter_t *writer, uint64_t timestamp,
+                     const void *frame, size_t len);
+int logwriter_flush(logwriter_t *writer);
+void logwriter_close(logwriter_t *writer);
+
+
+#endif//LOGWRITER_H
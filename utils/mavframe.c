@@ -0,0 +1,145 @@
+/**
+ * Dialect-independent scanner for MAVLink 1 and 2 frames in byte blocks.
+ */
+
+#include <string.h>
+
+#include "mavframe.h"
+
+
+/**
+ * Accumulate the MAVLink (X.25) checksum over a buffer.
+ * @param data to checksum.
+ * @param length of the data.
+ * @param initial checksum value, 0xFFFF to start a new checksum.
+ * @return the accumulated checksum.
+ */
+uint16_t mavframe_crc(const uint8_t *data, size_t len, uint16_t crc) {
+    for (size_t i=0; i<len; i++) {
+        uint8_t tmp = data[i] ^ (uint8_t)(crc & 0xFF);
+        tmp ^= tmp << 4;
+        crc = (crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4);
+    }
+    return crc;
+}
+
+
+/**
+ * Check the checksum of a complete candidate frame.
+ * @param crc_pos offset of the checksum in the frame, after the payload.
+ */
+static bool check_crc(mavframe_scanner_t *scanner, const uint8_t *data,
+                      size_t crc_pos, uint32_t msgid) {
+    int extra;
+    if (scanner->crc_extra)
+        extra = scanner->crc_extra(msgid);
+    else if (scanner->crc_extras)
+        extra = msgid < scanner->ncrc_extras ? scanner->crc_extras[msgid] : -1;
+    else
+        return true;
+    if (extra < 0)
+        return scanner->accept_unknown;
+
+    uint8_t extra_byte = extra;
+    uint16_t crc = mavframe_crc(data + 1, crc_pos - 1, 0xFFFF);
+    crc = mavframe_crc(&extra_byte, 1, crc);
+    return (data[crc_pos] | data[crc_pos + 1] << 8) == crc;
+}
+
+
+/**
+ * Find the next start marker of either protocol version.
+ * @return the offset of the marker or `len` if none.
+ */
+static size_t find_stx(const uint8_t *buf, size_t i, size_t len) {
+    while (i < len && buf[i] != MAVFRAME_V1_STX && buf[i] != MAVFRAME_V2_STX)
+        i++;
+    return i;
+}
+
+
+/**
+ * Find the next MAVLink 1 or 2 frame in a block of bytes.
+ *
+ * The frame is not copied, it points into the scanned buffer. When no
+ * complete frame is found, `pos` is left at the start of the incomplete
+ * candidate frame (or at the end of the block), so that the caller can keep
+ * the tail of the block and retry once more data is available.
+ *
+ * @param scanner state and counters.
+ * @param block of bytes to scan.
+ * @param length of the block.
+ * @param[in,out] offset where the scan starts, updated past the found frame.
+ * @param[out] the frame found.
+ * @return 1 if a frame was found, 0 if more data is needed.
+ */
+int mavframe_next(mavframe_scanner_t *scanner, const uint8_t *buf, size_t len,
+                  size_t *pos, mavframe_t *frame) {
+    size_t i = *pos;
+
+    while (i < len) {
+        // Look for the start marker
+        size_t stx = find_stx(buf, i, len);
+        scanner->skipped += stx - i;
+        i = stx;
+        if (i == len)
+            break;
+
+        // Wait for the whole frame
+        const uint8_t *data = buf + i;
+        bool v2 = data[0] == MAVFRAME_V2_STX;
+        size_t header_len = v2 ? MAVFRAME_V2_HEADER_LEN
+                               : MAVFRAME_V1_HEADER_LEN;
+        if (len - i < header_len)
+            break;
+        size_t crc_pos = header_len + data[1];
+        size_t frame_len = crc_pos + MAVFRAME_CHECKSUM_LEN;
+        if (v2 && data[2] & MAVFRAME_V2_IFLAG_SIGNED)
+            frame_len += MAVFRAME_V2_SIGNATURE_LEN;
+        if (len - i < frame_len)
+            break;
+
+        // Validate, on failure resume the search after the marker
+        uint32_t msgid = v2 ? data[7] | data[8] << 8 | (uint32_t) data[9] << 16
+                            : data[5];
+        if (!check_crc(scanner, data, crc_pos, msgid)) {
+            scanner->bad_crc++;
+            scanner->skipped++;
+            i++;
+            continue;
+        }
+
+        frame->data = data;
+        frame->len = frame_len;
+        frame->payload = data + header_len;
+        frame->payload_len = data[1];
+        frame->version = v2 ? 2 : 1;
+        frame->incompat_flags = v2 ? data[2] : 0;
+        frame->compat_flags = v2 ? data[3] : 0;
+        frame->seq = data[v2 ? 4 : 2];
+        frame->sysid = data[v2 ? 5 : 3];
+        frame->compid = data[v2 ? 6 : 4];
+        frame->msgid = msgid;
+
+        scanner->frames++;
+        *pos = i + frame_len;
+        return 1;
+    }
+
+    *pos = i;
+    return 0;
+}
+
+
+/**
+ * Copy the payload of a frame, restoring the trailing zeros that MAVLink 2
+ * truncates.
+ * @param frame found by the scanner.
+ * @param[out] dst buffer of the full payload.
+ * @param len length of the full payload of the message.
+ */
+void mavframe_payload(const mavframe_t *frame, void *dst, size_t len) {
+    size_t copy = frame->payload_len < len ? frame->payload_len : len;
+    memcpy(dst, frame->payload, copy);
+    memset((uint8_t *) dst + copy, 0, len - copy);
+}
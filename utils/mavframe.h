@@ -0,0 +1,85 @@
+/**
+ * Dialect-independent scanner for MAVLink 1 and 2 frames in byte blocks.
+ */
+
+#ifndef MAVFRAME_H
+#define MAVFRAME_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** MAVLink 1.0 start-of-frame marker. */
+#define MAVFRAME_V1_STX 0xFE
+
+/** Length of the MAVLink 1.0 header, including the start marker. */
+#define MAVFRAME_V1_HEADER_LEN 6
+
+/** MAVLink 2 start-of-frame marker. */
+#define MAVFRAME_V2_STX 0xFD
+
+/** Length of the MAVLink 2 header, including the start marker. */
+#define MAVFRAME_V2_HEADER_LEN 10
+
+/** MAVLink 2 incompatibility flag of signed frames. */
+#define MAVFRAME_V2_IFLAG_SIGNED 0x01
+
+/** Length of the MAVLink 2 signature block. */
+#define MAVFRAME_V2_SIGNATURE_LEN 13
+
+/** Length of the frame checksum. */
+#define MAVFRAME_CHECKSUM_LEN 2
+
+/** Maximum length of a MAVLink frame. */
+#define MAVFRAME_MAX_LEN 280
+
+
+/**
+ * CRC extra lookup function.
+ * @param message identifier.
+ * @return the CRC extra byte of the message or -1 if the message is unknown.
+ */
+typedef int (*mavframe_crc_extra_fn)(uint32_t msgid);
+
+
+/** A MAVLink frame found in a block, pointing into the scanned buffer. */
+typedef struct mavframe {
+    const uint8_t *data; ///< Start of the frame, at the start marker.
+    size_t len; ///< Length of the whole frame.
+    const uint8_t *payload; ///< Start of the payload.
+    uint8_t payload_len; ///< MAVLink 2 payloads may be zero-truncated.
+    uint8_t version; ///< 1 or 2.
+    uint8_t incompat_flags; ///< MAVLink 2 only, 0 otherwise.
+    uint8_t compat_flags; ///< MAVLink 2 only, 0 otherwise.
+    uint8_t seq;
+    uint8_t sysid;
+    uint8_t compid;
+    uint32_t msgid;
+} mavframe_t;
+
+
+/** Scanner state and counters. */
+typedef struct mavframe_scanner {
+    /** CRC extra lookup, frames are not checksummed without any. */
+    mavframe_crc_extra_fn crc_extra;
+    /** CRC extras by message id, -1 if unknown, used if `crc_extra` is NULL. */
+    const int16_t *crc_extras;
+    uint32_t ncrc_extras; ///< Length of `crc_extras`.
+    /** Accept unchecked the frames of messages unknown to the lookup. */
+    bool accept_unknown;
+
+    uint64_t frames; ///< Number of valid frames found.
+    uint64_t bad_crc; ///< Number of candidate frames with invalid checksum.
+    uint64_t skipped; ///< Number of bytes discarded between frames.
+} mavframe_scanner_t;
+
+
+uint16_t mavframe_crc(const uint8_t *data, size_t len, uint16_t crc);
+int mavframe_next(mavframe_scanner_t *scanner, const uint8_t *buf, size_t len,
+                  size_t *pos, mavframe_t *frame);
+void mavframe_payload(const mavframe_t *frame, void *dst, size_t len);
+
+
+#endif//MAVFRAME_H
@@ -9,6 +9,8 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,9 +21,16 @@
 #include <unistd.h>
 
 #include "mavlink/v1.0/ceaufmg/mavlink.h"
+#include "./logwriter.h"
+#include "./mavschema.h"
+#include "./sink.h"
 #include "./utils.h"
 
 
+/** Maximum number of demultiplexed channel streams. */
+#define MAX_CHANNELS 256
+
+
 /** Program version. */
 const char *argp_program_version = "mavlog 0.1";
 
@@ -36,6 +45,17 @@ static char args_doc[] = "DEVICE LOGFILE";
 
 /** Program options structure. */
 static struct argp_option options[] = {
+    {"demux", 'd', "DIR", 0,
+     "Write each DATA_INT/DATA_FLOAT/DATA_DOUBLE id to its own stream in DIR"},
+    {"xml", 'x', "PATH", 0,
+     "Message definitions file or directory embedded in the log header, may "
+     "be repeated"},
+    {0}
+};
+
+/** Child option parsers. */
+static struct argp_child children[] = {
+    {&sink_argp, 0, "Republishing options:", 0},
     {0}
 };
 
@@ -43,8 +63,33 @@ static struct argp_option options[] = {
 typedef struct arguments {
     char *device;
     char *logfile;
+    char *demux_dir;
+    char *xml[16];
+    int nxml;
+    sink_config_t sink;
 } arguments_t;
 
+/**
+ * Demultiplexed channel stream.
+ *
+ * The stream holds one record per sample: the 64-bit `time_usec` of the
+ * message followed by the value, as a 64-bit integer for DATA_INT or as a
+ * double for DATA_FLOAT and DATA_DOUBLE, both in host byte order.
+ */
+typedef struct channel {
+    uint32_t msgid;
+    uint16_t id;
+    logwriter_t *writer;
+} channel_t;
+
+/** Channel demultiplexer state. */
+typedef struct demux {
+    char *dir;
+    channel_t channels[MAX_CHANNELS];
+    unsigned nchannels;
+    bool full;
+} demux_t;
+
 
 /** Argument parser function */
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
@@ -52,6 +97,20 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     arguments_t *arguments = state->input;
     
     switch (key) {
+    case ARGP_KEY_INIT:
+        state->child_inputs[0] = &arguments->sink;
+        break;
+        
+    case 'd':
+        arguments->demux_dir = arg;
+        break;
+
+    case 'x':
+        if (arguments->nxml == sizeof arguments->xml / sizeof *arguments->xml)
+            argp_error(state, "Too many definitions.");
+        arguments->xml[arguments->nxml++] = arg;
+        break;
+        
     case ARGP_KEY_ARG:
         if (state->arg_num == 0)
             arguments->device = arg;
@@ -75,7 +134,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
 
 /** Argument parser object. */
-static struct argp argp = {options, parse_opt, args_doc, doc};
+static struct argp argp = {options, parse_opt, args_doc, doc, children};
 
 
 /**
@@ -108,29 +167,139 @@ int open_serial_port(char *device) {
 }
 
 
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
 /**
- * Open the logfile.
+ * Open the logfile, headed by the given message definitions.
  * Aborts the program on error.
  */
-FILE* open_log(char *filename) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        char *msg = "Error opening log file %s: %s";
-        syslog(LOG_ERR, msg, filename,  strerror(errno));
+logwriter_t* open_log(const arguments_t *args) {
+    logwriter_t *log = logwriter_open(args->logfile, 0);
+    if (!log)
+        exit(EXIT_FAILURE);
+    if (!args->nxml)
+        return log;
+
+    mavschema_t schema = {0};
+    for (int i=0; i<args->nxml; i++)
+        if (mavschema_load(&schema, args->xml[i]))
+            exit(EXIT_FAILURE);
+    if (logwriter_header(log, &schema))
         exit(EXIT_FAILURE);
+    mavschema_free(&schema);
+    return log;
+}
+
+
+/**
+ * Find or open the stream of a channel.
+ * @return the stream writer or NULL if unavailable.
+ */
+static logwriter_t* demux_channel(demux_t *demux, uint32_t msgid,
+                                  uint16_t id) {
+    for (unsigned i=0; i<demux->nchannels; i++) {
+        channel_t *channel = &demux->channels[i];
+        if (channel->msgid == msgid && channel->id == id)
+            return channel->writer;
+    }
+    
+    if (demux->nchannels == MAX_CHANNELS) {
+        if (!demux->full)
+            syslog(LOG_WARNING, "Too many channels, not demultiplexing more");
+        demux->full = true;
+        return NULL;
+    }
+    
+    char *type = msgid == MAVLINK_MSG_ID_DATA_INT ? "int"
+               : msgid == MAVLINK_MSG_ID_DATA_FLOAT ? "float" : "double";
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s_%hu.bin", demux->dir, type, id);
+    
+    // A channel failing to open is remembered with a NULL writer
+    channel_t *channel = &demux->channels[demux->nchannels++];
+    channel->msgid = msgid;
+    channel->id = id;
+    channel->writer = logwriter_open(path, 16 * 1024);
+    return channel->writer;
+}
+
+
+/**
+ * Write the sample of a DATA_INT/DATA_FLOAT/DATA_DOUBLE message to its
+ * channel stream.
+ */
+void demux_write(demux_t *demux, mavlink_message_t *msg) {
+    uint64_t time_usec;
+    uint16_t id;
+    union {int64_t i; double d;} value;
+    
+    switch (msg->msgid) {
+    case MAVLINK_MSG_ID_DATA_INT:
+        {
+            mavlink_data_int_t payload;
+            mavlink_msg_data_int_decode(msg, &payload);
+            time_usec = payload.time_usec;
+            id = payload.id;
+            value.i = payload.value;
+        }
+        break;
+        
+    case MAVLINK_MSG_ID_DATA_FLOAT:
+        {
+            mavlink_data_float_t payload;
+            mavlink_msg_data_float_decode(msg, &payload);
+            time_usec = payload.time_usec;
+            id = payload.id;
+            value.d = payload.value;
+        }
+        break;
+        
+    case MAVLINK_MSG_ID_DATA_DOUBLE:
+        {
+            mavlink_data_double_t payload;
+            mavlink_msg_data_double_decode(msg, &payload);
+            time_usec = payload.time_usec;
+            id = payload.id;
+            value.d = payload.value;
+        }
+        break;
+        
+    default:
+        return;
+    }
+    
+    logwriter_t *writer = demux_channel(demux, msg->msgid, id);
+    if (writer) {
+        logwriter_append(writer, &time_usec, sizeof time_usec);
+        logwriter_append(writer, &value, sizeof value);
     }
 }
 
 
-void logwrite(FILE *log, mavlink_message_t *msg) {
-    uint64_t timestamp_be = htobe64(get_time_us());
-    if (!fwrite(&timestamp_be, sizeof timestamp_be, 1, log))
-        syslog(LOG_ERR, "Error writing timestamp to log: %s", strerror(errno));
+/**
+ * Write the pending samples of all channel streams.
+ */
+void demux_flush(demux_t *demux) {
+    for (unsigned i=0; i<demux->nchannels; i++)
+        if (demux->channels[i].writer)
+            logwriter_flush(demux->channels[i].writer);
+}
 
-    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
-    size_t len = mavlink_msg_to_send_buffer(buf, msg);
-    if (!fwrite(buf, len, 1, log))
-        syslog(LOG_ERR, "Error writing message to log: %s", strerror(errno));
+
+/**
+ * Close all channel streams.
+ */
+void demux_close(demux_t *demux) {
+    for (unsigned i=0; i<demux->nchannels; i++)
+        logwriter_close(demux->channels[i].writer);
+    demux->nchannels = 0;
 }
 
 
@@ -142,24 +311,52 @@ int main(int argc, char **argv) {
     // Setup syslog
     openlog(0, LOG_PERROR, 0);
     
+    // Flush the batched logs when stopped
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
     // Open the output streams
     int port = open_serial_port(arguments.device);
-    FILE *log = open_log(arguments.logfile);    
+    logwriter_t *log = open_log(&arguments);
+    sink_t sink;
+    sink_open(&arguments.sink, &sink);
+    demux_t demux = {.dir=arguments.demux_dir};
 
     // Read loop
     mavlink_message_t msg;
     mavlink_status_t status;
+    uint64_t last_flush = get_time_us();
     
-    for (;;) {
-        char c;
-        int n = read(port, &c, 1);
-        if (n == 1) {
-            if (mavlink_parse_char(MAVLINK_COMM_1, c, &msg, &status))
-                logwrite(log, &msg);
-        } else if (n < 0) {
+    while (!stop_requested) {
+        uint8_t block[256];
+        ssize_t n = read(port, block, sizeof block);
+        if (n < 0 && errno != EINTR)
             syslog(LOG_ERR, "Error reading serial port: %s", strerror(errno));
+        
+        uint64_t now = get_time_us();
+        for (ssize_t i=0; i<n; i++) {
+            if (!mavlink_parse_char(MAVLINK_COMM_1, block[i], &msg, &status))
+                continue;
+            
+            uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+            size_t len = mavlink_msg_to_send_buffer(buf, &msg);
+            logwriter_record(log, now, buf, len);
+            sink_send(&sink, buf, len);
+            if (demux.dir)
+                demux_write(&demux, &msg);
+        }
+        
+        // Keep at most a second of data in memory
+        if (now - last_flush >= 1000000) {
+            logwriter_flush(log);
+            demux_flush(&demux);
+            last_flush = now;
         }
     }
     
+    logwriter_close(log);
+    sink_close(&sink);
+    demux_close(&demux);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,324 @@
+/**
+ * Build and read the summary pyramids of binary logs.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "logscan.h"
+#include "mavschema.h"
+#include "pyramid.h"
+
+
+/** Program version. */
+const char *argp_program_version = "mavpyramid 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "mavpyramid -- Build and read the summary pyramids of "
+    "binary logs."
+    "\vWithout --channel, the pyramid LOGFILE.pyr of each LOGFILE is built: "
+    "the minimum, maximum, mean and count of every numeric message field "
+    "over blocks of 64, 128, 256... samples. mavrecord --pyramid builds it "
+    "while recording. Logs embedding their message definitions are "
+    "summarized with them, unless --xml is given.\n\n"
+    "With --channel, the summary of a field such as ADC_RAW.data[3] or "
+    "AHRS_ANGLES.roll is printed at the level of detail of a plot WIDTH "
+    "pixels wide over the selected time range, one line per entry: start "
+    "and end time in microseconds, number of samples, minimum, maximum and "
+    "mean.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "LOGFILE...";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"xml", 'x', "PATH", 0,
+     "Message definitions file or directory, may be repeated, defaults to "
+     "those embedded in the logs, or else " MAVSCHEMA_DEFAULT_DIR},
+    {"format", 'f', "FORMAT", 0, "Log format: mavlog or logbin, detected "
+     "by default"},
+    {"list", 'l', 0, 0, "List the channels and levels of the pyramids"},
+    {"channel", 'c', "NAME", 0, "Print the summary of channel NAME"},
+    {"start", 's', "USEC", 0, "Start of the printed time range"},
+    {"end", 'e', "USEC", 0, "End of the printed time range"},
+    {"width", 'w', "PIXELS", 0, "Plot width, defaults to 1000"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char **files;
+    int nfiles;
+    char *xml[16];
+    int nxml;
+    logscan_format_t format;
+    bool list;
+    char *channel;
+    uint64_t start_usec;
+    uint64_t end_usec;
+    unsigned width;
+} arguments_t;
+
+
+/** Parse an unsigned integer argument, aborting on error. */
+static unsigned long long parse_uint(struct argp_state *state, char *arg,
+                                     unsigned long long max, char *name) {
+    char *endptr = 0;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &endptr, 0);
+    if (*endptr || !*arg)
+        argp_error(state, "%s argument must be an integer.", name);
+    if (errno || value > max)
+        argp_error(state, "%s number too large.", name);
+    return value;
+}
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'x':
+        if (arguments->nxml == sizeof arguments->xml / sizeof *arguments->xml)
+            argp_error(state, "Too many definitions.");
+        arguments->xml[arguments->nxml++] = arg;
+        break;
+
+    case 'f':
+        if (!strcmp(arg, "mavlog"))
+            arguments->format = LOGSCAN_MAVLOG;
+        else if (!strcmp(arg, "logbin"))
+            arguments->format = LOGSCAN_LOGBIN;
+        else
+            argp_error(state, "Unknown FORMAT `%s`.", arg);
+        break;
+
+    case 'l':
+        arguments->list = true;
+        break;
+
+    case 'c':
+        arguments->channel = arg;
+        break;
+
+    case 's':
+        arguments->start_usec = parse_uint(state, arg, UINT64_MAX, "USEC");
+        break;
+
+    case 'e':
+        arguments->end_usec = parse_uint(state, arg, UINT64_MAX, "USEC");
+        break;
+
+    case 'w':
+        arguments->width = parse_uint(state, arg, 1 << 20, "PIXELS");
+        if (!arguments->width)
+            argp_error(state, "PIXELS must be positive.");
+        break;
+
+    case ARGP_KEY_ARGS:
+        arguments->files = state->argv + state->next;
+        arguments->nfiles = state->argc - state->next;
+        break;
+
+    case ARGP_KEY_NO_ARGS:
+        argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+/**
+ * Load the given or installed message definitions, unless already done.
+ * @return 0 if success, -1 if error.
+ */
+static int load_definitions(const arguments_t *args, mavschema_t *schema) {
+    if (schema->nmessages)
+        return 0;
+    if (!args->nxml)
+        return mavschema_load(schema, MAVSCHEMA_DEFAULT_DIR);
+    for (int i=0; i<args->nxml; i++)
+        if (mavschema_load(schema, args->xml[i]))
+            return -1;
+    return 0;
+}
+
+
+/**
+ * Build the pyramid of a log.
+ * @param defs given or installed definitions, loaded on first use.
+ * @return 0 if success, -1 if error.
+ */
+static int build(const arguments_t *args, mavschema_t *defs,
+                 const char *path) {
+    char pyr_path[PATH_MAX];
+    if (pyramid_path(path, pyr_path, sizeof pyr_path))
+        return -1;
+
+    logscan_t scan;
+    if (logscan_open(&scan, path, args->format))
+        return -1;
+
+    // The definitions embedded in the log decode it, unless overridden
+    const mavschema_t *schema = &scan.schema;
+    if (args->nxml || !scan.schema.nmessages) {
+        if (load_definitions(args, defs)) {
+            logscan_close(&scan);
+            return -1;
+        }
+        schema = defs;
+    }
+
+    pyramid_writer_t *writer = pyramid_writer_open(pyr_path, schema);
+    if (!writer) {
+        logscan_close(&scan);
+        return -1;
+    }
+
+    logrecord_t record;
+    int status;
+    while ((status = logscan_next(&scan, &record)) > 0)
+        if (pyramid_writer_frame(writer, record.time_usec, &record.frame))
+            break;
+    if (status > 0)
+        status = -1;
+
+    if (scan.malformed)
+        syslog(LOG_WARNING, "Skipped %llu malformed bytes in `%s`",
+               (unsigned long long) scan.malformed, path);
+    if (pyramid_writer_close(writer))
+        status = -1;
+    logscan_close(&scan);
+    return status;
+}
+
+
+/**
+ * List the channels and levels of a pyramid.
+ */
+static void list(const pyramid_t *pyr) {
+    for (unsigned i=0; i<pyr->nchannels; i++) {
+        const pyramid_channel_t *ch = &pyr->channels[i];
+        const pyramid_level_t *finest = &ch->levels[0];
+        printf("%s: %u levels, %llu entries at level 0", ch->name,
+               ch->nlevels, (unsigned long long) finest->nentries);
+        if (finest->nentries)
+            printf(", %llu to %llu",
+                   (unsigned long long) finest->start_usec,
+                   (unsigned long long) finest->end_usec);
+        printf("\n");
+    }
+}
+
+
+/**
+ * Print the summary of a channel at the level of detail of a plot.
+ * @return 0 if success, -1 if error.
+ */
+static int print_channel(const arguments_t *args, const pyramid_t *pyr,
+                         const char *path) {
+    int channel = pyramid_find(pyr, args->channel);
+    if (channel < 0) {
+        syslog(LOG_ERR, "No channel `%s` in `%s`", args->channel, path);
+        return -1;
+    }
+
+    // At the chosen level, a plot holds less than two entries per pixel
+    unsigned level = pyramid_select_level(pyr, channel, args->start_usec,
+                                          args->end_usec, args->width);
+    size_t max = 2 * (size_t) args->width + 2;
+    pyramid_entry_t *entries = calloc(max, sizeof *entries);
+    if (!entries) {
+        syslog(LOG_ERR, "Error allocating entries: %s", strerror(errno));
+        return -1;
+    }
+
+    int64_t n = pyramid_read(pyr, channel, level, args->start_usec,
+                             args->end_usec, entries, max);
+    printf("# %s level %u, %llu samples per entry\n", args->channel, level,
+           (unsigned long long) pyr->base << level);
+    for (int64_t i=0; i<n; i++)
+        printf("%llu %llu %llu %.9g %.9g %.9g\n",
+               (unsigned long long) entries[i].start_usec,
+               (unsigned long long) entries[i].end_usec,
+               (unsigned long long) entries[i].count, entries[i].min,
+               entries[i].max, entries[i].mean);
+
+    free(entries);
+    return n < 0 ? -1 : 0;
+}
+
+
+/**
+ * List or print a pyramid.
+ * @return 0 if success, -1 if error.
+ */
+static int read_pyramid(const arguments_t *args, const char *path) {
+    char pyr_path[PATH_MAX];
+    pyramid_t pyr;
+    if (pyramid_path(path, pyr_path, sizeof pyr_path)
+        || pyramid_open(&pyr, pyr_path))
+        return -1;
+
+    int status = 0;
+    if (args->list)
+        list(&pyr);
+    else
+        status = print_channel(args, &pyr, path);
+
+    pyramid_close(&pyr);
+    return status;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.end_usec=UINT64_MAX, .width=1000};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    int status = EXIT_SUCCESS;
+    if (arguments.list || arguments.channel) {
+        for (int i=0; i<arguments.nfiles; i++)
+            if (read_pyramid(&arguments, arguments.files[i]))
+                status = EXIT_FAILURE;
+        return status;
+    }
+
+    // Given definitions are checked before any log
+    mavschema_t schema = {0};
+    if (arguments.nxml && load_definitions(&arguments, &schema))
+        return EXIT_FAILURE;
+
+    for (int i=0; i<arguments.nfiles; i++)
+        if (build(&arguments, &schema, arguments.files[i]))
+            status = EXIT_FAILURE;
+
+    mavschema_free(&schema);
+    return status;
+}
@@ -0,0 +1,1052 @@
+/**
+ * Filter binary logs with a condition on the message fields.
+ *
+ * The condition is compiled against the message definitions into a small
+ * stack bytecode whose field loads are specialized for the field type and
+ * payload offset. Records are decoded in batches and each instruction runs
+ * over the whole batch, so the interpretation overhead is paid once per
+ * batch rather than once per record. When the condition bounds the time
+ * and the log has a time index, the blocks outside the bounds are skipped.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "logscan.h"
+#include "logwriter.h"
+#include "mavschema.h"
+
+
+/** Number of records evaluated together. */
+#define BATCH_LEN 256
+
+/** Maximum depth of the evaluation stack. */
+#define MAX_STACK 32
+
+/** Maximum number of instructions of a compiled condition. */
+#define MAX_PROGRAM 256
+
+/** Program version. */
+const char *argp_program_version = "mavquery 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "mavquery -- Select the records of binary logs matching "
+    "a condition."
+    "\vThe CONDITION is an expression such as\n\n"
+    "  ADC_RAW.data[3] > 1200 && time in [1500000000000000, 1500000060000000]"
+    "\n\nover the message fields MSG.field and MSG.field[i], the bare message "
+    "names (true for records of that message), the record time in "
+    "microseconds and the header fields sysid, compid, msgid and seq. "
+    "Operators are || && ! == != < <= > >= + - * / and `x in [lo, hi]`. "
+    "Fields of other messages than the record's are NaN, so that comparisons "
+    "on them are false.\n\n"
+    "The LOGFILEs are mavlogs or binary logs of the readers (--logbin), "
+    "plain or compressed by gzip. The record time is the mavlog timestamp or the leading time_usec field of "
+    "the message. The time index LOGFILE.idx, built with --index, lets "
+    "conditions bounding the time skip the rest of the log. Logs embedding "
+    "their message definitions are decoded with them, unless --xml is "
+    "given.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "CONDITION LOGFILE...";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"xml", 'x', "PATH", 0,
+     "Message definitions file or directory, may be repeated, defaults to "
+     "those embedded in the logs, or else " MAVSCHEMA_DEFAULT_DIR},
+    {"format", 'f', "FORMAT", 0, "Log format: mavlog or logbin, detected "
+     "by default"},
+    {"output", 'o', "FILE", 0,
+     "Write the matching records to the mavlog FILE instead of printing"},
+    {"count", 'c', 0, 0, "Print only the number of matching records"},
+    {"index", 'I', 0, 0, "Build the time index of logs lacking an up to "
+     "date one"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char *condition;
+    char **files;
+    int nfiles;
+    char *xml[16];
+    int nxml;
+    logscan_format_t format;
+    char *output;
+    bool count;
+    bool index;
+} arguments_t;
+
+/** Bytecode operations. */
+typedef enum {
+    OP_CONST,
+    OP_TIME,
+    OP_SYSID,
+    OP_COMPID,
+    OP_MSGID,
+    OP_SEQ,
+    OP_IS_MSG,
+    OP_FIELD,
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_AND,
+    OP_OR,
+    OP_IN,
+} opcode_t;
+
+/** Load of a little-endian field element from a complete payload. */
+typedef double (*load_fn)(const uint8_t *p);
+
+/** Bytecode instruction. */
+typedef struct instr {
+    opcode_t op;
+    double value; ///< Constant of OP_CONST.
+    uint32_t msgid; ///< Message of OP_IS_MSG and OP_FIELD.
+    const mavschema_field_t *field; ///< Field of OP_FIELD.
+    unsigned index; ///< Array element of OP_FIELD.
+    unsigned offset; ///< Payload offset of the element of OP_FIELD.
+    load_fn load; ///< Specialized load of OP_FIELD.
+} instr_t;
+
+/** Syntax tree node of the condition. */
+typedef struct node {
+    opcode_t op;
+    instr_t leaf; ///< Operand of leaf nodes.
+    struct node *arg[3];
+} node_t;
+
+/** Condition parser state. */
+typedef struct parser {
+    const mavschema_t *schema;
+    const char *text;
+    const char *pos;
+    const char *error;
+} parser_t;
+
+/** Compiled condition. */
+typedef struct program {
+    instr_t code[MAX_PROGRAM];
+    unsigned len;
+    unsigned depth; ///< Maximum stack depth.
+    double min_usec, max_usec; ///< Time bounds implied by the condition.
+} program_t;
+
+/** Message definitions given or installed, loaded on first use. */
+typedef struct definitions {
+    mavschema_t schema;
+    program_t prog; ///< Condition compiled against the definitions.
+    bool loaded;
+} definitions_t;
+
+/** Batch of decoded records. */
+typedef struct batch {
+    unsigned n;
+    double time[BATCH_LEN];
+    double sysid[BATCH_LEN];
+    double compid[BATCH_LEN];
+    double msgid[BATCH_LEN];
+    double seq[BATCH_LEN];
+    uint32_t id[BATCH_LEN];
+    uint64_t time_usec[BATCH_LEN];
+    uint8_t payload_len[BATCH_LEN];
+    uint16_t header_len[BATCH_LEN];
+    uint16_t frame_len[BATCH_LEN];
+    uint8_t frames[BATCH_LEN][MAVFRAME_MAX_LEN];
+} batch_t;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'x':
+        if (arguments->nxml == sizeof arguments->xml / sizeof *arguments->xml)
+            argp_error(state, "Too many definitions.");
+        arguments->xml[arguments->nxml++] = arg;
+        break;
+
+    case 'f':
+        if (!strcmp(arg, "mavlog"))
+            arguments->format = LOGSCAN_MAVLOG;
+        else if (!strcmp(arg, "logbin"))
+            arguments->format = LOGSCAN_LOGBIN;
+        else
+            argp_error(state, "Unknown FORMAT `%s`.", arg);
+        break;
+
+    case 'o':
+        arguments->output = arg;
+        break;
+
+    case 'c':
+        arguments->count = true;
+        break;
+
+    case 'I':
+        arguments->index = true;
+        break;
+
+    case ARGP_KEY_ARGS:
+        arguments->condition = state->argv[state->next];
+        arguments->files = state->argv + state->next + 1;
+        arguments->nfiles = state->argc - state->next - 1;
+        if (arguments->nfiles < 1)
+            argp_error(state, "Not enough arguments.");
+        break;
+
+    case ARGP_KEY_NO_ARGS:
+        argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+static double load_int8(const uint8_t *p) {
+    return (int8_t) p[0];
+}
+
+static double load_uint8(const uint8_t *p) {
+    return p[0];
+}
+
+static double load_int16(const uint8_t *p) {
+    return (int16_t)(p[0] | p[1] << 8);
+}
+
+static double load_uint16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static double load_int32(const uint8_t *p) {
+    return (int32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+static double load_uint32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t load_u64(const uint8_t *p) {
+    return (uint64_t) load_uint32(p) | (uint64_t) load_uint32(p + 4) << 32;
+}
+
+static double load_int64(const uint8_t *p) {
+    return (int64_t) load_u64(p);
+}
+
+static double load_uint64(const uint8_t *p) {
+    return load_u64(p);
+}
+
+static double load_float(const uint8_t *p) {
+    uint32_t u = load_uint32(p);
+    float f;
+    memcpy(&f, &u, sizeof f);
+    return f;
+}
+
+static double load_double(const uint8_t *p) {
+    uint64_t u = load_u64(p);
+    double d;
+    memcpy(&d, &u, sizeof d);
+    return d;
+}
+
+/** Field loads, indexed by type. */
+static const load_fn loads[] = {
+    [MAVSCHEMA_CHAR]=load_uint8,
+    [MAVSCHEMA_INT8]=load_int8,
+    [MAVSCHEMA_UINT8]=load_uint8,
+    [MAVSCHEMA_INT16]=load_int16,
+    [MAVSCHEMA_UINT16]=load_uint16,
+    [MAVSCHEMA_INT32]=load_int32,
+    [MAVSCHEMA_UINT32]=load_uint32,
+    [MAVSCHEMA_INT64]=load_int64,
+    [MAVSCHEMA_UINT64]=load_uint64,
+    [MAVSCHEMA_FLOAT]=load_float,
+    [MAVSCHEMA_DOUBLE]=load_double,
+};
+
+
+/**
+ * Skip whitespace.
+ */
+static void skip_space(parser_t *p) {
+    while (isspace((unsigned char) *p->pos))
+        p->pos++;
+}
+
+
+/**
+ * Skip whitespace and check for a token.
+ * @return whether the token was consumed.
+ */
+static bool accept(parser_t *p, const char *token) {
+    skip_space(p);
+
+    size_t len = strlen(token);
+    if (strncmp(p->pos, token, len))
+        return false;
+
+    // Keywords and single-character operators must not be prefixes
+    if (isalpha((unsigned char) *token)
+        && (isalnum((unsigned char) p->pos[len]) || p->pos[len] == '_'))
+        return false;
+    if (len == 1 && strchr("<>=!", *token) && p->pos[1] == '=')
+        return false;
+    if (len == 1 && strchr("&|", *token) && p->pos[1] == *token)
+        return false;
+
+    p->pos += len;
+    return true;
+}
+
+
+/**
+ * Record the first syntax error.
+ * @return NULL, for use as the result of the failed production.
+ */
+static node_t* fail(parser_t *p, const char *message) {
+    if (!p->error)
+        p->error = message;
+    return NULL;
+}
+
+
+/**
+ * Allocate a node.
+ */
+static node_t* new_node(parser_t *p, opcode_t op, node_t *a, node_t *b,
+                        node_t *c) {
+    if (p->error)
+        return NULL;
+
+    node_t *node = calloc(1, sizeof *node);
+    if (!node)
+        return fail(p, "out of memory");
+    node->op = op;
+    node->leaf.op = op;
+    node->arg[0] = a;
+    node->arg[1] = b;
+    node->arg[2] = c;
+    return node;
+}
+
+
+/**
+ * Free a syntax tree.
+ */
+static void free_node(node_t *node) {
+    if (!node)
+        return;
+    for (int i=0; i<3; i++)
+        free_node(node->arg[i]);
+    free(node);
+}
+
+
+/**
+ * Read an identifier.
+ * @return whether one was read.
+ */
+static bool identifier(parser_t *p, char *name, size_t size) {
+    skip_space(p);
+
+    size_t len = 0;
+    while (isalnum((unsigned char) p->pos[len]) || p->pos[len] == '_')
+        len++;
+    if (!len || isdigit((unsigned char) *p->pos) || len >= size)
+        return false;
+
+    memcpy(name, p->pos, len);
+    name[len] = 0;
+    p->pos += len;
+    return true;
+}
+
+static node_t* parse_or(parser_t *p);
+
+
+/**
+ * Parse a number, parenthesized expression or name.
+ */
+static node_t* parse_primary(parser_t *p) {
+    if (accept(p, "(")) {
+        node_t *node = parse_or(p);
+        if (!accept(p, ")")) {
+            free_node(node);
+            return fail(p, "expected `)`");
+        }
+        return node;
+    }
+
+    skip_space(p);
+    char *endptr;
+    double value = strtod(p->pos, &endptr);
+    if (endptr != p->pos && !isalpha((unsigned char) *p->pos)) {
+        p->pos = endptr;
+        node_t *node = new_node(p, OP_CONST, NULL, NULL, NULL);
+        if (node)
+            node->leaf.value = value;
+        return node;
+    }
+
+    char name[MAVSCHEMA_NAME_LEN];
+    if (!identifier(p, name, sizeof name))
+        return fail(p, "expected a number, name or `(`");
+
+    static const struct {
+        const char *name;
+        opcode_t op;
+    } builtins[] = {
+        {"time", OP_TIME}, {"sysid", OP_SYSID}, {"compid", OP_COMPID},
+        {"msgid", OP_MSGID}, {"seq", OP_SEQ},
+    };
+    for (unsigned i=0; i<sizeof builtins / sizeof *builtins; i++)
+        if (!strcmp(name, builtins[i].name))
+            return new_node(p, builtins[i].op, NULL, NULL, NULL);
+
+    const mavschema_message_t *msg = mavschema_find_name(p->schema, name);
+    if (!msg)
+        return fail(p, "unknown message");
+
+    if (!accept(p, ".")) {
+        node_t *node = new_node(p, OP_IS_MSG, NULL, NULL, NULL);
+        if (node)
+            node->leaf.msgid = msg->id;
+        return node;
+    }
+
+    if (!identifier(p, name, sizeof name))
+        return fail(p, "expected a field name");
+    const mavschema_field_t *field = mavschema_find_field(msg, name);
+    if (!field)
+        return fail(p, "unknown field");
+
+    unsigned index = 0;
+    if (field->array_len) {
+        if (!accept(p, "["))
+            return fail(p, "expected `[` after an array field");
+        unsigned long n = strtoul(p->pos, &endptr, 10);
+        if (endptr == p->pos || n >= field->array_len)
+            return fail(p, "invalid array index");
+        p->pos = endptr;
+        if (!accept(p, "]"))
+            return fail(p, "expected `]`");
+        index = n;
+    }
+
+    node_t *node = new_node(p, OP_FIELD, NULL, NULL, NULL);
+    if (node) {
+        node->leaf.msgid = msg->id;
+        node->leaf.field = field;
+        node->leaf.index = index;
+        node->leaf.offset = field->offset + index * field->size;
+        node->leaf.load = loads[field->type];
+    }
+    return node;
+}
+
+
+/**
+ * Parse a negation, folding constants.
+ */
+static node_t* parse_unary(parser_t *p) {
+    if (accept(p, "-")) {
+        node_t *arg = parse_unary(p);
+        if (arg && arg->op == OP_CONST) {
+            arg->leaf.value = -arg->leaf.value;
+            return arg;
+        }
+        return new_node(p, OP_NEG, arg, NULL, NULL);
+    }
+    return parse_primary(p);
+}
+
+
+/**
+ * Parse a left-associative chain of binary operators.
+ */
+static node_t* parse_chain(parser_t *p, node_t* (*next)(parser_t *),
+                           const char **tokens, const opcode_t *ops,
+                           unsigned ntokens) {
+    node_t *node = next(p);
+    for (;;) {
+        unsigned i;
+        for (i=0; i<ntokens && !accept(p, tokens[i]); i++)
+            ;
+        if (i == ntokens)
+            return node;
+        node = new_node(p, ops[i], node, next(p), NULL);
+    }
+}
+
+
+static node_t* parse_term(parser_t *p) {
+    static const char *tokens[] = {"*", "/"};
+    static const opcode_t ops[] = {OP_MUL, OP_DIV};
+    return parse_chain(p, parse_unary, tokens, ops, 2);
+}
+
+
+static node_t* parse_sum(parser_t *p) {
+    static const char *tokens[] = {"+", "-"};
+    static const opcode_t ops[] = {OP_ADD, OP_SUB};
+    return parse_chain(p, parse_term, tokens, ops, 2);
+}
+
+
+/**
+ * Parse a comparison or interval test.
+ */
+static node_t* parse_compare(parser_t *p) {
+    static const char *tokens[] = {"==", "!=", "<=", ">=", "<", ">"};
+    static const opcode_t ops[] = {OP_EQ, OP_NE, OP_LE, OP_GE, OP_LT, OP_GT};
+
+    node_t *node = parse_sum(p);
+    if (accept(p, "in")) {
+        if (!accept(p, "["))
+            return fail(p, "expected `[` after `in`");
+        node_t *lo = parse_sum(p);
+        if (!accept(p, ","))
+            return fail(p, "expected `,` in interval");
+        node_t *hi = parse_sum(p);
+        if (!accept(p, "]"))
+            return fail(p, "expected `]` after interval");
+        return new_node(p, OP_IN, node, lo, hi);
+    }
+
+    for (unsigned i=0; i<sizeof tokens / sizeof *tokens; i++)
+        if (accept(p, tokens[i]))
+            return new_node(p, ops[i], node, parse_sum(p), NULL);
+    return node;
+}
+
+
+static node_t* parse_not(parser_t *p) {
+    if (accept(p, "!"))
+        return new_node(p, OP_NOT, parse_not(p), NULL, NULL);
+    return parse_compare(p);
+}
+
+
+static node_t* parse_and(parser_t *p) {
+    static const char *tokens[] = {"&&"};
+    static const opcode_t ops[] = {OP_AND};
+    return parse_chain(p, parse_not, tokens, ops, 1);
+}
+
+
+static node_t* parse_or(parser_t *p) {
+    static const char *tokens[] = {"||"};
+    static const opcode_t ops[] = {OP_OR};
+    return parse_chain(p, parse_and, tokens, ops, 1);
+}
+
+
+/**
+ * Narrow the time bounds implied by a condition.
+ *
+ * Only the terms of the top-level conjunction comparing the time with
+ * constants are considered, which is conservative.
+ */
+static void time_bounds(const node_t *node, double *min, double *max) {
+    if (node->op == OP_AND) {
+        time_bounds(node->arg[0], min, max);
+        time_bounds(node->arg[1], min, max);
+        return;
+    }
+
+    const node_t *a = node->arg[0], *b = node->arg[1], *c = node->arg[2];
+    if (node->op == OP_IN && a->op == OP_TIME && b->op == OP_CONST
+        && c->op == OP_CONST) {
+        *min = fmax(*min, b->leaf.value);
+        *max = fmin(*max, c->leaf.value);
+        return;
+    }
+    if (node->op < OP_EQ || node->op > OP_GE)
+        return;
+
+    // Normalize to `time OP constant`
+    opcode_t op = node->op;
+    if (b && b->op == OP_TIME && a->op == OP_CONST) {
+        const node_t *t = a;
+        a = b;
+        b = t;
+        static const opcode_t mirror[] = {
+            [OP_EQ]=OP_EQ, [OP_NE]=OP_NE, [OP_LT]=OP_GT, [OP_LE]=OP_GE,
+            [OP_GT]=OP_LT, [OP_GE]=OP_LE,
+        };
+        op = mirror[op];
+    }
+    if (a->op != OP_TIME || b->op != OP_CONST)
+        return;
+
+    double value = b->leaf.value;
+    if (op == OP_EQ || op == OP_GT || op == OP_GE)
+        *min = fmax(*min, value);
+    if (op == OP_EQ || op == OP_LT || op == OP_LE)
+        *max = fmin(*max, value);
+}
+
+
+/**
+ * Emit the bytecode of a syntax tree in postfix order.
+ * @param depth stack depth before the node.
+ * @return 0 if success, -1 if the condition is too complex.
+ */
+static int emit(program_t *prog, const node_t *node, unsigned depth) {
+    unsigned nargs = 0;
+    for (; nargs<3 && node->arg[nargs]; nargs++)
+        if (emit(prog, node->arg[nargs], depth + nargs))
+            return -1;
+
+    if (prog->len == MAX_PROGRAM || depth + 1 > MAX_STACK)
+        return -1;
+    if (depth + 1 > prog->depth)
+        prog->depth = depth + 1;
+    prog->code[prog->len++] = node->leaf;
+    return 0;
+}
+
+
+/**
+ * Compile a condition against the message definitions.
+ * @return 0 if success, -1 if error.
+ */
+static int compile(const mavschema_t *schema, const char *text,
+                   program_t *prog) {
+    parser_t parser = {.schema=schema, .text=text, .pos=text};
+    node_t *tree = parse_or(&parser);
+    skip_space(&parser);
+    if (!parser.error && *parser.pos)
+        parser.error = "unexpected text";
+
+    if (parser.error) {
+        syslog(LOG_ERR, "Invalid condition at column %d, %s: `%s`",
+               (int)(parser.pos - text) + 1, parser.error, text);
+        free_node(tree);
+        return -1;
+    }
+
+    memset(prog, 0, sizeof *prog);
+    prog->min_usec = -INFINITY;
+    prog->max_usec = INFINITY;
+    time_bounds(tree, &prog->min_usec, &prog->max_usec);
+    int status = emit(prog, tree, 0);
+    if (status)
+        syslog(LOG_ERR, "Condition too complex: `%s`", text);
+    free_node(tree);
+    return status;
+}
+
+
+/** Truth value of a stack entry, NaN being false. */
+static inline bool truth(double x) {
+    return x == x && x != 0;
+}
+
+
+/**
+ * Evaluate the condition over a batch of records.
+ * @param[out] match whether each record matches.
+ */
+static void evaluate(const program_t *prog, const batch_t *batch,
+                     bool *match) {
+    static double stack[MAX_STACK][BATCH_LEN];
+    unsigned n = batch->n;
+    int top = -1;
+
+    for (unsigned k=0; k<prog->len; k++) {
+        const instr_t *in = &prog->code[k];
+
+        // Operands push a new entry, operations combine the top entries
+        if (in->op <= OP_FIELD)
+            top++;
+        double *r = stack[top];
+        double *a = top > 0 ? stack[top - 1] : NULL;
+        double *b = r;
+
+        switch (in->op) {
+        case OP_CONST:
+            for (unsigned i=0; i<n; i++)
+                r[i] = in->value;
+            break;
+        case OP_TIME:
+            memcpy(r, batch->time, n * sizeof *r);
+            break;
+        case OP_SYSID:
+            memcpy(r, batch->sysid, n * sizeof *r);
+            break;
+        case OP_COMPID:
+            memcpy(r, batch->compid, n * sizeof *r);
+            break;
+        case OP_MSGID:
+            memcpy(r, batch->msgid, n * sizeof *r);
+            break;
+        case OP_SEQ:
+            memcpy(r, batch->seq, n * sizeof *r);
+            break;
+        case OP_IS_MSG:
+            for (unsigned i=0; i<n; i++)
+                r[i] = batch->id[i] == in->msgid;
+            break;
+        case OP_FIELD:
+            for (unsigned i=0; i<n; i++) {
+                const uint8_t *payload = batch->frames[i]
+                                         + batch->header_len[i];
+                if (batch->id[i] != in->msgid)
+                    r[i] = NAN;
+                else if (in->offset + in->field->size <= batch->payload_len[i])
+                    r[i] = in->load(payload + in->offset);
+                else
+                    r[i] = mavschema_get(in->field, payload,
+                                         batch->payload_len[i], in->index);
+            }
+            break;
+
+        // Unary operations work in place
+        case OP_NEG:
+            for (unsigned i=0; i<n; i++)
+                r[i] = -r[i];
+            break;
+        case OP_NOT:
+            for (unsigned i=0; i<n; i++)
+                r[i] = !truth(r[i]);
+            break;
+
+        // Binary operations replace the left operand by the result
+        case OP_ADD:
+            for (unsigned i=0; i<n; i++)
+                a[i] += b[i];
+            break;
+        case OP_SUB:
+            for (unsigned i=0; i<n; i++)
+                a[i] -= b[i];
+            break;
+        case OP_MUL:
+            for (unsigned i=0; i<n; i++)
+                a[i] *= b[i];
+            break;
+        case OP_DIV:
+            for (unsigned i=0; i<n; i++)
+                a[i] /= b[i];
+            break;
+        case OP_EQ:
+            for (unsigned i=0; i<n; i++)
+                a[i] = a[i] == b[i];
+            break;
+        case OP_NE:
+            // Comparisons with NaN are false, including this one
+            for (unsigned i=0; i<n; i++)
+                a[i] = a[i] < b[i] || a[i] > b[i];
+            break;
+        case OP_LT:
+            for (unsigned i=0; i<n; i++)
+                a[i] = a[i] < b[i];
+            break;
+        case OP_LE:
+            for (unsigned i=0; i<n; i++)
+                a[i] = a[i] <= b[i];
+            break;
+        case OP_GT:
+            for (unsigned i=0; i<n; i++)
+                a[i] = a[i] > b[i];
+            break;
+        case OP_GE:
+            for (unsigned i=0; i<n; i++)
+                a[i] = a[i] >= b[i];
+            break;
+        case OP_AND:
+            for (unsigned i=0; i<n; i++)
+                a[i] = truth(a[i]) && truth(b[i]);
+            break;
+        case OP_OR:
+            for (unsigned i=0; i<n; i++)
+                a[i] = truth(a[i]) || truth(b[i]);
+            break;
+        case OP_IN:
+            {
+                double *x = stack[top - 2];
+                for (unsigned i=0; i<n; i++)
+                    x[i] = x[i] >= a[i] && x[i] <= b[i];
+                top--;
+            }
+            break;
+        }
+
+        if (in->op >= OP_ADD)
+            top--;
+    }
+
+    for (unsigned i=0; i<n; i++)
+        match[i] = truth(stack[0][i]);
+}
+
+
+/**
+ * Print a record decoded with its definition.
+ */
+static void print_record(const mavschema_t *schema, const batch_t *batch,
+                         unsigned i) {
+    const uint8_t *payload = batch->frames[i] + batch->header_len[i];
+    const mavschema_message_t *msg = mavschema_find_id(schema, batch->id[i]);
+    if (!msg) {
+        printf("%llu MSGID_%u {}\n", (unsigned long long) batch->time_usec[i],
+               batch->id[i]);
+        return;
+    }
+
+    printf("%llu %s {", (unsigned long long) batch->time_usec[i], msg->name);
+    for (unsigned f=0; f<msg->nfields; f++) {
+        const mavschema_field_t *field = &msg->fields[f];
+        printf("%s%s : ", f ? ", " : "", field->name);
+
+        if (field->type == MAVSCHEMA_CHAR && field->array_len) {
+            putchar('"');
+            for (unsigned k=0; k<field->array_len; k++) {
+                int c = mavschema_get(field, payload, batch->payload_len[i], k);
+                if (!c)
+                    break;
+                putchar(isprint(c) ? c : '?');
+            }
+            putchar('"');
+            continue;
+        }
+
+        unsigned n = field->array_len ? field->array_len : 1;
+        if (field->array_len)
+            putchar('[');
+        int digits = field->type == MAVSCHEMA_FLOAT ? 9 : 17;
+        for (unsigned k=0; k<n; k++)
+            printf("%s%.*g", k ? ", " : "", digits,
+                   mavschema_get(field, payload, batch->payload_len[i], k));
+        if (field->array_len)
+            putchar(']');
+    }
+    printf("}\n");
+}
+
+
+/**
+ * Add a record to the batch.
+ */
+static void batch_add(batch_t *batch, const logrecord_t *record) {
+    unsigned i = batch->n++;
+    const mavframe_t *frame = &record->frame;
+    memcpy(batch->frames[i], frame->data, frame->len);
+    batch->frame_len[i] = frame->len;
+    batch->header_len[i] = frame->payload - frame->data;
+    batch->payload_len[i] = frame->payload_len;
+    batch->id[i] = frame->msgid;
+    batch->time_usec[i] = record->time_usec;
+    batch->time[i] = record->time_usec;
+    batch->sysid[i] = frame->sysid;
+    batch->compid[i] = frame->compid;
+    batch->msgid[i] = frame->msgid;
+    batch->seq[i] = frame->seq;
+}
+
+
+/**
+ * Evaluate the batch and output its matching records.
+ * @return the number of matching records.
+ */
+static uint64_t flush_batch(const arguments_t *args, const mavschema_t *schema,
+                            const program_t *prog, batch_t *batch,
+                            logwriter_t *out) {
+    bool match[BATCH_LEN];
+    evaluate(prog, batch, match);
+
+    uint64_t matches = 0;
+    for (unsigned i=0; i<batch->n; i++) {
+        if (!match[i])
+            continue;
+        matches++;
+
+        if (out)
+            logwriter_record(out, batch->time_usec[i], batch->frames[i],
+                             batch->frame_len[i]);
+        else if (!args->count)
+            print_record(schema, batch, i);
+    }
+
+    batch->n = 0;
+    return matches;
+}
+
+
+/**
+ * Load the given or installed message definitions and compile the
+ * condition against them, unless already done.
+ * @return 0 if success, -1 if error.
+ */
+static int load_definitions(const arguments_t *args, definitions_t *defs) {
+    if (defs->loaded)
+        return 0;
+
+    if (!args->nxml && mavschema_load(&defs->schema, MAVSCHEMA_DEFAULT_DIR))
+        return -1;
+    for (int i=0; i<args->nxml; i++)
+        if (mavschema_load(&defs->schema, args->xml[i]))
+            return -1;
+    if (compile(&defs->schema, args->condition, &defs->prog))
+        return -1;
+    defs->loaded = true;
+    return 0;
+}
+
+
+/**
+ * Query a log, skipping the blocks outside the time bounds if indexed.
+ * @return the number of matching records, or -1 if error.
+ */
+static int64_t query_file(const arguments_t *args, definitions_t *defs,
+                          const char *path, logwriter_t *out) {
+    logscan_t scan;
+    if (logscan_open(&scan, path, args->format))
+        return -1;
+
+    // The definitions embedded in the log decode it, unless overridden
+    static program_t embedded;
+    const mavschema_t *schema = &defs->schema;
+    const program_t *prog = &defs->prog;
+    if (!args->nxml && scan.schema.nmessages) {
+        if (compile(&scan.schema, args->condition, &embedded)) {
+            logscan_close(&scan);
+            return -1;
+        }
+        schema = &scan.schema;
+        prog = &embedded;
+    } else if (load_definitions(args, defs)) {
+        logscan_close(&scan);
+        return -1;
+    }
+
+    // The output carries the definitions of the first log
+    if (out && !out->written && !out->used && logwriter_header(out, schema)) {
+        logscan_close(&scan);
+        return -1;
+    }
+
+    bool bounded = isfinite(prog->min_usec) || isfinite(prog->max_usec);
+    logscan_index_t index = {0};
+    bool indexed = bounded && !logscan_index_load(path, &index);
+    if (bounded && !indexed && args->index)
+        indexed = !logscan_index_build(path, args->format, 0, &index);
+
+    static batch_t batch;
+    batch.n = 0;
+    int64_t matches = 0;
+    int status = 0;
+    logrecord_t record;
+    uint32_t block = 0;
+    uint64_t block_end = UINT64_MAX;
+    bool seek = indexed;
+    for (;;) {
+        // Seek to the next block overlapping the time bounds, the last one
+        // ending with the log, of size unknown if compressed
+        if (seek) {
+            while (block < index.nblocks
+                   && (index.blocks[block].max_usec < prog->min_usec
+                       || index.blocks[block].min_usec > prog->max_usec))
+                block++;
+            if (block == index.nblocks)
+                break;
+            if ((status = logscan_seek(&scan, index.blocks[block].offset)))
+                break;
+            block_end = ++block < index.nblocks ? index.blocks[block].offset
+                                                : UINT64_MAX;
+            seek = false;
+        }
+
+        if ((status = logscan_next(&scan, &record)) <= 0)
+            break;
+        if (indexed && record.offset >= block_end) {
+            seek = true;
+            continue;
+        }
+
+        batch_add(&batch, &record);
+        if (batch.n == BATCH_LEN)
+            matches += flush_batch(args, schema, prog, &batch, out);
+    }
+    matches += flush_batch(args, schema, prog, &batch, out);
+
+    if (scan.malformed)
+        syslog(LOG_WARNING, "%llu malformed bytes in `%s`",
+               (unsigned long long) scan.malformed, path);
+    logscan_close(&scan);
+    logscan_index_free(&index);
+    return status < 0 ? -1 : matches;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {0};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    // Given definitions are checked before any log
+    static definitions_t defs;
+    if (arguments.nxml && load_definitions(&arguments, &defs))
+        return EXIT_FAILURE;
+
+    logwriter_t *out = NULL;
+    if (arguments.output && !(out = logwriter_open(arguments.output, 0)))
+        return EXIT_FAILURE;
+
+    int status = EXIT_SUCCESS;
+    uint64_t matches = 0;
+    for (int i=0; i<arguments.nfiles; i++) {
+        int64_t n = query_file(&arguments, &defs, arguments.files[i], out);
+        if (n < 0)
+            status = EXIT_FAILURE;
+        else
+            matches += n;
+    }
+
+    if (arguments.count)
+        printf("%llu\n", (unsigned long long) matches);
+    logwriter_close(out);
+    mavschema_free(&defs.schema);
+    return status;
+}
@@ -0,0 +1,249 @@
+/**
+ * Rebuild signals from the compressed telemetry of the readers.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "logview.h"
+#include "mavschema.h"
+#include "swingdoor.h"
+
+
+/** Maximum number of rebuilt signals. */
+#define MAX_SIGNALS 64
+
+
+/** Program version. */
+const char *argp_program_version = "mavrebuild 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "mavrebuild -- Rebuild signals from compressed telemetry."
+    "\vThe LOGFILEs are a recording, by mavrecord for instance, of the UDP "
+    "stream of a reader started with --udp-tolerance, split in segments "
+    "given in the order of their start, plain or compressed by gzip. Each "
+    "CHANNEL, such as ADC_RAW.data[3] or AHRS_ANGLES.roll, is rebuilt by "
+    "linear interpolation between the received messages, within the "
+    "tolerance of the reader. The signals are printed on a regular time "
+    "grid, one line per instant: time in microseconds followed by the value "
+    "of each CHANNEL, nan before its first message. Logs embedding their "
+    "message definitions are decoded with those of the first one, unless "
+    "--xml is given.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "LOGFILE...";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"xml", 'x', "PATH", 0,
+     "Message definitions file or directory, may be repeated, defaults to "
+     "those embedded in the log, or else " MAVSCHEMA_DEFAULT_DIR},
+    {"format", 'f', "FORMAT", 0, "Log format: mavlog or logbin, detected "
+     "by default"},
+    {"channel", 'c', "CHANNEL", 0, "Rebuild CHANNEL, may be repeated"},
+    {"period", 'p', "MS", 0, "Period of the time grid, defaults to 20"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char **files;
+    int nfiles;
+    char *channels[MAX_SIGNALS];
+    int nchannels;
+    char *xml[16];
+    int nxml;
+    logscan_format_t format;
+    double period_usec;
+} arguments_t;
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'x':
+        if (arguments->nxml == sizeof arguments->xml / sizeof *arguments->xml)
+            argp_error(state, "Too many definitions.");
+        arguments->xml[arguments->nxml++] = arg;
+        break;
+
+    case 'f':
+        if (!strcmp(arg, "mavlog"))
+            arguments->format = LOGSCAN_MAVLOG;
+        else if (!strcmp(arg, "logbin"))
+            arguments->format = LOGSCAN_LOGBIN;
+        else
+            argp_error(state, "Unknown FORMAT `%s`.", arg);
+        break;
+
+    case 'c':
+        if (arguments->nchannels == MAX_SIGNALS)
+            argp_error(state, "Too many channels.");
+        arguments->channels[arguments->nchannels++] = arg;
+        break;
+
+    case 'p':
+        {
+            char *endptr = 0;
+            double period = strtod(arg, &endptr);
+            if (*endptr || !(period > 0))
+                argp_error(state, "MS must be a positive number.");
+            arguments->period_usec = period * 1e3;
+        }
+        break;
+
+    case ARGP_KEY_ARGS:
+        arguments->files = state->argv + state->next;
+        arguments->nfiles = state->argc - state->next;
+        break;
+
+    case ARGP_KEY_NO_ARGS:
+        argp_error(state, "Not enough arguments.");
+        break;
+
+    case ARGP_KEY_END:
+        if (!arguments->nchannels)
+            argp_error(state, "No channel to rebuild.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+/**
+ * Load the given or installed message definitions.
+ * @return 0 if success, -1 if error.
+ */
+static int load_definitions(const arguments_t *args, mavschema_t *schema) {
+    if (!args->nxml)
+        return mavschema_load(schema, MAVSCHEMA_DEFAULT_DIR);
+    for (int i=0; i<args->nxml; i++)
+        if (mavschema_load(schema, args->xml[i]))
+            return -1;
+    return 0;
+}
+
+
+/**
+ * Print the signals at the grid instants up to a time.
+ * @param[in,out] t next instant of the grid.
+ */
+static void print_until(const arguments_t *args, swingdoor_signal_t *signals,
+                        double *t, double end) {
+    for (; *t <= end; *t += args->period_usec) {
+        printf("%.0f", *t);
+        for (int i=0; i<args->nchannels; i++)
+            printf(" %.9g", swingdoor_signal_at(&signals[i], *t));
+        printf("\n");
+    }
+}
+
+
+/**
+ * Rebuild the signals of the segments of a log.
+ * @return 0 if success, -1 if error.
+ */
+static int rebuild(const arguments_t *args) {
+    logview_t view;
+    if (logview_open(&view, args->files, args->nfiles, args->format))
+        return -1;
+
+    // The definitions embedded in the log decode it, unless overridden
+    mavschema_t defs = {0};
+    const mavschema_t *schema = &view.schema;
+    if (args->nxml || !view.schema.nmessages) {
+        if (load_definitions(args, &defs)) {
+            mavschema_free(&defs);
+            logview_close(&view);
+            return -1;
+        }
+        schema = &defs;
+    }
+
+    swingdoor_signal_t signals[MAX_SIGNALS];
+    int nsignals = 0;
+    int status = 0;
+    while (nsignals < args->nchannels && !status)
+        if (swingdoor_signal_init(&signals[nsignals], schema,
+                                  args->channels[nsignals]))
+            status = -1;
+        else
+            nsignals++;
+
+    // The grid advances as far as all signals are rebuilt
+    printf("# time");
+    for (int i=0; i<args->nchannels; i++)
+        printf(" %s", args->channels[i]);
+    printf("\n");
+    logrecord_t record;
+    double t = NAN;
+    while (!status && (status = logview_next(&view, &record)) > 0) {
+        status = 0;
+        double end = INFINITY, start = INFINITY;
+        for (int i=0; i<nsignals && !status; i++) {
+            status = swingdoor_signal_push(&signals[i], &record.frame,
+                                           record.time_usec);
+            end = fmin(end, swingdoor_signal_end(&signals[i]));
+            if (signals[i].npoints)
+                start = fmin(start, signals[i].points[0].time_usec);
+        }
+        if (isnan(t) && isfinite(start))
+            t = ceil(start / args->period_usec) * args->period_usec;
+        if (!status && isfinite(end))
+            print_until(args, signals, &t, end);
+    }
+
+    // Then up to the last message
+    if (!status) {
+        double end = -INFINITY;
+        for (int i=0; i<nsignals; i++)
+            end = fmax(end, swingdoor_signal_end(&signals[i]));
+        if (!isnan(t))
+            print_until(args, signals, &t, end);
+    }
+
+    for (int i=0; i<nsignals; i++)
+        swingdoor_signal_free(&signals[i]);
+    mavschema_free(&defs);
+    logview_close(&view);
+    if (view.malformed)
+        syslog(LOG_WARNING, "Skipped %llu malformed bytes",
+               (unsigned long long) view.malformed);
+    return status;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.period_usec=20e3};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    return rebuild(&arguments) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
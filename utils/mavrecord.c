@@ -0,0 +1,575 @@
+/**
+ * Ground-side recorder for the MAVLink UDP telemetry.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logwriter.h"
+#include "mavframe.h"
+#include "mavschema.h"
+#include "pyramid.h"
+#include "shmring.h"
+#include "utils.h"
+
+
+/** Number of datagrams received per system call. */
+#define RECV_BATCH 64
+
+/** Maximum datagram size. */
+#define DGRAM_MAX 2048
+
+/** Capacity of the sender table, must be a power of two. */
+#define MAX_SOURCES 1024
+
+/** Wait between polls of an empty shared-memory ring, in nanoseconds. */
+#define RING_POLL_NS 1000000
+
+
+/** Program version. */
+const char *argp_program_version = "mavrecord 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "mavrecord -- Record MAVLink UDP telemetry to a mavlog."
+    "\vWith --shm, the frames are instead taken from the shared-memory ring "
+    "of a reader on the same host, started with --shm NAME, which carries "
+    "all its frames whatever the UDP options.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "LOGFILE";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"group", 'g', "ADDRESS", 0,
+     "Multicast group or address to listen on, defaults to 224.0.0.1"},
+    {"udp-port", 'p', "UDPPORT", 0, "UDP port to listen on, defaults to 38400"},
+    {"interface", 'i', "ADDRESS", 0,
+     "Address of the interface joining the multicast group"},
+    {"rcvbuf", 'r', "BYTES", 0,
+     "Socket receive buffer size, defaults to 8 MiB"},
+    {"report", 'R', "SECONDS", 0,
+     "Interval between loss reports, defaults to 10, 0 disables"},
+    {"shm", 's', "NAME", 0,
+     "Record the shared-memory ring NAME of a local reader instead of UDP"},
+    {"pyramid", 'P', 0, 0,
+     "Also build the summary pyramid LOGFILE.pyr while recording"},
+    {"xml", 'x', "PATH", 0,
+     "Message definitions embedded in the log and summarized by the pyramid, "
+     "may be repeated, defaults to " MAVSCHEMA_DEFAULT_DIR " with --pyramid"},
+    {0}
+};
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char *logfile;
+    char *group;
+    char *interface;
+    uint16_t udp_port;
+    int rcvbuf;
+    unsigned report_interval;
+    char *shm;
+    bool pyramid;
+    char *xml[16];
+    int nxml;
+} arguments_t;
+
+/** Sequence accounting of a MAVLink sender. */
+typedef struct source {
+    bool used;
+    struct in_addr addr;
+    uint16_t port;
+    uint8_t sysid;
+    uint8_t compid;
+    uint8_t last_seq;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t out_of_order;
+} source_t;
+
+/** Recorder counters. */
+typedef struct recorder {
+    source_t sources[MAX_SOURCES];
+    mavframe_scanner_t scanner;
+    uint64_t datagrams;
+    uint64_t untracked;
+    uint32_t kernel_drops;
+    uint64_t malformed_bytes;
+    shmring_t *ring; ///< Input instead of the UDP socket, or NULL.
+} recorder_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+/** Parse an unsigned integer argument, aborting on error. */
+static unsigned long parse_uint(struct argp_state *state, char *arg,
+                                unsigned long max, char *name) {
+    char *endptr = 0;
+    unsigned long value = strtoul(arg, &endptr, 0);
+    if (*endptr)
+        argp_error(state, "%s argument must be an integer.", name);
+    if (value > max)
+        argp_error(state, "%s number too large.", name);
+    return value;
+}
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'g':
+        arguments->group = arg;
+        break;
+
+    case 'p':
+        arguments->udp_port = parse_uint(state, arg, 65535, "UDPPORT");
+        break;
+
+    case 'i':
+        arguments->interface = arg;
+        break;
+
+    case 'r':
+        arguments->rcvbuf = parse_uint(state, arg, INT32_MAX, "BYTES");
+        break;
+
+    case 'R':
+        arguments->report_interval = parse_uint(state, arg, 86400, "SECONDS");
+        break;
+
+    case 's':
+        arguments->shm = arg;
+        break;
+
+    case 'P':
+        arguments->pyramid = true;
+        break;
+
+    case 'x':
+        if (arguments->nxml == sizeof arguments->xml / sizeof *arguments->xml)
+            argp_error(state, "Too many definitions.");
+        arguments->xml[arguments->nxml++] = arg;
+        break;
+
+    case ARGP_KEY_ARG:
+        if (state->arg_num >= 1)
+            argp_error(state, "Too many arguments.");
+        arguments->logfile = arg;
+        break;
+
+    case ARGP_KEY_END:
+        if (state->arg_num < 1)
+            argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Open the UDP socket and join the multicast group.
+ * Aborts the program on error.
+ */
+int open_socket(arguments_t *args) {
+    struct in_addr group;
+    if (!inet_aton(args->group, &group)) {
+        syslog(LOG_ERR, "Invalid listen address `%s`", args->group);
+        exit(EXIT_FAILURE);
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        syslog(LOG_ERR, "Error creating UDP socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Let other listeners share the port
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on))
+        syslog(LOG_WARNING, "Error setting SO_REUSEADDR: %s", strerror(errno));
+
+    // Kernel reception timestamps and socket drop counter
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on))
+        syslog(LOG_WARNING, "Error enabling kernel timestamps: %s",
+               strerror(errno));
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof on))
+        syslog(LOG_WARNING, "Error enabling drop counter: %s",
+               strerror(errno));
+
+    // Enlarge the receive buffer, beyond rmem_max if privileged
+    int rcvbuf = args->rcvbuf;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf)
+        && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf))
+        syslog(LOG_WARNING, "Error setting receive buffer: %s",
+               strerror(errno));
+    socklen_t optlen = sizeof rcvbuf;
+    if (!getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen)
+        && rcvbuf < args->rcvbuf)
+        syslog(LOG_WARNING, "Receive buffer limited to %d bytes, "
+               "raise net.core.rmem_max", rcvbuf / 2);
+
+    // Wake up periodically to flush and report
+    struct timeval timeout = {.tv_sec=1, .tv_usec=0};
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout))
+        syslog(LOG_WARNING, "Error setting receive timeout: %s",
+               strerror(errno));
+
+    struct sockaddr_in addr = {
+        .sin_family=AF_INET, .sin_port=htons(args->udp_port),
+        .sin_addr={.s_addr=htonl(INADDR_ANY)}
+    };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof addr)) {
+        syslog(LOG_ERR, "Error binding socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (IN_MULTICAST(ntohl(group.s_addr))) {
+        struct ip_mreq mreq = {.imr_multiaddr=group};
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        char *iface = args->interface;
+        if (iface && !inet_aton(iface, &mreq.imr_interface)) {
+            syslog(LOG_ERR, "Invalid interface address `%s`", iface);
+            exit(EXIT_FAILURE);
+        }
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq))
+            syslog(LOG_WARNING, "Error joining multicast group %s: %s",
+                   args->group, strerror(errno));
+    }
+
+    return sock;
+}
+
+
+/**
+ * Find or create the accounting entry of a sender.
+ * @return the entry or NULL if the table is full.
+ */
+static source_t* find_source(recorder_t *rec, const struct sockaddr_in *from,
+                             uint8_t sysid, uint8_t compid) {
+    uint32_t key = from->sin_addr.s_addr ^ from->sin_port << 16
+                   ^ sysid << 8 ^ compid;
+    key *= 0x9E3779B1;
+
+    for (unsigned i=0; i<MAX_SOURCES; i++) {
+        source_t *src = &rec->sources[(key + i) & (MAX_SOURCES - 1)];
+        if (!src->used) {
+            src->used = true;
+            src->addr = from->sin_addr;
+            src->port = from->sin_port;
+            src->sysid = sysid;
+            src->compid = compid;
+            return src;
+        }
+        if (src->addr.s_addr == from->sin_addr.s_addr
+            && src->port == from->sin_port
+            && src->sysid == sysid && src->compid == compid)
+            return src;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Account for the sequence number of a received frame.
+ *
+ * The sequence counter belongs to the sending process, so senders are told
+ * apart by their address and port besides the system and component ids:
+ * several readers share the same ids.
+ */
+static void track_seq(recorder_t *rec, const struct sockaddr_in *from,
+                      const mavframe_t *frame) {
+    source_t *src = find_source(rec, from, frame->sysid, frame->compid);
+    if (!src) {
+        rec->untracked++;
+        return;
+    }
+
+    if (src->received) {
+        uint8_t gap = frame->seq - (uint8_t)(src->last_seq + 1);
+        if (gap < 128) {
+            src->lost += gap;
+        } else {
+            // Sequence went backwards: duplicated or reordered frame
+            src->out_of_order++;
+            src->received++;
+            return;
+        }
+    }
+
+    src->last_seq = frame->seq;
+    src->received++;
+}
+
+
+/**
+ * Log the loss accounting of all senders.
+ */
+static void report(recorder_t *rec) {
+    for (unsigned i=0; i<MAX_SOURCES; i++) {
+        source_t *src = &rec->sources[i];
+        if (!src->used)
+            continue;
+
+        double expected = src->received + src->lost;
+        syslog(LOG_INFO, "%s:%hu sysid %u compid %u: %llu received, "
+               "%llu lost (%.3f%%), %llu out of order",
+               inet_ntoa(src->addr), ntohs(src->port), src->sysid, src->compid,
+               (unsigned long long) src->received,
+               (unsigned long long) src->lost, 100 * src->lost / expected,
+               (unsigned long long) src->out_of_order);
+    }
+
+    syslog(LOG_INFO, "%llu datagrams, %u dropped by the kernel, "
+           "%llu malformed bytes, %llu frames from untracked senders",
+           (unsigned long long) rec->datagrams, rec->kernel_drops,
+           (unsigned long long) (rec->malformed_bytes + rec->scanner.skipped),
+           (unsigned long long) rec->untracked);
+    if (rec->ring)
+        syslog(LOG_INFO, "%llu ring overruns",
+               (unsigned long long) rec->ring->overruns);
+}
+
+
+/**
+ * Get the kernel reception timestamp and drop counter of a datagram.
+ * @return the reception time in microseconds since epoch.
+ */
+static uint64_t get_recv_info(recorder_t *rec, struct msghdr *hdr) {
+    uint64_t timestamp = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+         cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+            timestamp = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&rec->kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        }
+    }
+
+    return timestamp ? timestamp : get_time_us();
+}
+
+
+/**
+ * Record the frames of a datagram or ring record.
+ */
+static void record_frames(recorder_t *rec, const struct sockaddr_in *from,
+                          const uint8_t *buf, size_t len, uint64_t timestamp,
+                          logwriter_t *log, pyramid_writer_t *pyramid) {
+    rec->datagrams++;
+
+    size_t pos = 0;
+    mavframe_t frame;
+    while (mavframe_next(&rec->scanner, buf, len, &pos, &frame)) {
+        track_seq(rec, from, &frame);
+        logwriter_record(log, timestamp, frame.data, frame.len);
+        if (pyramid)
+            pyramid_writer_frame(pyramid, timestamp, &frame);
+    }
+    rec->malformed_bytes += len - pos;
+}
+
+
+/**
+ * Receive and record a batch of datagrams, waiting for the first one up to
+ * the socket timeout.
+ */
+static void receive_udp(int sock, recorder_t *rec, logwriter_t *log,
+                        pyramid_writer_t *pyramid) {
+    static uint8_t bufs[RECV_BATCH][DGRAM_MAX];
+    static uint8_t control[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))
+                                       + CMSG_SPACE(sizeof(uint32_t))];
+    struct sockaddr_in from[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    for (int i=0; i<RECV_BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = DGRAM_MAX;
+        msgs[i].msg_hdr = (struct msghdr) {
+            .msg_name=&from[i], .msg_namelen=sizeof from[i],
+            .msg_iov=&iov[i], .msg_iovlen=1,
+            .msg_control=control[i], .msg_controllen=sizeof control[i]
+        };
+    }
+
+    int n = recvmmsg(sock, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+    if (n < 0 && errno != EINTR && errno != EAGAIN)
+        syslog(LOG_ERR, "Error receiving datagrams: %s", strerror(errno));
+
+    for (int i=0; i<n; i++) {
+        uint64_t timestamp = get_recv_info(rec, &msgs[i].msg_hdr);
+        record_frames(rec, &from[i], bufs[i], msgs[i].msg_len, timestamp,
+                      log, pyramid);
+    }
+}
+
+
+/**
+ * Record a batch of the frames of the shared-memory ring, waiting a little
+ * if it is empty. The ring records are stamped when read.
+ */
+static void receive_ring(recorder_t *rec, logwriter_t *log,
+                         pyramid_writer_t *pyramid) {
+    // The frames of a ring all come from the local reader
+    static const struct sockaddr_in local = {.sin_family=AF_INET};
+    uint8_t buf[DGRAM_MAX];
+
+    for (int i=0; i<RECV_BATCH; i++) {
+        int len = shmring_read(rec->ring, buf, sizeof buf);
+        if (!len) {
+            if (!i) {
+                struct timespec poll = {.tv_nsec=RING_POLL_NS};
+                nanosleep(&poll, NULL);
+            }
+            return;
+        }
+        record_frames(rec, &local, buf, len < sizeof buf ? len : sizeof buf,
+                      get_time_us(), log, pyramid);
+    }
+}
+
+
+/**
+ * Load the message definitions, if given or needed by the pyramid, and
+ * embed them in the log header.
+ * Aborts the program on error.
+ */
+static void load_definitions(arguments_t *args, mavschema_t *schema,
+                             logwriter_t *log) {
+    if (!args->nxml && !args->pyramid)
+        return;
+
+    if (!args->nxml)
+        args->xml[args->nxml++] = MAVSCHEMA_DEFAULT_DIR;
+    for (int i=0; i<args->nxml; i++)
+        if (mavschema_load(schema, args->xml[i]))
+            exit(EXIT_FAILURE);
+    if (logwriter_header(log, schema))
+        exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Open the summary pyramid of the log, if requested.
+ * Aborts the program on error.
+ */
+static pyramid_writer_t* open_pyramid(const arguments_t *args,
+                                      const mavschema_t *schema) {
+    if (!args->pyramid)
+        return NULL;
+
+    char path[PATH_MAX];
+    pyramid_writer_t *pyramid = NULL;
+    if (pyramid_path(args->logfile, path, sizeof path)
+        || !(pyramid = pyramid_writer_open(path, schema)))
+        exit(EXIT_FAILURE);
+    return pyramid;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {
+        .group="224.0.0.1", .udp_port=38400, .rcvbuf=8 * 1024 * 1024,
+        .report_interval=10
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    // Stop cleanly so that the log tail and final report are not lost
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Open the input and output
+    static recorder_t rec;
+    int sock = -1;
+    if (!arguments.shm)
+        sock = open_socket(&arguments);
+    else if (!(rec.ring = shmring_attach(arguments.shm)))
+        return EXIT_FAILURE;
+    logwriter_t *log = logwriter_open(arguments.logfile, 0);
+    if (!log)
+        return EXIT_FAILURE;
+    mavschema_t schema = {0};
+    load_definitions(&arguments, &schema, log);
+    pyramid_writer_t *pyramid = open_pyramid(&arguments, &schema);
+
+    uint64_t last_flush = get_time_us();
+    uint64_t last_report = last_flush;
+
+    // Receive loop
+    while (!stop_requested) {
+        if (rec.ring)
+            receive_ring(&rec, log, pyramid);
+        else
+            receive_udp(sock, &rec, log, pyramid);
+
+        // Flush at least once a second and report periodically
+        uint64_t now = get_time_us();
+        if (now - last_flush >= 1000000) {
+            logwriter_flush(log);
+            last_flush = now;
+        }
+        if (arguments.report_interval
+            && now - last_report >= arguments.report_interval * 1000000ULL) {
+            report(&rec);
+            last_report = now;
+        }
+    }
+
+    logwriter_close(log);
+    if (pyramid_writer_close(pyramid))
+        syslog(LOG_ERR, "Pyramid of `%s` incomplete, rebuild it with "
+               "mavpyramid", arguments.logfile);
+    mavschema_free(&schema);
+    report(&rec);
+    shmring_close(rec.ring);
+    if (sock >= 0)
+        close(sock);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,822 @@
+/**
+ * Route MAVLink frames between serial ports and UDP endpoints.
+ *
+ * The frames of each input are found by the block scanner in its read
+ * buffer, each datagram of a UDP input apart, and validated against their
+ * definitions. Each frame accepted is
+ * copied once, as received, to the batch of each output whose rules it
+ * matches, and the batches are written once per poll round: a single write
+ * to a serial port and a single sendmmsg, one datagram per frame, to a UDP
+ * endpoint. Frames received through several paths within the deduplication
+ * window are forwarded only once.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "mavframe.h"
+#include "mavschema.h"
+#include "utils.h"
+
+
+/** Maximum number of inputs and of outputs. */
+#define MAX_ENDPOINTS 16
+
+/** Maximum number of rules of an output. */
+#define MAX_RULES 16
+
+/** Size of the read buffer of an input. */
+#define INPUT_BUFFER_LEN (64 * 1024)
+
+/** Room for a datagram in the read buffer of a UDP input. */
+#define DATAGRAM_LEN 4096
+
+/** Number of datagrams received at once by a UDP input. */
+#define DATAGRAM_BATCH (INPUT_BUFFER_LEN / DATAGRAM_LEN)
+
+/** Size of the batch buffer of an output. */
+#define BATCH_BUFFER_LEN (64 * 1024)
+
+/** Maximum number of frames in a batch. */
+#define BATCH_MAX_FRAMES 1024
+
+/** Number of entries of the deduplication table, a power of 2. */
+#define DEDUP_TABLE_LEN 16384
+
+/** Entries of the deduplication table a frame may take. */
+#define DEDUP_WAYS 4
+
+/** Default serial port baud rate. */
+#define DEFAULT_BAUD 57600
+
+
+/** Program version. */
+const char *argp_program_version = "mavrouter 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "mavrouter -- Route MAVLink frames between serial ports "
+    "and UDP endpoints."
+    "\vENDPOINT is serial:DEVICE[@BAUD], the baud rate defaulting to 57600, "
+    "or udp:[HOST:]PORT. A UDP input listens on PORT, joining HOST if it is "
+    "a multicast group; a UDP output sends to HOST:PORT.\n\n"
+    "Each --match applies to the preceding --out, which forwards the frames "
+    "matching any of its rules, or all frames without rules. A RULE is "
+    "SYSID/COMPID/MSGID, each either a number, a range such as 150-156 or "
+    "`*`.\n\n"
+    "Frames are validated by the checksum of their definitions and are "
+    "forwarded unchanged. Identical frames received within the "
+    "deduplication window, through several inputs, are forwarded once.";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"in", 'i', "ENDPOINT", 0, "Read frames from ENDPOINT, may be repeated"},
+    {"out", 'o', "ENDPOINT", 0, "Write frames to ENDPOINT, may be repeated"},
+    {"match", 'm', "RULE", 0,
+     "Forward to the preceding output the frames matching RULE, may be "
+     "repeated"},
+    {"xml", 'x', "PATH", 0,
+     "Message definitions file or directory, may be repeated, defaults to "
+     MAVSCHEMA_DEFAULT_DIR},
+    {"unknown", 'u', 0, 0,
+     "Forward unchecked the frames of messages missing from the definitions"},
+    {"dedup", 'd', "MS", 0,
+     "Deduplication window in milliseconds, 0 to disable, defaults to 100"},
+    {0}
+};
+
+/** Inclusive range of a header field accepted by a rule. */
+typedef struct range {
+    uint32_t min;
+    uint32_t max;
+} range_t;
+
+/** Forwarding rule of an output. */
+typedef struct rule {
+    range_t sysid;
+    range_t compid;
+    range_t msgid;
+} rule_t;
+
+/** Endpoint specification. */
+typedef struct endpoint_spec {
+    char *text; ///< As given, for the messages.
+    bool serial;
+    char *device;
+    unsigned baud;
+    char *host; ///< NULL for any address of a UDP input.
+    uint16_t port;
+    rule_t rules[MAX_RULES];
+    unsigned nrules;
+} endpoint_spec_t;
+
+/** Program arguments structure. */
+typedef struct arguments {
+    endpoint_spec_t in[MAX_ENDPOINTS];
+    unsigned nin;
+    endpoint_spec_t out[MAX_ENDPOINTS];
+    unsigned nout;
+    char *xml[16];
+    int nxml;
+    bool unknown;
+    uint64_t dedup_usec;
+} arguments_t;
+
+/** Open input. */
+typedef struct input {
+    const endpoint_spec_t *spec;
+    int fd;
+    uint8_t buf[INPUT_BUFFER_LEN];
+    size_t len;
+    mavframe_scanner_t scanner;
+    unsigned long frames;
+    unsigned long truncated; ///< Datagrams larger than DATAGRAM_LEN.
+} input_t;
+
+/** Open output and its pending batch. */
+typedef struct output {
+    const endpoint_spec_t *spec;
+    int fd;
+    uint8_t buf[BATCH_BUFFER_LEN];
+    size_t len;
+    size_t tail; ///< Unwritten end of a frame, at the start of buf.
+    struct iovec iov[BATCH_MAX_FRAMES]; ///< Frames of the batch.
+    struct mmsghdr msgs[BATCH_MAX_FRAMES];
+    unsigned nframes;
+    unsigned long frames;
+    unsigned long dropped; ///< Frames the endpoint could not take.
+} output_t;
+
+/** Recently forwarded frame. */
+typedef struct dedup_entry {
+    uint64_t hash;
+    uint64_t time_usec;
+} dedup_entry_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+/** Checksum extras of the MAVLink 1 message ids, -1 if unknown. */
+static int crc_extra_v1[256];
+
+/** Message definitions, for the other ids. */
+static mavschema_t schema;
+
+
+/**
+ * Parse an endpoint specification.
+ * @return 0 if success, -1 if invalid.
+ */
+static int parse_endpoint(char *arg, endpoint_spec_t *spec) {
+    memset(spec, 0, sizeof *spec);
+    spec->text = arg;
+
+    char *copy = strdup(arg);
+    if (!copy)
+        return -1;
+
+    if (!strncmp(copy, "serial:", 7)) {
+        spec->serial = true;
+        spec->device = copy + 7;
+        spec->baud = DEFAULT_BAUD;
+        char *at = strrchr(spec->device, '@');
+        if (at) {
+            *at = 0;
+            char *endptr;
+            spec->baud = strtoul(at + 1, &endptr, 10);
+            if (*endptr || endptr == at + 1)
+                return -1;
+        }
+        return *spec->device ? 0 : -1;
+    }
+
+    if (strncmp(copy, "udp:", 4))
+        return -1;
+    char *port = strrchr(copy + 4, ':');
+    if (port) {
+        *port++ = 0;
+        spec->host = copy + 4;
+    } else {
+        port = copy + 4;
+    }
+    char *endptr;
+    unsigned long value = strtoul(port, &endptr, 10);
+    if (*endptr || endptr == port || !value || value > 65535)
+        return -1;
+    spec->port = value;
+    if (spec->host && !*spec->host)
+        spec->host = NULL;
+    return 0;
+}
+
+
+/**
+ * Parse a rule field: a number, a range or `*`.
+ * @return 0 if success, -1 if invalid.
+ */
+static int parse_range(char *text, uint32_t max, range_t *range) {
+    if (!strcmp(text, "*")) {
+        *range = (range_t) {0, max};
+        return 0;
+    }
+
+    char *endptr;
+    unsigned long min = strtoul(text, &endptr, 0);
+    unsigned long last = min;
+    if (endptr == text)
+        return -1;
+    if (*endptr == '-') {
+        char *start = endptr + 1;
+        last = strtoul(start, &endptr, 0);
+        if (endptr == start)
+            return -1;
+    }
+    if (*endptr || min > last || last > max)
+        return -1;
+    *range = (range_t) {min, last};
+    return 0;
+}
+
+
+/**
+ * Parse a SYSID/COMPID/MSGID rule.
+ * @return 0 if success, -1 if invalid.
+ */
+static int parse_rule(char *arg, rule_t *rule) {
+    char text[64];
+    if (strlen(arg) >= sizeof text)
+        return -1;
+    strcpy(text, arg);
+
+    char *compid = strchr(text, '/');
+    char *msgid = compid ? strchr(compid + 1, '/') : NULL;
+    if (!msgid)
+        return -1;
+    *compid++ = 0;
+    *msgid++ = 0;
+    if (parse_range(text, 255, &rule->sysid)
+        || parse_range(compid, 255, &rule->compid)
+        || parse_range(msgid, 0xFFFFFF, &rule->msgid))
+        return -1;
+    return 0;
+}
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+
+    switch (key) {
+    case 'i':
+        if (arguments->nin == MAX_ENDPOINTS)
+            argp_error(state, "Too many inputs.");
+        if (parse_endpoint(arg, &arguments->in[arguments->nin++]))
+            argp_error(state, "Invalid ENDPOINT `%s`.", arg);
+        break;
+
+    case 'o':
+        if (arguments->nout == MAX_ENDPOINTS)
+            argp_error(state, "Too many outputs.");
+        if (parse_endpoint(arg, &arguments->out[arguments->nout++]))
+            argp_error(state, "Invalid ENDPOINT `%s`.", arg);
+        break;
+
+    case 'm':
+        {
+            if (!arguments->nout)
+                argp_error(state, "--match must follow an --out.");
+            endpoint_spec_t *out = &arguments->out[arguments->nout - 1];
+            if (out->nrules == MAX_RULES)
+                argp_error(state, "Too many rules for `%s`.", out->text);
+            if (parse_rule(arg, &out->rules[out->nrules++]))
+                argp_error(state, "Invalid RULE `%s`.", arg);
+        }
+        break;
+
+    case 'x':
+        if (arguments->nxml == sizeof arguments->xml / sizeof *arguments->xml)
+            argp_error(state, "Too many definitions.");
+        arguments->xml[arguments->nxml++] = arg;
+        break;
+
+    case 'u':
+        arguments->unknown = true;
+        break;
+
+    case 'd':
+        {
+            char *endptr = 0;
+            unsigned long ms = strtoul(arg, &endptr, 0);
+            if (*endptr || endptr == arg || ms > 3600000)
+                argp_error(state, "MS must be an integer up to 3600000.");
+            arguments->dedup_usec = ms * 1000;
+        }
+        break;
+
+    case ARGP_KEY_ARG:
+        argp_error(state, "Too many arguments.");
+        break;
+
+    case ARGP_KEY_END:
+        if (!arguments->nin || !arguments->nout)
+            argp_error(state, "At least one input and one output needed.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, 0, doc};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Checksum extra of a message, for the scanners.
+ */
+static int crc_extra(uint32_t msgid) {
+    if (msgid < 256)
+        return crc_extra_v1[msgid];
+
+    const mavschema_message_t *msg = mavschema_find_id(&schema, msgid);
+    return msg ? msg->crc_extra : -1;
+}
+
+
+/**
+ * Convert a baud rate to its termios constant.
+ * @return the speed or B0 if unsupported.
+ */
+static speed_t baud_speed(unsigned baud) {
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default: return B0;
+    }
+}
+
+
+/**
+ * Open a raw serial port without blocking.
+ * Aborts the program on error.
+ */
+static int open_serial(const endpoint_spec_t *spec) {
+    int fd = open(spec->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        char *msg = "Error opening serial port `%s`: %s";
+        syslog(LOG_ERR, msg, spec->device, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    speed_t speed = baud_speed(spec->baud);
+    if (speed == B0) {
+        syslog(LOG_ERR, "Unsupported baud rate %u", spec->baud);
+        exit(EXIT_FAILURE);
+    }
+
+    struct termios termios;
+    if (tcgetattr(fd, &termios)) {
+        char *msg = "Error getting serial port `%s` attributes: %s";
+        syslog(LOG_WARNING, msg, spec->device, strerror(errno));
+        return fd;
+    }
+    cfmakeraw(&termios);
+    if (cfsetispeed(&termios, speed) || cfsetospeed(&termios, speed)
+        || tcsetattr(fd, TCSANOW, &termios)) {
+        char *msg = "Error configuring serial port `%s`: %s";
+        syslog(LOG_WARNING, msg, spec->device, strerror(errno));
+    }
+    return fd;
+}
+
+
+/**
+ * Resolve the IPv4 address of a host.
+ * Aborts the program on error.
+ */
+static struct in_addr resolve(const char *host) {
+    struct hostent *hostent = gethostbyname(host);
+    if (!hostent) {
+        syslog(LOG_ERR, "Could not find host address `%s`", host);
+        exit(EXIT_FAILURE);
+    }
+    if (hostent->h_addrtype != AF_INET || hostent->h_length != 4) {
+        syslog(LOG_ERR, "Only IPv4 hosts supported.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct in_addr addr;
+    memcpy(&addr, hostent->h_addr_list[0], sizeof addr);
+    return addr;
+}
+
+
+/**
+ * Open a UDP socket, listening for an input or connected for an output.
+ * Aborts the program on error.
+ */
+static int open_udp(const endpoint_spec_t *spec, bool input) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        syslog(LOG_ERR, "Error creating UDP socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family=AF_INET, .sin_port=htons(spec->port),
+        .sin_addr={htonl(INADDR_ANY)}
+    };
+    if (spec->host)
+        addr.sin_addr = resolve(spec->host);
+
+    if (!input) {
+        if (!spec->host) {
+            syslog(LOG_ERR, "UDP output `%s` needs a HOST", spec->text);
+            exit(EXIT_FAILURE);
+        }
+        if (connect(sock, (struct sockaddr *) &addr, sizeof addr)) {
+            syslog(LOG_ERR, "Error connecting socket: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        return sock;
+    }
+
+    // A multicast group is joined after binding to any address, several
+    // programs possibly listening to it
+    struct in_addr group = addr.sin_addr;
+    bool multicast = IN_MULTICAST(ntohl(group.s_addr));
+    if (multicast) {
+        int one = 1;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one))
+            syslog(LOG_WARNING, "Error reusing address: %s", strerror(errno));
+    }
+    if (bind(sock, (struct sockaddr *) &addr, sizeof addr)) {
+        syslog(LOG_ERR, "Error binding `%s`: %s", spec->text, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct ip_mreq mreq = {group, {htonl(INADDR_ANY)}};
+    if (multicast && setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                                sizeof mreq)) {
+        syslog(LOG_ERR, "Error joining `%s`: %s", spec->text, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+
+/**
+ * Open an endpoint.
+ * Aborts the program on error.
+ */
+static int open_endpoint(const endpoint_spec_t *spec, bool input) {
+    return spec->serial ? open_serial(spec) : open_udp(spec, input);
+}
+
+
+/**
+ * Whether an output forwards a frame.
+ */
+static bool matches(const endpoint_spec_t *spec, const mavframe_t *frame) {
+    if (!spec->nrules)
+        return true;
+
+    for (unsigned i=0; i<spec->nrules; i++) {
+        const rule_t *r = &spec->rules[i];
+        if (frame->sysid >= r->sysid.min && frame->sysid <= r->sysid.max
+            && frame->compid >= r->compid.min
+            && frame->compid <= r->compid.max
+            && frame->msgid >= r->msgid.min && frame->msgid <= r->msgid.max)
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Whether a frame was forwarded within the deduplication window, recording
+ * it otherwise in the oldest entry of its set. A duplicate may rarely be
+ * forwarded when the set was overwritten, but a new frame is never dropped.
+ */
+static bool is_duplicate(dedup_entry_t *table, uint64_t window,
+                         const mavframe_t *frame, uint64_t now) {
+    // FNV-1a hash of the whole frame
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i=0; i<frame->len; i++)
+        hash = (hash ^ frame->data[i]) * 0x100000001b3ULL;
+
+    dedup_entry_t *set = &table[hash & (DEDUP_TABLE_LEN - DEDUP_WAYS)];
+    dedup_entry_t *oldest = set;
+    for (unsigned i=0; i<DEDUP_WAYS; i++) {
+        if (set[i].hash == hash && now - set[i].time_usec < window)
+            return true;
+        if (set[i].time_usec < oldest->time_usec)
+            oldest = &set[i];
+    }
+    oldest->hash = hash;
+    oldest->time_usec = now;
+    return false;
+}
+
+
+/**
+ * Write the batch of an output, dropping what the endpoint cannot take.
+ * The end of a frame partially written to a serial port is kept for the
+ * next write, the receiver otherwise losing the frame after it as well.
+ */
+static void flush_batch(output_t *out) {
+    if (!out->nframes && !out->tail)
+        return;
+
+    if (out->spec->serial) {
+        ssize_t n = write(out->fd, out->buf, out->len);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            syslog(LOG_ERR, "Error writing `%s`: %s", out->spec->text,
+                   strerror(errno));
+
+        // Drop the frames not started, keeping the end of the last one
+        size_t written = n < 0 ? 0 : n;
+        size_t keep = out->tail;
+        for (unsigned i=0; i<out->nframes; i++) {
+            size_t start = (uint8_t *) out->iov[i].iov_base - out->buf;
+            if (start >= written) {
+                out->dropped++;
+                continue;
+            }
+            out->frames++;
+            keep = start + out->iov[i].iov_len;
+        }
+        out->tail = keep > written ? keep - written : 0;
+        memmove(out->buf, out->buf + written, out->tail);
+    } else {
+        unsigned sent = 0;
+        while (sent < out->nframes) {
+            int n = sendmmsg(out->fd, out->msgs + sent, out->nframes - sent,
+                             0);
+            if (n <= 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    syslog(LOG_ERR, "Error sending to `%s`: %s",
+                           out->spec->text, strerror(errno));
+                break;
+            }
+            sent += n;
+        }
+        out->frames += sent;
+        out->dropped += out->nframes - sent;
+    }
+
+    out->len = out->tail;
+    out->nframes = 0;
+}
+
+
+/**
+ * Copy a frame to the batch of an output, writing a full batch first.
+ */
+static void batch_frame(output_t *out, const mavframe_t *frame) {
+    if (out->nframes == BATCH_MAX_FRAMES
+        || BATCH_BUFFER_LEN - out->len < frame->len)
+        flush_batch(out);
+
+    uint8_t *dst = out->buf + out->len;
+    memcpy(dst, frame->data, frame->len);
+    out->iov[out->nframes] = (struct iovec) {dst, frame->len};
+    out->msgs[out->nframes].msg_hdr = (struct msghdr) {
+        .msg_iov=&out->iov[out->nframes], .msg_iovlen=1
+    };
+    out->nframes++;
+    out->len += frame->len;
+}
+
+
+/**
+ * Route the complete frames of a block of an input.
+ * @return the length of the routed part of the block.
+ */
+static size_t route_block(const arguments_t *args, input_t *in,
+                          const uint8_t *buf, size_t len, output_t *outs,
+                          unsigned nout, dedup_entry_t *dedup,
+                          uint64_t now) {
+    size_t pos = 0;
+    mavframe_t frame;
+    while (mavframe_next(&in->scanner, buf, len, &pos, &frame)) {
+        in->frames++;
+        if (args->dedup_usec
+            && is_duplicate(dedup, args->dedup_usec, &frame, now))
+            continue;
+        for (unsigned i=0; i<nout; i++)
+            if (matches(outs[i].spec, &frame))
+                batch_frame(&outs[i], &frame);
+    }
+    return pos;
+}
+
+
+/**
+ * Receive the pending datagrams of a UDP input and route their frames,
+ * each datagram apart in its part of the read buffer.
+ */
+static void route_datagrams(const arguments_t *args, input_t *in,
+                            output_t *outs, unsigned nout,
+                            dedup_entry_t *dedup) {
+    struct iovec iov[DATAGRAM_BATCH];
+    struct mmsghdr msgs[DATAGRAM_BATCH];
+    for (unsigned i=0; i<DATAGRAM_BATCH; i++) {
+        iov[i] = (struct iovec) {in->buf + i * DATAGRAM_LEN, DATAGRAM_LEN};
+        msgs[i].msg_hdr = (struct msghdr) {.msg_iov=&iov[i], .msg_iovlen=1};
+    }
+
+    int n;
+    while ((n = recvmmsg(in->fd, msgs, DATAGRAM_BATCH, 0, NULL)) > 0) {
+        uint64_t now = get_time_us();
+        for (int i=0; i<n; i++) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                in->truncated++;
+            // A frame is not continued by the next datagram
+            size_t pos = route_block(args, in, iov[i].iov_base,
+                                     msgs[i].msg_len, outs, nout, dedup, now);
+            in->scanner.skipped += msgs[i].msg_len - pos;
+        }
+        if (n < DATAGRAM_BATCH)
+            return;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        syslog(LOG_ERR, "Error reading `%s`: %s", in->spec->text,
+               strerror(errno));
+}
+
+
+/**
+ * Read the available data of an input and route its complete frames.
+ * @return 0 if success, -1 on end of file.
+ */
+static int route_input(const arguments_t *args, input_t *in, output_t *outs,
+                       unsigned nout, dedup_entry_t *dedup) {
+    if (!in->spec->serial) {
+        route_datagrams(args, in, outs, nout, dedup);
+        return 0;
+    }
+
+    // Read until the buffer is full or no data is left
+    bool eof = false;
+    while (in->len < INPUT_BUFFER_LEN) {
+        ssize_t n = read(in->fd, in->buf + in->len,
+                         INPUT_BUFFER_LEN - in->len);
+        if (n > 0) {
+            in->len += n;
+            continue;
+        }
+        if (n == 0)
+            eof = true;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            syslog(LOG_ERR, "Error reading `%s`: %s", in->spec->text,
+                   strerror(errno));
+        break;
+    }
+
+    size_t pos = route_block(args, in, in->buf, in->len, outs, nout, dedup,
+                             get_time_us());
+
+    // Keep the incomplete frame for the next read, a full buffer of
+    // garbage is dropped
+    if (pos == 0 && in->len == INPUT_BUFFER_LEN)
+        pos = 1;
+    memmove(in->buf, in->buf + pos, in->len - pos);
+    in->len -= pos;
+    return eof ? -1 : 0;
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {.dedup_usec=100000};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (!arguments.nxml)
+        arguments.xml[arguments.nxml++] = MAVSCHEMA_DEFAULT_DIR;
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    // Stop the routing when terminated
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Load the checksum extras
+    for (int i=0; i<arguments.nxml; i++)
+        if (mavschema_load(&schema, arguments.xml[i]))
+            return EXIT_FAILURE;
+    for (unsigned i=0; i<256; i++) {
+        const mavschema_message_t *msg = mavschema_find_id(&schema, i);
+        crc_extra_v1[i] = msg ? msg->crc_extra : -1;
+    }
+
+    // Open the endpoints, the buffers being too large for the stack
+    input_t *ins = calloc(arguments.nin, sizeof *ins);
+    output_t *outs = calloc(arguments.nout, sizeof *outs);
+    dedup_entry_t *dedup = calloc(DEDUP_TABLE_LEN, sizeof *dedup);
+    struct pollfd fds[2 * MAX_ENDPOINTS];
+    if (!ins || !outs || !dedup) {
+        syslog(LOG_ERR, "Error allocating buffers: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (unsigned i=0; i<arguments.nin; i++) {
+        ins[i].spec = &arguments.in[i];
+        ins[i].fd = open_endpoint(ins[i].spec, true);
+        ins[i].scanner.crc_extra = crc_extra;
+        ins[i].scanner.accept_unknown = arguments.unknown;
+        fds[i] = (struct pollfd) {.fd=ins[i].fd, .events=POLLIN};
+    }
+    for (unsigned i=0; i<arguments.nout; i++) {
+        outs[i].spec = &arguments.out[i];
+        outs[i].fd = open_endpoint(outs[i].spec, false);
+    }
+    struct pollfd *out_fds = fds + arguments.nin;
+
+    // Routing loop, each poll round ending with the batches written, the
+    // outputs with the end of a frame to write waking it up when writable
+    unsigned open_inputs = arguments.nin;
+    while (!stop_requested && open_inputs) {
+        for (unsigned i=0; i<arguments.nout; i++)
+            out_fds[i] = (struct pollfd) {
+                .fd=outs[i].tail ? outs[i].fd : -1, .events=POLLOUT
+            };
+        int n = poll(fds, arguments.nin + arguments.nout, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                syslog(LOG_ERR, "Error in poll: %s", strerror(errno));
+            continue;
+        }
+
+        for (unsigned i=0; i<arguments.nin; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (route_input(&arguments, &ins[i], outs, arguments.nout,
+                            dedup)) {
+                syslog(LOG_WARNING, "End of input `%s`", ins[i].spec->text);
+                fds[i].fd = -1;
+                open_inputs--;
+            }
+        }
+        for (unsigned i=0; i<arguments.nout; i++)
+            flush_batch(&outs[i]);
+    }
+
+    // Report the counters
+    for (unsigned i=0; i<arguments.nin; i++)
+        syslog(LOG_INFO, "Input `%s`: %lu frames, %llu bad checksums, "
+               "%llu bytes skipped, %lu datagrams truncated",
+               ins[i].spec->text, ins[i].frames,
+               (unsigned long long) ins[i].scanner.bad_crc,
+               (unsigned long long) ins[i].scanner.skipped,
+               ins[i].truncated);
+    for (unsigned i=0; i<arguments.nout; i++)
+        syslog(LOG_INFO, "Output `%s`: %lu frames, %lu dropped",
+               outs[i].spec->text, outs[i].frames, outs[i].dropped);
+
+    for (unsigned i=0; i<arguments.nin; i++)
+        close(ins[i].fd);
+    for (unsigned i=0; i<arguments.nout; i++)
+        close(outs[i].fd);
+    free(ins);
+    free(outs);
+    free(dedup);
+    mavschema_free(&schema);
+    return EXIT_SUCCESS;
+}
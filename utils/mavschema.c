@@ -0,0 +1,722 @@
+/**
+ * Runtime MAVLink message definitions loaded from the dialect XML.
+ *
+ * The parser understands the subset of XML used by the MAVLink message
+ * definitions: elements, quoted attributes, comments and processing
+ * instructions. Only the messages, their fields and the included files are
+ * read. The payload layout and CRC extra are computed as mavgen does: the
+ * base fields sorted by decreasing element size, followed by the extensions
+ * in declaration order. The definitions also have a compact compiled form,
+ * embedded in the log headers, that is decoded without parsing XML.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "mavframe.h"
+#include "mavschema.h"
+
+
+/** Maximum nesting of included files. */
+#define MAX_INCLUDE_DEPTH 8
+
+
+/** MAVLink type names and element sizes, indexed by type. */
+static const struct {
+    const char *name;
+    unsigned size;
+} types[] = {
+    [MAVSCHEMA_CHAR]={"char", 1},
+    [MAVSCHEMA_INT8]={"int8_t", 1},
+    [MAVSCHEMA_UINT8]={"uint8_t", 1},
+    [MAVSCHEMA_INT16]={"int16_t", 2},
+    [MAVSCHEMA_UINT16]={"uint16_t", 2},
+    [MAVSCHEMA_INT32]={"int32_t", 4},
+    [MAVSCHEMA_UINT32]={"uint32_t", 4},
+    [MAVSCHEMA_INT64]={"int64_t", 8},
+    [MAVSCHEMA_UINT64]={"uint64_t", 8},
+    [MAVSCHEMA_FLOAT]={"float", 4},
+    [MAVSCHEMA_DOUBLE]={"double", 8},
+};
+
+/** Parser state of a definitions file. */
+typedef struct parser {
+    mavschema_t *schema;
+    const char *dir; ///< Directory of the included files.
+    int depth; ///< Include nesting.
+    mavschema_message_t *msg; ///< Message being read, NULL outside.
+    bool extensions; ///< Whether the following fields are extensions.
+    bool in_include; ///< Whether reading an include element.
+} parser_t;
+
+static int load(mavschema_t *schema, const char *path, int depth);
+
+
+/**
+ * Parse a field type such as `uint8_t` or `char[16]`.
+ * @return 0 if success, -1 if unknown.
+ */
+static int parse_type(const char *text, mavschema_field_t *field) {
+    // The version field of HEARTBEAT has its own type name
+    if (!strcmp(text, "uint8_t_mavlink_version"))
+        text = "uint8_t";
+
+    size_t len = strcspn(text, "[");
+    for (unsigned i=0; i<sizeof types / sizeof *types; i++) {
+        if (strlen(types[i].name) != len || strncmp(text, types[i].name, len))
+            continue;
+
+        field->type = i;
+        field->size = types[i].size;
+        field->array_len = 0;
+        if (text[len] == '[') {
+            char *endptr;
+            unsigned long n = strtoul(text + len + 1, &endptr, 10);
+            if (*endptr != ']' || endptr[1] || !n || n > 255)
+                return -1;
+            field->array_len = n;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+
+/**
+ * Lay out the payload and compute the CRC extra of a complete message.
+ */
+static void finish_message(mavschema_message_t *msg) {
+    // Stable sort of the base fields by decreasing element size
+    mavschema_field_t sorted[MAVSCHEMA_MAX_FIELDS];
+    unsigned n = 0;
+    for (unsigned size=8; size>=1; size/=2)
+        for (unsigned i=0; i<msg->nfields; i++)
+            if (!msg->fields[i].extension && msg->fields[i].size == size)
+                sorted[n++] = msg->fields[i];
+    for (unsigned i=0; i<msg->nfields; i++)
+        if (msg->fields[i].extension)
+            sorted[n++] = msg->fields[i];
+    memcpy(msg->fields, sorted, n * sizeof *sorted);
+
+    uint16_t crc = mavframe_crc((const uint8_t *) msg->name,
+                                strlen(msg->name), 0xFFFF);
+    crc = mavframe_crc((const uint8_t *) " ", 1, crc);
+
+    unsigned offset = 0;
+    msg->min_len = 0;
+    for (unsigned i=0; i<msg->nfields; i++) {
+        mavschema_field_t *field = &msg->fields[i];
+        field->offset = offset;
+        offset += field->size * (field->array_len ? field->array_len : 1);
+        if (field->extension)
+            continue;
+
+        msg->min_len = offset;
+        const char *type = types[field->type].name;
+        crc = mavframe_crc((const uint8_t *) type, strlen(type), crc);
+        crc = mavframe_crc((const uint8_t *) " ", 1, crc);
+        crc = mavframe_crc((const uint8_t *) field->name, strlen(field->name),
+                           crc);
+        crc = mavframe_crc((const uint8_t *) " ", 1, crc);
+        if (field->array_len) {
+            uint8_t array_len = field->array_len;
+            crc = mavframe_crc(&array_len, 1, crc);
+        }
+    }
+    msg->len = offset;
+    msg->crc_extra = (crc & 0xFF) ^ (crc >> 8);
+}
+
+
+/**
+ * Copy the value of an attribute of a tag.
+ * @return whether the attribute was found.
+ */
+static bool get_attribute(const char *tag, size_t len, const char *name,
+                          char *value, size_t size) {
+    size_t name_len = strlen(name);
+    for (size_t i=0; i + name_len + 2 < len; i++) {
+        if (strncmp(tag + i, name, name_len) || tag[i + name_len] != '=')
+            continue;
+        if (i && tag[i - 1] != ' ' && tag[i - 1] != '\t'
+            && tag[i - 1] != '\n' && tag[i - 1] != '\r')
+            continue;
+
+        char quote = tag[i + name_len + 1];
+        if (quote != '"' && quote != '\'')
+            return false;
+        const char *start = tag + i + name_len + 2;
+        const char *end = memchr(start, quote, tag + len - start);
+        if (!end || end - start >= size)
+            return false;
+        memcpy(value, start, end - start);
+        value[end - start] = 0;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Whether a tag has the given element name.
+ */
+static bool is_element(const char *tag, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    return len >= name_len && !strncmp(tag, name, name_len)
+        && (len == name_len || strchr(" \t\r\n/", tag[name_len]));
+}
+
+
+/**
+ * Handle a start or empty-element tag, without its angle brackets.
+ * @return 0 if success, -1 if error.
+ */
+static int start_element(parser_t *p, const char *tag, size_t len) {
+    char id[16], name[MAVSCHEMA_NAME_LEN], type[32];
+
+    if (is_element(tag, len, "message")) {
+        if (!get_attribute(tag, len, "id", id, sizeof id)
+            || !get_attribute(tag, len, "name", name, sizeof name)) {
+            syslog(LOG_ERR, "Message without id or name in definitions");
+            return -1;
+        }
+
+        mavschema_t *schema = p->schema;
+        if (schema->nmessages == schema->capacity) {
+            unsigned capacity = schema->capacity ? 2 * schema->capacity : 64;
+            void *messages = realloc(schema->messages,
+                                     capacity * sizeof *schema->messages);
+            if (!messages) {
+                syslog(LOG_ERR, "Error allocating message definitions: %s",
+                       strerror(errno));
+                return -1;
+            }
+            schema->messages = messages;
+            schema->capacity = capacity;
+        }
+
+        p->msg = &schema->messages[schema->nmessages];
+        memset(p->msg, 0, sizeof *p->msg);
+        p->msg->id = strtoul(id, NULL, 0);
+        strcpy(p->msg->name, name);
+        p->extensions = false;
+    } else if (p->msg && is_element(tag, len, "extensions")) {
+        p->extensions = true;
+    } else if (p->msg && is_element(tag, len, "field")) {
+        if (p->msg->nfields == MAVSCHEMA_MAX_FIELDS) {
+            syslog(LOG_ERR, "Too many fields in message %s", p->msg->name);
+            return -1;
+        }
+
+        mavschema_field_t *field = &p->msg->fields[p->msg->nfields];
+        if (!get_attribute(tag, len, "type", type, sizeof type)
+            || !get_attribute(tag, len, "name", field->name,
+                              sizeof field->name)
+            || parse_type(type, field)) {
+            syslog(LOG_ERR, "Invalid field in message %s", p->msg->name);
+            return -1;
+        }
+        field->extension = p->extensions;
+        p->msg->nfields++;
+    } else if (is_element(tag, len, "include")) {
+        p->in_include = tag[len - 1] != '/';
+    }
+
+    return 0;
+}
+
+
+/**
+ * Handle an end tag, without its angle brackets and slash.
+ */
+static void end_element(parser_t *p, const char *tag, size_t len) {
+    if (p->msg && is_element(tag, len, "message")) {
+        finish_message(p->msg);
+
+        // A redefinition replaces the earlier message
+        mavschema_t *schema = p->schema;
+        for (unsigned i=0; i<schema->nmessages; i++) {
+            if (schema->messages[i].id == p->msg->id) {
+                schema->messages[i] = *p->msg;
+                p->msg = NULL;
+                return;
+            }
+        }
+        schema->nmessages++;
+        p->msg = NULL;
+    } else if (is_element(tag, len, "include")) {
+        p->in_include = false;
+    }
+}
+
+
+/**
+ * Load an included definitions file, relative to the including one.
+ * @return 0 if success, -1 if error.
+ */
+static int include(parser_t *p, const char *text, size_t len) {
+    while (len && strchr(" \t\r\n", *text)) {
+        text++;
+        len--;
+    }
+    while (len && strchr(" \t\r\n", text[len - 1]))
+        len--;
+
+    char path[PATH_MAX];
+    int n;
+    if (*text == '/' || !p->dir)
+        n = snprintf(path, sizeof path, "%.*s", (int) len, text);
+    else
+        n = snprintf(path, sizeof path, "%s/%.*s", p->dir, (int) len, text);
+    if (n >= sizeof path) {
+        syslog(LOG_ERR, "Included definitions path too long");
+        return -1;
+    }
+
+    if (p->depth >= MAX_INCLUDE_DEPTH) {
+        syslog(LOG_ERR, "Definitions includes nested too deeply at `%s`",
+               path);
+        return -1;
+    }
+    return load(p->schema, path, p->depth + 1);
+}
+
+
+/**
+ * Parse definitions text.
+ * @return 0 if success, -1 if error.
+ */
+static int parse(parser_t *p, const char *xml, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        const char *lt = memchr(xml + i, '<', len - i);
+        size_t start = lt ? lt - xml : len;
+
+        // Text between tags only matters inside includes
+        if (p->in_include && include(p, xml + i, start - i))
+            return -1;
+        if (!lt)
+            break;
+
+        const char *end;
+        if (len - start >= 4 && !strncmp(lt, "<!--", 4)) {
+            end = memmem(lt + 4, xml + len - lt - 4, "-->", 3);
+            i = end ? end - xml + 3 : len;
+            continue;
+        }
+
+        end = memchr(lt, '>', xml + len - lt);
+        if (!end) {
+            syslog(LOG_ERR, "Unterminated tag in definitions");
+            return -1;
+        }
+        const char *tag = lt + 1;
+        size_t tag_len = end - tag;
+        i = end - xml + 1;
+
+        if (tag_len && (*tag == '?' || *tag == '!'))
+            continue;
+        if (tag_len && *tag == '/') {
+            end_element(p, tag + 1, tag_len - 1);
+            continue;
+        }
+
+        bool empty = tag_len && tag[tag_len - 1] == '/';
+        if (start_element(p, tag, tag_len))
+            return -1;
+        if (empty)
+            end_element(p, tag, tag_len - 1);
+    }
+
+    if (p->msg) {
+        syslog(LOG_ERR, "Unterminated message %s in definitions", p->msg->name);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Load a definitions file at the given include depth.
+ */
+static int load(mavschema_t *schema, const char *path, int depth) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        syslog(LOG_ERR, "Error opening definitions `%s`: %s", path,
+               strerror(errno));
+        return -1;
+    }
+
+    char *xml = NULL;
+    size_t len = 0;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long size = ftell(file);
+        rewind(file);
+        xml = size >= 0 ? malloc(size + 1) : NULL;
+        if (xml)
+            len = fread(xml, 1, size, file);
+    }
+    if (!xml || ferror(file)) {
+        syslog(LOG_ERR, "Error reading definitions `%s`: %s", path,
+               strerror(errno));
+        free(xml);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    // Included files are relative to the directory of the including one
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - path) : 1,
+             slash ? path : ".");
+
+    parser_t parser = {.schema=schema, .dir=dir, .depth=depth};
+    int status = parse(&parser, xml, len);
+    if (status)
+        syslog(LOG_ERR, "Error in definitions `%s`", path);
+    free(xml);
+    return status;
+}
+
+
+/**
+ * Load the message definitions of a dialect XML file and its includes, or
+ * of all XML files of a directory.
+ * Messages already in the schema are replaced by redefinitions.
+ * @return 0 if success, -1 if error.
+ */
+int mavschema_load(mavschema_t *schema, const char *path) {
+    struct stat st;
+    if (stat(path, &st)) {
+        syslog(LOG_ERR, "Error accessing definitions `%s`: %s", path,
+               strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return load(schema, path, 0);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        syslog(LOG_ERR, "Error opening definitions directory `%s`: %s",
+               path, strerror(errno));
+        return -1;
+    }
+
+    int status = 0;
+    struct dirent *entry;
+    while (!status && (entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".xml"))
+            continue;
+
+        char file[PATH_MAX];
+        snprintf(file, sizeof file, "%s/%s", path, entry->d_name);
+        status = load(schema, file, 0);
+    }
+    closedir(dir);
+    return status;
+}
+
+
+/**
+ * Load message definitions from XML text.
+ * @param dir directory of included files, NULL if relative to the current.
+ * @return 0 if success, -1 if error.
+ */
+int mavschema_parse(mavschema_t *schema, const char *xml, size_t len,
+                    const char *dir) {
+    parser_t parser = {.schema=schema, .dir=dir};
+    return parse(&parser, xml, len);
+}
+
+
+/**
+ * Append a name and its terminator to an encoding.
+ */
+static uint8_t* put_name(uint8_t *p, const char *name) {
+    size_t len = strlen(name) + 1;
+    memcpy(p, name, len);
+    return p + len;
+}
+
+
+/**
+ * Encode the message definitions in their compiled form, as embedded in the
+ * log headers: the layout and CRC extras computed, so that readers need no
+ * XML parsing. All integers are little-endian:
+ *
+ *     u32 nmessages
+ *     per message: u32 id, u8 crc_extra, u8 len, u8 min_len, u8 nfields,
+ *                  name NUL-terminated
+ *     per field: u8 type, u8 array_len, u8 offset, u8 extension,
+ *                name NUL-terminated
+ *
+ * @param[out] buf set to the encoding, allocated with malloc.
+ * @param[out] len length of the encoding.
+ * @return 0 if success, -1 if error.
+ */
+int mavschema_encode(const mavschema_t *schema, uint8_t **buf, size_t *len) {
+    size_t size = 4;
+    for (unsigned i=0; i<schema->nmessages; i++) {
+        const mavschema_message_t *msg = &schema->messages[i];
+        size += 8 + strlen(msg->name) + 1;
+        for (unsigned f=0; f<msg->nfields; f++)
+            size += 4 + strlen(msg->fields[f].name) + 1;
+    }
+
+    uint8_t *p = *buf = malloc(size);
+    if (!p) {
+        syslog(LOG_ERR, "Error allocating definitions encoding: %s",
+               strerror(errno));
+        return -1;
+    }
+
+    for (int k=0; k<4; k++)
+        *p++ = schema->nmessages >> 8 * k;
+    for (unsigned i=0; i<schema->nmessages; i++) {
+        const mavschema_message_t *msg = &schema->messages[i];
+        for (int k=0; k<4; k++)
+            *p++ = msg->id >> 8 * k;
+        *p++ = msg->crc_extra;
+        *p++ = msg->len;
+        *p++ = msg->min_len;
+        *p++ = msg->nfields;
+        p = put_name(p, msg->name);
+
+        for (unsigned f=0; f<msg->nfields; f++) {
+            const mavschema_field_t *field = &msg->fields[f];
+            *p++ = field->type;
+            *p++ = field->array_len;
+            *p++ = field->offset;
+            *p++ = field->extension;
+            p = put_name(p, field->name);
+        }
+    }
+
+    *len = size;
+    return 0;
+}
+
+
+/**
+ * Read a NUL-terminated name of an encoding.
+ * @return the position after the name, or NULL if invalid.
+ */
+static const uint8_t* get_name(const uint8_t *p, const uint8_t *end,
+                               char name[MAVSCHEMA_NAME_LEN]) {
+    const uint8_t *nul = memchr(p, 0, end - p);
+    if (!nul || nul == p || nul - p >= MAVSCHEMA_NAME_LEN)
+        return NULL;
+    memcpy(name, p, nul - p + 1);
+    return nul + 1;
+}
+
+
+/**
+ * Decode the message definitions of a compiled form.
+ * Messages already in the schema are replaced by redefinitions.
+ * @return 0 if success, -1 if invalid.
+ */
+int mavschema_decode(mavschema_t *schema, const uint8_t *buf, size_t len) {
+    const uint8_t *p = buf, *end = buf + len;
+    if (end - p < 4)
+        goto invalid;
+    uint32_t nmessages = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+    p += 4;
+
+    for (uint32_t i=0; i<nmessages; i++) {
+        mavschema_message_t msg = {0};
+        if (end - p < 8)
+            goto invalid;
+        msg.id = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+        msg.crc_extra = p[4];
+        msg.len = p[5];
+        msg.min_len = p[6];
+        msg.nfields = p[7];
+        if (msg.nfields > MAVSCHEMA_MAX_FIELDS || msg.min_len > msg.len
+            || !(p = get_name(p + 8, end, msg.name)))
+            goto invalid;
+
+        for (unsigned f=0; f<msg.nfields; f++) {
+            mavschema_field_t *field = &msg.fields[f];
+            if (end - p < 4 || p[0] >= sizeof types / sizeof *types)
+                goto invalid;
+            field->type = p[0];
+            field->size = types[p[0]].size;
+            field->array_len = p[1];
+            field->offset = p[2];
+            field->extension = p[3];
+            unsigned n = field->array_len ? field->array_len : 1;
+            if (field->offset + n * field->size > msg.len
+                || !(p = get_name(p + 4, end, field->name)))
+                goto invalid;
+        }
+
+        // A redefinition replaces the earlier message
+        mavschema_message_t *slot = (mavschema_message_t *)
+            mavschema_find_id(schema, msg.id);
+        if (!slot) {
+            if (schema->nmessages == schema->capacity) {
+                unsigned capacity = schema->capacity ? 2 * schema->capacity
+                                                     : 64;
+                void *messages = realloc(schema->messages,
+                                         capacity * sizeof *schema->messages);
+                if (!messages) {
+                    syslog(LOG_ERR, "Error allocating message definitions: %s",
+                           strerror(errno));
+                    return -1;
+                }
+                schema->messages = messages;
+                schema->capacity = capacity;
+            }
+            slot = &schema->messages[schema->nmessages++];
+        }
+        *slot = msg;
+    }
+    return 0;
+
+ invalid:
+    syslog(LOG_ERR, "Invalid compiled message definitions");
+    return -1;
+}
+
+
+/**
+ * Build the table of CRC extras indexed by message id, for the frame
+ * scanner.
+ * @param[out] table set to the CRC extras, -1 for unknown messages,
+ *             allocated with malloc.
+ * @param[out] len of the table, one past the largest id.
+ * @return 0 if success, -1 if error.
+ */
+int mavschema_crc_extras(const mavschema_t *schema, int16_t **table,
+                         uint32_t *len) {
+    uint32_t n = 0;
+    for (unsigned i=0; i<schema->nmessages; i++)
+        if (schema->messages[i].id >= n)
+            n = schema->messages[i].id + 1;
+
+    *table = malloc((n ? n : 1) * sizeof **table);
+    if (!*table) {
+        syslog(LOG_ERR, "Error allocating CRC extras: %s", strerror(errno));
+        return -1;
+    }
+    for (uint32_t id=0; id<n; id++)
+        (*table)[id] = -1;
+    for (unsigned i=0; i<schema->nmessages; i++)
+        (*table)[schema->messages[i].id] = schema->messages[i].crc_extra;
+    *len = n;
+    return 0;
+}
+
+
+/**
+ * Find a message definition by identifier.
+ * @return the definition or NULL if unknown.
+ */
+const mavschema_message_t* mavschema_find_id(const mavschema_t *schema,
+                                             uint32_t id) {
+    for (unsigned i=0; i<schema->nmessages; i++)
+        if (schema->messages[i].id == id)
+            return &schema->messages[i];
+    return NULL;
+}
+
+
+/**
+ * Find a message definition by name.
+ * @return the definition or NULL if unknown.
+ */
+const mavschema_message_t* mavschema_find_name(const mavschema_t *schema,
+                                               const char *name) {
+    for (unsigned i=0; i<schema->nmessages; i++)
+        if (!strcmp(schema->messages[i].name, name))
+            return &schema->messages[i];
+    return NULL;
+}
+
+
+/**
+ * Find a field of a message by name.
+ * @return the field or NULL if unknown.
+ */
+const mavschema_field_t* mavschema_find_field(const mavschema_message_t *msg,
+                                              const char *name) {
+    for (unsigned i=0; i<msg->nfields; i++)
+        if (!strcmp(msg->fields[i].name, name))
+            return &msg->fields[i];
+    return NULL;
+}
+
+
+/**
+ * Get an element of a field from a little-endian payload.
+ * Bytes past the payload length read as zero, as truncated by MAVLink 2.
+ * @param index of the element, 0 for scalars.
+ * @return the value or NaN if the index is out of range.
+ */
+double mavschema_get(const mavschema_field_t *field, const uint8_t *payload,
+                     size_t payload_len, unsigned index) {
+    if (index >= (field->array_len ? field->array_len : 1))
+        return NAN;
+
+    size_t offset = field->offset + index * field->size;
+    uint8_t bytes[8] = {0};
+    for (unsigned i=0; i<field->size && offset + i < payload_len; i++)
+        bytes[i] = payload[offset + i];
+
+    uint64_t u = 0;
+    for (unsigned i=0; i<field->size; i++)
+        u |= (uint64_t) bytes[i] << 8 * i;
+
+    switch (field->type) {
+    case MAVSCHEMA_CHAR:
+    case MAVSCHEMA_UINT8:
+    case MAVSCHEMA_UINT16:
+    case MAVSCHEMA_UINT32:
+    case MAVSCHEMA_UINT64:
+        return u;
+    case MAVSCHEMA_INT8:
+        return (int8_t) u;
+    case MAVSCHEMA_INT16:
+        return (int16_t) u;
+    case MAVSCHEMA_INT32:
+        return (int32_t) u;
+    case MAVSCHEMA_INT64:
+        return (int64_t) u;
+    case MAVSCHEMA_FLOAT:
+        {
+            uint32_t u32 = u;
+            float f;
+            memcpy(&f, &u32, sizeof f);
+            return f;
+        }
+    case MAVSCHEMA_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &u, sizeof d);
+            return d;
+        }
+    }
+    return NAN;
+}
+
+
+/**
+ * Free the message definitions.
+ */
+void mavschema_free(mavschema_t *schema) {
+    free(schema->messages);
+    schema->messages = NULL;
+    schema->nmessages = schema->capacity = 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Runtime MAVLink message definitions loaded from the dialect XML.
+ */
+
+#ifndef MAVSCHEMA_H
+#define MAVSCHEMA_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Directory of the installed message definitions. */
+#ifndef MAVSCHEMA_DEFAULT_DIR
+#define MAVSCHEMA_DEFAULT_DIR "/usr/local/share/fdas3/mavlink"
+#endif
+
+/** Maximum length of message and field names, including the terminator. */
+#define MAVSCHEMA_NAME_LEN 64
+
+/** Maximum number of fields of a message. */
+#define MAVSCHEMA_MAX_FIELDS 64
+
+
+/** Field types, in the order of their MAVLink type names. */
+typedef enum {
+    MAVSCHEMA_CHAR,
+    MAVSCHEMA_INT8,
+    MAVSCHEMA_UINT8,
+    MAVSCHEMA_INT16,
+    MAVSCHEMA_UINT16,
+    MAVSCHEMA_INT32,
+    MAVSCHEMA_UINT32,
+    MAVSCHEMA_INT64,
+    MAVSCHEMA_UINT64,
+    MAVSCHEMA_FLOAT,
+    MAVSCHEMA_DOUBLE,
+} mavschema_type_t;
+
+/** Message field, with its place in the wire payload. */
+typedef struct mavschema_field {
+    char name[MAVSCHEMA_NAME_LEN];
+    mavschema_type_t type;
+    unsigned size; ///< Size of an element.
+    unsigned array_len; ///< Number of elements, 0 for scalars.
+    unsigned offset; ///< Offset in the payload.
+    bool extension; ///< MAVLink 2 extension field.
+} mavschema_field_t;
+
+/** Message definition. */
+typedef struct mavschema_message {
+    uint32_t id;
+    char name[MAVSCHEMA_NAME_LEN];
+    uint8_t crc_extra;
+    unsigned len; ///< Payload length, with the extensions.
+    unsigned min_len; ///< Payload length without the extensions.
+    unsigned nfields;
+    mavschema_field_t fields[MAVSCHEMA_MAX_FIELDS]; ///< In wire order.
+} mavschema_message_t;
+
+/** Set of message definitions. */
+typedef struct mavschema {
+    mavschema_message_t *messages;
+    unsigned nmessages;
+    unsigned capacity;
+} mavschema_t;
+
+
+int mavschema_load(mavschema_t *schema, const char *path);
+int mavschema_parse(mavschema_t *schema, const char *xml, size_t len,
+                    const char *dir);
+int mavschema_encode(const mavschema_t *schema, uint8_t **buf, size_t *len);
+int mavschema_decode(mavschema_t *schema, const uint8_t *buf, size_t len);
+int mavschema_crc_extras(const mavschema_t *schema, int16_t **table,
+                         uint32_t *len);
+const mavschema_message_t* mavschema_find_id(const mavschema_t *schema,
+                                             uint32_t id);
+const mavschema_message_t* mavschema_find_name(const mavschema_t *schema,
+                                               const char *name);
+const mavschema_field_t* mavschema_find_field(const mavschema_message_t *msg,
+                                              const char *name);
+double mavschema_get(const mavschema_field_t *field, const uint8_t *payload,
+                     size_t payload_len, unsigned index);
+void mavschema_free(mavschema_t *schema);
+
+
+#endif//MAVSCHEMA_H
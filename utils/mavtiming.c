@@ -0,0 +1,706 @@
+/**
+ * Offline timing-quality analyzer for recorded logs.
+ *
+ * A binary log is read in a single pass by logscan, through its sliding
+ * memory mapping or decompression thread, and a text log line by line, so
+ * that logs of several gigabytes are processed at disk speed with a fixed
+ * memory footprint. The intervals between the samples of each source are
+ * gathered in a log-linear histogram with 1024 bins per octave: the
+ * percentiles are approximate to about 0.1% but cost no memory per sample.
+ */
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <argp.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "logscan.h"
+#include "mavframe.h"
+
+#include "generated/ahrs400_messages/mavlink.h"
+
+
+/** Base 2 logarithm of the number of histogram bins per octave. */
+#define HIST_SUB_BITS 10
+
+/** Histogram bins per octave, intervals below twice this are exact. */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/** Number of histogram bins, covering intervals up to 2^32 - 1 us. */
+#define HIST_BINS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/** Capacity of the source table, must be a power of two. */
+#define MAX_SOURCES 1024
+
+/** Number of jitter percentiles reported. */
+#define NJITTER 4
+
+
+/** Program version. */
+const char *argp_program_version = "mavtiming 0.1";
+
+/** Bug report address. */
+const char *argp_program_bug_address = "https://github.com/cea-ufmg/fdas3";
+
+/** Program documentation. */
+static char doc[] = "mavtiming -- Report the timing quality of recorded logs."
+    "\vThe LOGFILEs may be mavlogs (mavlog, mavrecord, burst logs), binary "
+    "logs of the device readers (--logbin), both possibly gzip compressed, or "
+    "their text logs; the format is detected from the first byte unless "
+    "given. Samples are timed by the "
+    "host timestamp of mavlog records, by the leading time_usec field of "
+    "binary log messages and by the first column of text logs.\n\n"
+    "Intervals of zero are reported as duplicates, backward intervals and "
+    "forward ones of at least --step as clock steps, and intervals longer "
+    "than --gap times the median as gaps. The drift of the AHRS400 internal "
+    "timer is fitted against the host time by least squares.";
+
+/** Description of the accepted arguments. */
+static char args_doc[] = "LOGFILE...";
+
+/** Program options structure. */
+static struct argp_option options[] = {
+    {"format", 'f', "FORMAT", 0,
+     "Log format: mavlog, logbin or text, detected by default"},
+    {"gap", 'g', "FACTOR", 0,
+     "Gap threshold relative to the median interval, defaults to 1.5"},
+    {"step", 's', "SECONDS", 0,
+     "Forward clock step threshold, defaults to 1"},
+    {"sensor-tick", 't', "NANOSECONDS", 0,
+     "Period of the AHRS400 internal timer, defaults to 790"},
+    {"histogram", 'H', 0, 0, "Print the interval histograms"},
+    {0}
+};
+
+/** Log formats. */
+typedef enum {
+    FORMAT_AUTO,
+    FORMAT_MAVLOG,
+    FORMAT_LOGBIN,
+    FORMAT_TEXT,
+} log_format_t;
+
+/** Program arguments structure. */
+typedef struct arguments {
+    char **files;
+    int nfiles;
+    log_format_t format;
+    double gap_factor;
+    uint64_t step_usec;
+    double tick_usec;
+    bool histogram;
+} arguments_t;
+
+/** Least-squares fit of a device clock offset against the host time. */
+typedef struct drift {
+    uint64_t n;
+    uint64_t first_usec; ///< Host time of the first sample.
+    uint64_t last_usec; ///< Host time of the last sample.
+    uint16_t last_ticks;
+    double sensor_usec; ///< Unwrapped device time since the first sample.
+    double mean_x, mean_y; ///< Host time [s] and offset [us] means.
+    double m2_x, m2_y, c_xy; ///< Sums of squared deviations and products.
+    unsigned long breaks; ///< Intervals too long to unwrap the timer.
+} drift_t;
+
+/** Timing statistics of a source. */
+typedef struct source {
+    bool used;
+    uint64_t key;
+    int sensor_offset; ///< Payload offset of the AHRS400 timer, -1 if none.
+    uint64_t count;
+    uint64_t first_usec;
+    uint64_t last_usec;
+    uint64_t *hist; ///< Interval histogram of HIST_BINS bins.
+    uint64_t max_interval;
+    uint64_t max_interval_at;
+    uint64_t duplicates;
+    uint64_t backward_steps;
+    uint64_t max_backward;
+    uint64_t max_backward_at;
+    uint64_t forward_steps;
+    drift_t drift;
+} source_t;
+
+/** Analysis state of a log. */
+typedef struct analysis {
+    source_t sources[MAX_SOURCES];
+    unsigned nsources;
+    log_format_t format;
+    int sensor_column; ///< Text log column of the AHRS400 timer, -1 if none.
+    uint64_t malformed; ///< Unparsable bytes or lines.
+} analysis_t;
+
+/** A bin of the distribution of the deviations from the median interval. */
+typedef struct deviation {
+    double value;
+    uint64_t count;
+} deviation_t;
+
+
+/** Messages carrying the AHRS400 internal timer. */
+static const struct {
+    uint32_t msgid;
+    size_t offset;
+} sensor_time_fields[] = {
+    {MAVLINK_MSG_ID_AHRS400_ANGLE_RAW,
+     offsetof(mavlink_ahrs400_angle_raw_t, sensor_time)},
+    {MAVLINK_MSG_ID_AHRS400_ANGLE,
+     offsetof(mavlink_ahrs400_angle_t, sensor_time)},
+    {MAVLINK_MSG_ID_AHRS400_SCALED_RAW,
+     offsetof(mavlink_ahrs400_scaled_raw_t, sensor_time)},
+    {MAVLINK_MSG_ID_AHRS400_SCALED,
+     offsetof(mavlink_ahrs400_scaled_t, sensor_time)},
+    {MAVLINK_MSG_ID_AHRS400_VOLTAGE_RAW,
+     offsetof(mavlink_ahrs400_voltage_raw_t, sensor_time)},
+    {MAVLINK_MSG_ID_AHRS400_VOLTAGE,
+     offsetof(mavlink_ahrs400_voltage_t, sensor_time)},
+};
+
+
+/** Argument parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the arguments structure to write the parsed options
+    arguments_t *arguments = state->input;
+    char *endptr = 0;
+
+    switch (key) {
+    case 'f':
+        if (!strcmp(arg, "mavlog"))
+            arguments->format = FORMAT_MAVLOG;
+        else if (!strcmp(arg, "logbin"))
+            arguments->format = FORMAT_LOGBIN;
+        else if (!strcmp(arg, "text"))
+            arguments->format = FORMAT_TEXT;
+        else
+            argp_error(state, "Unknown FORMAT `%s`.", arg);
+        break;
+
+    case 'g':
+        arguments->gap_factor = strtod(arg, &endptr);
+        if (*endptr || !(arguments->gap_factor > 1))
+            argp_error(state, "FACTOR must be a number greater than 1.");
+        break;
+
+    case 's':
+        {
+            double step = strtod(arg, &endptr);
+            if (*endptr || !(step > 0))
+                argp_error(state, "SECONDS must be a positive number.");
+            arguments->step_usec = step * 1e6;
+        }
+        break;
+
+    case 't':
+        arguments->tick_usec = strtod(arg, &endptr) * 1e-3;
+        if (*endptr || !(arguments->tick_usec > 0))
+            argp_error(state, "NANOSECONDS must be a positive number.");
+        break;
+
+    case 'H':
+        arguments->histogram = true;
+        break;
+
+    case ARGP_KEY_ARGS:
+        arguments->files = state->argv + state->next;
+        arguments->nfiles = state->argc - state->next;
+        break;
+
+    case ARGP_KEY_NO_ARGS:
+        argp_error(state, "Not enough arguments.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Argument parser object. */
+static struct argp argp = {options, parse_opt, args_doc, doc};
+
+
+/**
+ * Histogram bin of an interval.
+ */
+static unsigned hist_bin(uint64_t interval) {
+    if (interval < 2 * HIST_SUB)
+        return interval;
+    if (interval > UINT32_MAX)
+        interval = UINT32_MAX;
+
+    unsigned octave = 63 - __builtin_clzll(interval);
+    unsigned shift = octave - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (interval >> shift) - HIST_SUB;
+}
+
+
+/**
+ * Midpoint of the intervals of a histogram bin.
+ */
+static double hist_value(unsigned bin) {
+    if (bin < 2 * HIST_SUB)
+        return bin;
+
+    unsigned shift = bin / HIST_SUB - 1;
+    uint64_t width = 1ULL << shift;
+    uint64_t lower = (uint64_t)(bin % HIST_SUB + HIST_SUB) << shift;
+    return lower + (width - 1) / 2.0;
+}
+
+
+/**
+ * Interval at the given fraction of the histogram.
+ */
+static double hist_percentile(const uint64_t *hist, uint64_t total, double p) {
+    uint64_t rank = ceil(p * total);
+    uint64_t seen = 0;
+    for (unsigned bin=0; bin<HIST_BINS; bin++) {
+        seen += hist[bin];
+        if (seen && seen >= rank)
+            return hist_value(bin);
+    }
+    return 0;
+}
+
+
+/** Order the deviation bins by value. */
+static int compare_deviations(const void *a, const void *b) {
+    double da = ((const deviation_t *) a)->value;
+    double db = ((const deviation_t *) b)->value;
+    return (da > db) - (da < db);
+}
+
+
+/**
+ * Find or create the statistics of a source.
+ * @return the source or NULL if the table is full.
+ */
+static source_t* find_source(analysis_t *an, uint64_t key) {
+    uint32_t hash = (key ^ key >> 32) * 0x9E3779B1;
+
+    for (unsigned i=0; i<MAX_SOURCES; i++) {
+        source_t *src = &an->sources[(hash + i) & (MAX_SOURCES - 1)];
+        if (!src->used) {
+            src->hist = calloc(HIST_BINS, sizeof *src->hist);
+            if (!src->hist) {
+                syslog(LOG_ERR, "Error allocating histogram: %s",
+                       strerror(errno));
+                return NULL;
+            }
+            src->used = true;
+            src->key = key;
+            src->sensor_offset = -1;
+            an->nsources++;
+            return src;
+        }
+        if (src->key == key)
+            return src;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Account for the interval preceding a sample.
+ */
+static void add_sample(const arguments_t *args, source_t *src,
+                       uint64_t time_usec) {
+    if (src->count++ == 0) {
+        src->first_usec = src->last_usec = time_usec;
+        return;
+    }
+
+    uint64_t interval = time_usec - src->last_usec;
+    if (time_usec < src->last_usec) {
+        src->backward_steps++;
+        if (src->last_usec - time_usec > src->max_backward) {
+            src->max_backward = src->last_usec - time_usec;
+            src->max_backward_at = time_usec;
+        }
+    } else if (interval == 0) {
+        src->duplicates++;
+    } else if (interval >= args->step_usec) {
+        src->forward_steps++;
+    } else {
+        src->hist[hist_bin(interval)]++;
+        if (interval > src->max_interval) {
+            src->max_interval = interval;
+            src->max_interval_at = time_usec;
+        }
+    }
+    src->last_usec = time_usec;
+}
+
+
+/**
+ * Add a reading of the AHRS400 internal timer to the drift fit.
+ *
+ * The 16-bit timer wraps in about 50 ms, so it is unwrapped with the
+ * intervals between consecutive samples. Longer or backward intervals
+ * advance the device time by the host interval instead, keeping the
+ * offset continuous.
+ */
+static void add_sensor_time(const arguments_t *args, drift_t *drift,
+                            uint64_t time_usec, uint16_t ticks) {
+    if (drift->n == 0) {
+        drift->first_usec = time_usec;
+    } else {
+        double host_step = (double) time_usec - (double) drift->last_usec;
+        if (host_step < 0 || host_step > 0.9 * 65536 * args->tick_usec) {
+            drift->breaks++;
+            drift->sensor_usec += host_step;
+        } else {
+            uint16_t elapsed = ticks - drift->last_ticks;
+            drift->sensor_usec += elapsed * args->tick_usec;
+        }
+    }
+    drift->last_usec = time_usec;
+    drift->last_ticks = ticks;
+
+    // Welford update of the means and co-moments
+    double host_usec = (double) time_usec - (double) drift->first_usec;
+    double x = host_usec * 1e-6;
+    double y = drift->sensor_usec - host_usec;
+    drift->n++;
+    double dx = x - drift->mean_x;
+    drift->mean_x += dx / drift->n;
+    double dy = y - drift->mean_y;
+    drift->mean_y += dy / drift->n;
+    drift->m2_x += dx * (x - drift->mean_x);
+    drift->m2_y += dy * (y - drift->mean_y);
+    drift->c_xy += dx * (y - drift->mean_y);
+}
+
+
+/**
+ * Account for a MAVLink frame.
+ * @param time_usec timestamp of the mavlog record, or leading time_usec
+ *        field of the payload.
+ */
+static void add_frame(const arguments_t *args, analysis_t *an,
+                      const mavframe_t *frame, uint64_t time_usec) {
+    uint64_t key = (uint64_t) frame->sysid << 32
+                   | (uint64_t) frame->compid << 24 | frame->msgid;
+    source_t *src = find_source(an, key);
+    if (!src)
+        return;
+
+    if (src->count == 0) {
+        unsigned n = sizeof sensor_time_fields / sizeof *sensor_time_fields;
+        for (unsigned i=0; i<n; i++)
+            if (sensor_time_fields[i].msgid == frame->msgid)
+                src->sensor_offset = sensor_time_fields[i].offset;
+    }
+
+    add_sample(args, src, time_usec);
+
+    if (src->sensor_offset >= 0) {
+        uint8_t payload[MAVFRAME_MAX_LEN];
+        mavframe_payload(frame, payload, src->sensor_offset + 2);
+        uint16_t ticks = payload[src->sensor_offset]
+                         | payload[src->sensor_offset + 1] << 8;
+        add_sensor_time(args, &src->drift, time_usec, ticks);
+    }
+}
+
+
+/**
+ * Parse an unsigned decimal number.
+ * @return the number of digits.
+ */
+static size_t parse_decimal(const uint8_t *s, size_t len, uint64_t *value) {
+    size_t i = 0;
+    *value = 0;
+    while (i < len && s[i] >= '0' && s[i] <= '9')
+        *value = *value * 10 + (s[i++] - '0');
+    return i;
+}
+
+
+/**
+ * Process a line of a text log.
+ */
+static void parse_line(const arguments_t *args, analysis_t *an,
+                       const uint8_t *line, size_t len) {
+    if (len == 0)
+        return;
+
+    // The header names the columns, look for the AHRS400 timer
+    if (line[0] == '%') {
+        an->sensor_column = -1;
+        int column = 0;
+        for (size_t i=0; i<len; i++) {
+            if (line[i] == '\t') {
+                column++;
+            } else if (len - i >= 11 && !memcmp(line + i, "sensor_time", 11)
+                       && (len - i == 11 || line[i + 11] == '\t'
+                           || line[i + 11] == '\r')) {
+                an->sensor_column = column;
+                break;
+            }
+        }
+        return;
+    }
+
+    uint64_t time_usec;
+    if (!parse_decimal(line, len, &time_usec)) {
+        an->malformed++;
+        return;
+    }
+
+    source_t *src = find_source(an, 0);
+    if (!src)
+        return;
+    add_sample(args, src, time_usec);
+
+    if (an->sensor_column > 0) {
+        int column = 0;
+        size_t i = 0;
+        while (i < len && column < an->sensor_column)
+            if (line[i++] == '\t')
+                column++;
+
+        uint64_t ticks;
+        if (column == an->sensor_column && parse_decimal(line + i, len - i,
+                                                         &ticks))
+            add_sensor_time(args, &src->drift, time_usec, ticks);
+    }
+}
+
+
+/**
+ * Analyze a text log line by line.
+ * @return 0 if success, -1 if error.
+ */
+static int analyze_text(const arguments_t *args, const char *path,
+                        analysis_t *an) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        syslog(LOG_ERR, "Error opening `%s`: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, file)) >= 0) {
+        if (len && line[len - 1] == '\n')
+            len--;
+        parse_line(args, an, (const uint8_t *) line, len);
+    }
+    int status = ferror(file) ? -1 : 0;
+    if (status)
+        syslog(LOG_ERR, "Error reading `%s`: %s", path, strerror(errno));
+    free(line);
+    fclose(file);
+    return status;
+}
+
+
+/**
+ * Whether a log is a text log, from its first byte.
+ */
+static bool is_text(const char *path) {
+    uint8_t first = 0;
+    FILE *file = fopen(path, "r");
+    if (file) {
+        if (fread(&first, 1, 1, file) != 1)
+            first = 0;
+        fclose(file);
+    }
+    return first == '%' || (first >= '0' && first <= '9');
+}
+
+
+/**
+ * Analyze a log in a single pass.
+ * @return 0 if success, -1 if error.
+ */
+static int analyze_file(const arguments_t *args, const char *path,
+                        analysis_t *an) {
+    log_format_t format = args->format;
+    if (format == FORMAT_AUTO && is_text(path))
+        format = FORMAT_TEXT;
+    an->format = format;
+    if (format == FORMAT_TEXT)
+        return analyze_text(args, path, an);
+
+    logscan_t scan;
+    if (logscan_open(&scan, path, format == FORMAT_MAVLOG ? LOGSCAN_MAVLOG
+                     : format == FORMAT_LOGBIN ? LOGSCAN_LOGBIN
+                     : LOGSCAN_AUTO))
+        return -1;
+    an->format = scan.format == LOGSCAN_LOGBIN ? FORMAT_LOGBIN
+                 : FORMAT_MAVLOG;
+
+    logrecord_t record;
+    int status;
+    while ((status = logscan_next(&scan, &record)) > 0)
+        add_frame(args, an, &record.frame, record.time_usec);
+    an->malformed += scan.malformed;
+    logscan_close(&scan);
+    return status;
+}
+
+
+/**
+ * Print the histogram bins holding samples.
+ */
+static void print_histogram(const source_t *src, uint64_t total) {
+    for (unsigned bin=0; bin<HIST_BINS; bin++) {
+        if (!src->hist[bin])
+            continue;
+
+        double value = hist_value(bin);
+        printf("    %12.1f us %12llu %7.3f%%\n", value,
+               (unsigned long long) src->hist[bin],
+               100.0 * src->hist[bin] / total);
+    }
+}
+
+
+/**
+ * Print the timing report of a source.
+ */
+static void report_source(const arguments_t *args, const source_t *src) {
+    static const double jitter_p[NJITTER] = {0.5, 0.9, 0.99, 0.999};
+
+    uint64_t intervals = 0;
+    for (unsigned bin=0; bin<HIST_BINS; bin++)
+        intervals += src->hist[bin];
+
+    printf("  %llu samples over %.3f s\n", (unsigned long long) src->count,
+           ((double) src->last_usec - (double) src->first_usec) * 1e-6);
+
+    if (intervals) {
+        double median = hist_percentile(src->hist, intervals, 0.5);
+        printf("  interval [us]: median %.1f p0.1 %.1f p1 %.1f p99 %.1f "
+               "p99.9 %.1f max %llu at %llu\n", median,
+               hist_percentile(src->hist, intervals, 0.001),
+               hist_percentile(src->hist, intervals, 0.01),
+               hist_percentile(src->hist, intervals, 0.99),
+               hist_percentile(src->hist, intervals, 0.999),
+               (unsigned long long) src->max_interval,
+               (unsigned long long) src->max_interval_at);
+
+        // Jitter and gaps relative to the median interval
+        static deviation_t dev[HIST_BINS];
+        unsigned ndev = 0;
+        uint64_t gaps = 0, missing = 0;
+        for (unsigned bin=0; bin<HIST_BINS; bin++) {
+            if (!src->hist[bin])
+                continue;
+            double value = hist_value(bin);
+            dev[ndev++] = (deviation_t) {fabs(value - median), src->hist[bin]};
+            if (value > args->gap_factor * median) {
+                gaps += src->hist[bin];
+                missing += src->hist[bin] * (llround(value / median) - 1);
+            }
+        }
+        qsort(dev, ndev, sizeof *dev, compare_deviations);
+
+        printf("  jitter [us]:");
+        uint64_t seen = 0;
+        unsigned j = 0;
+        for (unsigned i=0; i<ndev && j<NJITTER; i++) {
+            seen += dev[i].count;
+            while (j < NJITTER && seen >= ceil(jitter_p[j] * intervals))
+                printf(" p%g %.1f", 100 * jitter_p[j++], dev[i].value);
+        }
+        printf("\n");
+
+        printf("  gaps over %g x median: %llu, about %llu samples missing\n",
+               args->gap_factor, (unsigned long long) gaps,
+               (unsigned long long) missing);
+    }
+
+    printf("  duplicates: %llu\n", (unsigned long long) src->duplicates);
+    printf("  clock steps: %llu backward",
+           (unsigned long long) src->backward_steps);
+    if (src->backward_steps)
+        printf(" (largest %llu us at %llu)",
+               (unsigned long long) src->max_backward,
+               (unsigned long long) src->max_backward_at);
+    printf(", %llu forward over %g s\n",
+           (unsigned long long) src->forward_steps, args->step_usec * 1e-6);
+
+    const drift_t *drift = &src->drift;
+    if (drift->n > 2 && drift->m2_x > 0) {
+        double slope = drift->c_xy / drift->m2_x;
+        double residual = drift->m2_y - slope * drift->c_xy;
+        printf("  sensor_time drift: %.2f ppm, residual %.1f us rms, "
+               "%lu unwrap breaks\n", slope,
+               sqrt(fmax(residual, 0) / (drift->n - 2)), drift->breaks);
+    }
+
+    if (args->histogram && intervals)
+        print_histogram(src, intervals);
+}
+
+
+/**
+ * Print the timing report of all sources of a log.
+ */
+static void report(const arguments_t *args, const char *path,
+                   const analysis_t *an) {
+    printf("%s: %u sources, %llu malformed %s\n", path, an->nsources,
+           (unsigned long long) an->malformed,
+           an->format == FORMAT_TEXT ? "lines" : "bytes");
+
+    for (unsigned i=0; i<MAX_SOURCES; i++) {
+        const source_t *src = &an->sources[i];
+        if (!src->used)
+            continue;
+
+        if (src->key)
+            printf("sysid %u compid %u msgid %u:\n",
+                   (unsigned) (src->key >> 32),
+                   (unsigned) (src->key >> 24 & 0xFF),
+                   (unsigned) (src->key & 0xFFFFFF));
+        else
+            printf("%s:\n", path);
+        report_source(args, src);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    // Parse command line arguments
+    arguments_t arguments = {
+        .gap_factor=1.5, .step_usec=1000000, .tick_usec=0.79
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    // Setup syslog
+    openlog(0, LOG_PERROR, 0);
+
+    static analysis_t an;
+    int status = EXIT_SUCCESS;
+    for (int i=0; i<arguments.nfiles; i++) {
+        memset(&an, 0, sizeof an);
+        an.sensor_column = -1;
+        if (analyze_file(&arguments, arguments.files[i], &an))
+            status = EXIT_FAILURE;
+        else
+            report(&arguments, arguments.files[i], &an);
+
+        for (unsigned j=0; j<MAX_SOURCES; j++)
+            free(an.sources[j].hist);
+    }
+
+    return status;
+}
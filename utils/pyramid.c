@@ -0,0 +1,810 @@
+/**
+ * Multi-resolution summaries of the channels of binary logs.
+ *
+ * Every numeric field element of the logged messages is a channel. The
+ * finest level of a channel summarizes each run of PYRAMID_BASE samples by
+ * its time span, minimum, maximum, mean and count, and every level above
+ * merges pairs of entries of the one below, up to the level with a single
+ * entry. A plot of any time range then reads about one entry per pixel
+ * from the coarsest level that still has that resolution, whatever the
+ * length of the log.
+ *
+ * The pyramid of a log is written beside it, as LOG.pyr, while recording
+ * or offline. Entries are written in pages as each level fills them, so
+ * the builder memory does not grow with the log; the table of channels and
+ * pages is appended when the pyramid is closed. A pyramid left without its
+ * table by a crash is rebuilt from the log with mavpyramid.
+ *
+ * File layout, all little-endian: the header, the entry pages, the table
+ * of channels and pages, and a trailer with the offset of the table. The
+ * entries store their start and end times, sample count and minimum,
+ * maximum and mean as floats, which is plenty for plotting.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logwriter.h"
+#include "pyramid.h"
+
+
+/** Magic string of the pyramid files. */
+#define PYRAMID_MAGIC "FDAS3PYR"
+
+/** Version of the pyramid file layout. */
+#define PYRAMID_VERSION 1
+
+/** Length of an entry in the file. */
+#define ENTRY_LEN 32
+
+/** Length of a channel in the file table. */
+#define CHANNEL_RECORD_LEN (4 + PYRAMID_NAME_LEN)
+
+/** Length of a page in the file table. */
+#define PAGE_RECORD_LEN 48
+
+
+/** Header of the pyramid files. */
+typedef struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t base;
+    uint32_t page_len;
+    uint32_t reserved;
+} file_header_t;
+
+/** Trailer of the pyramid files. */
+typedef struct file_trailer {
+    uint64_t table_offset;
+    char magic[8];
+} file_trailer_t;
+
+/** Level being built. */
+typedef struct build_level {
+    pyramid_entry_t acc; ///< Entry being accumulated.
+    double sum; ///< Sum of the samples of the accumulated entry.
+    unsigned merged; ///< Samples or entries in the accumulated entry.
+    uint64_t emitted; ///< Entries completed.
+    pyramid_entry_t *page; ///< Completed entries not yet written.
+    unsigned used;
+} build_level_t;
+
+/** Channel being built. */
+typedef struct build_channel {
+    uint32_t msgid;
+    char name[PYRAMID_NAME_LEN];
+    const mavschema_field_t *field;
+    unsigned index; ///< Array element.
+    unsigned nlevels;
+    build_level_t levels[PYRAMID_MAX_LEVELS];
+} build_channel_t;
+
+/** Channels of a message, consecutive in the channel list. */
+typedef struct build_message {
+    uint32_t msgid;
+    const mavschema_message_t *msg; ///< NULL if not in the schema.
+    unsigned first_channel;
+    unsigned nchannels;
+} build_message_t;
+
+/** Pyramid builder. */
+struct pyramid_writer {
+    logwriter_t *file;
+    const mavschema_t *schema;
+    build_channel_t *channels;
+    unsigned nchannels;
+    unsigned channel_capacity;
+    build_message_t *messages;
+    unsigned nmessages;
+    unsigned message_capacity;
+    build_message_t *last; ///< Message of the previous frame.
+    pyramid_page_t *pages;
+    uint32_t npages;
+    uint32_t page_capacity;
+    int status; ///< -1 after a write or allocation error.
+};
+
+
+/**
+ * Path of the pyramid of a log.
+ * @return 0 if success, -1 if too long.
+ */
+int pyramid_path(const char *log, char *path, size_t size) {
+    if (snprintf(path, size, "%s.pyr", log) >= size) {
+        syslog(LOG_ERR, "Pyramid path of `%s` too long", log);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Grow an array to hold one more element.
+ * @return 0 if success, -1 if error.
+ */
+static int reserve(void **array, unsigned *capacity, unsigned count,
+                   size_t size) {
+    if (count < *capacity)
+        return 0;
+
+    unsigned new_capacity = *capacity ? 2 * *capacity : 64;
+    void *grown = realloc(*array, new_capacity * size);
+    if (!grown) {
+        syslog(LOG_ERR, "Error allocating pyramid: %s", strerror(errno));
+        return -1;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+
+/**
+ * Open a pyramid file for building.
+ * @param schema of the logged messages, used until the writer is closed.
+ * @return the writer or NULL if error.
+ */
+pyramid_writer_t* pyramid_writer_open(const char *path,
+                                      const mavschema_t *schema) {
+    pyramid_writer_t *writer = calloc(1, sizeof *writer);
+    if (!writer) {
+        syslog(LOG_ERR, "Error allocating pyramid: %s", strerror(errno));
+        return NULL;
+    }
+    writer->schema = schema;
+
+    writer->file = logwriter_open(path, 0);
+    if (!writer->file) {
+        free(writer);
+        return NULL;
+    }
+
+    file_header_t header = {
+        .magic=PYRAMID_MAGIC, .version=htole32(PYRAMID_VERSION),
+        .base=htole32(PYRAMID_BASE), .page_len=htole32(PYRAMID_PAGE)
+    };
+    if (logwriter_append(writer->file, &header, sizeof header))
+        writer->status = -1;
+    return writer;
+}
+
+
+/**
+ * Store a 32-bit word in little-endian order.
+ */
+static void put_le32(uint8_t *p, uint32_t value) {
+    value = htole32(value);
+    memcpy(p, &value, sizeof value);
+}
+
+
+/**
+ * Store a 64-bit word in little-endian order.
+ */
+static void put_le64(uint8_t *p, uint64_t value) {
+    value = htole64(value);
+    memcpy(p, &value, sizeof value);
+}
+
+
+/**
+ * Store a float in little-endian order.
+ */
+static void put_float(uint8_t *p, double value) {
+    float f = value;
+    uint32_t word;
+    memcpy(&word, &f, sizeof word);
+    put_le32(p, word);
+}
+
+
+/**
+ * Load a 32-bit little-endian word.
+ */
+static uint32_t get_le32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return le32toh(value);
+}
+
+
+/**
+ * Load a 64-bit little-endian word.
+ */
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof value);
+    return le64toh(value);
+}
+
+
+/**
+ * Load a little-endian float.
+ */
+static double get_float(const uint8_t *p) {
+    uint32_t word = get_le32(p);
+    float f;
+    memcpy(&f, &word, sizeof f);
+    return f;
+}
+
+
+/**
+ * Encode an entry for the pyramid file.
+ */
+static void encode_entry(const pyramid_entry_t *entry, uint8_t *record) {
+    put_le64(record, entry->start_usec);
+    put_le64(record + 8, entry->end_usec);
+    put_le32(record + 16, entry->count);
+    put_float(record + 20, entry->min);
+    put_float(record + 24, entry->max);
+    put_float(record + 28, entry->mean);
+}
+
+
+/**
+ * Decode an entry of the pyramid file.
+ */
+static void decode_entry(const uint8_t *record, pyramid_entry_t *entry) {
+    entry->start_usec = get_le64(record);
+    entry->end_usec = get_le64(record + 8);
+    entry->count = get_le32(record + 16);
+    entry->min = get_float(record + 20);
+    entry->max = get_float(record + 24);
+    entry->mean = get_float(record + 28);
+}
+
+
+/**
+ * Write the pending entries of a level as a page.
+ */
+static void write_page(pyramid_writer_t *writer, unsigned channel,
+                       unsigned level) {
+    build_level_t *lvl = &writer->channels[channel].levels[level];
+    if (!lvl->used)
+        return;
+
+    if (reserve((void **) &writer->pages, &writer->page_capacity,
+                writer->npages, sizeof *writer->pages)) {
+        writer->status = -1;
+        lvl->used = 0;
+        return;
+    }
+
+    pyramid_page_t *page = &writer->pages[writer->npages++];
+    *page = (pyramid_page_t) {
+        .channel=channel, .level=level, .first=lvl->emitted - lvl->used,
+        .count=lvl->used,
+        .file_offset=writer->file->written + writer->file->used,
+        .start_usec=UINT64_MAX, .end_usec=0
+    };
+
+    for (unsigned i=0; i<lvl->used; i++) {
+        pyramid_entry_t *e = &lvl->page[i];
+        uint8_t record[ENTRY_LEN];
+        encode_entry(e, record);
+        if (logwriter_append(writer->file, record, sizeof record))
+            writer->status = -1;
+
+        if (e->start_usec < page->start_usec)
+            page->start_usec = e->start_usec;
+        if (e->end_usec > page->end_usec)
+            page->end_usec = e->end_usec;
+    }
+    lvl->used = 0;
+}
+
+
+static void merge(pyramid_writer_t *writer, unsigned channel, unsigned level,
+                  const pyramid_entry_t *entry);
+
+
+/**
+ * Complete the accumulated entry of a level and merge it into the next.
+ */
+static void emit(pyramid_writer_t *writer, unsigned channel, unsigned level) {
+    build_level_t *lvl = &writer->channels[channel].levels[level];
+    pyramid_entry_t entry = lvl->acc;
+    entry.mean = lvl->sum / entry.count;
+    lvl->merged = 0;
+
+    if (!lvl->page && !(lvl->page = malloc(PYRAMID_PAGE * sizeof entry))) {
+        syslog(LOG_ERR, "Error allocating pyramid: %s", strerror(errno));
+        writer->status = -1;
+        return;
+    }
+    lvl->page[lvl->used++] = entry;
+    lvl->emitted++;
+    if (lvl->used == PYRAMID_PAGE)
+        write_page(writer, channel, level);
+
+    if (level + 1 < PYRAMID_MAX_LEVELS)
+        merge(writer, channel, level + 1, &entry);
+}
+
+
+/**
+ * Merge an entry into the accumulated entry of a level.
+ */
+static void merge(pyramid_writer_t *writer, unsigned channel, unsigned level,
+                  const pyramid_entry_t *entry) {
+    build_channel_t *ch = &writer->channels[channel];
+    build_level_t *lvl = &ch->levels[level];
+    if (level == ch->nlevels)
+        ch->nlevels++;
+
+    if (!lvl->merged) {
+        lvl->acc = *entry;
+        lvl->sum = entry->mean * entry->count;
+    } else {
+        lvl->acc.end_usec = entry->end_usec;
+        lvl->acc.count += entry->count;
+        lvl->acc.min = fmin(lvl->acc.min, entry->min);
+        lvl->acc.max = fmax(lvl->acc.max, entry->max);
+        lvl->sum += entry->mean * entry->count;
+    }
+
+    if (++lvl->merged == 2)
+        emit(writer, channel, level);
+}
+
+
+/**
+ * Add a sample to the finest level of a channel.
+ */
+static void add_sample(pyramid_writer_t *writer, unsigned channel,
+                       uint64_t time_usec, double value) {
+    build_level_t *lvl = &writer->channels[channel].levels[0];
+    if (isnan(value))
+        return;
+
+    if (!lvl->merged) {
+        lvl->acc = (pyramid_entry_t) {
+            time_usec, time_usec, 0, value, value
+        };
+        lvl->sum = 0;
+    }
+    lvl->acc.end_usec = time_usec;
+    lvl->acc.count++;
+    lvl->acc.min = fmin(lvl->acc.min, value);
+    lvl->acc.max = fmax(lvl->acc.max, value);
+    lvl->sum += value;
+
+    if (++lvl->merged == PYRAMID_BASE)
+        emit(writer, channel, 0);
+}
+
+
+/**
+ * Create the channels of a message on its first frame.
+ * @return the message or NULL if error.
+ */
+static build_message_t* add_message(pyramid_writer_t *writer,
+                                    uint32_t msgid) {
+    if (reserve((void **) &writer->messages, &writer->message_capacity,
+                writer->nmessages, sizeof *writer->messages))
+        return NULL;
+
+    build_message_t *message = &writer->messages[writer->nmessages++];
+    message->msgid = msgid;
+    message->msg = mavschema_find_id(writer->schema, msgid);
+    message->first_channel = writer->nchannels;
+    message->nchannels = 0;
+    if (!message->msg)
+        return message;
+
+    // The leading timestamp and the strings are not channels
+    const mavschema_message_t *msg = message->msg;
+    for (unsigned i=0; i<msg->nfields; i++) {
+        const mavschema_field_t *field = &msg->fields[i];
+        if (field->type == MAVSCHEMA_CHAR || !strcmp(field->name, "time_usec"))
+            continue;
+
+        unsigned n = field->array_len ? field->array_len : 1;
+        for (unsigned j=0; j<n; j++) {
+            if (reserve((void **) &writer->channels,
+                        &writer->channel_capacity, writer->nchannels,
+                        sizeof *writer->channels))
+                return NULL;
+
+            build_channel_t *ch = &writer->channels[writer->nchannels++];
+            memset(ch, 0, sizeof *ch);
+            ch->msgid = msgid;
+            ch->field = field;
+            ch->index = j;
+            ch->nlevels = 1;
+            if (field->array_len)
+                snprintf(ch->name, sizeof ch->name, "%s.%s[%u]", msg->name,
+                         field->name, j);
+            else
+                snprintf(ch->name, sizeof ch->name, "%s.%s", msg->name,
+                         field->name);
+            message->nchannels++;
+        }
+    }
+    return message;
+}
+
+
+/**
+ * Add the fields of a frame to the pyramid.
+ * @param time_usec of the record.
+ * @return 0 if success, -1 if error.
+ */
+int pyramid_writer_frame(pyramid_writer_t *writer, uint64_t time_usec,
+                         const mavframe_t *frame) {
+    build_message_t *message = writer->last;
+    if (!message || message->msgid != frame->msgid) {
+        message = NULL;
+        for (unsigned i=0; i<writer->nmessages; i++)
+            if (writer->messages[i].msgid == frame->msgid)
+                message = &writer->messages[i];
+        if (!message && !(message = add_message(writer, frame->msgid))) {
+            writer->status = -1;
+            return -1;
+        }
+        writer->last = message;
+    }
+
+    for (unsigned i=0; i<message->nchannels; i++) {
+        unsigned channel = message->first_channel + i;
+        build_channel_t *ch = &writer->channels[channel];
+        double value = mavschema_get(ch->field, frame->payload,
+                                     frame->payload_len, ch->index);
+        add_sample(writer, channel, time_usec, value);
+    }
+    return writer->status;
+}
+
+
+/**
+ * Complete the partial entries of a channel, up to its single-entry level.
+ */
+static void finish_channel(pyramid_writer_t *writer, unsigned channel) {
+    build_channel_t *ch = &writer->channels[channel];
+
+    for (unsigned k=0; k<ch->nlevels; k++) {
+        build_level_t *lvl = &ch->levels[k];
+        if (!lvl->merged)
+            continue;
+
+        // A partial entry above a single-entry level would repeat it
+        if (k > 0 && !lvl->emitted) {
+            ch->nlevels = k;
+            break;
+        }
+        emit(writer, channel, k);
+    }
+
+    for (unsigned k=0; k<ch->nlevels; k++)
+        write_page(writer, channel, k);
+}
+
+
+/**
+ * Write the table of channels and pages and the trailer.
+ */
+static void write_table(pyramid_writer_t *writer) {
+    logwriter_t *file = writer->file;
+    file_trailer_t trailer = {
+        .table_offset=htole64(file->written + file->used),
+        .magic=PYRAMID_MAGIC
+    };
+
+    uint32_t counts[2] = {htole32(writer->nchannels), htole32(writer->npages)};
+    int status = logwriter_append(file, counts, sizeof counts);
+
+    for (unsigned i=0; i<writer->nchannels; i++) {
+        uint8_t record[CHANNEL_RECORD_LEN] = {0};
+        put_le32(record, writer->channels[i].msgid);
+        // The zeroed record terminates the name
+        const char *name = writer->channels[i].name;
+        memcpy(record + 4, name, strnlen(name, PYRAMID_NAME_LEN - 1));
+        status |= logwriter_append(file, record, sizeof record);
+    }
+
+    for (uint32_t i=0; i<writer->npages; i++) {
+        const pyramid_page_t *page = &writer->pages[i];
+        uint8_t record[PAGE_RECORD_LEN] = {0};
+        put_le32(record, page->channel);
+        put_le32(record + 4, page->level);
+        put_le64(record + 8, page->first);
+        put_le32(record + 16, page->count);
+        put_le64(record + 24, page->file_offset);
+        put_le64(record + 32, page->start_usec);
+        put_le64(record + 40, page->end_usec);
+        status |= logwriter_append(file, record, sizeof record);
+    }
+
+    status |= logwriter_append(file, &trailer, sizeof trailer);
+    if (status)
+        writer->status = -1;
+}
+
+
+/**
+ * Complete the pyramid and close its file.
+ * @return 0 if success, -1 if any error occurred while building.
+ */
+int pyramid_writer_close(pyramid_writer_t *writer) {
+    if (!writer)
+        return 0;
+
+    for (unsigned i=0; i<writer->nchannels; i++)
+        finish_channel(writer, i);
+    write_table(writer);
+    if (logwriter_flush(writer->file))
+        writer->status = -1;
+    logwriter_close(writer->file);
+
+    int status = writer->status;
+    for (unsigned i=0; i<writer->nchannels; i++)
+        for (unsigned k=0; k<PYRAMID_MAX_LEVELS; k++)
+            free(writer->channels[i].levels[k].page);
+    free(writer->channels);
+    free(writer->messages);
+    free(writer->pages);
+    free(writer);
+    return status;
+}
+
+
+/** Order of the pages by channel, level and position. */
+static int compare_pages(const void *a, const void *b) {
+    const pyramid_page_t *pa = a, *pb = b;
+    if (pa->channel != pb->channel)
+        return pa->channel < pb->channel ? -1 : 1;
+    if (pa->level != pb->level)
+        return pa->level < pb->level ? -1 : 1;
+    return pa->first < pb->first ? -1 : pa->first > pb->first;
+}
+
+
+/**
+ * Read exactly a range of the pyramid file.
+ * @return 0 if success, -1 if error.
+ */
+static int read_at(int fd, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (uint8_t *) buf + done, len - done,
+                          offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Parse the table of channels and pages.
+ * @return 0 if success, -1 if invalid.
+ */
+static int parse_table(pyramid_t *pyr, const uint8_t *table, size_t len) {
+    if (len < 8)
+        return -1;
+    pyr->nchannels = get_le32(table);
+    pyr->npages = get_le32(table + 4);
+
+    size_t expected = 8 + (size_t) pyr->nchannels
+                      * CHANNEL_RECORD_LEN
+                      + (size_t) pyr->npages * PAGE_RECORD_LEN;
+    if (len != expected)
+        return -1;
+
+    pyr->channels = calloc(pyr->nchannels + 1, sizeof *pyr->channels);
+    pyr->pages = calloc(pyr->npages + 1, sizeof *pyr->pages);
+    if (!pyr->channels || !pyr->pages)
+        return -1;
+
+    const uint8_t *p = table + 8;
+    for (unsigned i=0; i<pyr->nchannels; i++, p += CHANNEL_RECORD_LEN) {
+        pyramid_channel_t *ch = &pyr->channels[i];
+        ch->msgid = get_le32(p);
+        memcpy(ch->name, p + 4, PYRAMID_NAME_LEN - 1);
+    }
+
+    for (uint32_t i=0; i<pyr->npages; i++, p += PAGE_RECORD_LEN) {
+        pyr->pages[i] = (pyramid_page_t) {
+            .channel=get_le32(p), .level=get_le32(p + 4),
+            .first=get_le64(p + 8), .count=get_le32(p + 16),
+            .file_offset=get_le64(p + 24), .start_usec=get_le64(p + 32),
+            .end_usec=get_le64(p + 40)
+        };
+        if (pyr->pages[i].channel >= pyr->nchannels
+            || pyr->pages[i].level >= PYRAMID_MAX_LEVELS
+            || pyr->pages[i].count > PYRAMID_PAGE)
+            return -1;
+    }
+
+    // Index the pages of each level
+    qsort(pyr->pages, pyr->npages, sizeof *pyr->pages, compare_pages);
+    for (uint32_t i=0; i<pyr->npages; i++) {
+        const pyramid_page_t *page = &pyr->pages[i];
+        pyramid_channel_t *ch = &pyr->channels[page->channel];
+        pyramid_level_t *lvl = &ch->levels[page->level];
+        if (!lvl->npages) {
+            lvl->first_page = i;
+            lvl->start_usec = page->start_usec;
+        }
+        lvl->npages++;
+        lvl->nentries += page->count;
+        if (page->start_usec < lvl->start_usec)
+            lvl->start_usec = page->start_usec;
+        if (page->end_usec > lvl->end_usec)
+            lvl->end_usec = page->end_usec;
+        if (page->level >= ch->nlevels)
+            ch->nlevels = page->level + 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Open a pyramid file for reading.
+ * @return 0 if success, -1 if error.
+ */
+int pyramid_open(pyramid_t *pyr, const char *path) {
+    memset(pyr, 0, sizeof *pyr);
+    pyr->fd = open(path, O_RDONLY);
+    if (pyr->fd < 0) {
+        syslog(LOG_ERR, "Error opening pyramid `%s`: %s", path,
+               strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    file_header_t header;
+    file_trailer_t trailer;
+    if (fstat(pyr->fd, &st)
+        || st.st_size < (off_t) (sizeof header + sizeof trailer)
+        || read_at(pyr->fd, &header, sizeof header, 0)
+        || read_at(pyr->fd, &trailer, sizeof trailer,
+                   st.st_size - sizeof trailer)
+        || memcmp(header.magic, PYRAMID_MAGIC, sizeof header.magic)
+        || le32toh(header.version) != PYRAMID_VERSION
+        || le32toh(header.page_len) != PYRAMID_PAGE
+        || memcmp(trailer.magic, PYRAMID_MAGIC, sizeof trailer.magic)) {
+        syslog(LOG_ERR, "Invalid or incomplete pyramid `%s`", path);
+        pyramid_close(pyr);
+        return -1;
+    }
+    pyr->base = le32toh(header.base);
+
+    uint64_t table_offset = le64toh(trailer.table_offset);
+    uint64_t table_end = st.st_size - sizeof trailer;
+    uint8_t *table = NULL;
+    int status = -1;
+    if (table_offset >= sizeof header && table_offset <= table_end
+        && (table = malloc(table_end - table_offset + 1))
+        && !read_at(pyr->fd, table, table_end - table_offset, table_offset))
+        status = parse_table(pyr, table, table_end - table_offset);
+    free(table);
+
+    if (status) {
+        syslog(LOG_ERR, "Invalid pyramid table in `%s`", path);
+        pyramid_close(pyr);
+    }
+    return status;
+}
+
+
+/**
+ * Find a channel by name.
+ * @return the channel index or -1 if not found.
+ */
+int pyramid_find(const pyramid_t *pyr, const char *name) {
+    for (unsigned i=0; i<pyr->nchannels; i++)
+        if (!strcmp(pyr->channels[i].name, name))
+            return i;
+    return -1;
+}
+
+
+/**
+ * Choose the level of detail for plotting a time range.
+ *
+ * The number of entries in the range is estimated from the mean entry
+ * duration of each level, assuming a steady sample rate.
+ * @param width of the plot in pixels.
+ * @return the coarsest level with at least one entry per pixel, or the
+ *         finest level if none has.
+ */
+unsigned pyramid_select_level(const pyramid_t *pyr, unsigned channel,
+                              uint64_t start_usec, uint64_t end_usec,
+                              unsigned width) {
+    const pyramid_channel_t *ch = &pyr->channels[channel];
+
+    for (unsigned k=ch->nlevels; k-- > 1; ) {
+        const pyramid_level_t *lvl = &ch->levels[k];
+        uint64_t lo = start_usec > lvl->start_usec ? start_usec
+                                                   : lvl->start_usec;
+        uint64_t hi = end_usec < lvl->end_usec ? end_usec : lvl->end_usec;
+        if (hi < lo || !lvl->nentries)
+            continue;
+
+        double span = lvl->end_usec - lvl->start_usec + 1.0;
+        if (lvl->nentries * ((hi - lo + 1.0) / span) >= width)
+            return k;
+    }
+    return 0;
+}
+
+
+/**
+ * Read the entries of a level overlapping a time range.
+ * @param[out] entries read, in time order.
+ * @param max number of entries to read.
+ * @return the number of entries read or -1 if error.
+ */
+int64_t pyramid_read(const pyramid_t *pyr, unsigned channel, unsigned level,
+                     uint64_t start_usec, uint64_t end_usec,
+                     pyramid_entry_t *entries, size_t max) {
+    const pyramid_channel_t *ch = &pyr->channels[channel];
+    if (level >= ch->nlevels)
+        return 0;
+    const pyramid_level_t *lvl = &ch->levels[level];
+    const pyramid_page_t *pages = pyr->pages + lvl->first_page;
+
+    // First page ending at or after the start of the range
+    uint32_t lo = 0, hi = lvl->npages;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pages[mid].end_usec < start_usec)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    size_t n = 0;
+    for (uint32_t i=lo; i<lvl->npages && n<max; i++) {
+        const pyramid_page_t *page = &pages[i];
+        if (page->start_usec > end_usec)
+            break;
+
+        uint8_t records[PYRAMID_PAGE][ENTRY_LEN];
+        if (read_at(pyr->fd, records, page->count * sizeof *records,
+                    page->file_offset)) {
+            syslog(LOG_ERR, "Error reading pyramid: %s",
+                   errno ? strerror(errno) : "truncated file");
+            return -1;
+        }
+
+        for (uint32_t j=0; j<page->count && n<max; j++) {
+            pyramid_entry_t entry;
+            decode_entry(records[j], &entry);
+            if (entry.end_usec >= start_usec && entry.start_usec <= end_usec)
+                entries[n++] = entry;
+        }
+    }
+    return n;
+}
+
+
+/**
+ * Close a pyramid opened for reading.
+ */
+void pyramid_close(pyramid_t *pyr) {
+    if (pyr->fd >= 0 && close(pyr->fd))
+        syslog(LOG_ERR, "Error closing pyramid: %s", strerror(errno));
+    pyr->fd = -1;
+    free(pyr->channels);
+    free(pyr->pages);
+    pyr->channels = NULL;
+    pyr->pages = NULL;
+    pyr->nchannels = 0;
+    pyr->npages = 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * Multi-resolution summaries of the channels of binary logs.
+ */
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavframe.h"
+#include "mavschema.h"
+
+
+/** Samples summarized by an entry of the finest level. */
+#define PYRAMID_BASE 64
+
+/** Entries per page of the pyramid files. */
+#define PYRAMID_PAGE 128
+
+/** Maximum number of levels of a channel. */
+#define PYRAMID_MAX_LEVELS 48
+
+/** Maximum length of channel names, including the terminator. */
+#define PYRAMID_NAME_LEN (2 * MAVSCHEMA_NAME_LEN + 16)
+
+
+/** Summary of a block of consecutive samples of a channel. */
+typedef struct pyramid_entry {
+    uint64_t start_usec; ///< Time of the first sample.
+    uint64_t end_usec; ///< Time of the last sample.
+    uint64_t count; ///< Number of samples.
+    double min;
+    double max;
+    double mean;
+} pyramid_entry_t;
+
+/** Page of entries in a pyramid file. */
+typedef struct pyramid_page {
+    uint32_t channel;
+    uint32_t level;
+    uint64_t first; ///< Index of the first entry in the level.
+    uint32_t count;
+    uint64_t file_offset;
+    uint64_t start_usec;
+    uint64_t end_usec;
+} pyramid_page_t;
+
+/** Level of a channel, with its pages consecutive in the page table. */
+typedef struct pyramid_level {
+    uint64_t nentries;
+    uint64_t start_usec;
+    uint64_t end_usec;
+    uint32_t first_page;
+    uint32_t npages;
+} pyramid_level_t;
+
+/** Channel, a scalar field or array element of a message. */
+typedef struct pyramid_channel {
+    uint32_t msgid;
+    char name[PYRAMID_NAME_LEN]; ///< MESSAGE.field or MESSAGE.field[i].
+    unsigned nlevels;
+    pyramid_level_t levels[PYRAMID_MAX_LEVELS];
+} pyramid_channel_t;
+
+/** Pyramid file opened for reading. */
+typedef struct pyramid {
+    int fd;
+    uint32_t base; ///< Samples per entry of level 0.
+    unsigned nchannels;
+    pyramid_channel_t *channels;
+    uint32_t npages;
+    pyramid_page_t *pages;
+} pyramid_t;
+
+/** Pyramid builder, see pyramid.c. */
+typedef struct pyramid_writer pyramid_writer_t;
+
+
+int pyramid_path(const char *log, char *path, size_t size);
+
+pyramid_writer_t* pyramid_writer_open(const char *path,
+                                      const mavschema_t *schema);
+int pyramid_writer_frame(pyramid_writer_t *writer, uint64_t time_usec,
+                         const mavframe_t *frame);
+int pyramid_writer_close(pyramid_writer_t *writer);
+
+int pyramid_open(pyramid_t *pyr, const char *path);
+int pyramid_find(const pyramid_t *pyr, const char *name);
+unsigned pyramid_select_level(const pyramid_t *pyr, unsigned channel,
+                              uint64_t start_usec, uint64_t end_usec,
+                              unsigned width);
+int64_t pyramid_read(const pyramid_t *pyr, unsigned channel, unsigned level,
+                     uint64_t start_usec, uint64_t end_usec,
+                     pyramid_entry_t *entries, size_t max);
+void pyramid_close(pyramid_t *pyr);
+
+
+#endif//PYRAMID_H
@@ -0,0 +1,91 @@
+/**
+ * Running per-channel statistics of sampled signals.
+ *
+ * The mean and variance are updated with Welford's algorithm, which is
+ * numerically stable for long intervals and signals with large offsets.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "runstats.h"
+
+
+/**
+ * Initialize the statistics of `nchannels` channels.
+ */
+void runstats_init(runstats_t *stats, unsigned nchannels) {
+    if (nchannels > RUNSTATS_MAX_CHANNELS)
+        nchannels = RUNSTATS_MAX_CHANNELS;
+    stats->nchannels = nchannels;
+    runstats_reset(stats);
+}
+
+
+/**
+ * Discard the accumulated samples, starting a new interval.
+ */
+void runstats_reset(runstats_t *stats) {
+    stats->count = 0;
+    stats->start_usec = 0;
+    for (unsigned i=0; i<RUNSTATS_MAX_CHANNELS; i++) {
+        stats->min[i] = INFINITY;
+        stats->max[i] = -INFINITY;
+        stats->mean[i] = 0;
+        stats->m2[i] = 0;
+        stats->sumsq[i] = 0;
+    }
+}
+
+
+/**
+ * Accumulate a sample of all channels.
+ * @param time_usec of the sample.
+ * @param x the sample, one value per channel.
+ */
+void runstats_update(runstats_t *stats, uint64_t time_usec, const double *x) {
+    if (stats->count++ == 0)
+        stats->start_usec = time_usec;
+
+    // Pad the sample to a multiple of 8 channels, so that the update below
+    // is a branch-free loop over whole vectors
+    double sample[RUNSTATS_MAX_CHANNELS] = {0};
+    memcpy(sample, x, stats->nchannels * sizeof *x);
+    unsigned width = (stats->nchannels + 7) & ~7u;
+
+    const double inv_count = 1.0 / stats->count;
+    double *restrict min = stats->min;
+    double *restrict max = stats->max;
+    double *restrict mean = stats->mean;
+    double *restrict m2 = stats->m2;
+    double *restrict sumsq = stats->sumsq;
+
+    for (unsigned i=0; i<width; i++) {
+        double delta = sample[i] - mean[i];
+        mean[i] += delta * inv_count;
+        m2[i] += delta * (sample[i] - mean[i]);
+        sumsq[i] += sample[i] * sample[i];
+        min[i] = sample[i] < min[i] ? sample[i] : min[i];
+        max[i] = sample[i] > max[i] ? sample[i] : max[i];
+    }
+}
+
+
+/**
+ * Sample standard deviation of a channel.
+ */
+double runstats_std(const runstats_t *stats, unsigned channel) {
+    if (stats->count < 2)
+        return 0;
+    return sqrt(stats->m2[channel] / (stats->count - 1));
+}
+
+
+/**
+ * Root mean square of a channel.
+ */
+double runstats_rms(const runstats_t *stats, unsigned channel) {
+    if (stats->count == 0)
+        return 0;
+    return sqrt(stats->sumsq[channel] / stats->count);
+}
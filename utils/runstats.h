@@ -0,0 +1,41 @@
+/**
+ * Running per-channel statistics of sampled signals.
+ */
+
+#ifndef RUNSTATS_H
+#define RUNSTATS_H
+
+
+#include <stdint.h>
+
+
+/** Maximum number of channels summarized together. */
+#define RUNSTATS_MAX_CHANNELS 64
+
+
+/**
+ * Running statistics of a set of channels sampled together.
+ *
+ * The accumulators are kept as one array per statistic, so that the update
+ * of all channels is a single loop the compiler can vectorize.
+ */
+typedef struct runstats {
+    unsigned nchannels;
+    uint32_t count; ///< Samples since the last reset.
+    uint64_t start_usec; ///< Time of the first sample since the last reset.
+    double min[RUNSTATS_MAX_CHANNELS];
+    double max[RUNSTATS_MAX_CHANNELS];
+    double mean[RUNSTATS_MAX_CHANNELS];
+    double m2[RUNSTATS_MAX_CHANNELS]; ///< Sum of squared deviations.
+    double sumsq[RUNSTATS_MAX_CHANNELS]; ///< Sum of squares.
+} runstats_t;
+
+
+void runstats_init(runstats_t *stats, unsigned nchannels);
+void runstats_reset(runstats_t *stats);
+void runstats_update(runstats_t *stats, uint64_t time_usec, const double *x);
+double runstats_std(const runstats_t *stats, unsigned channel);
+double runstats_rms(const runstats_t *stats, unsigned channel);
+
+
+#endif//RUNSTATS_H
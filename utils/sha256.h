@@ -0,0 +1,32 @@
+/**
+ * SHA-256 message digest.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Length of a SHA-256 digest. */
+#define SHA256_LEN 32
+
+
+/** Incremental SHA-256 state. */
+typedef struct sha256 {
+    uint32_t state[8];
+    uint64_t len; ///< Bytes hashed so far.
+    uint8_t block[64]; ///< Partial block.
+} sha256_t;
+
+
+void sha256_init(sha256_t *sha);
+void sha256_update(sha256_t *sha, const void *data, size_t len);
+void sha256_final(sha256_t *sha, uint8_t digest[SHA256_LEN]);
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_LEN]);
+void sha256_hex(const uint8_t digest[SHA256_LEN], char hex[2*SHA256_LEN + 1]);
+
+
+#endif//SHA256_H
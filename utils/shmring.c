@@ -0,0 +1,234 @@
+/**
+ * Shared-memory ring of MAVLink frames for local consumers.
+ *
+ * A single producer appends length-prefixed records to a POSIX shared-memory
+ * object and publishes them by advancing the write position. Consumers map
+ * the object read-only and never block the producer: a consumer that falls
+ * more than a ring behind loses the pending records and resumes at the
+ * newest position.
+ *
+ * Before writing a record, the producer advances the reserve position to
+ * its end, as the sequence of a seqlock: a consumer checks after copying a
+ * record that the reserve position is still less than a ring ahead of it,
+ * the copy being torn otherwise.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+
+/** Identifies a ring shared-memory object, "FDRG". */
+#define SHMRING_MAGIC 0x47524446
+
+/** Records are aligned to the length prefix size. */
+#define RECORD_ALIGN sizeof(uint32_t)
+
+
+/**
+ * Map a shared-memory object.
+ * @return the ring or NULL if error.
+ */
+static shmring_t* map_ring(int fd, size_t len, int prot) {
+    shmring_t *ring = calloc(1, sizeof *ring);
+    if (!ring) {
+        syslog(LOG_ERR, "Error allocating ring: %s", strerror(errno));
+        return NULL;
+    }
+
+    void *map = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Error mapping shared memory: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = map;
+    ring->data = (uint8_t *) map + sizeof(shmring_header_t);
+    ring->map_len = len;
+    return ring;
+}
+
+
+/**
+ * Create the shared-memory ring, replacing an existing one.
+ * @param name of the shared-memory object, as in shm_open.
+ * @param capacity of the data area, rounded up to a power of two.
+ * @return the ring or NULL if error.
+ */
+shmring_t* shmring_create(const char *name, size_t capacity) {
+    size_t pow2 = RECORD_ALIGN;
+    while (pow2 < capacity)
+        pow2 <<= 1;
+
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        char *msg = "Error creating shared memory `%s`: %s";
+        syslog(LOG_ERR, msg, name, strerror(errno));
+        return NULL;
+    }
+
+    size_t len = sizeof(shmring_header_t) + pow2;
+    if (ftruncate(fd, len)) {
+        syslog(LOG_ERR, "Error sizing shared memory: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    shmring_t *ring = map_ring(fd, len, PROT_READ | PROT_WRITE);
+    close(fd);
+    if (ring) {
+        ring->header->capacity = pow2;
+        ring->header->write_pos = 0;
+        ring->header->reserve_pos = 0;
+        __atomic_store_n(&ring->header->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+    }
+    return ring;
+}
+
+
+/**
+ * Attach to an existing ring as a consumer, starting at the newest record.
+ * @return the ring or NULL if error.
+ */
+shmring_t* shmring_attach(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        char *msg = "Error opening shared memory `%s`: %s";
+        syslog(LOG_ERR, msg, name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(shmring_header_t)) {
+        syslog(LOG_ERR, "Invalid shared memory `%s`", name);
+        close(fd);
+        return NULL;
+    }
+
+    shmring_t *ring = map_ring(fd, st.st_size, PROT_READ);
+    close(fd);
+    if (!ring)
+        return NULL;
+
+    shmring_header_t *header = ring->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC
+        || sizeof(shmring_header_t) + header->capacity > ring->map_len) {
+        syslog(LOG_ERR, "Invalid shared memory ring `%s`", name);
+        shmring_close(ring);
+        return NULL;
+    }
+
+    ring->read_pos = __atomic_load_n(&header->write_pos, __ATOMIC_ACQUIRE);
+    return ring;
+}
+
+
+static void copy_in(shmring_t *ring, uint64_t pos, const void *src,
+                    size_t len) {
+    uint32_t capacity = ring->header->capacity;
+    size_t offset = pos & (capacity - 1);
+    size_t first = len < capacity - offset ? len : capacity - offset;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const uint8_t *) src + first, len - first);
+}
+
+
+static void copy_out(const shmring_t *ring, uint64_t pos, void *dst,
+                     size_t len) {
+    uint32_t capacity = ring->header->capacity;
+    size_t offset = pos & (capacity - 1);
+    size_t first = len < capacity - offset ? len : capacity - offset;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((uint8_t *) dst + first, ring->data, len - first);
+}
+
+
+/**
+ * Append a record to the ring, overwriting the oldest ones.
+ */
+void shmring_write(shmring_t *ring, const void *data, size_t len) {
+    uint64_t pos = ring->header->write_pos;
+    uint32_t len32 = len;
+    size_t record_len = sizeof len32 + len;
+    record_len = (record_len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+    if (record_len > ring->header->capacity)
+        return;
+
+    // The reserve position is visible before the overwritten data changes
+    __atomic_store_n(&ring->header->reserve_pos, pos + record_len,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    copy_in(ring, pos, &len32, sizeof len32);
+    copy_in(ring, pos + sizeof len32, data, len);
+    __atomic_store_n(&ring->header->write_pos, pos + record_len,
+                     __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Read the next record from the ring without blocking.
+ * @param ring attached as consumer.
+ * @param[out] buffer for the record, truncated if too short.
+ * @param size of the buffer.
+ * @return the record length or 0 if no new record is available.
+ */
+int shmring_read(shmring_t *ring, void *buf, size_t size) {
+    shmring_header_t *header = ring->header;
+    uint32_t capacity = header->capacity;
+
+    for (;;) {
+        uint64_t write_pos = __atomic_load_n(&header->write_pos,
+                                             __ATOMIC_ACQUIRE);
+        if (ring->read_pos == write_pos)
+            return 0;
+        if (write_pos - ring->read_pos > capacity) {
+            ring->overruns++;
+            ring->read_pos = write_pos;
+            return 0;
+        }
+
+        uint32_t len;
+        copy_out(ring, ring->read_pos, &len, sizeof len);
+        size_t record_len = sizeof len + len;
+        record_len = (record_len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+        copy_out(ring, ring->read_pos + sizeof len, buf,
+                 len < size ? len : size);
+
+        // Discard the copy if the producer started overwriting the record
+        // meanwhile, even if not done yet
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t reserve_pos = __atomic_load_n(&header->reserve_pos,
+                                               __ATOMIC_RELAXED);
+        if (len > capacity || reserve_pos - ring->read_pos > capacity) {
+            ring->overruns++;
+            ring->read_pos = __atomic_load_n(&header->write_pos,
+                                             __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        ring->read_pos += record_len;
+        return len;
+    }
+}
+
+
+/**
+ * Unmap the ring. The shared-memory object is left for other consumers.
+ */
+void shmring_close(shmring_t *ring) {
+    if (!ring)
+        return;
+
+    if (munmap(ring->header, ring->map_len))
+        syslog(LOG_ERR, "Error unmapping shared memory: %s", strerror(errno));
+    free(ring);
+}
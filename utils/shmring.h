@@ -0,0 +1,42 @@
+/**
+ * Shared-memory ring of MAVLink frames for local consumers.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Default capacity of the ring data area. */
+#define SHMRING_DEFAULT_CAPACITY (1024 * 1024)
+
+
+/** Header at the start of the shared-memory object. */
+typedef struct shmring_header {
+    uint32_t magic;
+    uint32_t capacity; ///< Size of the data area, a power of two.
+    uint64_t write_pos; ///< Total bytes ever written, updated atomically.
+    uint64_t reserve_pos; ///< End of the record being written, if any.
+} shmring_header_t;
+
+/** Mapped ring, from the producer or a consumer side. */
+typedef struct shmring {
+    shmring_header_t *header;
+    uint8_t *data;
+    size_t map_len;
+    uint64_t read_pos; ///< Consumer position in the stream.
+    uint64_t overruns; ///< Consumer records lost to the producer.
+} shmring_t;
+
+
+shmring_t* shmring_create(const char *name, size_t capacity);
+shmring_t* shmring_attach(const char *name);
+void shmring_write(shmring_t *ring, const void *data, size_t len);
+int shmring_read(shmring_t *ring, void *buf, size_t size);
+void shmring_close(shmring_t *ring);
+
+
+#endif//SHMRING_H
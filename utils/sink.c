@@ -0,0 +1,1127 @@
+/**
+ * MAVLink output sinks shared by the device readers.
+ *
+ * The frames sent to the UDP socket may be shaped to bound the load of a
+ * narrow telemetry link: a token bucket limits the rate of each configured
+ * message type, and another the bandwidth of the socket. A frame over its
+ * limits is held back and sent as soon as the buckets allow, a later frame
+ * of the same type replacing it, so that the latest value always gets
+ * through. Held back summaries, being what the link is mostly for, take
+ * the bandwidth before the other frames.
+ *
+ * The frames sent may also be paced, so that the readers sharing a radio
+ * modem do not overflow its buffer with clumps of datagrams. Each frame
+ * gets a departure time, the frames being spaced evenly at the rate of the
+ * previous pacing period, a few of them back to back after an idle time.
+ * The departure times are either left to an fq or ETF qdisc with SO_TXTIME
+ * or kept by a sender thread.
+ *
+ * The raw frames sent may also be compressed within a tolerance on chosen
+ * signals, by the swinging door algorithm: only the frames the receiver
+ * needs to rebuild the signals by linear interpolation are sent, at least
+ * one per message type and maximum interval. The other sinks still get all
+ * frames.
+ *
+ * The black box keeps the last frames in a fixed-size circular file, frozen
+ * into a normal log on SIGUSR2 or by the `freeze` control command.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/net_tstamp.h>
+
+#include "mavframe.h"
+#include "mavschema.h"
+#include "sink.h"
+#include "utils.h"
+
+
+/** Maximum time the binary log is kept in memory, in microseconds. */
+#define FLUSH_INTERVAL 1000000
+
+/** Default burst of the UDP bandwidth limit, in seconds of its rate. */
+#define BANDWIDTH_BURST_TIME 0.1
+
+/** Capacity of the queue of the pacer thread, in frames. */
+#define PACE_QUEUE_LEN 256
+
+/** Margin of the pacing rate over the rate of the previous period. */
+#define PACE_HEADROOM 1.25
+
+/** Default longest time between compressed UDP frames, in seconds. */
+#define DEFAULT_MAX_INTERVAL 1.0
+
+/** Keys of the long-only options. */
+enum {
+    OPT_UDP_SUMMARIES = 0x200,
+    OPT_MAVLINK2,
+    OPT_UDP_SHAPE,
+    OPT_UDP_BANDWIDTH,
+    OPT_UDP_PACE,
+    OPT_UDP_TXTIME,
+    OPT_BLACKBOX,
+    OPT_BLACKBOX_SIZE,
+    OPT_UDP_TOLERANCE,
+    OPT_UDP_MAX_INTERVAL,
+};
+
+
+/** A frame waiting for its departure in the pacer thread. */
+typedef struct pace_entry {
+    uint64_t departure_ns;
+    size_t len;
+    uint8_t buf[SINK_MAX_FRAME_LEN];
+} pace_entry_t;
+
+/** UDP pacing state. */
+typedef struct sink_pacer {
+    uint64_t period_ns;
+    unsigned burst;
+    uint64_t gap_ns; ///< Spacing of the frames, from the previous period.
+    uint64_t next_ns; ///< Earliest departure of the next frame.
+    uint64_t period_start_ns;
+    unsigned period_frames; ///< Frames sent in the current period.
+
+    // Departures left to the qdisc
+    bool txtime;
+    clockid_t clock;
+    int64_t clock_offset_ns; ///< Time of `clock` minus monotonic time.
+
+    // Queue of the pacer thread, departures in monotonic time
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pace_entry_t queue[PACE_QUEUE_LEN];
+    unsigned head;
+    unsigned count;
+    bool stop; ///< Send the queued frames without waiting and exit.
+} sink_pacer_t;
+
+
+/** Sink options structure. */
+static struct argp_option options[] = {
+    {"logbin", 'b', "FILE", 0, "Write binary MAVLink stream FILE"},
+    {"udp", 'u', "HOST", OPTION_ARG_OPTIONAL,
+     "Send MAVLink messages via UDP to HOST, defaults to 224.0.0.1"},
+    {"udp-port", 'p', "UDPPORT", 0,
+     "UDP port to send MAVLink messages to, defaults to 38400, implies --udp"},
+    {"udp-summaries", OPT_UDP_SUMMARIES, 0, 0,
+     "Send only summary messages via UDP, implies --udp"},
+    {"shm", 's', "NAME", 0,
+     "Publish MAVLink messages to the shared-memory ring NAME"},
+    {"mavlink2", OPT_MAVLINK2, 0, 0,
+     "Emit MAVLink 2 frames with zero-truncated payloads instead of MAVLink 1"},
+    {"udp-shape", OPT_UDP_SHAPE, "MSGID:RATE[:BURST]", 0,
+     "Send at most RATE messages MSGID per second via UDP, BURST of them "
+     "back to back, defaults to 1, the latest message replacing a held back "
+     "one, except summaries, which are queued; may be repeated, implies "
+     "--udp"},
+    {"udp-bandwidth", OPT_UDP_BANDWIDTH, "BYTES[:BURST]", 0,
+     "Send at most BYTES per second via UDP, BURST bytes back to back, "
+     "defaults to a tenth of a second; implies --udp"},
+    {"udp-pace", OPT_UDP_PACE, "MS[:BURST]", 0,
+     "Spread the UDP frames evenly over periods of MS milliseconds at the "
+     "rate of the previous one, BURST of them back to back, defaults to 1; "
+     "implies --udp"},
+    {"udp-txtime", OPT_UDP_TXTIME, "mono|tai", 0,
+     "Leave the paced departures to an fq (mono) or ETF (tai) qdisc with "
+     "SO_TXTIME instead of a sender thread; requires --udp-pace"},
+    {"udp-tolerance", OPT_UDP_TOLERANCE, "SIGNAL:TOL", 0,
+     "Send via UDP only the raw messages needed to rebuild SIGNAL, such as "
+     "ADC_RAW.data[3], or all elements of ADC_RAW.data, within TOL by linear "
+     "interpolation; may be repeated, implies --udp"},
+    {"udp-max-interval", OPT_UDP_MAX_INTERVAL, "SECONDS", 0,
+     "Send a compressed message type at least every SECONDS, defaults to 1"},
+    {"blackbox", OPT_BLACKBOX, "FILE", 0,
+     "Keep the latest MAVLink messages in the circular log FILE, copied to a "
+     "normal log FILE.TIME on SIGUSR2 or the `freeze` command"},
+    {"blackbox-size", OPT_BLACKBOX_SIZE, "MB", 0,
+     "Size of the circular log, defaults to 64 MB"},
+    {0}
+};
+
+
+/**
+ * Parse a positive number following the separator at `*endptr`.
+ */
+static double parse_limit(struct argp_state *state, char **endptr,
+                          char *name) {
+    char *start = *endptr + 1;
+    double value = strtod(start, endptr);
+    if (*endptr == start || !(value > 0))
+        argp_error(state, "%s must be a positive number.", name);
+    return value;
+}
+
+
+/** Sink option parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the configuration structure to write the parsed options
+    sink_config_t *config = state->input;
+
+    switch (key) {
+    case ARGP_KEY_INIT:
+        config->udp_host = "224.0.0.1";
+        config->udp_port = 38400;
+        config->udp_txtime_clock = -1;
+        config->udp_max_interval = DEFAULT_MAX_INTERVAL;
+        config->blackbox_size = BLACKBOX_DEFAULT_SIZE;
+        break;
+
+    case ARGP_KEY_END:
+        if (config->udp_txtime_clock >= 0 && !config->udp_pace)
+            argp_error(state, "--udp-txtime requires --udp-pace.");
+        break;
+
+    case 'b':
+        config->binary_log = arg;
+        break;
+
+    case 'u':
+        config->use_udp = true;
+        if (arg)
+            config->udp_host = arg;
+        break;
+
+    case 'p':
+        config->use_udp = true;
+        {
+            char *endptr = 0;
+            unsigned long udp_port = strtoul(arg, &endptr, 0);
+            if (*endptr) {
+                argp_error(state, "UPDPORT argument must be an integer.");
+            }
+            if (udp_port > 65535) {
+                argp_error(state, "UPDPORT number too large.");
+            }
+            config->udp_port = udp_port;
+        }
+        break;
+
+    case OPT_UDP_SUMMARIES:
+        config->use_udp = true;
+        config->udp_summaries_only = true;
+        break;
+
+    case 's':
+        config->shm_name = arg;
+        break;
+
+    case OPT_MAVLINK2:
+        config->mavlink2 = true;
+        break;
+
+    case OPT_UDP_SHAPE:
+        config->use_udp = true;
+        {
+            char *endptr = 0;
+            unsigned long msgid = strtoul(arg, &endptr, 0);
+            if (endptr == arg || *endptr != ':' || msgid > 0xFFFFFF)
+                argp_error(state, "Invalid shaped MSGID.");
+            double rate = parse_limit(state, &endptr, "RATE");
+            double burst = 1;
+            if (*endptr == ':')
+                burst = parse_limit(state, &endptr, "BURST");
+            if (*endptr || burst < 1)
+                argp_error(state, "Invalid shaping of MSGID %lu.", msgid);
+
+            // A repeated MSGID replaces its previous limit
+            unsigned i = 0;
+            while (i < config->nshapers && config->shapers[i].msgid != msgid)
+                i++;
+            if (i == SINK_MAX_SHAPERS)
+                argp_error(state, "Too many shaped messages.");
+            config->shapers[i] = (sink_shaper_config_t) {
+                .msgid=msgid, .rate=rate, .burst=burst
+            };
+            if (i == config->nshapers)
+                config->nshapers++;
+        }
+        break;
+
+    case OPT_UDP_BANDWIDTH:
+        config->use_udp = true;
+        {
+            char *endptr = arg - 1;
+            config->udp_bandwidth = parse_limit(state, &endptr, "BYTES");
+            config->udp_bandwidth_burst =
+                config->udp_bandwidth * BANDWIDTH_BURST_TIME;
+            if (*endptr == ':')
+                config->udp_bandwidth_burst =
+                    parse_limit(state, &endptr, "BURST");
+            if (*endptr)
+                argp_error(state, "Invalid UDP bandwidth.");
+
+            // A frame must fit in a full bucket
+            if (config->udp_bandwidth_burst < SINK_MAX_FRAME_LEN)
+                config->udp_bandwidth_burst = SINK_MAX_FRAME_LEN;
+        }
+        break;
+
+    case OPT_UDP_PACE:
+        config->use_udp = true;
+        {
+            char *endptr = arg - 1;
+            config->udp_pace = parse_limit(state, &endptr, "MS") * 1e-3;
+            config->udp_pace_burst = 1;
+            if (*endptr == ':')
+                config->udp_pace_burst = parse_limit(state, &endptr, "BURST");
+            if (*endptr || !config->udp_pace_burst)
+                argp_error(state, "Invalid UDP pacing.");
+        }
+        break;
+
+    case OPT_UDP_TXTIME:
+        if (!strcmp(arg, "mono"))
+            config->udp_txtime_clock = CLOCK_MONOTONIC;
+        else if (!strcmp(arg, "tai"))
+            config->udp_txtime_clock = CLOCK_TAI;
+        else
+            argp_error(state, "Invalid SO_TXTIME clock `%s`.", arg);
+        break;
+
+    case OPT_UDP_TOLERANCE:
+        config->use_udp = true;
+        {
+            char *colon = strrchr(arg, ':');
+            if (!colon || colon == arg)
+                argp_error(state, "Invalid compressed signal `%s`.", arg);
+            char *endptr = colon;
+            double tolerance = parse_limit(state, &endptr, "TOL");
+            if (*endptr)
+                argp_error(state, "Invalid tolerance of `%s`.", arg);
+            if (config->ntolerances == SINK_MAX_TOLERANCES)
+                argp_error(state, "Too many compressed signals.");
+            *colon = 0;
+            config->tolerances[config->ntolerances++] =
+                (sink_tolerance_config_t) {.name=arg, .tolerance=tolerance};
+        }
+        break;
+
+    case OPT_UDP_MAX_INTERVAL:
+        {
+            char *endptr = arg - 1;
+            config->udp_max_interval = parse_limit(state, &endptr, "SECONDS");
+            if (*endptr)
+                argp_error(state, "Invalid maximum interval.");
+        }
+        break;
+
+    case OPT_BLACKBOX:
+        config->blackbox = arg;
+        break;
+
+    case OPT_BLACKBOX_SIZE:
+        {
+            char *endptr = arg - 1;
+            double size = parse_limit(state, &endptr, "MB");
+            if (*endptr || size < 1)
+                argp_error(state, "The black box takes at least 1 MB.");
+            config->blackbox_size = size * 1024 * 1024;
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Sink option parser object. */
+struct argp sink_argp = {options, parse_opt};
+
+
+/**
+ * Open the UDP socket connected to the destination host.
+ * Aborts the program on error.
+ */
+static int open_udp(const sink_config_t *config) {
+    struct sockaddr_in host_addr;
+    socklen_t addr_len = sizeof(host_addr);
+    struct hostent *hostent = gethostbyname(config->udp_host);
+    if (!hostent) {
+        syslog(LOG_ERR, "Could not find host address `%s`", config->udp_host);
+        exit(EXIT_FAILURE);
+    }
+    if (hostent->h_addrtype != AF_INET || hostent->h_length != 4) {
+        syslog(LOG_ERR, "Only IPv4 hosts supported.");
+        exit(EXIT_FAILURE);
+    }
+    memset((void *)&host_addr, 0, addr_len);
+    host_addr.sin_family = AF_INET;
+    host_addr.sin_port = htons(config->udp_port);
+    memcpy((void *)&host_addr.sin_addr,
+           hostent->h_addr_list[0], hostent->h_length);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        syslog(LOG_ERR, "Error creating UDP socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (connect(sock, (struct sockaddr *)&host_addr, addr_len)) {
+        syslog(LOG_ERR, "Error connecting socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return sock;
+}
+
+
+/**
+ * Start a full token bucket.
+ */
+static void bucket_init(sink_bucket_t *bucket, double rate, double burst,
+                        uint64_t now) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->last_usec = now;
+}
+
+
+/**
+ * Add the tokens accumulated since the last refill.
+ */
+static void bucket_refill(sink_bucket_t *bucket, uint64_t now) {
+    if (!bucket->rate || now <= bucket->last_usec)
+        return;
+
+    bucket->tokens += bucket->rate * (now - bucket->last_usec) * 1e-6;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last_usec = now;
+}
+
+
+/**
+ * Whether a bucket holds the given number of tokens.
+ */
+static bool bucket_allows(const sink_bucket_t *bucket, double cost) {
+    return !bucket->rate || bucket->tokens >= cost;
+}
+
+
+/**
+ * Write a frame to the UDP socket now, or at `txtime` in the clock of the
+ * socket with SO_TXTIME.
+ */
+static void transmit_udp(sink_t *sink, const uint8_t *buf, size_t len,
+                         uint64_t txtime) {
+    struct iovec iov = {.iov_base=(void *) buf, .iov_len=len};
+    struct msghdr msg = {.msg_iov=&iov, .msg_iovlen=1};
+    union {
+        char buf[CMSG_SPACE(sizeof txtime)];
+        struct cmsghdr align;
+    } control = {};
+    if (txtime) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof txtime);
+        memcpy(CMSG_DATA(cmsg), &txtime, sizeof txtime);
+    }
+
+    if (sendmsg(sink->udp_sock, &msg, 0) != len) {
+        syslog(LOG_ERR, "Error sending UDP message: %s", strerror(errno));
+        __atomic_fetch_add(&sink->udp_errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * Send the queued frames of the pacer at their departure times.
+ */
+static void* pacer_thread(void *arg) {
+    sink_t *sink = arg;
+    sink_pacer_t *pacer = sink->pacer;
+
+    pthread_mutex_lock(&pacer->lock);
+    for (;;) {
+        while (!pacer->count && !pacer->stop)
+            pthread_cond_wait(&pacer->cond, &pacer->lock);
+        if (!pacer->count)
+            break;
+
+        // Wait for the departure, or for the stop to drain the queue
+        pace_entry_t *entry = &pacer->queue[pacer->head];
+        if (!pacer->stop && entry->departure_ns > get_mono_ns()) {
+            struct timespec deadline = {
+                .tv_sec=entry->departure_ns / 1000000000,
+                .tv_nsec=entry->departure_ns % 1000000000
+            };
+            pthread_cond_timedwait(&pacer->cond, &pacer->lock, &deadline);
+            continue;
+        }
+
+        // Send out of the lock, the slot staying queued meanwhile
+        pthread_mutex_unlock(&pacer->lock);
+        transmit_udp(sink, entry->buf, entry->len, 0);
+        pthread_mutex_lock(&pacer->lock);
+        pacer->head = (pacer->head + 1) % PACE_QUEUE_LEN;
+        pacer->count--;
+    }
+    pthread_mutex_unlock(&pacer->lock);
+    return NULL;
+}
+
+
+/**
+ * Start the pacing of the UDP socket, with SO_TXTIME if asked and
+ * supported, otherwise with a sender thread.
+ * Aborts the program on error.
+ */
+static void pacer_open(const sink_config_t *config, sink_t *sink) {
+    sink_pacer_t *pacer = calloc(1, sizeof *pacer);
+    if (!pacer) {
+        syslog(LOG_ERR, "Error allocating UDP pacer: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pacer->period_ns = config->udp_pace * 1e9;
+    pacer->burst = config->udp_pace_burst;
+    sink->pacer = pacer;
+
+    if (config->udp_txtime_clock >= 0) {
+        struct sock_txtime txtime = {.clockid=config->udp_txtime_clock};
+        if (!setsockopt(sink->udp_sock, SOL_SOCKET, SO_TXTIME,
+                        &txtime, sizeof txtime)) {
+            pacer->txtime = true;
+            pacer->clock = config->udp_txtime_clock;
+            return;
+        }
+        syslog(LOG_WARNING, "SO_TXTIME not available, pacing in a thread: %s",
+               strerror(errno));
+    }
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pacer->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    pthread_mutex_init(&pacer->lock, NULL);
+
+    // The signals stay with the acquisition loop, to interrupt its reads
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int status = pthread_create(&pacer->thread, NULL, pacer_thread, sink);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error starting UDP pacer: %s", strerror(status));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Assign the departure time of the next frame, in monotonic time.
+ */
+static uint64_t pace_departure(sink_pacer_t *pacer, uint64_t now) {
+    // Spacing for the rate of the previous period
+    if (now - pacer->period_start_ns >= pacer->period_ns) {
+        if (pacer->period_frames)
+            pacer->gap_ns = pacer->period_ns
+                / (pacer->period_frames * PACE_HEADROOM);
+        pacer->period_start_ns = now;
+        pacer->period_frames = 0;
+        if (pacer->txtime && pacer->clock != CLOCK_MONOTONIC) {
+            struct timespec t;
+            clock_gettime(pacer->clock, &t);
+            pacer->clock_offset_ns = (int64_t) t.tv_sec * 1000000000
+                + t.tv_nsec - (int64_t) get_mono_ns();
+        }
+    }
+    pacer->period_frames++;
+
+    // Credit of a burst after an idle time, and at most a period of delay
+    uint64_t credit = (pacer->burst - 1) * pacer->gap_ns;
+    if (pacer->next_ns + credit < now)
+        pacer->next_ns = now - credit;
+    uint64_t departure = pacer->next_ns > now ? pacer->next_ns : now;
+    if (departure > now + pacer->period_ns)
+        departure = now + pacer->period_ns;
+    pacer->next_ns = departure + pacer->gap_ns;
+    return departure;
+}
+
+
+/**
+ * Send a frame at its paced departure time.
+ */
+static void pace_udp(sink_t *sink, const uint8_t *buf, size_t len) {
+    sink_pacer_t *pacer = sink->pacer;
+    uint64_t departure = pace_departure(pacer, get_mono_ns());
+    if (pacer->txtime) {
+        transmit_udp(sink, buf, len, departure + pacer->clock_offset_ns);
+        return;
+    }
+
+    pthread_mutex_lock(&pacer->lock);
+    if (pacer->count == PACE_QUEUE_LEN || len > SINK_MAX_FRAME_LEN) {
+        __atomic_fetch_add(&sink->udp_errors, 1, __ATOMIC_RELAXED);
+    } else {
+        unsigned tail = (pacer->head + pacer->count) % PACE_QUEUE_LEN;
+        pace_entry_t *entry = &pacer->queue[tail];
+        entry->departure_ns = departure;
+        entry->len = len;
+        memcpy(entry->buf, buf, len);
+        if (!pacer->count++)
+            pthread_cond_signal(&pacer->cond);
+    }
+    pthread_mutex_unlock(&pacer->lock);
+}
+
+
+/**
+ * Stop the pacing, sending the queued frames first.
+ */
+static void pacer_close(sink_t *sink) {
+    sink_pacer_t *pacer = sink->pacer;
+    if (!pacer)
+        return;
+
+    if (!pacer->txtime) {
+        pthread_mutex_lock(&pacer->lock);
+        pacer->stop = true;
+        pthread_cond_signal(&pacer->cond);
+        pthread_mutex_unlock(&pacer->lock);
+        pthread_join(pacer->thread, NULL);
+        pthread_cond_destroy(&pacer->cond);
+        pthread_mutex_destroy(&pacer->lock);
+    }
+    free(pacer);
+    sink->pacer = NULL;
+}
+
+
+/** Set by SIGUSR2 to freeze the black box. */
+static volatile sig_atomic_t freeze_requested;
+
+
+static void handle_freeze(int sig) {
+    freeze_requested = 1;
+}
+
+
+/**
+ * Parse the message definitions of the reader and encode the header
+ * embedding them in the logs.
+ * @param xml definitions, the logs have no header if NULL.
+ * @return 0 if success, -1 if error.
+ */
+static int encode_header(sink_t *sink, const char *xml) {
+    if (!xml)
+        return 0;
+
+    if (mavschema_parse(&sink->schema, xml, strlen(xml), NULL))
+        return -1;
+    return logwriter_header_encode(&sink->schema, &sink->log_header,
+                                   &sink->log_header_len);
+}
+
+
+/**
+ * Start the UDP compression of the configured signals.
+ * Aborts the program on error.
+ */
+static void compressor_open(const sink_config_t *config, sink_t *sink) {
+    if (!config->schema_xml) {
+        syslog(LOG_ERR, "No message definitions for the UDP compression");
+        exit(EXIT_FAILURE);
+    }
+
+    sink->compressor = calloc(1, sizeof *sink->compressor);
+    if (!sink->compressor) {
+        syslog(LOG_ERR, "Error allocating UDP compression: %s",
+               strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    swingdoor_init(sink->compressor, &sink->schema, config->udp_max_interval);
+    for (unsigned i=0; i<config->ntolerances; i++)
+        if (swingdoor_add(sink->compressor, config->tolerances[i].name,
+                          config->tolerances[i].tolerance))
+            exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Open the configured sinks.
+ * Aborts the program on error.
+ */
+void sink_open(const sink_config_t *config, sink_t *sink) {
+    memset(sink, 0, sizeof *sink);
+    sink->udp_sock = -1;
+    sink->last_flush = get_time_us();
+    sink->udp_enabled = sink->binary_log_enabled = sink->shm_enabled = true;
+    sink->blackbox_enabled = true;
+
+    // The logs start with the message definitions of the reader
+    if (encode_header(sink, config->schema_xml))
+        exit(EXIT_FAILURE);
+
+    // Open binary log
+    if (config->binary_log) {
+        sink->binary_log = logwriter_open(config->binary_log, 0);
+        if (!sink->binary_log
+            || (sink->log_header
+                && logwriter_append(sink->binary_log, sink->log_header,
+                                    sink->log_header_len)))
+            exit(EXIT_FAILURE);
+    }
+
+    // Open black box, frozen on SIGUSR2 without interrupting the device
+    // reads
+    if (config->blackbox) {
+        sink->blackbox = blackbox_open(config->blackbox,
+                                       config->blackbox_size);
+        if (!sink->blackbox)
+            exit(EXIT_FAILURE);
+        sink->blackbox->freeze_header = sink->log_header;
+        sink->blackbox->freeze_header_len = sink->log_header_len;
+        struct sigaction action = {
+            .sa_handler=handle_freeze, .sa_flags=SA_RESTART
+        };
+        sigaction(SIGUSR2, &action, NULL);
+    }
+
+    // Open UDP socket
+    if (config->use_udp)
+        sink->udp_sock = open_udp(config);
+    if (sink->udp_sock >= 0 && config->udp_pace)
+        pacer_open(config, sink);
+    sink->udp_summaries_only = config->udp_summaries_only;
+
+    // Start the UDP shaping with full buckets
+    uint64_t now = get_time_us();
+    sink->udp_shaping = config->nshapers || config->udp_bandwidth;
+    bucket_init(&sink->udp_bucket, config->udp_bandwidth,
+                config->udp_bandwidth_burst, now);
+    for (unsigned i=0; i<config->nshapers; i++) {
+        const sink_shaper_config_t *shaper = &config->shapers[i];
+        sink->shapers[i].msgid = shaper->msgid;
+        bucket_init(&sink->shapers[i].bucket, shaper->rate, shaper->burst,
+                    now);
+    }
+    sink->nshapers = config->nshapers;
+    if (sink->udp_sock >= 0 && config->ntolerances)
+        compressor_open(config, sink);
+
+    // Create shared-memory ring
+    if (config->shm_name) {
+        sink->shm = shmring_create(config->shm_name, SHMRING_DEFAULT_CAPACITY);
+        if (!sink->shm)
+            exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Give a frame the next sequence number of the UDP socket and update its
+ * checksum, into a copy. Signed frames and frames of unknown messages are
+ * left as they are.
+ * @return the frame to send, `buf` or `copy`.
+ */
+static const uint8_t* renumber_udp(sink_t *sink, const uint8_t *buf,
+                                   size_t len, uint8_t *copy) {
+    size_t header_len, seq_pos;
+    uint32_t msgid;
+    if (len > MAVFRAME_V2_HEADER_LEN && buf[0] == MAVFRAME_V2_STX
+        && !(buf[2] & MAVFRAME_V2_IFLAG_SIGNED)) {
+        header_len = MAVFRAME_V2_HEADER_LEN;
+        seq_pos = 4;
+        msgid = buf[7] | buf[8] << 8 | (uint32_t) buf[9] << 16;
+    } else if (len > MAVFRAME_V1_HEADER_LEN && buf[0] == MAVFRAME_V1_STX) {
+        header_len = MAVFRAME_V1_HEADER_LEN;
+        seq_pos = 2;
+        msgid = buf[5];
+    } else {
+        return buf;
+    }
+
+    size_t crc_pos = header_len + buf[1];
+    const mavschema_message_t *msg = mavschema_find_id(&sink->schema, msgid);
+    if (crc_pos + MAVFRAME_CHECKSUM_LEN != len || !msg)
+        return buf;
+
+    memcpy(copy, buf, len);
+    copy[seq_pos] = sink->udp_seq++;
+    uint16_t crc = mavframe_crc(copy + 1, crc_pos - 1, 0xFFFF);
+    crc = mavframe_crc(&msg->crc_extra, 1, crc);
+    copy[crc_pos] = crc & 0xFF;
+    copy[crc_pos + 1] = crc >> 8;
+    return copy;
+}
+
+
+/**
+ * Send a frame to the UDP socket, paced if enabled. With the compression,
+ * the frames are numbered again in the order they are sent, so that the
+ * receivers tell the frames dropped on purpose from those lost.
+ */
+static void send_udp(sink_t *sink, const uint8_t *buf, size_t len) {
+    uint8_t copy[MAVFRAME_MAX_LEN];
+    if (sink->compressor)
+        buf = renumber_udp(sink, buf, len, copy);
+
+    if (sink->pacer)
+        pace_udp(sink, buf, len);
+    else
+        transmit_udp(sink, buf, len, 0);
+}
+
+
+/**
+ * Get the shaping state of a message type. Without a configured limit, a
+ * state is only needed to hold frames back for the bandwidth limit.
+ * @return the shaper or NULL if none.
+ */
+static sink_shaper_t* get_shaper(sink_t *sink, uint32_t msgid) {
+    for (unsigned i=0; i<sink->nshapers; i++)
+        if (sink->shapers[i].msgid == msgid)
+            return &sink->shapers[i];
+
+    if (!sink->udp_bucket.rate || sink->nshapers == SINK_MAX_SHAPERS)
+        return NULL;
+    sink_shaper_t *shaper = &sink->shapers[sink->nshapers++];
+    memset(shaper, 0, sizeof *shaper);
+    shaper->msgid = msgid;
+    return shaper;
+}
+
+
+/**
+ * Send a frame to the UDP socket if the buckets allow, taking its tokens.
+ * @return whether the frame was sent.
+ */
+static bool admit_udp(sink_t *sink, sink_shaper_t *shaper, const uint8_t *buf,
+                      size_t len) {
+    if (shaper && !bucket_allows(&shaper->bucket, 1))
+        return false;
+    if (!bucket_allows(&sink->udp_bucket, len))
+        return false;
+
+    if (shaper) {
+        if (shaper->bucket.rate)
+            shaper->bucket.tokens -= 1;
+        shaper->sent++;
+    }
+    if (sink->udp_bucket.rate)
+        sink->udp_bucket.tokens -= len;
+    send_udp(sink, buf, len);
+    return true;
+}
+
+
+/**
+ * Refill the buckets and send the held back frames they allow, the queued
+ * ones first in their order, then the replaced ones starting from a
+ * different message type each time.
+ * @return whether queued frames are still held back by the bandwidth.
+ */
+static bool release_pending(sink_t *sink, uint64_t now) {
+    bucket_refill(&sink->udp_bucket, now);
+    for (unsigned i=0; i<sink->nshapers; i++)
+        bucket_refill(&sink->shapers[i].bucket, now);
+
+    unsigned kept = 0;
+    bool starved = false;
+    for (unsigned i=0; i<sink->nheld_frames; i++) {
+        sink_held_frame_t *held = &sink->held_frames[i];
+        if (admit_udp(sink, held->shaper, held->frame, held->len))
+            continue;
+        if (!held->shaper || bucket_allows(&held->shaper->bucket, 1))
+            starved = true;
+        if (kept != i)
+            sink->held_frames[kept] = *held;
+        kept++;
+    }
+    sink->nheld_frames = kept;
+    if (starved)
+        return true;
+
+    for (unsigned k=0; k<sink->nshapers; k++) {
+        unsigned i = (sink->next_pending + k) % sink->nshapers;
+        sink_shaper_t *shaper = &sink->shapers[i];
+        if (shaper->pending_len
+            && admit_udp(sink, shaper, shaper->pending, shaper->pending_len))
+            shaper->pending_len = 0;
+    }
+    if (sink->nshapers)
+        sink->next_pending = (sink->next_pending + 1) % sink->nshapers;
+    return false;
+}
+
+
+/**
+ * Queue a frame until the limits allow.
+ * @return whether queued, false if too many are.
+ */
+static bool hold_frame(sink_t *sink, sink_shaper_t *shaper,
+                       const uint8_t *buf, size_t len) {
+    if (sink->nheld_frames == SINK_MAX_HELD_FRAMES
+        || len > SINK_MAX_FRAME_LEN)
+        return false;
+
+    sink_held_frame_t *held = &sink->held_frames[sink->nheld_frames++];
+    held->shaper = shaper;
+    memcpy(held->frame, buf, len);
+    held->len = len;
+    return true;
+}
+
+
+/**
+ * Shaping state of the message type of a frame.
+ * @return the shaper or NULL if none or not a frame.
+ */
+static sink_shaper_t* frame_shaper(sink_t *sink, const uint8_t *buf,
+                                   size_t len) {
+    if (len > 9 && buf[0] == MAVFRAME_V2_STX)
+        return get_shaper(sink, buf[7] | buf[8] << 8
+                                | (uint32_t) buf[9] << 16);
+    if (len > 5)
+        return get_shaper(sink, buf[5]);
+    return NULL;
+}
+
+
+/**
+ * Send a frame to the UDP socket through the shaping, holding it back if
+ * over the limits, replaced by the next one of its message type.
+ */
+static void shape_udp(sink_t *sink, const uint8_t *buf, size_t len) {
+    bool queue_pending = release_pending(sink, get_time_us());
+    sink_shaper_t *shaper = frame_shaper(sink, buf, len);
+
+    // The latest data frame of a type wins over a held back one, and the
+    // bandwidth goes to the queued frames first
+    if (shaper && shaper->pending_len) {
+        shaper->shaped++;
+        sink->udp_shaped++;
+    } else if (!queue_pending && admit_udp(sink, shaper, buf, len)) {
+        return;
+    }
+
+    if (!shaper || len > sizeof shaper->pending) {
+        sink->udp_shaped++;
+        return;
+    }
+    memcpy(shaper->pending, buf, len);
+    shaper->pending_len = len;
+}
+
+
+/**
+ * Send a frame to the UDP socket through the shaping, queueing it in order
+ * if over the limits.
+ * @param force send the frame over the limits rather than drop it when the
+ *        queue is full.
+ */
+static void queue_udp(sink_t *sink, const uint8_t *buf, size_t len,
+                      bool force) {
+    bool queue_pending = release_pending(sink, get_time_us());
+    sink_shaper_t *shaper = frame_shaper(sink, buf, len);
+    if ((!queue_pending && admit_udp(sink, shaper, buf, len))
+        || hold_frame(sink, shaper, buf, len))
+        return;
+
+    if (force) {
+        sink->udp_overlimit++;
+        send_udp(sink, buf, len);
+        return;
+    }
+    if (shaper)
+        shaper->shaped++;
+    sink->udp_shaped++;
+}
+
+
+/**
+ * Send a frame passed by the UDP compression, queued by the shaping if any:
+ * the receiver needs all of them to stay within tolerance.
+ */
+static void emit_udp(void *ctx, const uint8_t *buf, size_t len) {
+    sink_t *sink = ctx;
+    if (sink->udp_shaping)
+        queue_udp(sink, buf, len, true);
+    else
+        send_udp(sink, buf, len);
+}
+
+
+/**
+ * Send a MAVLink frame to the open sinks.
+ */
+static void send_frame(sink_t *sink, const uint8_t *buf, size_t len,
+                       bool summary) {
+    sink->frames++;
+
+    // Output to binary log and black box, keeping at most a second of data
+    // in memory
+    if (sink->binary_log && sink->binary_log_enabled)
+        logwriter_append(sink->binary_log, buf, len);
+    if (sink->blackbox && sink->blackbox_enabled)
+        blackbox_append(sink->blackbox, buf, len);
+    if (sink->binary_log || sink->blackbox) {
+        uint64_t now = get_time_us();
+        if (now - sink->last_flush >= FLUSH_INTERVAL) {
+            if (sink->binary_log)
+                logwriter_flush(sink->binary_log);
+            if (sink->blackbox)
+                blackbox_flush(sink->blackbox);
+            sink->last_flush = now;
+        }
+    }
+    if (freeze_requested) {
+        freeze_requested = 0;
+        sink_freeze(sink);
+    }
+
+    // Output to UDP socket
+    if (sink->udp_sock >= 0 && sink->udp_enabled
+        && (summary || !sink->udp_summaries_only)) {
+        if (sink->compressor && !summary)
+            swingdoor_push(sink->compressor, buf, len, get_time_us(),
+                           emit_udp, sink);
+        else if (sink->udp_shaping && summary)
+            queue_udp(sink, buf, len, false);
+        else if (sink->udp_shaping)
+            shape_udp(sink, buf, len);
+        else
+            send_udp(sink, buf, len);
+    }
+
+    // Output to shared-memory ring
+    if (sink->shm && sink->shm_enabled)
+        shmring_write(sink->shm, buf, len);
+}
+
+
+/**
+ * Send a MAVLink frame of raw data to the open sinks, except a UDP socket
+ * restricted to summaries.
+ */
+void sink_send(sink_t *sink, const uint8_t *buf, size_t len) {
+    send_frame(sink, buf, len, false);
+}
+
+
+/**
+ * Send a MAVLink frame of summarized data to all open sinks, including the
+ * UDP socket restricted to summaries.
+ */
+void sink_send_summary(sink_t *sink, const uint8_t *buf, size_t len) {
+    send_frame(sink, buf, len, true);
+}
+
+
+/**
+ * Write the pending data of the sinks.
+ */
+void sink_flush(sink_t *sink) {
+    if (sink->binary_log)
+        logwriter_flush(sink->binary_log);
+    if (sink->blackbox)
+        blackbox_flush(sink->blackbox);
+    sink->last_flush = get_time_us();
+    sink_poll(sink);
+}
+
+
+/**
+ * Send the UDP frames held back by the compression past the maximum
+ * interval, and those held back by the shaping that the limits now allow,
+ * which would otherwise wait for the next frame. To be called once per
+ * round of the reader loop.
+ */
+void sink_poll(sink_t *sink) {
+    if (sink->udp_sock < 0 || !sink->udp_enabled)
+        return;
+
+    uint64_t now = get_time_us();
+    if (sink->compressor)
+        swingdoor_poll(sink->compressor, now, emit_udp, sink);
+    if (sink->udp_shaping)
+        release_pending(sink, now);
+}
+
+
+/**
+ * Resume or pause the output to an open sink.
+ * @param name of the sink: `udp`, `logbin`, `shm` or `blackbox`.
+ * @return 0 if success, -1 if the sink is unknown or was not opened.
+ */
+int sink_enable(sink_t *sink, const char *name, bool enable) {
+    if (!strcmp(name, "udp") && sink->udp_sock >= 0) {
+        sink->udp_enabled = enable;
+    } else if (!strcmp(name, "logbin") && sink->binary_log) {
+        // Do not keep paused data waiting in memory
+        if (!enable)
+            logwriter_flush(sink->binary_log);
+        sink->binary_log_enabled = enable;
+    } else if (!strcmp(name, "shm") && sink->shm) {
+        sink->shm_enabled = enable;
+    } else if (!strcmp(name, "blackbox") && sink->blackbox) {
+        sink->blackbox_enabled = enable;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Copy the window of the black box to a normal log, in the background.
+ * @return the path of the log, or NULL if error or a freeze is running.
+ */
+const char* sink_freeze(sink_t *sink) {
+    if (!sink->blackbox)
+        return NULL;
+    return blackbox_freeze(sink->blackbox);
+}
+
+
+/**
+ * Flush and close all sinks.
+ */
+void sink_close(sink_t *sink) {
+    logwriter_close(sink->binary_log);
+    sink->binary_log = NULL;
+    blackbox_close(sink->blackbox);
+    sink->blackbox = NULL;
+    free(sink->log_header);
+    sink->log_header = NULL;
+
+    // The receivers get the last values of the compressed signals and the
+    // queued frames, over the limits
+    if (sink->compressor && sink->udp_sock >= 0 && sink->udp_enabled)
+        swingdoor_flush(sink->compressor, emit_udp, sink);
+    if (sink->udp_sock >= 0 && sink->udp_enabled)
+        for (unsigned i=0; i<sink->nheld_frames; i++)
+            send_udp(sink, sink->held_frames[i].frame,
+                     sink->held_frames[i].len);
+    sink->nheld_frames = 0;
+    free(sink->compressor);
+    sink->compressor = NULL;
+    mavschema_free(&sink->schema);
+
+    pacer_close(sink);
+    if (sink->udp_sock >= 0 && close(sink->udp_sock))
+        syslog(LOG_ERR, "Error closing UDP socket: %s", strerror(errno));
+    sink->udp_sock = -1;
+
+    shmring_close(sink->shm);
+    sink->shm = NULL;
+}
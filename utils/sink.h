@@ -0,0 +1,149 @@
+/**
+ * MAVLink output sinks shared by the device readers.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+
+#include <argp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blackbox.h"
+#include "logwriter.h"
+#include "mavschema.h"
+#include "shmring.h"
+#include "swingdoor.h"
+
+
+/** Maximum number of message types shaped on the UDP socket. */
+#define SINK_MAX_SHAPERS 32
+
+/** Maximum length of a frame held back by the UDP shaping. */
+#define SINK_MAX_FRAME_LEN 280
+
+/** Maximum number of frames queued by the UDP shaping. */
+#define SINK_MAX_HELD_FRAMES 64
+
+/** Maximum number of signals compressed on the UDP socket. */
+#define SINK_MAX_TOLERANCES 64
+
+
+/** Token bucket, refilled at `rate` up to `burst` tokens. */
+typedef struct sink_bucket {
+    double rate; ///< Tokens per second, unlimited if 0.
+    double burst;
+    double tokens;
+    uint64_t last_usec; ///< Time of the last refill.
+} sink_bucket_t;
+
+/** Rate limit of a message type on the UDP socket. */
+typedef struct sink_shaper_config {
+    uint32_t msgid;
+    double rate; ///< Messages per second.
+    double burst; ///< Messages sent back to back after an idle period.
+} sink_shaper_config_t;
+
+/** Error tolerance of a signal compressed on the UDP socket. */
+typedef struct sink_tolerance_config {
+    char *name; ///< MSG.field[i], or MSG.field for all elements.
+    double tolerance;
+} sink_tolerance_config_t;
+
+/** UDP shaping state of a message type. */
+typedef struct sink_shaper {
+    uint32_t msgid;
+    sink_bucket_t bucket; ///< In messages.
+    uint8_t pending[SINK_MAX_FRAME_LEN]; ///< Latest data frame held back.
+    size_t pending_len; ///< 0 if none.
+    unsigned long sent; ///< Frames sent.
+    unsigned long shaped; ///< Frames replaced by a later one or dropped.
+} sink_shaper_t;
+
+/**
+ * Frame queued by the UDP shaping rather than replaced by the next one of
+ * its message type: a summary, one per channel or field, or a frame the
+ * compression sent for the receiver to stay within tolerance.
+ */
+typedef struct sink_held_frame {
+    sink_shaper_t *shaper; ///< NULL if none.
+    uint8_t frame[SINK_MAX_FRAME_LEN];
+    size_t len;
+} sink_held_frame_t;
+
+/**
+ * Sink configuration, filled by the `sink_argp` option parser, except for
+ * the message definitions XML set by the reader.
+ */
+typedef struct sink_config {
+    char *binary_log;
+    const char *schema_xml; ///< Definitions embedded in the binary log.
+    bool use_udp;
+    char *udp_host;
+    uint16_t udp_port;
+    bool udp_summaries_only;
+    char *shm_name;
+    bool mavlink2; ///< Emit MAVLink 2 frames, applied by the readers.
+    sink_shaper_config_t shapers[SINK_MAX_SHAPERS];
+    unsigned nshapers;
+    double udp_bandwidth; ///< Bytes per second of the UDP socket, or 0.
+    double udp_bandwidth_burst; ///< In bytes.
+    double udp_pace; ///< Period the UDP frames are spread over, in s, or 0.
+    unsigned udp_pace_burst; ///< Frames sent back to back.
+    int udp_txtime_clock; ///< Clock of SO_TXTIME, or -1 for a pacer thread.
+    sink_tolerance_config_t tolerances[SINK_MAX_TOLERANCES];
+    unsigned ntolerances;
+    double udp_max_interval; ///< Longest time between compressed frames.
+    char *blackbox;
+    uint64_t blackbox_size; ///< In bytes.
+} sink_config_t;
+
+/** Open sinks. */
+typedef struct sink {
+    int udp_sock;
+    bool udp_summaries_only;
+    logwriter_t *binary_log;
+    blackbox_t *blackbox;
+    shmring_t *shm;
+    uint64_t last_flush;
+    bool udp_enabled; ///< Whether frames go to the open UDP socket.
+    bool binary_log_enabled; ///< Whether frames go to the open binary log.
+    bool shm_enabled; ///< Whether frames go to the open ring.
+    bool blackbox_enabled; ///< Whether frames go to the open black box.
+    unsigned long frames; ///< Frames sent.
+    unsigned long udp_errors; ///< Frames the UDP socket failed to send.
+    bool udp_shaping; ///< Whether UDP frames pass the shapers.
+    sink_bucket_t udp_bucket; ///< Bandwidth of the UDP socket, in bytes.
+    sink_shaper_t shapers[SINK_MAX_SHAPERS];
+    unsigned nshapers;
+    unsigned next_pending; ///< Shaper served first by the next round.
+    sink_held_frame_t held_frames[SINK_MAX_HELD_FRAMES];
+    unsigned nheld_frames; ///< In the order they were sent.
+    unsigned long udp_overlimit; ///< Compressed frames sent over the limits.
+    unsigned long udp_shaped; ///< Frames not sent due to the shaping.
+    struct sink_pacer *pacer; ///< UDP pacing, NULL if disabled.
+    uint8_t *log_header; ///< Start of the logs, NULL if none.
+    size_t log_header_len;
+    mavschema_t schema; ///< Definitions of the reader's messages.
+    swingdoor_t *compressor; ///< UDP compression, NULL if disabled.
+    uint8_t udp_seq; ///< Sequence of the UDP frames, with the compression.
+} sink_t;
+
+
+/** Option parser of the sinks, to be used as an argp child. */
+extern struct argp sink_argp;
+
+
+void sink_open(const sink_config_t *config, sink_t *sink);
+void sink_send(sink_t *sink, const uint8_t *buf, size_t len);
+void sink_send_summary(sink_t *sink, const uint8_t *buf, size_t len);
+void sink_flush(sink_t *sink);
+void sink_poll(sink_t *sink);
+int sink_enable(sink_t *sink, const char *name, bool enable);
+const char* sink_freeze(sink_t *sink);
+void sink_close(sink_t *sink);
+
+
+#endif//SINK_H
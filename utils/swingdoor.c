@@ -0,0 +1,377 @@
+/**
+ * Bounded-error compression of telemetry signals by the swinging door
+ * algorithm, and their reconstruction by the receivers.
+ *
+ * The receiver rebuilds each signal by linear interpolation between the
+ * frames it gets. The compressor holds back the latest frame of a message
+ * type, and keeps for each signal the range of slopes, the doors, of the
+ * lines from the last sent value that pass within tolerance of every value
+ * since. A new frame whose line from the sent frame falls outside the doors
+ * of any signal closes them: the held frame is sent and becomes the origin
+ * of new doors. Slowly changing or linear signals are thus sent a few
+ * times, while transients are kept to the tolerance. A frame is also sent
+ * when the last one is older than the maximum interval, so that the
+ * receiver never waits long for a point.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "swingdoor.h"
+
+
+/**
+ * Parse a signal name, MSG.field or MSG.field[i].
+ * @param[out] index of the element, -1 for all elements of an array field.
+ * @return 0 if success, -1 if unknown.
+ */
+static int parse_name(const mavschema_t *schema, const char *name,
+                      const mavschema_message_t **msg,
+                      const mavschema_field_t **field, int *index) {
+    const char *dot = strchr(name, '.');
+    char msg_name[MAVSCHEMA_NAME_LEN], field_name[MAVSCHEMA_NAME_LEN];
+    if (!dot || dot - name >= sizeof msg_name)
+        goto unknown;
+    memcpy(msg_name, name, dot - name);
+    msg_name[dot - name] = 0;
+
+    size_t len = strcspn(dot + 1, "[");
+    if (len >= sizeof field_name)
+        goto unknown;
+    memcpy(field_name, dot + 1, len);
+    field_name[len] = 0;
+
+    if (!(*msg = mavschema_find_name(schema, msg_name))
+        || !(*field = mavschema_find_field(*msg, field_name)))
+        goto unknown;
+
+    *index = (*field)->array_len ? -1 : 0;
+    const char *bracket = dot + 1 + len;
+    if (*bracket) {
+        char *endptr;
+        unsigned long i = strtoul(bracket + 1, &endptr, 10);
+        if (*endptr != ']' || endptr[1] || i >= (*field)->array_len)
+            goto unknown;
+        *index = i;
+    }
+    return 0;
+
+ unknown:
+    syslog(LOG_ERR, "Unknown signal `%s`", name);
+    return -1;
+}
+
+
+/**
+ * Start a compressor without signals.
+ * @param max_interval between sent frames of a message type, in seconds,
+ *        0 for none.
+ */
+void swingdoor_init(swingdoor_t *sd, const mavschema_t *schema,
+                    double max_interval) {
+    memset(sd, 0, sizeof *sd);
+    sd->schema = schema;
+    sd->max_interval_usec = max_interval * 1e6;
+}
+
+
+/**
+ * Compress a signal within a tolerance. The other fields of its message are
+ * sent along, but not bounded.
+ * @param name of the signal, MSG.field[i], or MSG.field for all elements.
+ * @return 0 if success, -1 if error.
+ */
+int swingdoor_add(swingdoor_t *sd, const char *name, double tolerance) {
+    const mavschema_message_t *msg;
+    const mavschema_field_t *field;
+    int index;
+    if (parse_name(sd->schema, name, &msg, &field, &index))
+        return -1;
+
+    swingdoor_stream_t *s = NULL;
+    for (unsigned i=0; i<sd->nstreams && !s; i++)
+        if (sd->streams[i].msg == msg)
+            s = &sd->streams[i];
+    if (!s) {
+        if (sd->nstreams == SWINGDOOR_MAX_STREAMS) {
+            syslog(LOG_ERR, "Too many compressed message types");
+            return -1;
+        }
+        s = &sd->streams[sd->nstreams++];
+        s->msg = msg;
+        s->time_field = mavschema_find_field(msg, "time_usec");
+    }
+
+    unsigned first = index < 0 ? 0 : index;
+    unsigned last = index < 0 ? field->array_len - 1 : index;
+    for (unsigned k=first; k<=last; k++) {
+        // A repeated signal replaces its previous tolerance
+        unsigned i = 0;
+        while (i < s->nchannels && (s->channels[i].field != field
+                                    || s->channels[i].index != k))
+            i++;
+        if (i == SWINGDOOR_MAX_CHANNELS) {
+            syslog(LOG_ERR, "Too many compressed signals of %s", msg->name);
+            return -1;
+        }
+        s->channels[i] = (swingdoor_channel_t) {
+            .field=field, .index=k, .tolerance=tolerance
+        };
+        if (i == s->nchannels)
+            s->nchannels++;
+    }
+    return 0;
+}
+
+
+/**
+ * Make a sent frame the origin of new doors.
+ * @param held whether it is the held frame rather than the given values.
+ */
+static void restart(swingdoor_stream_t *s, double time, const double *values,
+                    bool held) {
+    s->started = true;
+    s->sent_usec = time;
+    for (unsigned i=0; i<s->nchannels; i++) {
+        swingdoor_channel_t *ch = &s->channels[i];
+        ch->sent = held ? ch->held : values[i];
+        ch->lo = -INFINITY;
+        ch->hi = INFINITY;
+    }
+    s->nsent++;
+}
+
+
+/**
+ * Whether the lines from the sent frame to the given values fall within
+ * the doors of all signals.
+ */
+static bool within_doors(const swingdoor_stream_t *s, double time,
+                         const double *values) {
+    double dt = time - s->sent_usec;
+    for (unsigned i=0; i<s->nchannels; i++) {
+        const swingdoor_channel_t *ch = &s->channels[i];
+        double slope = (values[i] - ch->sent) / dt;
+        if (slope < ch->lo || slope > ch->hi)
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Narrow the doors to pass within tolerance of the given values.
+ */
+static void narrow_doors(swingdoor_stream_t *s, double time,
+                         const double *values) {
+    double dt = time - s->sent_usec;
+    for (unsigned i=0; i<s->nchannels; i++) {
+        swingdoor_channel_t *ch = &s->channels[i];
+        ch->lo = fmax(ch->lo, (values[i] - ch->tolerance - ch->sent) / dt);
+        ch->hi = fmin(ch->hi, (values[i] + ch->tolerance - ch->sent) / dt);
+        ch->held = values[i];
+    }
+}
+
+
+/**
+ * Send the held frame of a message type, if any.
+ */
+static void send_held(swingdoor_stream_t *s, swingdoor_emit_fn emit,
+                      void *ctx) {
+    if (!s->held_len)
+        return;
+    emit(ctx, s->held, s->held_len);
+    restart(s, s->held_usec, NULL, true);
+    s->held_len = 0;
+}
+
+
+/**
+ * Pass a frame through the compression: the frames of other message types
+ * are sent at once, the others when the receiver needs them to rebuild the
+ * signals within tolerance.
+ * @param now_usec arrival time, for the messages without time_usec field.
+ * @param emit destination of the frames to send, called with `ctx`.
+ */
+void swingdoor_push(swingdoor_t *sd, const uint8_t *buf, size_t len,
+                    uint64_t now_usec, swingdoor_emit_fn emit, void *ctx) {
+    mavframe_scanner_t scanner = {0};
+    mavframe_t frame;
+    size_t pos = 0;
+    swingdoor_stream_t *s = NULL;
+    if (mavframe_next(&scanner, buf, len, &pos, &frame) && frame.data == buf)
+        for (unsigned i=0; i<sd->nstreams && !s; i++)
+            if (sd->streams[i].msg->id == frame.msgid)
+                s = &sd->streams[i];
+    if (!s || len > sizeof s->held) {
+        emit(ctx, buf, len);
+        return;
+    }
+
+    double time = now_usec;
+    if (s->time_field)
+        time = mavschema_get(s->time_field, frame.payload, frame.payload_len,
+                             0);
+    double values[SWINGDOOR_MAX_CHANNELS];
+    for (unsigned i=0; i<s->nchannels; i++)
+        values[i] = mavschema_get(s->channels[i].field, frame.payload,
+                                  frame.payload_len, s->channels[i].index);
+
+    // Doors closed by the new frame, or time going backwards, send the
+    // held frame
+    if (s->started
+        && (time <= s->sent_usec || !within_doors(s, time, values)))
+        send_held(s, emit, ctx);
+
+    // The frame itself is sent if it is the first, the only one after the
+    // sent frame or too late after it
+    if (!s->started || time <= s->sent_usec
+        || (sd->max_interval_usec
+            && time - s->sent_usec >= sd->max_interval_usec)) {
+        if (s->held_len)
+            s->dropped++;
+        s->held_len = 0;
+        emit(ctx, buf, len);
+        restart(s, time, values, false);
+        return;
+    }
+
+    // Otherwise it is held back, replacing the previous held frame
+    if (s->held_len)
+        s->dropped++;
+    narrow_doors(s, time, values);
+    memcpy(s->held, buf, len);
+    s->held_len = len;
+    s->held_usec = time;
+}
+
+
+/**
+ * Send the held frames that are past the maximum interval, for the message
+ * types that stopped.
+ */
+void swingdoor_poll(swingdoor_t *sd, uint64_t now_usec,
+                    swingdoor_emit_fn emit, void *ctx) {
+    if (!sd->max_interval_usec)
+        return;
+
+    for (unsigned i=0; i<sd->nstreams; i++) {
+        swingdoor_stream_t *s = &sd->streams[i];
+        if (s->held_len && now_usec - s->sent_usec >= sd->max_interval_usec)
+            send_held(s, emit, ctx);
+    }
+}
+
+
+/**
+ * Send all held frames, before the compression stops, for the receiver to
+ * rebuild the signals up to their last value.
+ */
+void swingdoor_flush(swingdoor_t *sd, swingdoor_emit_fn emit, void *ctx) {
+    for (unsigned i=0; i<sd->nstreams; i++)
+        send_held(&sd->streams[i], emit, ctx);
+}
+
+
+/**
+ * Start rebuilding a signal.
+ * @param name of the signal, MSG.field or MSG.field[i].
+ * @return 0 if success, -1 if unknown.
+ */
+int swingdoor_signal_init(swingdoor_signal_t *sig, const mavschema_t *schema,
+                          const char *name) {
+    memset(sig, 0, sizeof *sig);
+    int index;
+    if (parse_name(schema, name, &sig->msg, &sig->field, &index))
+        return -1;
+    sig->index = index < 0 ? 0 : index;
+    sig->time_field = mavschema_find_field(sig->msg, "time_usec");
+    return 0;
+}
+
+
+/**
+ * Add the point of a received frame, if of the signal's message type.
+ * The frames must come in time order.
+ * @param time_usec record time, for the messages without time_usec field.
+ * @return 0 if success, -1 if error.
+ */
+int swingdoor_signal_push(swingdoor_signal_t *sig, const mavframe_t *frame,
+                          uint64_t time_usec) {
+    if (frame->msgid != sig->msg->id)
+        return 0;
+
+    if (sig->npoints == sig->capacity) {
+        size_t capacity = sig->capacity ? 2 * sig->capacity : 64;
+        void *points = realloc(sig->points, capacity * sizeof *sig->points);
+        if (!points) {
+            syslog(LOG_ERR, "Error allocating signal points: %s",
+                   strerror(errno));
+            return -1;
+        }
+        sig->points = points;
+        sig->capacity = capacity;
+    }
+
+    swingdoor_point_t *point = &sig->points[sig->npoints++];
+    point->time_usec = time_usec;
+    if (sig->time_field)
+        point->time_usec = mavschema_get(sig->time_field, frame->payload,
+                                         frame->payload_len, 0);
+    point->value = mavschema_get(sig->field, frame->payload,
+                                 frame->payload_len, sig->index);
+    return 0;
+}
+
+
+/**
+ * Value of the signal at a time, interpolated between the received points.
+ * The queries must come in time order, as the points before the queried
+ * time are dropped, except the one starting its segment.
+ * @return the value, the last one after the last point, or NaN before the
+ *         first.
+ */
+double swingdoor_signal_at(swingdoor_signal_t *sig, double time_usec) {
+    size_t skip = 0;
+    while (skip + 1 < sig->npoints
+           && sig->points[skip + 1].time_usec <= time_usec)
+        skip++;
+    if (skip) {
+        sig->npoints -= skip;
+        memmove(sig->points, sig->points + skip,
+                sig->npoints * sizeof *sig->points);
+    }
+
+    if (!sig->npoints || time_usec < sig->points[0].time_usec)
+        return NAN;
+    const swingdoor_point_t *a = &sig->points[0];
+    if (sig->npoints == 1 || time_usec == a->time_usec)
+        return a->value;
+    const swingdoor_point_t *b = &sig->points[1];
+    return a->value + (b->value - a->value) * (time_usec - a->time_usec)
+                      / (b->time_usec - a->time_usec);
+}
+
+
+/**
+ * Time of the last received point, up to which the signal is rebuilt.
+ * @return the time or -INFINITY if none.
+ */
+double swingdoor_signal_end(const swingdoor_signal_t *sig) {
+    return sig->npoints ? sig->points[sig->npoints - 1].time_usec
+                        : -INFINITY;
+}
+
+
+/**
+ * Free the points of a rebuilt signal.
+ */
+void swingdoor_signal_free(swingdoor_signal_t *sig) {
+    free(sig->points);
+    sig->points = NULL;
+    sig->npoints = sig->capacity = 0;
+}
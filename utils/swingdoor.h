@@ -0,0 +1,100 @@
+/**
+ * Bounded-error compression of telemetry signals by the swinging door
+ * algorithm, and their reconstruction by the receivers.
+ */
+
+#ifndef SWINGDOOR_H
+#define SWINGDOOR_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mavframe.h"
+#include "mavschema.h"
+
+
+/** Maximum number of compressed message types. */
+#define SWINGDOOR_MAX_STREAMS 16
+
+/** Maximum number of compressed signals of a message type. */
+#define SWINGDOOR_MAX_CHANNELS 64
+
+
+/** Compressed signal: an element of a message field. */
+typedef struct swingdoor_channel {
+    const mavschema_field_t *field;
+    unsigned index; ///< Element of array fields, 0 for scalars.
+    double tolerance;
+    double sent; ///< Value at the last sent frame.
+    double held; ///< Value at the held back frame.
+    double lo, hi; ///< Slopes from the sent value within the doors.
+} swingdoor_channel_t;
+
+/** Compression state of a message type. */
+typedef struct swingdoor_stream {
+    const mavschema_message_t *msg;
+    const mavschema_field_t *time_field; ///< NULL to use the arrival time.
+    swingdoor_channel_t channels[SWINGDOOR_MAX_CHANNELS];
+    unsigned nchannels;
+    bool started; ///< Whether a frame was sent.
+    double sent_usec; ///< Time of the last sent frame.
+    double held_usec;
+    uint8_t held[MAVFRAME_MAX_LEN]; ///< Latest frame, not sent yet.
+    size_t held_len; ///< 0 if none.
+    unsigned long nsent; ///< Frames sent.
+    unsigned long dropped; ///< Frames left for the receiver to rebuild.
+} swingdoor_stream_t;
+
+/** Compressor of the frames of several message types. */
+typedef struct swingdoor {
+    const mavschema_t *schema;
+    double max_interval_usec; ///< Longest time between sent frames, or 0.
+    swingdoor_stream_t streams[SWINGDOOR_MAX_STREAMS];
+    unsigned nstreams;
+} swingdoor_t;
+
+/**
+ * Destination of the frames to send.
+ * @param ctx context given to the compressor.
+ */
+typedef void (*swingdoor_emit_fn)(void *ctx, const uint8_t *buf, size_t len);
+
+/** Point of a rebuilt signal. */
+typedef struct swingdoor_point {
+    double time_usec;
+    double value;
+} swingdoor_point_t;
+
+/** Signal rebuilt by a receiver from the frames it got. */
+typedef struct swingdoor_signal {
+    const mavschema_message_t *msg;
+    const mavschema_field_t *field;
+    const mavschema_field_t *time_field; ///< NULL to use the record time.
+    unsigned index;
+    swingdoor_point_t *points; ///< Points not yet passed by the queries.
+    size_t npoints;
+    size_t capacity;
+} swingdoor_signal_t;
+
+
+void swingdoor_init(swingdoor_t *sd, const mavschema_t *schema,
+                    double max_interval);
+int swingdoor_add(swingdoor_t *sd, const char *name, double tolerance);
+void swingdoor_push(swingdoor_t *sd, const uint8_t *buf, size_t len,
+                    uint64_t now_usec, swingdoor_emit_fn emit, void *ctx);
+void swingdoor_poll(swingdoor_t *sd, uint64_t now_usec,
+                    swingdoor_emit_fn emit, void *ctx);
+void swingdoor_flush(swingdoor_t *sd, swingdoor_emit_fn emit, void *ctx);
+
+int swingdoor_signal_init(swingdoor_signal_t *sig, const mavschema_t *schema,
+                          const char *name);
+int swingdoor_signal_push(swingdoor_signal_t *sig, const mavframe_t *frame,
+                          uint64_t time_usec);
+double swingdoor_signal_at(swingdoor_signal_t *sig, double time_usec);
+double swingdoor_signal_end(const swingdoor_signal_t *sig);
+void swingdoor_signal_free(swingdoor_signal_t *sig);
+
+
+#endif//SWINGDOOR_H
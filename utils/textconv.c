@@ -0,0 +1,347 @@
+/**
+ * Deferred conversion of the binary logs of the device readers to text.
+ *
+ * In flight the readers write only their binary log, and the text log is
+ * produced by a second instance of the reader in conversion mode. The
+ * converter runs at idle CPU and IO priority, so it only takes the time the
+ * acquisition leaves unused, and converts the complete records of the log
+ * incrementally, following it while it grows. Its progress is kept in the
+ * checkpoint TEXT.ckpt beside the text log: the binary log offset converted,
+ * the length of the text written from it and the state of the conversion
+ * function. A restarted converter truncates the text log to the checkpoint
+ * and resumes from there, so the result is the same as an uninterrupted
+ * conversion.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logscan.h"
+#include "textconv.h"
+
+
+/** IO priority class and target of ioprio_set, see linux/ioprio.h. */
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/** Keys of the long-only options. */
+enum {
+    OPT_CONVERT = 0x300,
+    OPT_FOLLOW,
+};
+
+
+/** Conversion progress, as stored in the checkpoint. */
+typedef struct checkpoint {
+    uint64_t binary_offset; ///< End of the last converted record.
+    uint64_t text_offset; ///< Length of the text log written from it.
+    uint32_t state; ///< State of the conversion function.
+} checkpoint_t;
+
+
+/** Set by the termination signal handler. */
+static volatile sig_atomic_t stop_requested;
+
+
+/** Conversion options structure. */
+static struct argp_option options[] = {
+    {"convert", OPT_CONVERT, "BINLOG", 0,
+     "Convert the binary log BINLOG to the text log instead of acquiring, "
+     "at idle priority and resuming from the last checkpoint"},
+    {"follow", OPT_FOLLOW, 0, 0,
+     "Keep converting BINLOG while it grows, until terminated"},
+    {0}
+};
+
+
+/** Conversion option parser function */
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    //Get the configuration structure to write the parsed options
+    textconv_config_t *config = state->input;
+
+    switch (key) {
+    case OPT_CONVERT:
+        config->binary_log = arg;
+        break;
+
+    case OPT_FOLLOW:
+        config->follow = true;
+        break;
+
+    case ARGP_KEY_END:
+        if (config->follow && !config->binary_log)
+            argp_error(state, "--follow requires --convert.");
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+
+/** Conversion option parser object. */
+struct argp textconv_argp = {options, parse_opt};
+
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+
+/**
+ * Leave the CPU and the disk to the acquisition.
+ */
+static void lower_priority(void) {
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param))
+        syslog(LOG_WARNING, "Error setting idle scheduling: %s",
+               strerror(errno));
+
+    int ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio))
+        syslog(LOG_WARNING, "Error setting idle IO priority: %s",
+               strerror(errno));
+}
+
+
+/**
+ * Read the checkpoint of a text log.
+ * @return 0 if read, -1 if absent or invalid.
+ */
+static int checkpoint_load(const char *path, checkpoint_t *ckpt) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    unsigned long long binary_offset, text_offset;
+    unsigned long state;
+    int n = fscanf(file, "%llu %llu %lu", &binary_offset, &text_offset,
+                   &state);
+    fclose(file);
+    if (n != 3 || state > UINT32_MAX) {
+        syslog(LOG_WARNING, "Ignoring invalid checkpoint `%s`", path);
+        return -1;
+    }
+
+    ckpt->binary_offset = binary_offset;
+    ckpt->text_offset = text_offset;
+    ckpt->state = state;
+    return 0;
+}
+
+
+/**
+ * Make the text log durable and replace its checkpoint.
+ * @return 0 if success, -1 if error.
+ */
+static int checkpoint_save(const char *path, FILE *text,
+                           const checkpoint_t *ckpt) {
+    if (fflush(text) || fdatasync(fileno(text))) {
+        syslog(LOG_ERR, "Error writing to text log: %s", strerror(errno));
+        return -1;
+    }
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path)
+        >= sizeof tmp_path) {
+        syslog(LOG_ERR, "Checkpoint path `%s` too long", path);
+        return -1;
+    }
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        syslog(LOG_ERR, "Error creating checkpoint `%s`: %s", tmp_path,
+               strerror(errno));
+        return -1;
+    }
+    fprintf(file, "%llu %llu %lu\n",
+            (unsigned long long) ckpt->binary_offset,
+            (unsigned long long) ckpt->text_offset,
+            (unsigned long) ckpt->state);
+    bool failed = fflush(file) || fdatasync(fileno(file));
+    if (fclose(file) || failed || rename(tmp_path, path)) {
+        syslog(LOG_ERR, "Error writing checkpoint `%s`: %s", path,
+               strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Open the text log at the checkpoint, or from scratch without a usable
+ * checkpoint.
+ * @return the text log stream or NULL on error.
+ */
+static FILE* open_text(const char *path, checkpoint_t *ckpt, bool resume) {
+    struct stat st;
+    if (resume && (stat(path, &st) || st.st_size < ckpt->text_offset)) {
+        syslog(LOG_WARNING, "Text log `%s` behind its checkpoint, "
+               "converting from the start", path);
+        resume = false;
+    }
+
+    FILE *text = fopen(path, resume ? "r+" : "w");
+    if (!text) {
+        syslog(LOG_ERR, "Error opening text log `%s`: %s", path,
+               strerror(errno));
+        return NULL;
+    }
+
+    // Drop the text written after the checkpoint
+    if (!resume) {
+        memset(ckpt, 0, sizeof *ckpt);
+    } else if (ftruncate(fileno(text), ckpt->text_offset)
+               || fseeko(text, 0, SEEK_END)) {
+        syslog(LOG_ERR, "Error truncating text log `%s`: %s", path,
+               strerror(errno));
+        fclose(text);
+        return NULL;
+    }
+    return text;
+}
+
+
+/**
+ * Convert the complete records of the binary log after the checkpoint.
+ * Unless `final`, the conversion stops at bytes which are not a frame, as
+ * they may be a frame the reader has not finished writing.
+ * @return the number of records converted, -1 if error.
+ */
+static long long convert_pass(const textconv_config_t *config,
+                              const char *ckpt_path, FILE *text,
+                              checkpoint_t *ckpt, textconv_fn convert,
+                              void *ctx, bool final) {
+    logscan_t scan;
+    if (logscan_open(&scan, config->binary_log, LOGSCAN_LOGBIN))
+        return -1;
+    if (ckpt->binary_offset > scan.size) {
+        syslog(LOG_ERR, "Binary log `%s` shorter than its checkpoint",
+               config->binary_log);
+        logscan_close(&scan);
+        return -1;
+    }
+
+    // A record cut at the end is converted by the next pass
+    long long records = 0;
+    uint64_t last_save = ckpt->text_offset;
+    logrecord_t record;
+    uint64_t start = ckpt->binary_offset > scan.data_offset
+                     ? ckpt->binary_offset : scan.data_offset;
+    int status = logscan_seek(&scan, start);
+    while (!status && (status = logscan_next(&scan, &record)) > 0) {
+        if (scan.malformed && !final) {
+            status = 0;
+            break;
+        }
+        if (convert(&record.frame, text, &ckpt->state, ctx)) {
+            status = -1;
+            break;
+        }
+        status = 0;
+        records++;
+        ckpt->binary_offset = record.offset + record.frame.len;
+        ckpt->text_offset = ftello(text);
+        if (ckpt->text_offset - last_save >= TEXTCONV_CHECKPOINT_BYTES) {
+            if (checkpoint_save(ckpt_path, text, ckpt))
+                status = -1;
+            last_save = ckpt->text_offset;
+        }
+    }
+    logscan_close(&scan);
+
+    if (status < 0 || (records && checkpoint_save(ckpt_path, text, ckpt)))
+        return -1;
+    return records;
+}
+
+
+/**
+ * Wait for the binary log to grow, returning early if terminated.
+ */
+static void wait_poll(void) {
+    struct timespec poll = {
+        .tv_sec=TEXTCONV_POLL_MS / 1000,
+        .tv_nsec=TEXTCONV_POLL_MS % 1000 * 1000000L
+    };
+    nanosleep(&poll, NULL);
+}
+
+
+/**
+ * Convert a binary log to a text log, resuming from its checkpoint.
+ * With `follow`, the log is converted while it grows until the program is
+ * terminated, and then up to its final end.
+ * @return 0 if success, -1 if error.
+ */
+int textconv_run(const textconv_config_t *config, const char *text_log,
+                 textconv_fn convert, void *ctx) {
+    struct sigaction action = {.sa_handler=handle_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    lower_priority();
+
+    char ckpt_path[PATH_MAX];
+    if (snprintf(ckpt_path, sizeof ckpt_path, "%s.ckpt", text_log)
+        >= sizeof ckpt_path) {
+        syslog(LOG_ERR, "Checkpoint path of `%s` too long", text_log);
+        return -1;
+    }
+
+    checkpoint_t ckpt = {0};
+    bool resume = !checkpoint_load(ckpt_path, &ckpt);
+    FILE *text = open_text(text_log, &ckpt, resume);
+    if (!text)
+        return -1;
+
+    // The reader may not have created its log yet
+    while (config->follow && !stop_requested
+           && access(config->binary_log, F_OK))
+        wait_poll();
+    if (config->follow && access(config->binary_log, F_OK)) {
+        fclose(text);
+        return 0;
+    }
+
+    // After termination the reader flushes its log, wait for that too
+    int status = 0;
+    bool draining = false;
+    for (;;) {
+        bool final = !config->follow || draining;
+        long long records = convert_pass(config, ckpt_path, text, &ckpt,
+                                         convert, ctx, final);
+        if (records < 0) {
+            status = -1;
+            break;
+        }
+        if (!config->follow || (draining && !records))
+            break;
+
+        if (stop_requested && !draining)
+            draining = true;
+        else if (records)
+            continue;
+        wait_poll();
+    }
+
+    if (fclose(text)) {
+        syslog(LOG_ERR, "Error closing text log: %s", strerror(errno));
+        status = -1;
+    }
+    return status;
+}
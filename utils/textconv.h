@@ -0,0 +1,47 @@
+/**
+ * Deferred conversion of the binary logs of the device readers to text.
+ */
+
+#ifndef TEXTCONV_H
+#define TEXTCONV_H
+
+
+#include <argp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mavframe.h"
+
+
+/** Text written between two checkpoints of a long conversion pass. */
+#define TEXTCONV_CHECKPOINT_BYTES (16 * 1024 * 1024)
+
+/** Polling interval of the binary log when following it, in ms. */
+#define TEXTCONV_POLL_MS 1000
+
+
+/** Conversion configuration, filled by the `textconv_argp` option parser. */
+typedef struct textconv_config {
+    char *binary_log; ///< Log to convert, none to acquire instead.
+    bool follow; ///< Keep converting the log while it grows.
+} textconv_config_t;
+
+/**
+ * Conversion function of a reader, writing the text of a frame.
+ * @param state kept in the checkpoint, 0 at the start of the text log.
+ * @return 0 if success, -1 if error.
+ */
+typedef int (*textconv_fn)(const mavframe_t *frame, FILE *text,
+                           uint32_t *state, void *ctx);
+
+
+/** Option parser of the conversion, to be used as an argp child. */
+extern struct argp textconv_argp;
+
+
+int textconv_run(const textconv_config_t *config, const char *text_log,
+                 textconv_fn convert, void *ctx);
+
+
+#endif//TEXTCONV_H
@@ -0,0 +1,205 @@
+/**
+ * Time stamps from the calibrated time stamp counter.
+ *
+ * Reading the invariant TSC takes a few cycles, against the system call or
+ * vDSO path of clock_gettime. A background thread pairs TSC readings with
+ * CLOCK_MONOTONIC and CLOCK_REALTIME once per calibration period and
+ * publishes the conversion under a sequence lock. Each new conversion
+ * starts where the previous one is at its reference tick, and its rate is
+ * steered to reach the measured clock one period later, so that the
+ * converted time stays continuous and monotonic while tracking the clock.
+ * Without an invariant TSC, or before `timing_init`, the time functions of
+ * utils.h fall back to clock_gettime.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#ifdef TIMING_HAVE_TSC
+#include <cpuid.h>
+#endif
+
+
+/** Time between calibrations, in ms. */
+#define CALIBRATION_PERIOD_MS 1000
+
+/** Time between the two readings of the initial calibration, in ms. */
+#define INITIAL_CALIBRATION_MS 20
+
+/** Number of tries for a tight pairing of a TSC and clock reading. */
+#define PAIRING_TRIES 8
+
+
+/** A TSC reading paired with the clocks. */
+typedef struct timing_sample {
+    uint64_t tsc;
+    uint64_t mono_ns;
+    int64_t real_offset_ns;
+} timing_sample_t;
+
+
+timing_calibration_t timing_calibration;
+
+
+/**
+ * Whether the processor has an invariant TSC, constant rate in all states.
+ */
+static bool has_invariant_tsc(void) {
+#ifdef TIMING_HAVE_TSC
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return false;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & 1 << 8;
+#else
+    return false;
+#endif
+}
+
+
+/**
+ * Convert a timespec to nanoseconds.
+ */
+static uint64_t timespec_ns(const struct timespec *t) {
+    return (uint64_t) t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+
+/**
+ * Pair a TSC reading with the clocks, keeping the tightest of a few tries.
+ */
+static void take_sample(timing_sample_t *sample) {
+    uint64_t best = UINT64_MAX;
+    for (int i=0; i<PAIRING_TRIES; i++) {
+        struct timespec mono, real;
+        uint64_t before = timing_ticks();
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME, &real);
+        uint64_t after = timing_ticks();
+
+        if (after - before < best) {
+            best = after - before;
+            sample->tsc = before + (after - before) / 2;
+            sample->mono_ns = timespec_ns(&mono);
+            sample->real_offset_ns = timespec_ns(&real) - timespec_ns(&mono);
+        }
+    }
+}
+
+
+/**
+ * Publish a conversion.
+ */
+static void publish(uint64_t tsc0, uint64_t mono_ns0, uint64_t mult,
+                    int64_t real_offset_ns) {
+    timing_calibration_t *cal = &timing_calibration;
+    uint32_t seq = cal->seq;
+    __atomic_store_n(&cal->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    cal->tsc0 = tsc0;
+    cal->mono_ns0 = mono_ns0;
+    cal->mult = mult;
+    cal->real_offset_ns = real_offset_ns;
+    cal->valid = true;
+    __atomic_store_n(&cal->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Fixed-point rate of a time interval over a tick interval.
+ */
+static uint64_t rate(uint64_t ns, uint64_t ticks) {
+    return (uint64_t) ((long double) ns * 4294967296.0L / ticks);
+}
+
+
+/**
+ * Recalibrate periodically, steering the conversion towards the clock.
+ */
+static void* calibration_thread(void *arg) {
+    timing_sample_t last = *(timing_sample_t *) arg;
+    const timing_calibration_t *cal = &timing_calibration;
+
+    for (;;) {
+        struct timespec period = {
+            .tv_sec=CALIBRATION_PERIOD_MS / 1000,
+            .tv_nsec=CALIBRATION_PERIOD_MS % 1000 * 1000000L
+        };
+        nanosleep(&period, NULL);
+
+        timing_sample_t now;
+        take_sample(&now);
+        if (now.tsc <= last.tsc || now.mono_ns <= last.mono_ns)
+            continue;
+
+        // Measured rate, and where the current conversion is
+        uint64_t ticks = now.tsc - last.tsc;
+        uint64_t measured = rate(now.mono_ns - last.mono_ns, ticks);
+        uint64_t mono0 = cal->mono_ns0 + timing_scale(now.tsc - cal->tsc0,
+                                                      cal->mult);
+
+        // Reach the clock one period later, never running backwards
+        int64_t error = (int64_t) (now.mono_ns - mono0);
+        int64_t mult = measured + (int64_t) ((long double) error
+                                             * 4294967296.0L / ticks);
+        if (mult < (int64_t) measured / 2)
+            mult = measured / 2;
+        publish(now.tsc, mono0, mult, now.real_offset_ns);
+        last = now;
+    }
+    return NULL;
+}
+
+
+/**
+ * Calibrate the TSC and start its background recalibration.
+ * Without an invariant TSC, the time functions keep using clock_gettime.
+ * @return 0 if the TSC is used, -1 otherwise.
+ */
+int timing_init(void) {
+    static timing_sample_t first;
+    if (timing_calibration.valid)
+        return 0;
+    if (!has_invariant_tsc()) {
+        syslog(LOG_INFO, "No invariant TSC, timing from clock_gettime");
+        return -1;
+    }
+
+    timing_sample_t second;
+    take_sample(&first);
+    struct timespec wait = {0, INITIAL_CALIBRATION_MS * 1000000L};
+    nanosleep(&wait, NULL);
+    take_sample(&second);
+    if (second.tsc <= first.tsc || second.mono_ns <= first.mono_ns) {
+        syslog(LOG_WARNING, "TSC not advancing, timing from clock_gettime");
+        return -1;
+    }
+
+    uint64_t mult = rate(second.mono_ns - first.mono_ns,
+                         second.tsc - first.tsc);
+    publish(second.tsc, second.mono_ns, mult, second.real_offset_ns);
+    first = second;
+
+    // The thread takes no signals, they stay with the acquisition loop
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int status = pthread_create(&thread, &attr, calibration_thread, &first);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status) {
+        syslog(LOG_ERR, "Error starting TSC calibration: %s",
+               strerror(status));
+        timing_calibration.valid = false;
+        return -1;
+    }
+    return 0;
+}
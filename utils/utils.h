@@ -6,20 +6,124 @@
 #define UTILS_H
 
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <syslog.h>
 #include <time.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define TIMING_HAVE_TSC 1
+#endif
+
 
 /**
- * Get current time in microseconds since epoch.
+ * Conversion of time stamp counter ticks to time, published by the
+ * calibration thread of `timing_init` under a sequence lock.
+ */
+typedef struct timing_calibration {
+    uint32_t seq; ///< Odd while being updated.
+    bool valid; ///< Whether the TSC is used.
+    uint64_t tsc0; ///< Reference tick count.
+    uint64_t mono_ns0; ///< Monotonic time at the reference.
+    uint64_t mult; ///< Nanoseconds per tick, 32.32 fixed point.
+    int64_t real_offset_ns; ///< Realtime minus monotonic time.
+} timing_calibration_t;
+
+/** Current calibration, see timing.c. */
+extern timing_calibration_t timing_calibration;
+
+
+int timing_init(void);
+
+
+/**
+ * Read the time stamp counter, or 0 without one.
+ */
+static inline uint64_t timing_ticks(void) {
+#ifdef TIMING_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * Multiply a tick count by a 32.32 fixed-point factor with 64-bit
+ * multiplications, the product being split so that no 128-bit intermediate
+ * is needed. The result is exact as long as it fits in 64 bits.
+ */
+static inline uint64_t timing_scale(uint64_t ticks, uint64_t mult) {
+    uint64_t t_hi = ticks >> 32, t_lo = (uint32_t) ticks;
+    uint64_t m_hi = mult >> 32, m_lo = (uint32_t) mult;
+    return ticks * m_hi + t_hi * m_lo + (t_lo * m_lo >> 32);
+}
+
+
+/**
+ * Convert a tick count to monotonic and realtime nanoseconds.
+ * @return whether the TSC is calibrated.
+ */
+static inline bool timing_convert(uint64_t ticks, uint64_t *mono_ns,
+                                  uint64_t *real_ns) {
+    const timing_calibration_t *cal = &timing_calibration;
+    uint32_t seq;
+    uint64_t mono;
+    int64_t offset;
+    do {
+        seq = __atomic_load_n(&cal->seq, __ATOMIC_ACQUIRE);
+        if (!cal->valid)
+            return false;
+        // Ticks read just before a recalibration precede its reference
+        if (ticks >= cal->tsc0)
+            mono = cal->mono_ns0 + timing_scale(ticks - cal->tsc0, cal->mult);
+        else
+            mono = cal->mono_ns0 - timing_scale(cal->tsc0 - ticks, cal->mult);
+        offset = cal->real_offset_ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq & 1 || seq != __atomic_load_n(&cal->seq, __ATOMIC_RELAXED));
+
+    if (mono_ns)
+        *mono_ns = mono;
+    if (real_ns)
+        *real_ns = mono + offset;
+    return true;
+}
+
+
+/**
+ * Get the monotonic time in nanoseconds, from the calibrated TSC if
+ * available.
+ */
+static inline uint64_t get_mono_ns(void) {
+    uint64_t ns;
+    if (timing_convert(timing_ticks(), &ns, NULL))
+        return ns;
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/**
+ * Get current time in microseconds since epoch, from the calibrated TSC if
+ * available.
  */
 static inline uint64_t get_time_us() {
+    uint64_t ns;
+    if (timing_convert(timing_ticks(), NULL, &ns))
+        return ns / 1000;
+
     struct timespec t;
     if (clock_gettime(CLOCK_REALTIME, &t)) {
         syslog(LOG_ERR, "Error getting time: %s", strerror(errno));
         return 0;
     }
-    
+
     return (uint64_t)t.tv_sec * 1000000 + (uint64_t)t.tv_nsec / 1000;
 }
 